@@ -0,0 +1,134 @@
+#!/usr/bin/env bash
+# End-to-end benchmark of the TOON.* commands against a running server.
+#
+# For each payload it fills a database with KEYS documents, reports the
+# memory used per key, then runs redis-benchmark over the read and write
+# commands with random keys from that set.
+#
+# Usage: e2e_bench.sh [options]
+#   -h HOST        Server host (default 127.0.0.1)
+#   -p PORT        Server port (default 6379)
+#   -n REQUESTS    Requests per command (default 100000)
+#   -c CLIENTS     Parallel connections (default 50)
+#   -P PIPELINE    Requests per pipeline (default 1)
+#   -k KEYS        Documents per payload (default 10000)
+#   -d DB          Database to use; it is flushed (default 15)
+#   -m MODULE      Load this module first if redisTOON is not loaded
+#   --csv          CSV output
+#
+# Needs redis-cli and redis-benchmark on PATH.
+
+set -euo pipefail
+
+HOST=127.0.0.1
+PORT=6379
+REQUESTS=100000
+CLIENTS=50
+PIPELINE=1
+KEYS=10000
+DB=15
+MODULE=""
+CSV=0
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -h) HOST="$2"; shift 2 ;;
+        -p) PORT="$2"; shift 2 ;;
+        -n) REQUESTS="$2"; shift 2 ;;
+        -c) CLIENTS="$2"; shift 2 ;;
+        -P) PIPELINE="$2"; shift 2 ;;
+        -k) KEYS="$2"; shift 2 ;;
+        -d) DB="$2"; shift 2 ;;
+        -m) MODULE="$2"; shift 2 ;;
+        --csv) CSV=1; shift ;;
+        *) sed -n '2,19s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+cli() {
+    redis-cli -h "$HOST" -p "$PORT" -n "$DB" "$@"
+}
+
+# Notes go to stderr in CSV mode so stdout stays one table
+note() {
+    if [ "$CSV" = 1 ]; then echo "# $*" >&2; else echo "$*"; fi
+}
+
+used_memory() {
+    cli INFO memory | tr -d '\r' | sed -n 's/^used_memory://p'
+}
+
+# One command in the protocol, for redis-cli --pipe
+resp() {
+    printf '*%d\r\n' $#
+    for arg in "$@"; do
+        printf '$%d\r\n%s\r\n' "${#arg}" "$arg"
+    done
+}
+
+if [ -n "$MODULE" ] && ! cli MODULE LIST | grep -q redisTOON; then
+    cli MODULE LOAD "$MODULE" > /dev/null
+fi
+
+# Payloads: a flat record and a 20-row table, each with a path to read.
+# Writes go to a top-level key so they work on both.
+FLAT='{"id":1,"name":"Alice","email":"alice@example.com","active":true,"score":98.5,"tags":["admin","ops"]}'
+FLAT_PATH='$.name'
+
+TABLE='{"rows":['
+for i in $(seq 1 20); do
+    [ "$i" -gt 1 ] && TABLE+=','
+    TABLE+="{\"id\":$i,\"host\":\"web-$i\",\"cpu\":$((i * 3 % 100)).5,\"mem\":$((i * 7 % 100)),\"ok\":true}"
+done
+TABLE+=']}'
+TABLE_PATH='$.rows[7].host'
+
+# redis-benchmark replaces __rand_int__ with a 12-digit number below -r
+key_name() {
+    printf 'key:%012d' "$1"
+}
+
+run_benchmark() {
+    local payload="$1" first="$2"
+    shift 2
+
+    if [ "$CSV" = 1 ]; then
+        redis-benchmark -h "$HOST" -p "$PORT" --dbnum "$DB" -n "$REQUESTS" -c "$CLIENTS" \
+            -P "$PIPELINE" -r "$KEYS" --csv "$@" |
+            awk -v payload="$payload" -v first="$first" '
+                /^"test"/ { if (first) print "\"payload\"," $0; next }
+                { print "\"" payload "\"," $0 }'
+    else
+        redis-benchmark -h "$HOST" -p "$PORT" --dbnum "$DB" -n "$REQUESTS" -c "$CLIENTS" \
+            -P "$PIPELINE" -r "$KEYS" -q "$@"
+    fi
+}
+
+bench_payload() {
+    local name="$1" json="$2" path="$3" first="$4"
+
+    cli FLUSHDB > /dev/null
+    local before
+    before=$(used_memory)
+
+    for i in $(seq 0 $((KEYS - 1))); do
+        resp TOON.FROMJSON "$(key_name "$i")" "$json"
+    done | cli --pipe > /dev/null
+
+    local after
+    after=$(used_memory)
+    note "$name: $KEYS keys, $(( (after - before) / KEYS )) bytes/key, ${#json} bytes of JSON each"
+
+    run_benchmark "$name" "$first" TOON.GET key:__rand_int__
+    run_benchmark "$name" 0 TOON.GET key:__rand_int__ "$path"
+    run_benchmark "$name" 0 TOON.TOJSON key:__rand_int__
+    run_benchmark "$name" 0 TOON.TYPE key:__rand_int__ "$path"
+    run_benchmark "$name" 0 TOON.TOKENCOUNT key:__rand_int__
+    run_benchmark "$name" 0 TOON.SET key:__rand_int__ '$.status' 'bench'
+    run_benchmark "$name" 0 TOON.FROMJSON key:__rand_int__ "$json"
+}
+
+bench_payload flat "$FLAT" "$FLAT_PATH" 1
+bench_payload table "$TABLE" "$TABLE_PATH" 0
+
+cli FLUSHDB > /dev/null
@@ -0,0 +1,456 @@
+// Micro-benchmarks for the redisTOON core: decoding, encoding, JSON
+// conversion, path operations and token estimation, run over generated
+// documents of different shapes. The core files do not call into Redis,
+// so this links them directly, without a server.
+//
+// Usage: toon_bench [--quick] [--csv] [--scale N] [--time SECONDS] [corpus...]
+
+#include "redistoon.h"
+#include <time.h>
+
+// ============================================================================
+// Allocation counting
+// ============================================================================
+
+// On GNU toolchains the build wraps malloc and friends (-Wl,--wrap) so calls
+// made by the core are counted; elsewhere allocations are reported as n/a
+#ifdef TOON_BENCH_COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static size_t alloc_count = 0;
+
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    alloc_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+static size_t allocations(void) {
+#ifdef TOON_BENCH_COUNT_ALLOCS
+    return alloc_count;
+#else
+    return 0;
+#endif
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// Corpus generation
+// ============================================================================
+
+// Deterministic generator so runs are comparable across builds
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static const char *words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa"
+};
+
+#define NUM_WORDS (sizeof(words) / sizeof(words[0]))
+
+static void append_words(ToonBuffer *buf, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) toon_buffer_putc(buf, ' ');
+        toon_buffer_append_str(buf, words[rng() % NUM_WORDS]);
+    }
+}
+
+static void append_scalar(ToonBuffer *buf, size_t i) {
+    switch (i % 5) {
+        case 0:  toon_buffer_append_size(buf, rng() % 100000); break;
+        case 1:  toon_buffer_append_number(buf, (double)(rng() % 100000) / 100); break;
+        case 2:  toon_buffer_putc(buf, '"'); append_words(buf, 2); toon_buffer_putc(buf, '"'); break;
+        case 3:  toon_buffer_append_str(buf, rng() % 2 ? "true" : "false"); break;
+        default: toon_buffer_append_str(buf, "null"); break;
+    }
+}
+
+// Object of scale * 64 scalar fields
+static void gen_flat(ToonBuffer *buf, size_t scale) {
+    toon_buffer_putc(buf, '{');
+    for (size_t i = 0; i < 64 * scale; i++) {
+        if (i > 0) toon_buffer_putc(buf, ',');
+        toon_buffer_append_str(buf, "\"field");
+        toon_buffer_append_size(buf, i);
+        toon_buffer_append_str(buf, "\":");
+        append_scalar(buf, i);
+    }
+    toon_buffer_putc(buf, '}');
+}
+
+// Chain of 48 nested objects with a few scalars at each level; not scaled
+static void gen_deep(ToonBuffer *buf, size_t scale) {
+    (void)scale;
+    for (size_t i = 0; i < 48; i++) {
+        toon_buffer_append_str(buf, "{\"level\":");
+        toon_buffer_append_size(buf, i);
+        toon_buffer_append_str(buf, ",\"name\":\"");
+        append_words(buf, 1);
+        toon_buffer_append_str(buf, "\",\"child\":");
+    }
+    toon_buffer_append_str(buf, "null");
+    for (size_t i = 0; i < 48; i++) toon_buffer_putc(buf, '}');
+}
+
+// Array of scale * 200 chains nesting objects and arrays 100 levels deep,
+// near the default depth limit, so the tree walks run on their own stacks
+static void gen_nested(ToonBuffer *buf, size_t scale) {
+    toon_buffer_append_str(buf, "{\"items\":[");
+    for (size_t i = 0; i < 200 * scale; i++) {
+        if (i > 0) toon_buffer_putc(buf, ',');
+        for (size_t level = 0; level < 50; level++) toon_buffer_append_str(buf, "{\"a\":[");
+        append_scalar(buf, i);
+        for (size_t level = 0; level < 50; level++) toon_buffer_append_str(buf, "]}");
+    }
+    toon_buffer_append_str(buf, "]}");
+}
+
+// Object of scale * 20000 numeric fields, large enough to be hash indexed
+static void gen_wide(ToonBuffer *buf, size_t scale) {
+    toon_buffer_putc(buf, '{');
+    for (size_t i = 0; i < 20000 * scale; i++) {
+        if (i > 0) toon_buffer_putc(buf, ',');
+        toon_buffer_append_str(buf, "\"key");
+        toon_buffer_append_size(buf, i);
+        toon_buffer_append_str(buf, "\":");
+        toon_buffer_append_size(buf, rng() % 1000000);
+    }
+    toon_buffer_putc(buf, '}');
+}
+
+// Metrics table of scale * 20000 uniform rows
+static void gen_tabular(ToonBuffer *buf, size_t scale) {
+    toon_buffer_append_str(buf, "{\"rows\":[");
+    for (size_t i = 0; i < 20000 * scale; i++) {
+        if (i > 0) toon_buffer_putc(buf, ',');
+        toon_buffer_append_str(buf, "{\"ts\":");
+        toon_buffer_append_size(buf, 1700000000 + i);
+        toon_buffer_append_str(buf, ",\"host\":\"");
+        toon_buffer_append_str(buf, words[rng() % NUM_WORDS]);
+        toon_buffer_append_str(buf, "\",\"cpu\":");
+        toon_buffer_append_number(buf, (double)(rng() % 10000) / 100);
+        toon_buffer_append_str(buf, ",\"mem\":");
+        toon_buffer_append_size(buf, rng() % 65536);
+        toon_buffer_append_str(buf, ",\"ok\":");
+        toon_buffer_append_str(buf, rng() % 8 ? "true" : "false");
+        toon_buffer_putc(buf, '}');
+    }
+    toon_buffer_append_str(buf, "]}");
+}
+
+// Object of scale * 2000 paragraphs, some with characters that need escapes
+static void gen_strings(ToonBuffer *buf, size_t scale) {
+    toon_buffer_putc(buf, '{');
+    for (size_t i = 0; i < 2000 * scale; i++) {
+        if (i > 0) toon_buffer_putc(buf, ',');
+        toon_buffer_append_str(buf, "\"doc");
+        toon_buffer_append_size(buf, i);
+        toon_buffer_append_str(buf, "\":\"");
+        append_words(buf, 20 + rng() % 40);
+        if (i % 3 == 0) toon_buffer_append_str(buf, ", \\\"quoted\\\"\\nnext line");
+        toon_buffer_putc(buf, '"');
+    }
+    toon_buffer_putc(buf, '}');
+}
+
+typedef struct {
+    const char *name;
+    void (*generate)(ToonBuffer *buf, size_t scale);
+    const char *get_path;   // Existing value read by path_get and replaced by path_set
+    const char *new_path;   // Missing key inserted and deleted by path_del
+} CorpusSpec;
+
+static const CorpusSpec corpus_specs[] = {
+    {"flat",    gen_flat,    "$.field33", "$.extra"},
+    {"deep",    gen_deep,    "$.child.child.child.child.child.child.child.child.level", "$.child.child.extra"},
+    {"nested",  gen_nested,  "$.items[100].a[0].a[0].a[0].a", "$.extra"},
+    {"wide",    gen_wide,    "$.key12345", "$.extra"},
+    {"tabular", gen_tabular, "$.rows[9999].cpu", "$.extra"},
+    {"strings", gen_strings, "$.doc1000", "$.extra"}
+};
+
+#define NUM_CORPORA (sizeof(corpus_specs) / sizeof(corpus_specs[0]))
+
+// A generated document in its three forms
+typedef struct {
+    const CorpusSpec *spec;
+    char *json;
+    size_t json_len;
+    char *toon;
+    size_t toon_len;
+    ToonDocument *doc;      // Parsed from the JSON
+    bool roundtrips;        // Whether the TOON text decodes back to the same document
+} Corpus;
+
+static bool corpus_load(Corpus *corpus, const CorpusSpec *spec, size_t scale) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+    spec->generate(&buf, scale);
+
+    corpus->spec = spec;
+    corpus->json = toon_buffer_detach(&buf, &corpus->json_len);
+    if (!corpus->json) return false;
+
+    char *error = NULL;
+    ToonArena *arena = toon_arena_create(corpus->json_len);
+    ToonValue *root = arena ? json_to_toon(arena, corpus->json, &error) : NULL;
+    if (!root) {
+        fprintf(stderr, "%s: %s\n", spec->name, error ? error : "out of memory");
+        free(error);
+        toon_arena_destroy(arena);
+        return false;
+    }
+    corpus->doc = toon_document_create(arena, root);
+
+    corpus->toon = toon_encode(root, 0);
+    corpus->toon_len = corpus->toon ? strlen(corpus->toon) : 0;
+
+    // The encoder still flattens some nested shapes; flag them so decode
+    // numbers are read with that in mind
+    ToonArena *check = toon_arena_create(0);
+    ToonValue *decoded = check && corpus->toon ? toon_decode(check, corpus->toon, &error) : NULL;
+    char *expected = toon_to_json(root);
+    char *actual = decoded ? toon_to_json(decoded) : NULL;
+    corpus->roundtrips = expected && actual && strcmp(expected, actual) == 0;
+    free(expected);
+    free(actual);
+    free(error);
+    toon_arena_destroy(check);
+
+    return corpus->doc && corpus->toon;
+}
+
+static void corpus_free(Corpus *corpus) {
+    free(corpus->json);
+    free(corpus->toon);
+    if (corpus->doc) toon_document_free(corpus->doc);
+}
+
+// ============================================================================
+// Operations
+// ============================================================================
+
+typedef struct {
+    const char *name;
+    bool (*run)(Corpus *corpus);              // Returns false if the op failed
+    size_t (*bytes)(const Corpus *corpus);    // Input bytes per op, for MB/s
+    size_t batch;                              // Calls per timed op
+} Operation;
+
+static volatile size_t sink;
+
+static bool op_decode(Corpus *corpus) {
+    char *error = NULL;
+    ToonArena *arena = toon_arena_create(corpus->toon_len);
+    ToonValue *value = toon_decode_len(arena, corpus->toon, corpus->toon_len, &error);
+    free(error);
+    toon_arena_destroy(arena);
+    return value != NULL;
+}
+
+static bool op_encode(Corpus *corpus) {
+    char *toon = toon_encode(corpus->doc->root, 0);
+    free(toon);
+    return toon != NULL;
+}
+
+static bool op_from_json(Corpus *corpus) {
+    char *error = NULL;
+    ToonArena *arena = toon_arena_create(corpus->json_len);
+    ToonValue *value = json_to_toon(arena, corpus->json, &error);
+    free(error);
+    toon_arena_destroy(arena);
+    return value != NULL;
+}
+
+static bool op_to_json(Corpus *corpus) {
+    char *json = toon_to_json(corpus->doc->root);
+    free(json);
+    return json != NULL;
+}
+
+static bool op_path_get(Corpus *corpus) {
+    const char *str = corpus->spec->get_path;
+    ToonValue scratch;
+    return toon_path_get(corpus->doc->root, toon_path_cache_lookup(str, strlen(str)), &scratch) != NULL;
+}
+
+static ToonValue *new_number(Corpus *corpus, double number) {
+    ToonValue *value = toon_value_create(corpus->doc->arena, TOON_NUMBER);
+    if (value) value->value.number = number;
+    return value;
+}
+
+static bool op_path_set(Corpus *corpus) {
+    const char *str = corpus->spec->get_path;
+    return toon_path_set(corpus->doc, toon_path_cache_lookup(str, strlen(str)), new_number(corpus, 42)) == 0;
+}
+
+// Insert a missing key and delete it again, leaving the document as it was
+static bool op_path_del(Corpus *corpus) {
+    const char *str = corpus->spec->new_path;
+    const ToonPath *path = toon_path_cache_lookup(str, strlen(str));
+    return toon_path_set(corpus->doc, path, new_number(corpus, 1)) == 0 && toon_path_delete(corpus->doc, path) == 0;
+}
+
+static bool op_tokens(Corpus *corpus) {
+    sink += toon_estimate_tokens(corpus->doc->root);
+    return true;
+}
+
+static size_t toon_bytes(const Corpus *corpus) { return corpus->toon_len; }
+static size_t json_bytes(const Corpus *corpus) { return corpus->json_len; }
+static size_t no_bytes(const Corpus *corpus) { (void)corpus; return 0; }
+
+static const Operation operations[] = {
+    {"decode",    op_decode,    toon_bytes, 1},
+    {"encode",    op_encode,    toon_bytes, 1},
+    {"from_json", op_from_json, json_bytes, 1},
+    {"to_json",   op_to_json,   json_bytes, 1},
+    {"path_get",  op_path_get,  no_bytes,   1000},
+    {"path_set",  op_path_set,  no_bytes,   1000},
+    {"path_del",  op_path_del,  no_bytes,   1000},
+    {"tokens",    op_tokens,    toon_bytes, 1}
+};
+
+#define NUM_OPERATIONS (sizeof(operations) / sizeof(operations[0]))
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+typedef struct {
+    bool csv;
+    double min_time;        // Seconds each operation runs for
+    size_t scale;
+} Options;
+
+static void run_operation(const Options *options, Corpus *corpus, const Operation *op) {
+    // Warm up once, then time whole batches until min_time has passed
+    if (!op->run(corpus)) {
+        if (options->csv) {
+            printf("%s,%s,,,,%zu\n", corpus->spec->name, op->name, corpus->doc->arena->reserved);
+        } else {
+            printf("  %-10s %14s\n", op->name, "unsupported");
+        }
+        return;
+    }
+
+    size_t calls = 0;
+    size_t allocs_before = allocations();
+    double start = now();
+    double elapsed;
+    do {
+        for (size_t i = 0; i < op->batch; i++) op->run(corpus);
+        calls += op->batch;
+        elapsed = now() - start;
+    } while (elapsed < options->min_time);
+    size_t allocs = allocations() - allocs_before;
+
+    double ops_per_sec = calls / elapsed;
+    double mb_per_sec = op->bytes(corpus) * ops_per_sec / 1e6;
+    double allocs_per_op = (double)allocs / calls;
+
+    if (options->csv) {
+        printf("%s,%s,%.1f,%.2f,", corpus->spec->name, op->name, ops_per_sec, mb_per_sec);
+#ifdef TOON_BENCH_COUNT_ALLOCS
+        printf("%.2f", allocs_per_op);
+#endif
+        printf(",%zu\n", corpus->doc->arena->reserved);
+        return;
+    }
+
+    printf("  %-10s %14.1f ops/s", op->name, ops_per_sec);
+    if (mb_per_sec > 0) {
+        printf(" %9.1f MB/s", mb_per_sec);
+    } else {
+        printf(" %14s", "");
+    }
+#ifdef TOON_BENCH_COUNT_ALLOCS
+    printf(" %10.2f allocs/op\n", allocs_per_op);
+#else
+    (void)allocs_per_op;
+    printf(" %10s allocs/op\n", "n/a");
+#endif
+}
+
+static void run_corpus(const Options *options, const CorpusSpec *spec) {
+    Corpus corpus = {0};
+    if (!corpus_load(&corpus, spec, options->scale)) {
+        corpus_free(&corpus);
+        return;
+    }
+
+    if (!options->csv) {
+        printf("%s: json %zu bytes, toon %zu bytes, document %zu bytes%s\n",
+               spec->name, corpus.json_len, corpus.toon_len, corpus.doc->arena->reserved,
+               corpus.roundtrips ? "" : " (toon text does not roundtrip)");
+    }
+
+    for (size_t i = 0; i < NUM_OPERATIONS; i++) {
+        run_operation(options, &corpus, &operations[i]);
+    }
+
+    corpus_free(&corpus);
+    toon_path_cache_clear();
+}
+
+int main(int argc, char **argv) {
+    Options options = {false, 0.5, 1};
+    const char *selected[NUM_CORPORA];
+    size_t num_selected = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            options.min_time = 0;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            options.csv = true;
+        } else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) {
+            options.min_time = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            options.scale = (size_t)atol(argv[++i]);
+            if (options.scale == 0) options.scale = 1;
+        } else if (argv[i][0] != '-' && num_selected < NUM_CORPORA) {
+            selected[num_selected++] = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--csv] [--scale N] [--time SECONDS] [corpus...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.csv) printf("corpus,operation,ops_per_sec,mb_per_sec,allocs_per_op,document_bytes\n");
+
+    for (size_t i = 0; i < NUM_CORPORA; i++) {
+        bool wanted = num_selected == 0;
+        for (size_t j = 0; j < num_selected; j++) {
+            if (strcmp(selected[j], corpus_specs[i].name) == 0) wanted = true;
+        }
+        if (wanted) run_corpus(&options, &corpus_specs[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+// Fuzz target for the redisTOON core: every input is parsed as TOON and
+// as JSON, and whatever parses is run through the encoders, the truncating
+// encoder, the token estimate and discard. The streaming transcoders must
+// agree with the tree they mirror, byte for byte, and every walk must
+// survive the deepest input the parsers accept.
+//
+// Built with clang and -DREDISTOON_FUZZ=ON this is a libFuzzer target:
+//
+//   ./toon_fuzz -max_len=65536 corpus/
+//
+// Otherwise it is a replay driver: each file argument is run once, and
+// without arguments a fixed set of seeds and their mutations is, which is
+// what make test runs.
+
+#include "redistoon.h"
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                            \
+        }                                                                       \
+    } while (0)
+
+// Run everything that takes a tree over value, then drop it
+static void exercise_tree(ToonArena *arena, ToonValue *value, uint8_t budget_byte) {
+    char *toon = toon_encode(value, 0);
+    char *json = toon_to_json(value);
+    CHECK(toon && json);
+
+    size_t tokens = toon_estimate_tokens(value);
+    CHECK(toon_estimate_tokens(value) == tokens);  // Cached the second time
+    (void)toon_encoded_size_hint(value);
+    (void)toon_value_footprint(value);
+
+    // A budget at least the whole estimate gives the plain encoding back
+    ToonBudget budget = {.remaining = budget_byte & 0x7f, .keep_tail = budget_byte & 0x80};
+    ToonBuffer cut;
+    toon_buffer_init(&cut, 0);
+    toon_encode_budget_to(&cut, value, 0, &budget);
+    CHECK(!cut.failed && budget.remaining <= (size_t)(budget_byte & 0x7f));
+
+    budget.remaining = tokens;
+    toon_buffer_reset(&cut);
+    toon_encode_budget_to(&cut, value, 0, &budget);
+    CHECK(strcmp(cut.data, toon) == 0 && budget.remaining == 0);
+    toon_buffer_free(&cut);
+
+    // The JSON the tree gives parses back to the same JSON
+    ToonArena *scratch = toon_arena_create(0);
+    char *error = NULL;
+    ToonValue *reparsed = json_to_toon(scratch, json, &error);
+    if (reparsed) {
+        char *again = toon_to_json(reparsed);
+        CHECK(again && strcmp(again, json) == 0);
+        free(again);
+    }
+    free(error);
+    toon_arena_destroy(scratch);
+
+    toon_value_discard(arena, value);
+    free(toon);
+    free(json);
+}
+
+// Input as TOON text: the tree, and the streaming transcoder against it
+// Strings in the intern pool, which input that fails to parse must not add to
+static size_t interned_strings(void) {
+    size_t strings, bytes, rejected;
+    toon_intern_usage(&strings, &bytes, &rejected);
+    return strings;
+}
+
+static void fuzz_toon(const char *text, size_t len, uint8_t budget_byte) {
+    ToonArena *arena = toon_arena_create(0);
+    char *error = NULL;
+    size_t interned = interned_strings();
+    ToonValue *value = toon_decode_len(arena, text, len, &error);
+    CHECK(value || interned_strings() == interned);
+
+    ToonBuffer out;
+    toon_buffer_init(&out, 0);
+    char *stream_error = NULL;
+    bool streamed = toon_transcode_toon(&out, text, len, &stream_error);
+
+    CHECK(!value == !streamed);
+    if (value) {
+        char *json = toon_to_json(value);
+        CHECK(json && strcmp(json, out.data) == 0);
+        free(json);
+        exercise_tree(arena, value, budget_byte);
+    }
+
+    free(error);
+    free(stream_error);
+    toon_buffer_free(&out);
+    toon_arena_destroy(arena);
+}
+
+// Input as JSON text, which the parser reads as far as a NUL
+static void fuzz_json(const char *text, uint8_t budget_byte) {
+    ToonArena *arena = toon_arena_create(0);
+    char *error = NULL;
+    size_t interned = interned_strings();
+    ToonValue *value = json_to_toon(arena, text, &error);
+    CHECK(value || interned_strings() == interned);
+
+    ToonBuffer out;
+    toon_buffer_init(&out, 0);
+    char *stream_error = NULL;
+    bool streamed = toon_transcode_json(&out, text, &stream_error);
+    CHECK(streamed == (value != NULL));
+
+    if (value && streamed) {
+        char *toon = toon_encode(value, 0);
+        CHECK(toon && strcmp(toon, out.data) == 0);
+        free(toon);
+    }
+    if (value) exercise_tree(arena, value, budget_byte);
+
+    free(error);
+    free(stream_error);
+    toon_buffer_free(&out);
+    toon_arena_destroy(arena);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+// The first byte picks the budget of the truncating encoder; the rest is
+// the text
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size == 0) return 0;
+
+    char *text = malloc(size);
+    if (!text) return 0;
+    memcpy(text, data + 1, size - 1);
+    text[size - 1] = '\0';
+
+    fuzz_toon(text, size - 1, data[0]);
+    fuzz_json(text, data[0]);
+
+    free(text);
+    return 0;
+}
+
+#ifndef TOON_FUZZ_LIBFUZZER
+
+// ============================================================================
+// Replay driver
+// ============================================================================
+
+static const char *seeds[] = {
+    "name: Alice\nage: 30\ntags[2]: a,b\n",
+    "users[2,]{id,name,active}:\n  1,Alice,true\n  2,\"Bob, Jr.\",false\n",
+    "[3]: [2]: 1,2,[1]: \"x\",[0]: ",
+    "[2]:\n  - [1]: 1\n  - [2]: true,null\n",
+    "{\"a\":[1,2,{\"b\":null}],\"c\":\"d\\n\\\"e\\\"\"}",
+    "[{\"id\":1,\"v\":\"x\"},{\"id\":2,\"v\":\"y\"},{\"id\":3,\"v\":null}]",
+    "[[[[[[[[[[[[[[[[[[[[1]]]]]]]]]]]]]]]]]]]]",
+    "{\"a\":{\"b\":{\"c\":{\"d\":[{\"x\":1},{\"x\":2}]}}}}",
+    "[[[[[{\"a\":1},{\"a\":2}],[3,4]],[[5]]]],[]]",
+    "-12.5e3",
+    "\"quoted \\\"string\\\"\"",
+};
+
+#define NUM_SEEDS (sizeof(seeds) / sizeof(seeds[0]))
+
+// Mutations of each seed run by default
+#ifndef TOON_FUZZ_MUTATIONS
+#define TOON_FUZZ_MUTATIONS 2000
+#endif
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Syntax bytes, so mutations reach past the first token
+static const char alphabet[] = "[]{}:,\"\\-\n 0123456789abtrue";
+
+static void run(const uint8_t *data, size_t size) {
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+// Flip, insert and delete a few bytes of a seed, and duplicate spans of it
+// so nesting grows
+static size_t mutate(const char *seed, uint8_t *out, size_t cap) {
+    size_t len = strlen(seed);
+    if (len + 1 > cap) len = cap - 1;
+    out[0] = (uint8_t)rng();
+    memcpy(out + 1, seed, len);
+    len++;
+
+    size_t edits = 1 + rng() % 8;
+    for (size_t i = 0; i < edits; i++) {
+        size_t at = 1 + rng() % len;
+        switch (rng() % 4) {
+            case 0:
+                if (at < len) out[at] = (uint8_t)alphabet[rng() % (sizeof(alphabet) - 1)];
+                break;
+            case 1:
+                if (len < cap) {
+                    memmove(out + at + 1, out + at, len - at);
+                    out[at] = (uint8_t)alphabet[rng() % (sizeof(alphabet) - 1)];
+                    len++;
+                }
+                break;
+            case 2:
+                if (at < len) {
+                    memmove(out + at, out + at + 1, len - at - 1);
+                    len--;
+                }
+                break;
+            default: {
+                size_t span = 1 + rng() % 16;
+                if (at + span <= len && len + span <= cap) {
+                    memmove(out + at + span, out + at, len - at);
+                    len += span;
+                }
+                break;
+            }
+        }
+    }
+    return len;
+}
+
+// Nesting at and just past the depth limit, as arrays and as objects.
+// Returns the number of inputs run.
+static size_t run_deep(void) {
+    size_t count = 0;
+    const char *shapes[][3] = {
+        {"[", "]", "1"},
+        {"{\"a\":", "}", "1"},
+        {"[1]: ", "", "1"},
+        {"[", "]", "[{\"x\":1},{\"x\":2}]"},
+    };
+
+    for (size_t shape = 0; shape < sizeof(shapes) / sizeof(shapes[0]); shape++) {
+        for (size_t depth = toon_max_depth() - 2; depth <= toon_max_depth() + 1; depth++) {
+            ToonBuffer buf;
+            toon_buffer_init(&buf, 0);
+            toon_buffer_putc(&buf, '\x40');
+            for (size_t i = 0; i < depth; i++) toon_buffer_append_str(&buf, shapes[shape][0]);
+            toon_buffer_append_str(&buf, shapes[shape][2]);
+            for (size_t i = 0; i < depth; i++) toon_buffer_append_str(&buf, shapes[shape][1]);
+            run((const uint8_t *)buf.data, buf.len);
+            toon_buffer_free(&buf);
+            count++;
+        }
+    }
+    return count;
+}
+
+static bool run_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return false;
+    }
+
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) toon_buffer_append(&buf, chunk, n);
+    fclose(file);
+
+    run((const uint8_t *)buf.data, buf.len);
+    toon_buffer_free(&buf);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++) {
+            if (!run_file(argv[i])) return 1;
+        }
+        return 0;
+    }
+
+    uint8_t input[512];
+    for (size_t seed = 0; seed < NUM_SEEDS; seed++) {
+        for (size_t i = 0; i < TOON_FUZZ_MUTATIONS; i++) run(input, mutate(seeds[seed], input, sizeof(input)));
+    }
+    size_t deep = run_deep();
+
+    printf("%zu inputs ok\n", NUM_SEEDS * TOON_FUZZ_MUTATIONS + deep);
+    return 0;
+}
+
+#endif
@@ -6,7 +6,7 @@ Provides high-level interface for TOON data operations.
 """
 
 import json
-from typing import Any, Optional, Union
+from typing import Any, List, Optional, Union
 import redis
 
 
@@ -72,7 +72,8 @@ class RedisTOON:
             path: JSONPath to retrieve (default: '$' for root)
 
         Returns:
-            Python object (dict, list, str, etc.) or None if not found
+            Python object (dict, list, str, etc.) or None if not found; a
+            list of matches for paths with wildcards, slices or filters
 
         Example:
             >>> r.get('user:1')
@@ -86,7 +87,6 @@ class RedisTOON:
         # Try to decode TOON format
         try:
             from toon import decode
-            return decode(toon_str.decode('utf-8'))
         except ImportError:
             # Fallback: get as JSON
             json_str = self.redis.execute_command('TOON.TOJSON', key, path)
@@ -94,6 +94,59 @@ class RedisTOON:
                 return json.loads(json_str)
             return None
 
+        # Paths with wildcards, slices or filters reply with every match
+        if isinstance(toon_str, list):
+            return [decode(match.decode('utf-8')) for match in toon_str]
+        return decode(toon_str.decode('utf-8'))
+
+    def get_prompt(self, key: str, max_tokens: int, path: str = '$', keep: str = 'head') -> Optional[str]:
+        """
+        Get TOON text cut down to a token budget, for pasting into a prompt.
+
+        Args:
+            key: Redis key name
+            max_tokens: Estimated tokens the text may take
+            path: JSONPath to retrieve (default: '$' for root)
+            keep: 'head' to keep the first elements of arrays, 'tail' the last
+
+        Returns:
+            TOON text, or None if not found
+
+        Example:
+            >>> r.get_prompt('chat:1', 2000, '$.messages', keep='tail')
+            '[12,]{role,content}:\n  user,...'
+        """
+        toon_str = self.redis.execute_command('TOON.GET', key, path, 'MAXTOKENS', max_tokens, 'KEEP', keep)
+        return toon_str.decode('utf-8') if toon_str is not None else None
+
+    def mget(self, keys: List[str], path: str = '$') -> List[Optional[Any]]:
+        """
+        Get the same path from several keys in one round trip.
+
+        In cluster mode all keys must hash to the same slot (use a hash tag
+        such as '{ctx}:1').
+
+        Args:
+            keys: Redis key names
+            path: JSONPath to retrieve (default: '$' for root)
+
+        Returns:
+            One Python object per key, or None where the key or path is missing
+
+        Example:
+            >>> r.mget(['user:1', 'user:2'], '$.name')
+            ['Alice', 'Bob']
+        """
+        results = self.redis.execute_command('TOON.MGET', *keys, path)
+
+        try:
+            from toon import decode
+            return [decode(r.decode('utf-8')) if r is not None else None for r in results]
+        except ImportError:
+            # Fallback: get each value as JSON
+            return [json.loads(j) if j else None
+                    for j in (self.redis.execute_command('TOON.TOJSON', key, path) for key in keys)]
+
     def delete(self, key: str, path: str) -> int:
         """
         Delete value at path.
@@ -111,6 +164,110 @@ class RedisTOON:
         """
         return self.redis.execute_command('TOON.DEL', key, path)
 
+    def clone(self, src: str, dst: str) -> bool:
+        """
+        Copy the document at src to dst, sharing its tree until either changes.
+
+        Args:
+            src: Key of the document to copy
+            dst: Key to copy it to, replaced if it holds a document
+
+        Returns:
+            True if successful
+
+        Example:
+            >>> r.clone('template:chat', 'session:42')
+            True
+        """
+        return self.redis.execute_command('TOON.CLONE', src, dst) == b'OK'
+
+    def index_create(self, name: str, path: str, *columns: str) -> bool:
+        """
+        Index columns of the tabular array at path in every document.
+
+        Args:
+            name: Index name
+            path: Definite JSONPath of the tabular array
+            columns: Columns to index
+
+        Returns:
+            True if successful
+
+        Example:
+            >>> r.index_create('msgs', '$.messages', 'role', 'ts')
+            True
+        """
+        return self.redis.execute_command('TOON.INDEX', 'CREATE', name, path, *columns) == b'OK'
+
+    def query(self, index: str, filter: str, limit: Optional[int] = None) -> List[tuple]:
+        """
+        Find rows through an index.
+
+        Args:
+            index: Index name
+            filter: Filter on an indexed column, as in a path: '@.role=="tool"'
+            limit: Most rows to return, 10 if not given
+
+        Returns:
+            List of (key, row number, row as TOON) tuples
+
+        Example:
+            >>> r.query('msgs', '@.ts>1700000000', limit=5)
+            [('chat:1', 3, 'role: tool\nts: 1700000042')]
+        """
+        args = ['TOON.QUERY', index, filter]
+        if limit is not None:
+            args += ['LIMIT', limit]
+        rows = self.redis.execute_command(*args)
+        return [(key.decode('utf-8'), row, text.decode('utf-8')) for key, row, text in rows]
+
+    def arr_append(self, key: str, path: str, *values: str) -> int:
+        """
+        Append TOON values to the array at path.
+
+        Args:
+            key: Redis key name
+            path: JSONPath of the array
+            values: Values in TOON format
+
+        Returns:
+            New length of the array
+
+        Example:
+            >>> r.arr_append('user:1', '$.tags', 'admin', 'ops')
+            4
+        """
+        return self.redis.execute_command('TOON.ARRAPPEND', key, path, *values)
+
+    def row_append(self, key: str, path: str, *rows: list) -> int:
+        """
+        Append rows to the tabular array at path.
+
+        Args:
+            key: Redis key name
+            path: JSONPath of the tabular array
+            rows: Lists of cells in header order; None is stored as null
+
+        Returns:
+            New number of rows
+
+        Example:
+            >>> r.row_append('chat:1', '$.messages', [3, 'user', 'Hello'])
+            3
+        """
+        cells = []
+        for row in rows:
+            for cell in row:
+                if cell is None:
+                    cells.append('null')
+                elif isinstance(cell, bool):
+                    cells.append('true' if cell else 'false')
+                elif isinstance(cell, str):
+                    cells.append(json.dumps(cell, ensure_ascii=False))
+                else:
+                    cells.append(str(cell))
+        return self.redis.execute_command('TOON.ROWAPPEND', key, path, *cells)
+
     def type(self, key: str, path: str = '$') -> Optional[str]:
         """
         Get type of value at path.
@@ -168,21 +325,25 @@ class RedisTOON:
         result = self.redis.execute_command('TOON.FROMJSON', key, json_data)
         return result == b'OK'
 
-    def token_count(self, key: str, path: str = '$') -> int:
+    def token_count(self, key: str, path: str = '$', tokenizer: Optional[str] = None) -> int:
         """
         Estimate token count for TOON data.
 
         Args:
             key: Redis key name
             path: JSONPath to count
+            tokenizer: Name of a tokenizer loaded with the module, for an
+                exact count instead of the estimate
 
         Returns:
-            Approximate token count
+            Token count
 
         Example:
             >>> r.token_count('user:1')
             15
         """
+        if tokenizer:
+            return self.redis.execute_command('TOON.TOKENCOUNT', key, path, 'TOKENIZER', tokenizer)
         return self.redis.execute_command('TOON.TOKENCOUNT', key, path)
 
     def compare_efficiency(self, data: dict) -> dict:
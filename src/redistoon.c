@@ -1,21 +1,31 @@
 #include "redistoon.h"
+#include <math.h>
+#include <strings.h>
 
 // Redis module type
 RedisModuleType *ToonType_RMT = NULL;
 
+// Cached encodings are the first memory given back near maxmemory: past
+// this fraction of it, reads stop caching and drop what is cached
+#define TOON_CACHE_PRESSURE_RATIO 0.9f
+
+// Bytes of arena reachable from a document's root
+static size_t document_size(const ToonDocument *doc) {
+    return toon_document_live_bytes(doc);
+}
+
 // ============================================================================
 // Redis Type Methods
 // ============================================================================
 
-void *ToonTypeRdbLoad(RedisModuleIO *rdb, int encver) {
-    if (encver != 0) return NULL;
-
+// Load a document written by pre-binary versions as a single TOON string
+static ToonValue *rdb_load_text(ToonArena *arena, RedisModuleIO *rdb) {
     size_t len;
     char *toon_str = RedisModule_LoadStringBuffer(rdb, &len);
     if (!toon_str) return NULL;
 
     char *error = NULL;
-    ToonValue *value = toon_decode(toon_str, &error);
+    ToonValue *value = toon_decode_len(arena, toon_str, len, &error);
     RedisModule_Free(toon_str);
 
     if (!value) {
@@ -23,201 +33,1631 @@ void *ToonTypeRdbLoad(RedisModuleIO *rdb, int encver) {
         return NULL;
     }
 
-    ToonDocument *doc = toon_document_create();
+    return value;
+}
+
+void *ToonTypeRdbLoad(RedisModuleIO *rdb, int encver) {
+    if (encver < 0 || encver > TOON_ENCODING_VERSION) {
+        RedisModule_LogIOError(rdb, "warning", "Can't load TOON data with encoding version %d", encver);
+        return NULL;
+    }
+
+    ToonArena *arena = toon_arena_create(0);
+    if (!arena) return NULL;
+
+    // encver 0 is the text encoding; keep reading it so rolling upgrades work.
+    // Documents saved without a version get a new one.
+    ToonValue *value;
+    uint64_t version = 0;
+    if (encver == 0) {
+        value = rdb_load_text(arena, rdb);
+    } else {
+        value = toon_rdb_load(arena, rdb, &version);
+    }
+
+    ToonDocument *doc = value ? toon_document_create(arena, value) : NULL;
+    if (!doc) {
+        toon_arena_destroy(arena);
+        return NULL;
+    }
+
+    if (version) doc->version = version;
+    toon_version_observe(doc->version);
+    return doc;
+}
+
+void ToonTypeRdbSave(RedisModuleIO *rdb, void *value) {
+    ToonDocument *doc = value;
+    if (!doc || !doc->root) return;
+
+    toon_rdb_save(rdb, doc);
+}
+
+// Large documents are rewritten as a base value and bounded appends
+void ToonTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
+    ToonDocument *doc = value;
+    if (!doc || !doc->root) return;
+
+    toon_aof_rewrite(aof, key, doc->root, document_size(doc));
+}
+
+// The TOON text is canonical for a tree, so it is what gets digested;
+// cached text is used when there is some
+void ToonTypeDigest(RedisModuleDigest *md, void *value) {
+    ToonDocument *doc = value;
+    if (!doc || !doc->root) return;
+
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+
+    size_t len;
+    const char *text = toon_document_text(doc, TOON_TEXT_TOON, false, &buf, &len);
+    if (text) RedisModule_DigestAddStringBuffer(md, text, len);
+    RedisModule_DigestEndSequence(md);
+
+    toon_buffer_free(&buf);
+}
+
+size_t ToonTypeMemUsage(const void *value) {
+    return value ? toon_document_mem_usage(value) : 0;
+}
+
+// COPY gets a clone sharing the tree, like TOON.CLONE. Freezing the
+// arena leaves the source's content as it was.
+void *ToonTypeCopy(RedisModuleString *fromkey, RedisModuleString *tokey, const void *value) {
+    (void)fromkey;
+    (void)tokey;
+    return toon_document_clone((ToonDocument *)value);
+}
+
+// Nodes are allocated from arena chunks, not one by one, so what active
+// defrag moves is chunks, through the server's allocator they come from.
+// A document the server hands over with a deadline resumes at the chunk
+// it stopped at; documents within the free effort it scans at once are
+// done whole.
+static void *defrag_chunk(void *chunk, void *ctx) {
+    return RedisModule_DefragAlloc(ctx, chunk);
+}
+
+static bool defrag_should_stop(void *ctx) {
+    return RedisModule_DefragShouldStop && RedisModule_DefragShouldStop(ctx);
+}
+
+int ToonTypeDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value) {
+    (void)key;
+    ToonDocument *doc = *value;
+    if (!doc || !doc->root || !RedisModule_DefragAlloc || !RedisModule_TryAlloc) return 0;
+
+    unsigned long cursor = 0;
+    if (RedisModule_DefragCursorGet) RedisModule_DefragCursorGet(ctx, &cursor);
+
+    size_t next = cursor;
+    ToonChunkMover mover = {defrag_chunk, defrag_should_stop, ctx};
+    if (!toon_document_defrag(doc, &mover, &next)) return 0;
+
+    return RedisModule_DefragCursorSet && RedisModule_DefragCursorSet(ctx, next) == REDISMODULE_OK;
+}
+
+// Freeing the tree can run on the server's lazyfree thread, so everything
+// main-thread state points at is released in ToonTypeUnlink first
+void ToonTypeFree(void *value) {
+    toon_document_free((ToonDocument *)value);
+}
+
+// How much work freeing takes; past the server's threshold UNLINK and
+// lazyfree deletes free the document in the background
+size_t ToonTypeFreeEffort(RedisModuleString *key, const void *value) {
+    (void)key;
+    return toon_document_free_effort(value);
+}
+
+// Called on the main thread when the key is removed, before the document
+// is freed on whichever thread the server picks
+void ToonTypeUnlink(RedisModuleString *key, const void *value) {
+    (void)key;
+    toon_document_unlink((ToonDocument *)value);
+}
+
+// An asynchronous flush frees every document on another thread without
+// unlinking them one by one, so drop what points into them up front
+static void on_flush(RedisModuleCtx *ctx, RedisModuleEvent event, uint64_t subevent, void *data) {
+    (void)ctx;
+    (void)event;
+    if (subevent != REDISMODULE_SUBEVENT_FLUSHDB_START) return;
+
+    RedisModuleFlushInfo *info = data;
+    toon_cache_clear();
+    toon_snapshot_detach_all();
+    toon_index_forget_db(info->dbnum);
+}
+
+// Resolve the path argument argv[index] through the compiled path cache,
+// defaulting to the root when it is absent. NULL for an invalid path.
+static const ToonPath *path_arg(RedisModuleString **argv, int argc, int index) {
+    if (index >= argc) {
+        return toon_path_cache_lookup("$", 1);
+    }
+
+    size_t path_len;
+    const char *path_str = RedisModule_StringPtrLen(argv[index], &path_len);
+
+    toon_stats_mark();
+    const ToonPath *path = toon_path_cache_lookup(path_str, path_len);
+    toon_stats_phase(TOON_PHASE_PATH);
+    return path;
+}
+
+// ============================================================================
+// Change notifications
+// ============================================================================
+
+// Every write raises a module keyspace event named after its command, as
+// core types do. The event cannot carry the path, so while module events
+// are enabled a companion message "<event> <version> <path>" is published
+// on __toonpath@<db>__:<key> for clients that invalidate by path.
+static void notify_change(RedisModuleCtx *ctx, const char *event, RedisModuleString *key,
+                          const ToonDocument *doc, const char *path, size_t path_len) {
+    RedisModule_NotifyKeyspaceEvent(ctx, REDISMODULE_NOTIFY_MODULE, event, key);
+
+    if (!RedisModule_PublishMessage || !RedisModule_GetNotifyKeyspaceEvents ||
+        !(RedisModule_GetNotifyKeyspaceEvents() & REDISMODULE_NOTIFY_MODULE)) {
+        return;
+    }
+
+    size_t key_len;
+    const char *key_str = RedisModule_StringPtrLen(key, &key_len);
+    RedisModuleString *channel = RedisModule_CreateStringPrintf(ctx, "__toonpath@%d__:",
+                                                                RedisModule_GetSelectedDb(ctx));
+    RedisModule_StringAppendBuffer(ctx, channel, key_str, key_len);
+
+    RedisModuleString *message = RedisModule_CreateStringPrintf(ctx, "%s %llu ", event,
+                                                                (unsigned long long)doc->version);
+    RedisModule_StringAppendBuffer(ctx, message, path, path_len);
+
+    RedisModule_PublishMessage(ctx, channel, message);
+}
+
+// notify_change for a command whose path is argv[2]
+static void notify_path_arg(RedisModuleCtx *ctx, const char *event, RedisModuleString **argv,
+                            const ToonDocument *doc) {
+    size_t path_len;
+    const char *path = RedisModule_StringPtrLen(argv[2], &path_len);
+    notify_change(ctx, event, argv[1], doc, path, path_len);
+}
+
+// ============================================================================
+// Secondary index upkeep
+// ============================================================================
+
+// Bring the indexes up to date after a write at path; rows_appended when
+// path is a table that only gained rows
+static void index_write(RedisModuleCtx *ctx, RedisModuleString *key, ToonDocument *doc,
+                        const ToonPath *path, bool rows_appended) {
+    if (!toon_index_list() || !path) return;
+
+    size_t key_len;
+    const char *key_str = RedisModule_StringPtrLen(key, &key_len);
+    toon_index_update(doc, key_str, key_len, RedisModule_GetSelectedDb(ctx), path, rows_appended);
+}
+
+static void index_root_write(RedisModuleCtx *ctx, RedisModuleString *key, ToonDocument *doc) {
+    index_write(ctx, key, doc, toon_path_cache_lookup("$", 1), false);
+}
+
+static void index_scan_key(RedisModuleCtx *ctx, RedisModuleString *keyname, RedisModuleKey *key,
+                           void *privdata) {
+    ToonIndex *only = privdata;
+    if (!key || RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return;
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    if (!doc || !doc->root) return;
+
+    size_t key_len;
+    const char *key_str = RedisModule_StringPtrLen(keyname, &key_len);
+    int db = RedisModule_GetSelectedDb(ctx);
+    for (ToonIndex *index = only ? only : toon_index_list(); index; index = only ? NULL : index->next) {
+        toon_index_add(index, doc, key_str, key_len, db);
+    }
+}
+
+// Index every document of every database, in one index or all of them
+static void index_scan_all(RedisModuleCtx *ctx, ToonIndex *only) {
+    if (!RedisModule_Scan || !RedisModule_SelectDb) return;
+
+    RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+    int selected = RedisModule_GetSelectedDb(ctx);
+    for (int db = 0; RedisModule_SelectDb(ctx, db) == REDISMODULE_OK; db++) {
+        RedisModule_ScanCursorRestart(cursor);
+        while (RedisModule_Scan(ctx, cursor, index_scan_key, only)) {
+        }
+    }
+    RedisModule_SelectDb(ctx, selected);
+    RedisModule_ScanCursorDestroy(cursor);
+}
+
+// Documents can reach a key without a TOON command: RENAME and MOVE carry
+// one to a new name or database, COPY and RESTORE make new ones
+static int on_key_event(RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key) {
+    (void)type;
+    if (!toon_index_list()) return REDISMODULE_OK;
+    if (strcmp(event, "rename_to") != 0 && strcmp(event, "move_to") != 0 &&
+        strcmp(event, "copy_to") != 0 && strcmp(event, "restore") != 0) {
+        return REDISMODULE_OK;
+    }
+
+    RedisModuleKey *handle = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+    if (RedisModule_KeyType(handle) == REDISMODULE_KEYTYPE_MODULE &&
+        RedisModule_ModuleTypeGetType(handle) == ToonType_RMT) {
+        ToonDocument *doc = RedisModule_ModuleTypeGetValue(handle);
+        if (doc && doc->root) index_root_write(ctx, key, doc);
+    }
+    RedisModule_CloseKey(handle);
+    return REDISMODULE_OK;
+}
+
+// Loaded documents are indexed in one pass once the load is over, against
+// the definitions the RDB or AOF brought with it
+static void on_loading(RedisModuleCtx *ctx, RedisModuleEvent event, uint64_t subevent, void *data) {
+    (void)event;
+    (void)data;
+    if (subevent == REDISMODULE_SUBEVENT_LOADING_ENDED && toon_index_list()) {
+        index_scan_all(ctx, NULL);
+    }
+}
+
+// Index definitions are not keys, so an AOF rewrite has no callback to
+// write them from. Instead the main process replicates them once the
+// rewrite has begun: a background rewrite has its child forked, and from
+// then on writes reach the AOF that replaces the rewritten one. A
+// synchronous rewrite, made at startup, has them replicated as it ends.
+// Replaying one already defined is a no-op.
+static bool aof_sync_rewrite = false;
+
+static void on_persistence(RedisModuleCtx *ctx, RedisModuleEvent event, uint64_t subevent, void *data) {
+    (void)event;
+    (void)data;
+    if (subevent == REDISMODULE_SUBEVENT_PERSISTENCE_SYNC_AOF_START) {
+        aof_sync_rewrite = true;
+    } else if (subevent == REDISMODULE_SUBEVENT_PERSISTENCE_ENDED && aof_sync_rewrite) {
+        aof_sync_rewrite = false;
+        toon_aof_replicate_indexes(ctx);
+    } else if (subevent == REDISMODULE_SUBEVENT_PERSISTENCE_FAILED) {
+        aof_sync_rewrite = false;
+    }
+}
+
+static void on_fork_child(RedisModuleCtx *ctx, RedisModuleEvent event, uint64_t subevent, void *data) {
+    (void)event;
+    (void)data;
+    if (subevent != REDISMODULE_SUBEVENT_FORK_CHILD_BORN || !toon_index_list() || !RedisModule_GetServerInfo) return;
+
+    RedisModuleServerInfoData *info = RedisModule_GetServerInfo(ctx, "persistence");
+    if (!info) return;
+
+    int err = 0;
+    bool rewriting = RedisModule_ServerInfoGetFieldSigned(info, "aof_rewrite_in_progress", &err) == 1 && !err;
+    RedisModule_FreeServerInfo(ctx, info);
+    if (rewriting) toon_aof_replicate_indexes(ctx);
+}
+
+static void on_swapdb(RedisModuleCtx *ctx, RedisModuleEvent event, uint64_t subevent, void *data) {
+    (void)ctx;
+    (void)event;
+    (void)subevent;
+    RedisModuleSwapDbInfo *info = data;
+    toon_index_swap_db(info->dbnum_first, info->dbnum_second);
+}
+
+// ============================================================================
+// Path replies
+// ============================================================================
+
+static bool cache_allowed(void) {
+    if (RedisModule_GetUsedMemoryRatio &&
+        RedisModule_GetUsedMemoryRatio() >= TOON_CACHE_PRESSURE_RATIO) {
+        toon_cache_clear();
+        return false;
+    }
+    return true;
+}
+
+// Reply with the whole document as text, cached after the first read
+static void reply_document_text(RedisModuleCtx *ctx, ToonDocument *doc, ToonTextFormat format) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+
+    toon_stats_mark();
+    size_t len;
+    const char *text = toon_document_text(doc, format, cache_allowed(), &buf, &len);
+    if (text) {
+        RedisModule_ReplyWithStringBuffer(ctx, text, len);
+    } else {
+        RedisModule_ReplyWithNull(ctx);
+    }
+    toon_stats_phase(TOON_PHASE_ENCODE);
+
+    toon_buffer_free(&buf);
+}
+
+static bool is_root(const ToonPath *path) {
+    return path && path->num_segments == 0;
+}
+
+// State shared by the visitors that reply once per match
+typedef struct {
+    RedisModuleCtx *ctx;
+    ToonBuffer *buf;        // Reused for every encoded match
+    ToonBudget *budget;     // Tokens left for all the matches, or NULL for no limit
+    long count;
+} MatchReply;
+
+// Matches are encoded as they are found, so the time up to each one counts
+// as path and its encoding as encode
+static void reply_match_toon(ToonValue *value, void *arg) {
+    MatchReply *reply = arg;
+
+    toon_stats_phase(TOON_PHASE_PATH);
+    toon_buffer_reset(reply->buf);
+    if (reply->budget) {
+        toon_encode_budget_to(reply->buf, value, 0, reply->budget);
+    } else {
+        toon_buffer_reserve(reply->buf, toon_encoded_size_hint(value));
+        toon_encode_to(reply->buf, value, 0);
+    }
+    if (reply->buf->failed) {
+        RedisModule_ReplyWithNull(reply->ctx);
+    } else {
+        RedisModule_ReplyWithStringBuffer(reply->ctx, reply->buf->data, reply->buf->len);
+    }
+    reply->count++;
+    toon_stats_phase(TOON_PHASE_ENCODE);
+}
+
+// Largest magnitude below which every integral double is exact
+#define TOON_EXACT_INTEGER_MAX 9007199254740992.0
+
+// Reply with value as native RESP3 types instead of text: objects as maps,
+// arrays as arrays, integral numbers as integers and others as doubles,
+// and a table as an array of rows that starts with its header row. Under
+// RESP2 the server sends maps as flat arrays, booleans as 1 or 0 and
+// doubles as bulk strings.
+static void reply_value(RedisModuleCtx *ctx, const ToonValue *value) {
+    switch (value->type) {
+        case TOON_NULL:
+            RedisModule_ReplyWithNull(ctx);
+            return;
+
+        case TOON_BOOLEAN:
+            if (RedisModule_ReplyWithBool) RedisModule_ReplyWithBool(ctx, value->value.boolean);
+            else RedisModule_ReplyWithLongLong(ctx, value->value.boolean);
+            return;
+
+        case TOON_NUMBER: {
+            double number = value->value.number;
+            if (number == floor(number) && fabs(number) < TOON_EXACT_INTEGER_MAX) {
+                RedisModule_ReplyWithLongLong(ctx, (long long)number);
+            } else {
+                RedisModule_ReplyWithDouble(ctx, number);
+            }
+            return;
+        }
+
+        case TOON_STRING:
+            RedisModule_ReplyWithStringBuffer(ctx, value->value.string, strlen(value->value.string));
+            return;
+
+        case TOON_ARRAY:
+            RedisModule_ReplyWithArray(ctx, value->value.array.length);
+            for (size_t i = 0; i < value->value.array.length; i++) {
+                reply_value(ctx, value->value.array.elements[i]);
+            }
+            return;
+
+        case TOON_OBJECT: {
+            size_t length = value->value.object.length;
+            if (RedisModule_ReplyWithMap) RedisModule_ReplyWithMap(ctx, length);
+            else RedisModule_ReplyWithArray(ctx, length * 2);
+
+            for (size_t i = 0; i < length; i++) {
+                const ToonObjectEntry *entry = &value->value.object.entries[i];
+                RedisModule_ReplyWithStringBuffer(ctx, entry->key, strlen(entry->key));
+                reply_value(ctx, entry->value);
+            }
+            return;
+        }
+
+        case TOON_TABULAR_ARRAY: {
+            const ToonTabularArray *tab = &value->value.tabular;
+            RedisModule_ReplyWithArray(ctx, tab->num_rows + 1);
+
+            RedisModule_ReplyWithArray(ctx, tab->num_headers);
+            for (size_t col = 0; col < tab->num_headers; col++) {
+                RedisModule_ReplyWithStringBuffer(ctx, tab->headers[col], strlen(tab->headers[col]));
+            }
+            for (size_t row = 0; row < tab->num_rows; row++) {
+                RedisModule_ReplyWithArray(ctx, tab->num_headers);
+                for (size_t col = 0; col < tab->num_headers; col++) {
+                    ToonValue scratch;
+                    reply_value(ctx, toon_tabular_cell(tab, row, col, &scratch));
+                }
+            }
+            return;
+        }
+    }
+}
+
+static void reply_match_resp3(ToonValue *value, void *arg) {
+    MatchReply *reply = arg;
+
+    toon_stats_phase(TOON_PHASE_PATH);
+    reply_value(reply->ctx, value);
+    reply->count++;
+    toon_stats_phase(TOON_PHASE_ENCODE);
+}
+
+static void reply_match_type(ToonValue *value, void *arg) {
+    MatchReply *reply = arg;
+
+    RedisModule_ReplyWithSimpleString(reply->ctx, toon_type_string(value->type));
+    reply->count++;
+}
+
+// Reply with the matches of path in root, each through reply_one, as they
+// are found. A definite path replies with its match, or null if there is
+// none; any other path replies with an array of all of them.
+static void reply_matches(RedisModuleCtx *ctx, ToonValue *root, const ToonPath *path,
+                          ToonPathVisit reply_one, ToonBuffer *buf, ToonBudget *budget) {
+    MatchReply reply = {.ctx = ctx, .buf = buf, .budget = budget};
+    toon_stats_mark();
+
+    if (!path || path->definite) {
+        toon_path_eval(root, path, reply_one, &reply);
+        toon_stats_phase(TOON_PHASE_PATH);
+        if (reply.count == 0) RedisModule_ReplyWithNull(ctx);
+        return;
+    }
+
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_LEN);
+    toon_path_eval(root, path, reply_one, &reply);
+    toon_stats_phase(TOON_PHASE_PATH);
+    RedisModule_ReplySetArrayLength(ctx, reply.count);
+}
+
+// Matches of a path as JSON: the value itself for a definite path, an
+// array of the matches otherwise
+typedef struct {
+    ToonBuffer *buf;
+    size_t count;
+} JsonMatches;
+
+static void append_match_json(ToonValue *value, void *arg) {
+    JsonMatches *matches = arg;
+
+    toon_stats_phase(TOON_PHASE_PATH);
+    if (matches->count++ > 0) toon_buffer_putc(matches->buf, ',');
+    toon_to_json_to(matches->buf, value);
+    toon_stats_phase(TOON_PHASE_ENCODE);
+}
+
+static void sum_match_tokens(ToonValue *value, void *arg) {
+    *(size_t *)arg += toon_estimate_tokens(value);
+}
+
+// State of a count with a real tokenizer, which reads the TOON text
+typedef struct {
+    ToonTokenizer *tokenizer;
+    ToonBuffer *buf;        // Reused for every encoded match
+    size_t tokens;
+} TokenizerCount;
+
+static void sum_match_tokenizer(ToonValue *value, void *arg) {
+    TokenizerCount *count = arg;
+
+    toon_stats_phase(TOON_PHASE_PATH);
+    toon_buffer_reset(count->buf);
+    toon_encode_to(count->buf, value, 0);
+    if (!count->buf->failed) {
+        count->tokens += toon_tokenizer_count(count->tokenizer, count->buf->data, count->buf->len);
+    }
+    toon_stats_phase(TOON_PHASE_ENCODE);
+}
+
+// ============================================================================
+// Worker jobs
+// ============================================================================
+
+// Parsing and whole-document encoding of inputs or documents at least this
+// large run on a worker thread while the client is blocked
+#define TOON_THREAD_DEFAULT_THRESHOLD (1024 * 1024)
+#define TOON_POOL_DEFAULT_THREADS 4
+
+static size_t thread_threshold = TOON_THREAD_DEFAULT_THRESHOLD;
+
+typedef enum {
+    JOB_FROMJSON,           // Parse JSON into a new root
+    JOB_SET,                // Parse TOON into a new root
+    JOB_ENCODE,             // Encode a pinned snapshot
+    JOB_CONVERT             // Transcode the input into the other format
+} ToonJobType;
+
+typedef struct {
+    ToonJobType type;
+    RedisModuleBlockedClient *client;
+
+    // Parse jobs: the key, a private copy of the input and what it became
+    RedisModuleString *key;
+    char *input;            // NUL-terminated
+    size_t input_len;
+    ToonArena *arena;       // Owned by the job until swapped into the key
+    ToonValue *root;
+    char *error;
+
+    // Encode jobs, and convert jobs with the input's format
+    ToonSnapshot *snapshot;
+    ToonTextFormat format;
+    ToonBuffer buf;
+    bool converted;
+} ToonJob;
+
+// Whether a request of size bytes should go to a worker. Calls inside
+// MULTI, scripts, replication or loading cannot block and run inline.
+static bool can_offload(RedisModuleCtx *ctx, size_t size) {
+    if (size < thread_threshold || toon_pool_size() == 0) return false;
+
+    int flags = RedisModule_GetContextFlags(ctx);
+    return !(flags & (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA |
+                      REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING |
+                      REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+}
+
+// Transcode input, in format, into the other format
+static bool convert_text(ToonTextFormat format, const char *input, size_t input_len,
+                         ToonBuffer *buf, char **error) {
+    if (format == TOON_TEXT_JSON) return toon_transcode_json(buf, input, error);
+    return toon_transcode_toon(buf, input, input_len, error);
+}
+
+static int reply_converted(RedisModuleCtx *ctx, bool ok, ToonBuffer *buf, const char *error) {
+    if (!ok) return RedisModule_ReplyWithError(ctx, error ? error : "ERR out of memory");
+    return RedisModule_ReplyWithStringBuffer(ctx, buf->data, buf->len);
+}
+
+static void job_destroy(ToonJob *job) {
+    if (job->snapshot) toon_snapshot_release(job->snapshot);
+    if (job->key) RedisModule_FreeString(NULL, job->key);
+    toon_arena_reclaim(job->arena);
+    toon_buffer_free(&job->buf);
+    free(job->input);
+    free(job->error);
+    free(job);
+}
+
+// The command a job runs for
+static ToonCommand job_command(const ToonJob *job) {
+    switch (job->type) {
+        case JOB_FROMJSON: return TOON_CMD_FROMJSON;
+        case JOB_SET:      return TOON_CMD_SET;
+        case JOB_CONVERT:  return TOON_CMD_CONVERT;
+        case JOB_ENCODE:   break;
+    }
+    return job->format == TOON_TEXT_TOON ? TOON_CMD_GET : TOON_CMD_TOJSON;
+}
+
+// Runs on a worker; touches nothing but the job
+static void job_run(void *arg) {
+    ToonJob *job = arg;
+    uint64_t start = toon_stats_now();
+
+    switch (job->type) {
+        case JOB_FROMJSON:
+        case JOB_SET:
+            job->arena = toon_arena_create(job->input_len);
+            if (!job->arena) break;
+
+            if (job->type == JOB_FROMJSON) {
+                job->root = json_to_toon(job->arena, job->input, &job->error);
+            } else {
+                job->root = toon_decode_len(job->arena, job->input, job->input_len, &job->error);
+            }
+            break;
+
+        case JOB_ENCODE:
+            toon_buffer_init(&job->buf, toon_encoded_size_hint(job->snapshot->root));
+            if (job->format == TOON_TEXT_TOON) {
+                toon_encode_to(&job->buf, job->snapshot->root, 0);
+            } else {
+                toon_to_json_to(&job->buf, job->snapshot->root);
+            }
+            break;
+
+        case JOB_CONVERT:
+            toon_buffer_init(&job->buf, job->input_len);
+            job->converted = convert_text(job->format, job->input, job->input_len, &job->buf, &job->error);
+            break;
+    }
+
+    toon_stats_record(job_command(job), job->type == JOB_ENCODE ? TOON_PHASE_ENCODE : TOON_PHASE_PARSE,
+                      toon_stats_now() - start);
+    RedisModule_UnblockClient(job->client, job);
+}
+
+// Back on the main thread: put a parsed root into the key, as the inline
+// command would have
+static int job_swap_in(RedisModuleCtx *ctx, ToonJob *job) {
+    if (!job->root) {
+        if (!job->arena) return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+
+        const char *fallback = job->type == JOB_FROMJSON ? "ERR invalid JSON" : "ERR invalid TOON format";
+        return RedisModule_ReplyWithError(ctx, job->error ? job->error : fallback);
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, job->key, REDISMODULE_READ | REDISMODULE_WRITE);
+
+    // The key may have changed while the client was blocked
+    ToonDocument *doc = NULL;
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_MODULE &&
+        RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
+        doc = RedisModule_ModuleTypeGetValue(key);
+    } else if (type != REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
     if (doc) {
-        toon_value_free(doc->root);
-        doc->root = value;
+        toon_document_set_root(doc, job->arena, job->root);
+    } else {
+        doc = toon_document_create(job->arena, job->root);
+        if (!doc) {
+            return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+        }
+        RedisModule_ModuleTypeSetValue(key, ToonType_RMT, doc);
+    }
+    job->arena = NULL;
+    index_root_write(ctx, job->key, doc);
+
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    if (job->type == JOB_FROMJSON) {
+        RedisModule_Replicate(ctx, "TOON.FROMJSON", "sb", job->key, job->input, job->input_len);
+        notify_change(ctx, "toon.fromjson", job->key, doc, "$", 1);
+    } else {
+        RedisModule_Replicate(ctx, "TOON.SET", "scb", job->key, "$", job->input, job->input_len);
+        notify_change(ctx, "toon.set", job->key, doc, "$", 1);
+    }
+    return REDISMODULE_OK;
+}
+
+static int job_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    (void)argv;
+    (void)argc;
+    RedisModule_AutoMemory(ctx);
+
+    ToonJob *job = RedisModule_GetBlockedClientPrivateData(ctx);
+    if (job->type == JOB_CONVERT) {
+        return reply_converted(ctx, job->converted, &job->buf, job->error);
+    }
+    if (job->type != JOB_ENCODE) {
+        return job_swap_in(ctx, job);
+    }
+
+    if (job->buf.failed) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+    RedisModule_ReplyWithStringBuffer(ctx, job->buf.data, job->buf.len);
+
+    // The text is still current if the document has not moved off the snapshot
+    if (job->snapshot->doc && cache_allowed()) {
+        toon_document_cache_text(job->snapshot->doc, job->format, &job->buf);
+    }
+    return REDISMODULE_OK;
+}
+
+static void job_free(RedisModuleCtx *ctx, void *arg) {
+    (void)ctx;
+    job_destroy(arg);
+}
+
+// Block the client and queue the job. On failure the job is destroyed and
+// the caller runs the request inline.
+static bool job_submit(RedisModuleCtx *ctx, ToonJob *job) {
+    job->client = RedisModule_BlockClient(ctx, job_reply, NULL, job_free, 0);
+    if (!job->client) {
+        job_destroy(job);
+        return false;
+    }
+
+    if (!toon_pool_submit(job_run, job)) {
+        RedisModule_AbortBlock(job->client);
+        job_destroy(job);
+        return false;
+    }
+    return true;
+}
+
+// A job of type holding a private, NUL-terminated copy of input
+static ToonJob *job_with_input(ToonJobType type, const char *input, size_t input_len) {
+    ToonJob *job = calloc(1, sizeof(ToonJob));
+    if (!job) return NULL;
+    job->type = type;
+    job->input = malloc(input_len + 1);
+    job->input_len = input_len;
+    if (!job->input) {
+        job_destroy(job);
+        return NULL;
+    }
+    memcpy(job->input, input, input_len);
+    job->input[input_len] = '\0';
+    return job;
+}
+
+// Parse a large root value for key on a worker. False if it runs inline.
+static bool parse_on_worker(RedisModuleCtx *ctx, ToonJobType type, RedisModuleString *key,
+                            const char *input, size_t input_len) {
+    if (!can_offload(ctx, input_len)) return false;
+
+    ToonJob *job = job_with_input(type, input, input_len);
+    if (!job) return false;
+    job->key = RedisModule_CreateStringFromString(NULL, key);
+
+    return job_submit(ctx, job);
+}
+
+// Convert a large input on a worker. False if it runs inline.
+static bool convert_on_worker(RedisModuleCtx *ctx, ToonTextFormat format, const char *input,
+                              size_t input_len) {
+    if (!can_offload(ctx, input_len)) return false;
+
+    ToonJob *job = job_with_input(JOB_CONVERT, input, input_len);
+    if (!job) return false;
+    job->format = format;
+
+    return job_submit(ctx, job);
+}
+
+// Encode a large document that has no cached text on a worker, from a
+// snapshot that writes in the meantime cannot touch. False if it runs inline.
+static bool encode_on_worker(RedisModuleCtx *ctx, ToonDocument *doc, ToonTextFormat format) {
+    if (doc->cache.text[format] || !can_offload(ctx, document_size(doc))) return false;
+
+    ToonJob *job = calloc(1, sizeof(ToonJob));
+    if (!job) return false;
+    job->type = JOB_ENCODE;
+    job->format = format;
+    job->snapshot = toon_document_pin(doc);
+    if (!job->snapshot) {
+        job_destroy(job);
+        return false;
+    }
+
+    return job_submit(ctx, job);
+}
+
+// ============================================================================
+// Command: TOON.SET key path value
+// ============================================================================
+
+int ToonSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    const ToonPath *path = path_arg(argv, argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
+    size_t value_len;
+    const char *value_str = RedisModule_StringPtrLen(argv[3], &value_len);
+
+    // Get the existing document, if any
+    ToonDocument *doc = NULL;
+    int type = RedisModule_KeyType(key);
+
+    if (type == REDISMODULE_KEYTYPE_MODULE &&
+        RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
+        doc = RedisModule_ModuleTypeGetValue(key);
+    } else if (type != REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    bool is_root = path->num_segments == 0;
+    if (!doc && !is_root) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
+    if (is_root && parse_on_worker(ctx, JOB_SET, argv[1], value_str, value_len)) {
+        return REDISMODULE_OK;
+    }
+
+    // A path update is checked before anything is decoded, and a pinned
+    // tree frozen so the value goes into the arena the document continues in
+    if (!is_root && !toon_path_writable(doc->root, path, true)) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+    if (!is_root && !toon_document_unshare(doc)) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    // A root replacement is parsed into a fresh arena so the old tree can
+    // be freed wholesale; a path update allocates into the document arena
+    ToonArena *arena = is_root ? toon_arena_create(value_len) : doc->arena;
+    if (!arena) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    // Parse the TOON value
+    toon_stats_mark();
+    char *error = NULL;
+    ToonValue *value = toon_decode_len(arena, value_str, value_len, &error);
+    toon_stats_phase(TOON_PHASE_PARSE);
+    if (!value) {
+        if (is_root) toon_arena_destroy(arena);
+        RedisModule_ReplyWithError(ctx, error ? error : "ERR invalid TOON format");
+        if (error) free(error);
+        return REDISMODULE_OK;
+    }
+
+    // Set value at path
+    if (is_root) {
+        if (doc) {
+            toon_document_set_root(doc, arena, value);
+        } else {
+            doc = toon_document_create(arena, value);
+            if (!doc) {
+                toon_arena_destroy(arena);
+                return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+            }
+            RedisModule_ModuleTypeSetValue(key, ToonType_RMT, doc);
+        }
+    } else {
+        toon_stats_mark();
+        int result = toon_path_set(doc, path, value);
+        toon_stats_phase(TOON_PHASE_PATH);
+        if (result != 0) {
+            // Nodes copied on the way were allocated after the value, so
+            // it is left as waste rather than rewound
+            toon_value_discard(arena, value);
+            return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+        }
+    }
+
+    index_write(ctx, argv[1], doc, path, false);
+
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    notify_path_arg(ctx, "toon.set", argv, doc);
+
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.GET key [path] [FORMAT TOON|RESP3] [IFNEWER version]
+//                   [MAXTOKENS n [KEEP HEAD|TAIL]]
+// ============================================================================
+
+static bool arg_is(RedisModuleString *arg, const char *word) {
+    size_t len;
+    const char *str = RedisModule_StringPtrLen(arg, &len);
+    return len == strlen(word) && strncasecmp(str, word, len) == 0;
+}
+
+// With IFNEWER the reply is null unless the document's version is past
+// the one given, so a client holding a copy only transfers a changed one.
+// FORMAT RESP3 replies with the values themselves rather than their text.
+int ToonGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 2 || argc > 11) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    // Options come in pairs, so an odd count means a path is given.
+    // Any version is newer than 0, which a document never has.
+    int path_argc = argc % 2 ? 3 : 2;
+    long long newer_than = 0;
+    long long max_tokens = -1;
+    bool resp3 = false;
+    ToonBudget budget = {0};
+    for (int i = path_argc; i < argc; i += 2) {
+        if (arg_is(argv[i], "IFNEWER")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &newer_than) != REDISMODULE_OK || newer_than < 0) {
+                return RedisModule_ReplyWithError(ctx, "ERR version is not an integer or out of range");
+            }
+        } else if (arg_is(argv[i], "FORMAT") && (arg_is(argv[i + 1], "RESP3") || arg_is(argv[i + 1], "TOON"))) {
+            resp3 = arg_is(argv[i + 1], "RESP3");
+        } else if (arg_is(argv[i], "MAXTOKENS")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &max_tokens) != REDISMODULE_OK || max_tokens < 0) {
+                return RedisModule_ReplyWithError(ctx, "ERR MAXTOKENS is not an integer or out of range");
+            }
+            budget.remaining = (size_t)max_tokens;
+        } else if (arg_is(argv[i], "KEEP") && (arg_is(argv[i + 1], "HEAD") || arg_is(argv[i + 1], "TAIL"))) {
+            budget.keep_tail = arg_is(argv[i + 1], "TAIL");
+        } else {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+    }
+    if (resp3 && max_tokens >= 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR MAXTOKENS only applies to FORMAT TOON");
+    }
+
+    const ToonPath *path = path_arg(argv, path_argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    if (!doc || !doc->root || doc->version <= (unsigned long long)newer_than) {
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    // The whole document comes from the cache, or a worker when it is
+    // large; anything else is encoded straight into the reply, match by
+    // match (path defaults to root), with one budget for all the matches
+    if (is_root(path) && !resp3 && max_tokens < 0) {
+        if (!encode_on_worker(ctx, doc, TOON_TEXT_TOON)) reply_document_text(ctx, doc, TOON_TEXT_TOON);
+        return REDISMODULE_OK;
+    }
+
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+    reply_matches(ctx, doc->root, path, resp3 ? reply_match_resp3 : reply_match_toon, &buf,
+                  max_tokens >= 0 ? &budget : NULL);
+    toon_buffer_free(&buf);
+
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.VERSION key
+// ============================================================================
+
+// Reply with the document's version: above any other version given out
+// when it was created, plus one for every write since. 0 when the key does
+// not exist.
+int ToonVersion_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 2) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    return RedisModule_ReplyWithLongLong(ctx, doc ? (long long)doc->version : 0);
+}
+
+// ============================================================================
+// Command: TOON.MGET key [key ...] path
+// ============================================================================
+
+// Replies with one element per key: what TOON.GET would reply for it, or
+// null when the key is missing or holds another type. The path is
+// compiled once for the batch and one buffer serves every key.
+// The keys are declared to the server, so in cluster mode they must share
+// a slot like those of MGET.
+int ToonMGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    const ToonPath *path = path_arg(argv, argc, argc - 1);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
+    int num_keys = argc - 2;
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+
+    RedisModule_ReplyWithArray(ctx, num_keys);
+    for (int i = 1; i <= num_keys; i++) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+
+        ToonDocument *doc = NULL;
+        if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_MODULE &&
+            RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
+            doc = RedisModule_ModuleTypeGetValue(key);
+        }
+
+        if (doc && doc->root && is_root(path)) {
+            reply_document_text(ctx, doc, TOON_TEXT_TOON);
+        } else if (doc && doc->root) {
+            reply_matches(ctx, doc->root, path, reply_match_toon, &buf, NULL);
+        } else {
+            RedisModule_ReplyWithNull(ctx);
+        }
+
+        // Release keys as we go; a batch can name hundreds
+        RedisModule_CloseKey(key);
+    }
+
+    toon_buffer_free(&buf);
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.DEL key path
+// ============================================================================
+
+int ToonDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    const ToonPath *path = path_arg(argv, argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    if (!doc || !doc->root) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    if (!toon_path_writable(doc->root, path, false)) {
+        return RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+    if (!toon_document_unshare(doc)) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    toon_stats_mark();
+    int result = toon_path_delete(doc, path);
+    toon_stats_phase(TOON_PHASE_PATH);
+
+    if (result == 0) {
+        index_write(ctx, argv[1], doc, path, false);
+        RedisModule_ReplyWithLongLong(ctx, 1);
+        RedisModule_ReplicateVerbatim(ctx);
+        notify_path_arg(ctx, "toon.del", argv, doc);
+    } else {
+        RedisModule_ReplyWithLongLong(ctx, 0);
+    }
+
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.ARRAPPEND key path value [value ...]
+// ============================================================================
+
+// Append TOON values to the array at path and reply with its new length.
+// Only the element vector grows, so the cost is independent of the rest of
+// the document, and the command itself is the delta that is replicated.
+int ToonArrAppend_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
+
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    if (!doc || !doc->root) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
+    const ToonPath *path = path_arg(argv, argc, 2);
+
+    ToonValue scratch;
+    toon_stats_mark();
+    ToonValue *array = toon_path_get(doc->root, path, &scratch);
+    toon_stats_phase(TOON_PHASE_PATH);
+    if (!array) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+    if (array->type == TOON_TABULAR_ARRAY) {
+        return RedisModule_ReplyWithError(ctx, "ERR tabular array, use TOON.ROWAPPEND");
+    }
+    if (array->type != TOON_ARRAY) {
+        return RedisModule_ReplyWithError(ctx, "ERR not an array");
+    }
+
+    size_t num_values = argc - 3;
+    ToonValue **values = malloc(sizeof(ToonValue *) * num_values);
+    if (!values || !toon_document_unshare(doc)) {
+        free(values);
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    // Decode every value before copying the nodes on the way to the
+    // array, so a rejected value is rewound and nothing is copied
+    ToonArenaMark mark = toon_arena_mark(doc->arena);
+    long long tokens = 0;
+    toon_stats_mark();
+    for (size_t i = 0; i < num_values; i++) {
+        size_t value_len;
+        const char *value_str = RedisModule_StringPtrLen(argv[3 + i], &value_len);
+
+        char *error = NULL;
+        values[i] = toon_decode_len(doc->arena, value_str, value_len, &error);
+        if (!values[i]) {
+            toon_arena_rewind(doc->arena, mark);
+            free(values);
+            RedisModule_ReplyWithError(ctx, error ? error : "ERR invalid TOON format");
+            if (error) free(error);
+            return REDISMODULE_OK;
+        }
+        tokens += toon_estimate_tokens(values[i]);
+    }
+    toon_stats_phase(TOON_PHASE_PARSE);
+
+    // The array may be a copy now. Copies follow the mark, so from here a
+    // failure leaves the values as waste.
+    array = toon_document_unshare_path(doc, path, path->num_segments) ? toon_path_get(doc->root, path, &scratch)
+                                                                      : NULL;
+    if (!array || !toon_array_reserve(doc->arena, array, num_values)) {
+        for (size_t i = 0; i < num_values; i++) toon_value_discard(doc->arena, values[i]);
+        free(values);
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    size_t length = array->value.array.length;
+    memcpy(array->value.array.elements + length, values, sizeof(ToonValue *) * num_values);
+    free(values);
+    array->value.array.length = length + num_values;
+    toon_path_add_tokens(doc->root, path, tokens);
+    toon_document_changed(doc);
+    index_write(ctx, argv[1], doc, path, false);
+
+    RedisModule_ReplyWithLongLong(ctx, array->value.array.length);
+    RedisModule_ReplicateVerbatim(ctx);
+    notify_path_arg(ctx, "toon.arrappend", argv, doc);
+
+    toon_document_compact(doc);
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.ROWAPPEND key path cell [cell ...]
+// ============================================================================
+
+// Append rows to the tabular array at path, one cell per column in header
+// order, and reply with the new row count. Each cell is a TOON scalar.
+// Only the column vectors grow, and only the rows are replicated.
+int ToonRowAppend_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    int type = RedisModule_KeyType(key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
+
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
+    if (!doc || !doc->root) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
+    const ToonPath *path = path_arg(argv, argc, 2);
+
+    ToonValue scratch;
+    toon_stats_mark();
+    ToonValue *table = toon_path_get(doc->root, path, &scratch);
+    toon_stats_phase(TOON_PHASE_PATH);
+    if (!table) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+    if (table->type != TOON_TABULAR_ARRAY) {
+        return RedisModule_ReplyWithError(ctx, "ERR not a tabular array");
     }
 
-    return doc;
-}
-
-void ToonTypeRdbSave(RedisModuleIO *rdb, void *value) {
-    ToonDocument *doc = value;
-    if (!doc || !doc->root) return;
+    ToonTabularArray *tab = &table->value.tabular;
+    size_t num_cells = argc - 3;
+    if (tab->num_headers == 0 || num_cells % tab->num_headers != 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR wrong number of cells");
+    }
 
-    char *toon_str = toon_encode(doc->root, 0);
-    if (toon_str) {
-        RedisModule_SaveStringBuffer(rdb, toon_str, strlen(toon_str));
-        free(toon_str);
+    // Parse every cell before touching the table; they are copied into
+    // the columns, so they only need to live in a scratch arena
+    ToonArena *cell_arena = toon_arena_create(0);
+    ToonValue **cells = malloc(sizeof(ToonValue *) * num_cells);
+    if (!cell_arena || !cells) {
+        toon_arena_destroy(cell_arena);
+        free(cells);
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
     }
-}
 
-void ToonTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
-    ToonDocument *doc = value;
-    if (!doc || !doc->root) return;
+    toon_stats_mark();
+    for (size_t i = 0; i < num_cells; i++) {
+        size_t cell_len;
+        const char *cell_str = RedisModule_StringPtrLen(argv[3 + i], &cell_len);
+
+        char *error = NULL;
+        cells[i] = toon_decode_len(cell_arena, cell_str, cell_len, &error);
+        if (!cells[i] || cells[i]->type == TOON_ARRAY || cells[i]->type == TOON_OBJECT ||
+            cells[i]->type == TOON_TABULAR_ARRAY) {
+            RedisModule_ReplyWithError(ctx, error ? error : "ERR cells must be scalars");
+            if (error) free(error);
+            toon_arena_destroy(cell_arena);
+            free(cells);
+            return REDISMODULE_OK;
+        }
+    }
+    toon_stats_phase(TOON_PHASE_PARSE);
+
+    // Only now copy the nodes on the way to the table, which may move it
+    if (!toon_document_unshare(doc) || !toon_document_unshare_path(doc, path, path->num_segments) ||
+        !(table = toon_path_get(doc->root, path, &scratch))) {
+        toon_arena_destroy(cell_arena);
+        free(cells);
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+    tab = &table->value.tabular;
+
+    // A cell costs the same tokens in a column as on its own
+    size_t num_rows = num_cells / tab->num_headers;
+    size_t appended = 0;
+    long long tokens = 0;
+    while (appended < num_rows &&
+           toon_tabular_append_row(doc->arena, tab, cells + appended * tab->num_headers)) {
+        for (size_t col = 0; col < tab->num_headers; col++) {
+            tokens += toon_estimate_tokens(cells[appended * tab->num_headers + col]);
+        }
+        appended++;
+    }
 
-    char *toon_str = toon_encode(doc->root, 0);
-    if (toon_str) {
-        RedisModule_EmitAOF(aof, "TOON.SET", "ssc", key, "$", toon_str, strlen(toon_str));
-        free(toon_str);
+    toon_arena_destroy(cell_arena);
+    free(cells);
+    if (appended > 0) {
+        toon_path_add_tokens(doc->root, path, tokens);
+        toon_document_changed(doc);
+        index_write(ctx, argv[1], doc, path, true);
+        notify_path_arg(ctx, "toon.rowappend", argv, doc);
     }
-}
 
-void ToonTypeDigest(RedisModuleDigest *md, void *value) {
-    // Not implemented yet
-}
+    if (appended == num_rows) {
+        RedisModule_ReplyWithLongLong(ctx, tab->num_rows);
+        RedisModule_ReplicateVerbatim(ctx);
+    } else {
+        // Replicate the rows that made it in, so replicas stay in step
+        if (appended > 0) {
+            RedisModule_Replicate(ctx, "TOON.ROWAPPEND", "ssv", argv[1], argv[2],
+                                  argv + 3, appended * tab->num_headers);
+        }
+        RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
 
-void ToonTypeFree(void *value) {
-    toon_document_free((ToonDocument *)value);
+    toon_document_compact(doc);
+    return REDISMODULE_OK;
 }
 
 // ============================================================================
-// Command: TOON.SET key path value
+// Command: TOON.CLONE src dst
 // ============================================================================
 
-int ToonSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 4) {
+// Copy the document at src to dst, replacing what dst holds if it is a
+// document. The two share the tree until either is written to, and each
+// write then copies only the nodes on its path, so cloning a template and
+// editing a few fields stays cheap however large the template is.
+int ToonClone_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
         return RedisModule_WrongArity(ctx);
     }
 
     RedisModule_AutoMemory(ctx);
 
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    if (RedisModule_StringCompare(argv[1], argv[2]) == 0) {
+        return RedisModule_ReplyWithError(ctx, "ERR source and destination objects are the same");
+    }
 
-    size_t path_len;
-    const char *path = RedisModule_StringPtrLen(argv[2], &path_len);
+    RedisModuleKey *src_key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
-    size_t value_len;
-    const char *value_str = RedisModule_StringPtrLen(argv[3], &value_len);
+    int type = RedisModule_KeyType(src_key);
+    if (type == REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
 
-    // Parse the TOON value
-    char *error = NULL;
-    ToonValue *value = toon_decode(value_str, &error);
-    if (!value) {
-        RedisModule_ReplyWithError(ctx, error ? error : "ERR invalid TOON format");
-        if (error) free(error);
-        return REDISMODULE_OK;
+    if (type != REDISMODULE_KEYTYPE_MODULE ||
+        RedisModule_ModuleTypeGetType(src_key) != ToonType_RMT) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    // Get or create document
-    ToonDocument *doc;
-    int type = RedisModule_KeyType(key);
+    ToonDocument *src = RedisModule_ModuleTypeGetValue(src_key);
+    if (!src || !src->root) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such key");
+    }
 
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-        doc = toon_document_create();
-        RedisModule_ModuleTypeSetValue(key, ToonType_RMT, doc);
-    } else if (type == REDISMODULE_KEYTYPE_MODULE &&
-               RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
-        doc = RedisModule_ModuleTypeGetValue(key);
-    } else {
-        toon_value_free(value);
+    RedisModuleKey *dst_key = RedisModule_OpenKey(ctx, argv[2], REDISMODULE_READ | REDISMODULE_WRITE);
+
+    type = RedisModule_KeyType(dst_key);
+    if (type != REDISMODULE_KEYTYPE_EMPTY &&
+        (type != REDISMODULE_KEYTYPE_MODULE || RedisModule_ModuleTypeGetType(dst_key) != ToonType_RMT)) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    // Set value at path
-    if (strcmp(path, "$") == 0) {
-        toon_value_free(doc->root);
-        doc->root = value;
-    } else {
-        if (toon_path_set(doc->root, path, value) != 0) {
-            toon_value_free(value);
-            return RedisModule_ReplyWithError(ctx, "ERR invalid path");
-        }
+    ToonDocument *clone = toon_document_clone(src);
+    if (!clone) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
     }
 
+    // A clone starts above every version given out, the replaced
+    // document's included
+    RedisModule_ModuleTypeSetValue(dst_key, ToonType_RMT, clone);
+    index_root_write(ctx, argv[2], clone);
+
     RedisModule_ReplyWithSimpleString(ctx, "OK");
     RedisModule_ReplicateVerbatim(ctx);
+    notify_change(ctx, "toon.clone", argv[2], clone, "$", 1);
 
     return REDISMODULE_OK;
 }
 
 // ============================================================================
-// Command: TOON.GET key [path]
+// Command: TOON.INDEX CREATE name path column [column ...] | DROP name
 // ============================================================================
 
-int ToonGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc < 2 || argc > 3) {
-        return RedisModule_WrongArity(ctx);
+// Whether an index has the path and columns given, in order
+static bool index_defined_as(const ToonIndex *index, RedisModuleString **argv, int argc) {
+    size_t len;
+    const char *path = RedisModule_StringPtrLen(argv[0], &len);
+    if (len != index->path->source_len || memcmp(path, index->path->source, len) != 0) return false;
+    if ((size_t)argc - 1 != index->num_columns) return false;
+
+    for (size_t col = 0; col < index->num_columns; col++) {
+        const char *column = RedisModule_StringPtrLen(argv[1 + col], &len);
+        const char *name = toon_index_column(index, col);
+        if (len != strlen(name) || memcmp(column, name, len) != 0) return false;
     }
+    return true;
+}
 
-    RedisModule_AutoMemory(ctx);
-
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+// Indexes are module-wide, cover every database, and are kept up to date
+// by every write from then on. CREATE indexes the existing documents in
+// one scan of the keyspace; creating an index again with the same
+// definition does nothing.
+static int index_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 5) {
+        return RedisModule_WrongArity(ctx);
+    }
 
-    int type = RedisModule_KeyType(key);
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-        return RedisModule_ReplyWithNull(ctx);
+    size_t name_len;
+    const char *name = RedisModule_StringPtrLen(argv[2], &name_len);
+    ToonIndex *existing = toon_index_find(name, name_len);
+    if (existing) {
+        if (!index_defined_as(existing, argv + 3, argc - 3)) {
+            return RedisModule_ReplyWithError(ctx, "ERR index already exists");
+        }
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
     }
 
-    if (type != REDISMODULE_KEYTYPE_MODULE ||
-        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    size_t path_len;
+    const char *path_str = RedisModule_StringPtrLen(argv[3], &path_len);
+    ToonPath *path = toon_path_compile(path_str, path_len);
+    if (!path || !path->definite) {
+        toon_path_free(path);
+        return RedisModule_ReplyWithError(ctx, "ERR index path must select a single table");
     }
 
-    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
-    if (!doc || !doc->root) {
-        return RedisModule_ReplyWithNull(ctx);
+    size_t num_columns = argc - 4;
+    char **columns = RedisModule_Alloc(sizeof(char *) * num_columns);
+    size_t *column_lens = RedisModule_Alloc(sizeof(size_t) * num_columns);
+    for (size_t i = 0; i < num_columns; i++) {
+        columns[i] = (char *)RedisModule_StringPtrLen(argv[4 + i], &column_lens[i]);
     }
 
-    // Get path (default to root)
-    const char *path = "$";
-    if (argc == 3) {
-        size_t path_len;
-        path = RedisModule_StringPtrLen(argv[2], &path_len);
+    ToonIndex *index = toon_index_create(name, name_len, path, columns, column_lens, num_columns);
+    toon_path_free(path);
+    RedisModule_Free(columns);
+    RedisModule_Free(column_lens);
+    if (!index) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
     }
 
-    ToonValue *value;
-    if (strcmp(path, "$") == 0) {
-        value = doc->root;
-    } else {
-        value = toon_path_get(doc->root, path);
+    index_scan_all(ctx, index);
+
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+int ToonIndex_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 3) {
+        return RedisModule_WrongArity(ctx);
     }
 
-    if (!value) {
-        return RedisModule_ReplyWithNull(ctx);
+    RedisModule_AutoMemory(ctx);
+
+    if (arg_is(argv[1], "CREATE")) {
+        return index_create(ctx, argv, argc);
+    }
+    if (!arg_is(argv[1], "DROP")) {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
     }
 
-    // Encode and return
-    char *result = toon_encode(value, 0);
-    if (result) {
-        RedisModule_ReplyWithStringBuffer(ctx, result, strlen(result));
-        free(result);
-    } else {
-        return RedisModule_ReplyWithNull(ctx);
+    size_t name_len;
+    const char *name = RedisModule_StringPtrLen(argv[2], &name_len);
+    ToonIndex *index = toon_index_find(name, name_len);
+    if (!index) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such index");
     }
 
+    toon_index_drop(index);
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
     return REDISMODULE_OK;
 }
 
 // ============================================================================
-// Command: TOON.DEL key path
+// Command: TOON.QUERY index filter [LIMIT n]
 // ============================================================================
 
-int ToonDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc != 3) {
+#define TOON_QUERY_DEFAULT_LIMIT 10
+
+typedef struct {
+    RedisModuleCtx *ctx;
+    const ToonIndex *index;
+    ToonBuffer *buf;
+    long count;
+} QueryReply;
+
+// Reply with one matched row as [key, row, row as a TOON object]
+static bool reply_query_row(ToonDocument *doc, const char *key, size_t key_len, size_t row, void *arg) {
+    QueryReply *reply = arg;
+
+    // Skip an entry whose table is no longer there, or no longer that long
+    ToonValue scratch;
+    ToonValue *table = toon_path_get(doc->root, reply->index->path, &scratch);
+    if (!table || table->type != TOON_TABULAR_ARRAY || row >= table->value.tabular.num_rows) return false;
+    ToonTabularArray *tab = &table->value.tabular;
+
+    ToonValue object = {.type = TOON_OBJECT};
+    ToonObjectEntry *entries = malloc(sizeof(ToonObjectEntry) * (tab->num_headers + 1));
+    ToonValue *cells = malloc(sizeof(ToonValue) * (tab->num_headers + 1));
+    toon_buffer_reset(reply->buf);
+    if (entries && cells) {
+        for (size_t c = 0; c < tab->num_headers; c++) {
+            entries[c].key = tab->headers[c];
+            entries[c].value = toon_tabular_cell(tab, row, c, &cells[c]);
+        }
+        object.value.object.entries = entries;
+        object.value.object.length = object.value.object.capacity = tab->num_headers;
+        toon_encode_to(reply->buf, &object, 0);
+    } else {
+        reply->buf->failed = true;
+    }
+    free(entries);
+    free(cells);
+
+    RedisModule_ReplyWithArray(reply->ctx, 3);
+    RedisModule_ReplyWithStringBuffer(reply->ctx, key, key_len);
+    RedisModule_ReplyWithLongLong(reply->ctx, (long long)row);
+    if (reply->buf->failed) {
+        RedisModule_ReplyWithNull(reply->ctx);
+    } else {
+        RedisModule_ReplyWithStringBuffer(reply->ctx, reply->buf->data, reply->buf->len);
+    }
+    reply->count++;
+    return true;
+}
+
+// Find rows through an index. The filter is written as inside a path
+// filter, "@.column op literal" or "@.column", on an indexed column; only
+// documents with matching rows are read.
+int ToonQuery_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3 && argc != 5) {
         return RedisModule_WrongArity(ctx);
     }
 
     RedisModule_AutoMemory(ctx);
 
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    size_t name_len;
+    const char *name = RedisModule_StringPtrLen(argv[1], &name_len);
+    ToonIndex *index = toon_index_find(name, name_len);
+    if (!index) {
+        return RedisModule_ReplyWithError(ctx, "ERR no such index");
+    }
 
-    int type = RedisModule_KeyType(key);
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-        return RedisModule_ReplyWithLongLong(ctx, 0);
+    long long limit = TOON_QUERY_DEFAULT_LIMIT;
+    if (argc == 5 && (!arg_is(argv[3], "LIMIT") ||
+                      RedisModule_StringToLongLong(argv[4], &limit) != REDISMODULE_OK || limit < 0)) {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
     }
 
-    if (type != REDISMODULE_KEYTYPE_MODULE ||
-        RedisModule_ModuleTypeGetType(key) != ToonType_RMT) {
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    // Compile the filter as the selector of a path
+    size_t filter_len;
+    const char *filter_str = RedisModule_StringPtrLen(argv[2], &filter_len);
+    RedisModuleString *text = RedisModule_CreateStringPrintf(ctx, "$[?(%.*s)]", (int)filter_len, filter_str);
+    size_t text_len;
+    const char *text_str = RedisModule_StringPtrLen(text, &text_len);
+
+    toon_stats_mark();
+    ToonPath *filter = toon_path_compile(text_str, text_len);
+    toon_stats_phase(TOON_PHASE_PATH);
+    if (!filter || filter->num_segments != 1 || filter->segments[0].type != TOON_SEGMENT_FILTER) {
+        toon_path_free(filter);
+        return RedisModule_ReplyWithError(ctx, "ERR invalid filter");
     }
 
-    ToonDocument *doc = RedisModule_ModuleTypeGetValue(key);
-    if (!doc || !doc->root) {
-        return RedisModule_ReplyWithLongLong(ctx, 0);
+    bool indexed = false;
+    for (size_t col = 0; col < index->num_columns && !indexed; col++) {
+        indexed = strcmp(toon_index_column(index, col), filter->segments[0].key) == 0;
+    }
+    if (!indexed) {
+        toon_path_free(filter);
+        return RedisModule_ReplyWithError(ctx, "ERR column not indexed");
     }
 
-    size_t path_len;
-    const char *path = RedisModule_StringPtrLen(argv[2], &path_len);
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+    QueryReply reply = {.ctx = ctx, .index = index, .buf = &buf};
 
-    if (toon_path_delete(doc->root, path) == 0) {
-        RedisModule_ReplyWithLongLong(ctx, 1);
-        RedisModule_ReplicateVerbatim(ctx);
-    } else {
-        RedisModule_ReplyWithLongLong(ctx, 0);
-    }
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_LEN);
+    toon_stats_mark();
+    toon_index_query(index, &filter->segments[0], RedisModule_GetSelectedDb(ctx), (size_t)limit,
+                     reply_query_row, &reply);
+    toon_stats_phase(TOON_PHASE_ENCODE);
+    RedisModule_ReplySetArrayLength(ctx, reply.count);
 
+    toon_buffer_free(&buf);
+    toon_path_free(filter);
     return REDISMODULE_OK;
 }
 
@@ -232,6 +1672,11 @@ int ToonType_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
 
     RedisModule_AutoMemory(ctx);
 
+    const ToonPath *path = path_arg(argv, argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
@@ -249,15 +1694,7 @@ int ToonType_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
         return RedisModule_ReplyWithNull(ctx);
     }
 
-    size_t path_len;
-    const char *path = RedisModule_StringPtrLen(argv[2], &path_len);
-
-    ToonValue *value = toon_path_get(doc->root, path);
-    if (!value) {
-        return RedisModule_ReplyWithNull(ctx);
-    }
-
-    RedisModule_ReplyWithSimpleString(ctx, toon_type_string(value->type));
+    reply_matches(ctx, doc->root, path, reply_match_type, NULL, NULL);
     return REDISMODULE_OK;
 }
 
@@ -272,6 +1709,11 @@ int ToonToJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int a
 
     RedisModule_AutoMemory(ctx);
 
+    const ToonPath *path = path_arg(argv, argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
@@ -289,24 +1731,34 @@ int ToonToJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int a
         return RedisModule_ReplyWithNull(ctx);
     }
 
-    const char *path = "$";
-    if (argc == 3) {
-        size_t path_len;
-        path = RedisModule_StringPtrLen(argv[2], &path_len);
+    // A definite path converts its value; any other path gets a JSON array
+    // of its matches, written into the one buffer as they are found
+    if (is_root(path)) {
+        if (!encode_on_worker(ctx, doc, TOON_TEXT_JSON)) reply_document_text(ctx, doc, TOON_TEXT_JSON);
+        return REDISMODULE_OK;
     }
+    bool definite = path->definite;
 
-    ToonValue *value = toon_path_get(doc->root, path);
-    if (!value) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+    JsonMatches matches = {.buf = &buf};
+
+    toon_stats_mark();
+    if (!definite) toon_buffer_putc(&buf, '[');
+    toon_path_eval(doc->root, path, append_match_json, &matches);
+    if (!definite) toon_buffer_putc(&buf, ']');
+    toon_stats_phase(TOON_PHASE_PATH);
+
+    if (definite && matches.count == 0) {
+        toon_buffer_free(&buf);
         return RedisModule_ReplyWithNull(ctx);
     }
-
-    char *json = toon_to_json(value);
-    if (json) {
-        RedisModule_ReplyWithStringBuffer(ctx, json, strlen(json));
-        free(json);
-    } else {
+    if (buf.failed) {
+        toon_buffer_free(&buf);
         return RedisModule_ReplyWithNull(ctx);
     }
+    RedisModule_ReplyWithStringBuffer(ctx, buf.data, buf.len);
+    toon_buffer_free(&buf);
 
     return REDISMODULE_OK;
 }
@@ -327,48 +1779,111 @@ int ToonFromJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     size_t json_len;
     const char *json_str = RedisModule_StringPtrLen(argv[2], &json_len);
 
+    ToonDocument *doc = NULL;
+    int type = RedisModule_KeyType(key);
+
+    if (type == REDISMODULE_KEYTYPE_MODULE &&
+        RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
+        doc = RedisModule_ModuleTypeGetValue(key);
+    } else if (type != REDISMODULE_KEYTYPE_EMPTY) {
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    }
+
+    if (parse_on_worker(ctx, JOB_FROMJSON, argv[1], json_str, json_len)) {
+        return REDISMODULE_OK;
+    }
+
+    ToonArena *arena = toon_arena_create(json_len);
+    if (!arena) {
+        return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+    }
+
+    toon_stats_mark();
     char *error = NULL;
-    ToonValue *value = json_to_toon(json_str, &error);
+    ToonValue *value = json_to_toon(arena, json_str, &error);
+    toon_stats_phase(TOON_PHASE_PARSE);
     if (!value) {
+        toon_arena_destroy(arena);
         RedisModule_ReplyWithError(ctx, error ? error : "ERR invalid JSON");
         if (error) free(error);
         return REDISMODULE_OK;
     }
 
-    ToonDocument *doc;
-    int type = RedisModule_KeyType(key);
-
-    if (type == REDISMODULE_KEYTYPE_EMPTY) {
-        doc = toon_document_create();
-        RedisModule_ModuleTypeSetValue(key, ToonType_RMT, doc);
-    } else if (type == REDISMODULE_KEYTYPE_MODULE &&
-               RedisModule_ModuleTypeGetType(key) == ToonType_RMT) {
-        doc = RedisModule_ModuleTypeGetValue(key);
+    if (doc) {
+        toon_document_set_root(doc, arena, value);
     } else {
-        toon_value_free(value);
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        doc = toon_document_create(arena, value);
+        if (!doc) {
+            toon_arena_destroy(arena);
+            return RedisModule_ReplyWithError(ctx, "ERR out of memory");
+        }
+        RedisModule_ModuleTypeSetValue(key, ToonType_RMT, doc);
     }
 
-    toon_value_free(doc->root);
-    doc->root = value;
+    index_root_write(ctx, argv[1], doc);
 
     RedisModule_ReplyWithSimpleString(ctx, "OK");
     RedisModule_ReplicateVerbatim(ctx);
+    notify_change(ctx, "toon.fromjson", argv[1], doc, "$", 1);
 
     return REDISMODULE_OK;
 }
 
 // ============================================================================
-// Command: TOON.TOKENCOUNT key [path]
+// Command: TOON.TOKENCOUNT key [path [TOKENIZER name]]
 // ============================================================================
 
+// Count tokens with a tokenizer loaded at module load, over the TOON text
+// TOON.GET would reply with
+static void reply_tokenizer_count(RedisModuleCtx *ctx, ToonDocument *doc, const ToonPath *path,
+                                  ToonTokenizer *tokenizer) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+
+    TokenizerCount count = {.tokenizer = tokenizer, .buf = &buf};
+    toon_stats_mark();
+    if (is_root(path)) {
+        size_t len;
+        const char *text = toon_document_text(doc, TOON_TEXT_TOON, cache_allowed(), &buf, &len);
+        if (text) count.tokens = toon_tokenizer_count(tokenizer, text, len);
+        toon_stats_phase(TOON_PHASE_ENCODE);
+    } else {
+        toon_path_eval(doc->root, path, sum_match_tokenizer, &count);
+        toon_stats_phase(TOON_PHASE_PATH);
+    }
+    RedisModule_ReplyWithLongLong(ctx, count.tokens);
+
+    toon_buffer_free(&buf);
+}
+
 int ToonTokenCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc < 2 || argc > 3) {
+    if (argc < 2 || argc > 5 || argc == 4) {
         return RedisModule_WrongArity(ctx);
     }
 
     RedisModule_AutoMemory(ctx);
 
+    // Without a tokenizer the count is the cheap estimate
+    ToonTokenizer *tokenizer = NULL;
+    if (argc == 5) {
+        size_t option_len, name_len;
+        const char *option = RedisModule_StringPtrLen(argv[3], &option_len);
+        const char *name = RedisModule_StringPtrLen(argv[4], &name_len);
+        if (option_len != 9 || strncasecmp(option, "TOKENIZER", 9) != 0) {
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+
+        tokenizer = toon_tokenizer_find(name, name_len);
+        if (!tokenizer) {
+            return RedisModule_ReplyWithError(ctx, "ERR unknown tokenizer");
+        }
+    }
+
+    const ToonPath *path = path_arg(argv, argc, 2);
+    if (!path) {
+        return RedisModule_ReplyWithError(ctx, "ERR invalid path");
+    }
+
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
 
     int type = RedisModule_KeyType(key);
@@ -386,83 +1901,323 @@ int ToonTokenCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, i
         return RedisModule_ReplyWithLongLong(ctx, 0);
     }
 
-    const char *path = "$";
-    if (argc == 3) {
-        size_t path_len;
-        path = RedisModule_StringPtrLen(argv[2], &path_len);
+    if (tokenizer) {
+        reply_tokenizer_count(ctx, doc, path, tokenizer);
+        return REDISMODULE_OK;
     }
 
-    ToonValue *value = toon_path_get(doc->root, path);
-    if (!value) {
-        return RedisModule_ReplyWithLongLong(ctx, 0);
+    // Counts are cached on the nodes; paths with several matches count
+    // all of them
+    size_t tokens = 0;
+    toon_stats_mark();
+    toon_path_eval(doc->root, path, sum_match_tokens, &tokens);
+    toon_stats_phase(TOON_PHASE_PATH);
+    RedisModule_ReplyWithLongLong(ctx, tokens);
+
+    return REDISMODULE_OK;
+}
+
+// ============================================================================
+// Command: TOON.CONVERT JSON|TOON text
+// ============================================================================
+
+// Transcode JSON text to TOON text or TOON text to JSON text without a key
+// or a tree. The reply is what storing the text and reading it back in the
+// other format would give.
+int ToonConvert_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
+        return RedisModule_WrongArity(ctx);
     }
 
-    size_t tokens = toon_estimate_tokens(value);
-    RedisModule_ReplyWithLongLong(ctx, tokens);
+    size_t format_len, input_len;
+    const char *format_str = RedisModule_StringPtrLen(argv[1], &format_len);
+    const char *input = RedisModule_StringPtrLen(argv[2], &input_len);
 
+    ToonTextFormat format;
+    if (format_len == 4 && strncasecmp(format_str, "JSON", 4) == 0) {
+        format = TOON_TEXT_JSON;
+    } else if (format_len == 4 && strncasecmp(format_str, "TOON", 4) == 0) {
+        format = TOON_TEXT_TOON;
+    } else {
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+
+    if (convert_on_worker(ctx, format, input, input_len)) {
+        return REDISMODULE_OK;
+    }
+
+    ToonBuffer buf;
+    toon_buffer_init(&buf, input_len);
+
+    // Transcoding parses and encodes in one pass; it counts as parse
+    toon_stats_mark();
+    char *error = NULL;
+    bool ok = convert_text(format, input, input_len, &buf, &error);
+    toon_stats_phase(TOON_PHASE_PARSE);
+    reply_converted(ctx, ok, &buf, error);
+
+    free(error);
+    toon_buffer_free(&buf);
     return REDISMODULE_OK;
 }
 
+// ============================================================================
+// Command timing
+// ============================================================================
+
+// Commands are registered through a wrapper timing the whole call; the
+// phases are marked inside
+#define TIMED_COMMAND(handler, command)                                                   \
+    static int handler##_Timed(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) { \
+        toon_stats_command_begin(command);                                                \
+        int result = handler(ctx, argv, argc);                                            \
+        toon_stats_command_end();                                                         \
+        return result;                                                                    \
+    }
+
+TIMED_COMMAND(ToonSet_RedisCommand, TOON_CMD_SET)
+TIMED_COMMAND(ToonGet_RedisCommand, TOON_CMD_GET)
+TIMED_COMMAND(ToonVersion_RedisCommand, TOON_CMD_VERSION)
+TIMED_COMMAND(ToonMGet_RedisCommand, TOON_CMD_MGET)
+TIMED_COMMAND(ToonDel_RedisCommand, TOON_CMD_DEL)
+TIMED_COMMAND(ToonArrAppend_RedisCommand, TOON_CMD_ARRAPPEND)
+TIMED_COMMAND(ToonRowAppend_RedisCommand, TOON_CMD_ROWAPPEND)
+TIMED_COMMAND(ToonClone_RedisCommand, TOON_CMD_CLONE)
+TIMED_COMMAND(ToonIndex_RedisCommand, TOON_CMD_INDEX)
+TIMED_COMMAND(ToonQuery_RedisCommand, TOON_CMD_QUERY)
+TIMED_COMMAND(ToonType_RedisCommand, TOON_CMD_TYPE)
+TIMED_COMMAND(ToonToJson_RedisCommand, TOON_CMD_TOJSON)
+TIMED_COMMAND(ToonFromJson_RedisCommand, TOON_CMD_FROMJSON)
+TIMED_COMMAND(ToonTokenCount_RedisCommand, TOON_CMD_TOKENCOUNT)
+TIMED_COMMAND(ToonConvert_RedisCommand, TOON_CMD_CONVERT)
+
 // ============================================================================
 // Module Initialization
 // ============================================================================
 
+// ============================================================================
+// Module arguments
+// ============================================================================
+
+// Apply the module arguments:
+//   TOKENIZER name file [SPLIT cl100k|o200k]
+//                           Load a tiktoken vocabulary for TOON.TOKENCOUNT
+//   CACHE_LIMIT bytes       Cap on cached document text
+//   THREADS n               Worker threads for large requests, 0 for none
+//   THREAD_THRESHOLD bytes  Size from which requests go to a worker
+static int parse_module_args(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+                             size_t *num_threads) {
+    for (int i = 0; i < argc; i++) {
+        const char *option = RedisModule_StringPtrLen(argv[i], NULL);
+
+        if (strcasecmp(option, "TOKENIZER") == 0 && i + 2 < argc) {
+            const char *name = RedisModule_StringPtrLen(argv[i + 1], NULL);
+            const char *file = RedisModule_StringPtrLen(argv[i + 2], NULL);
+
+            // The split pattern follows the file name unless SPLIT names it
+            ToonTokenizerSplit split = toon_tokenizer_split_for(file);
+            if (i + 4 < argc && strcasecmp(RedisModule_StringPtrLen(argv[i + 3], NULL), "SPLIT") == 0) {
+                const char *pattern = RedisModule_StringPtrLen(argv[i + 4], NULL);
+                if (!toon_tokenizer_split_parse(pattern, &split)) {
+                    RedisModule_Log(ctx, "warning", "Unknown SPLIT %s, expected cl100k or o200k", pattern);
+                    return REDISMODULE_ERR;
+                }
+                i += 2;
+            }
+
+            char *error = NULL;
+            if (!toon_tokenizer_load(name, file, split, &error)) {
+                RedisModule_Log(ctx, "warning", "Can't load tokenizer %s: %s", name,
+                                error ? error : "out of memory");
+                free(error);
+                return REDISMODULE_ERR;
+            }
+            RedisModule_Log(ctx, "notice", "Loaded tokenizer %s with %zu tokens", name,
+                            toon_tokenizer_size(toon_tokenizer_find(name, strlen(name))));
+            i += 2;
+        } else if (strcasecmp(option, "CACHE_LIMIT") == 0 && i + 1 < argc) {
+            long long bytes;
+            if (RedisModule_StringToLongLong(argv[i + 1], &bytes) != REDISMODULE_OK || bytes < 0) {
+                RedisModule_Log(ctx, "warning", "Invalid CACHE_LIMIT");
+                return REDISMODULE_ERR;
+            }
+            toon_cache_set_limit((size_t)bytes);
+            i += 1;
+        } else if (strcasecmp(option, "THREADS") == 0 && i + 1 < argc) {
+            long long threads;
+            if (RedisModule_StringToLongLong(argv[i + 1], &threads) != REDISMODULE_OK ||
+                threads < 0 || threads > 64) {
+                RedisModule_Log(ctx, "warning", "Invalid THREADS, expected 0 to 64");
+                return REDISMODULE_ERR;
+            }
+            *num_threads = (size_t)threads;
+            i += 1;
+        } else if (strcasecmp(option, "THREAD_THRESHOLD") == 0 && i + 1 < argc) {
+            long long bytes;
+            if (RedisModule_StringToLongLong(argv[i + 1], &bytes) != REDISMODULE_OK || bytes < 0) {
+                RedisModule_Log(ctx, "warning", "Invalid THREAD_THRESHOLD");
+                return REDISMODULE_ERR;
+            }
+            thread_threshold = (size_t)bytes;
+            i += 1;
+        } else if (strcasecmp(option, "MAX_DEPTH") == 0 && i + 1 < argc) {
+            long long depth;
+            if (RedisModule_StringToLongLong(argv[i + 1], &depth) != REDISMODULE_OK ||
+                depth < 1 || depth > TOON_MAX_DEPTH_LIMIT) {
+                RedisModule_Log(ctx, "warning", "Invalid MAX_DEPTH, expected 1 to %d", TOON_MAX_DEPTH_LIMIT);
+                return REDISMODULE_ERR;
+            }
+            toon_set_max_depth((size_t)depth);
+            i += 1;
+        } else if (strcasecmp(option, "MAX_INPUT") == 0 && i + 1 < argc) {
+            long long bytes;
+            if (RedisModule_StringToLongLong(argv[i + 1], &bytes) != REDISMODULE_OK || bytes < 0) {
+                RedisModule_Log(ctx, "warning", "Invalid MAX_INPUT");
+                return REDISMODULE_ERR;
+            }
+            toon_set_max_input((size_t)bytes);
+            i += 1;
+        } else {
+            RedisModule_Log(ctx, "warning", "Unknown or incomplete module argument %s", option);
+            return REDISMODULE_ERR;
+        }
+    }
+
+    return REDISMODULE_OK;
+}
+
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (RedisModule_Init(ctx, REDISTOON_MODULE_NAME, 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
+    size_t num_threads = TOON_POOL_DEFAULT_THREADS;
+    if (parse_module_args(ctx, argv, argc, &num_threads) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    // Without workers every request runs inline
+    if (num_threads > 0 && !toon_pool_start(num_threads)) {
+        RedisModule_Log(ctx, "warning", "Can't start worker threads, running large requests inline");
+    }
+
     // Register the TOON data type
     RedisModuleTypeMethods tm = {
         .version = REDISMODULE_TYPE_METHOD_VERSION,
         .rdb_load = ToonTypeRdbLoad,
         .rdb_save = ToonTypeRdbSave,
         .aof_rewrite = ToonTypeAofRewrite,
+        .mem_usage = ToonTypeMemUsage,
         .free = ToonTypeFree,
-        .digest = ToonTypeDigest
+        .digest = ToonTypeDigest,
+        .free_effort = ToonTypeFreeEffort,
+        .unlink = ToonTypeUnlink,
+        .copy = ToonTypeCopy,
+        .defrag = ToonTypeDefrag,
+        .aux_load = toon_rdb_load_aux,
+        .aux_save = toon_rdb_save_aux,
+        .aux_save_triggers = REDISMODULE_AUX_BEFORE_RDB
     };
 
-    ToonType_RMT = RedisModule_CreateDataType(ctx, "toon-type", 0, &tm);
+    ToonType_RMT = RedisModule_CreateDataType(ctx, "toon-type", TOON_ENCODING_VERSION, &tm);
     if (ToonType_RMT == NULL) {
         return REDISMODULE_ERR;
     }
 
+    if (RedisModule_SubscribeToServerEvent &&
+        (RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_FlushDB, on_flush) == REDISMODULE_ERR ||
+         RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Loading, on_loading) == REDISMODULE_ERR ||
+         RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_SwapDB, on_swapdb) == REDISMODULE_ERR ||
+         RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_Persistence, on_persistence) == REDISMODULE_ERR ||
+         RedisModule_SubscribeToServerEvent(ctx, RedisModuleEvent_ForkChild, on_fork_child) == REDISMODULE_ERR)) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_SubscribeToKeyspaceEvents &&
+        RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_GENERIC, on_key_event) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_RegisterInfoFunc && RedisModule_RegisterInfoFunc(ctx, toon_info) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
     // Register commands
-    if (RedisModule_CreateCommand(ctx, "toon.set", ToonSet_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.set", ToonSet_RedisCommand_Timed,
                                    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.get", ToonGet_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.get", ToonGet_RedisCommand_Timed,
                                    "readonly", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.del", ToonDel_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.version", ToonVersion_RedisCommand_Timed,
+                                   "readonly fast", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.mget", ToonMGet_RedisCommand_Timed,
+                                   "readonly", 1, -2, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.del", ToonDel_RedisCommand_Timed,
                                    "write", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.type", ToonType_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.arrappend", ToonArrAppend_RedisCommand_Timed,
+                                   "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.rowappend", ToonRowAppend_RedisCommand_Timed,
+                                   "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.clone", ToonClone_RedisCommand_Timed,
+                                   "write deny-oom", 1, 2, 1) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.index", ToonIndex_RedisCommand_Timed,
+                                   "write deny-oom", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.query", ToonQuery_RedisCommand_Timed,
+                                   "readonly", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
+    if (RedisModule_CreateCommand(ctx, "toon.type", ToonType_RedisCommand_Timed,
                                    "readonly", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.tojson", ToonToJson_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.tojson", ToonToJson_RedisCommand_Timed,
                                    "readonly", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.fromjson", ToonFromJson_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.fromjson", ToonFromJson_RedisCommand_Timed,
                                    "write deny-oom", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
-    if (RedisModule_CreateCommand(ctx, "toon.tokencount", ToonTokenCount_RedisCommand,
+    if (RedisModule_CreateCommand(ctx, "toon.tokencount", ToonTokenCount_RedisCommand_Timed,
                                    "readonly", 1, 1, 1) == REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
 
+    if (RedisModule_CreateCommand(ctx, "toon.convert", ToonConvert_RedisCommand_Timed,
+                                   "readonly", 0, 0, 0) == REDISMODULE_ERR) {
+        return REDISMODULE_ERR;
+    }
+
     RedisModule_Log(ctx, "notice", "redisTOON module loaded successfully v%s", REDISTOON_VERSION);
 
     return REDISMODULE_OK;
@@ -6,11 +6,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 // Version information
 #define REDISTOON_VERSION "0.1.0"
 #define REDISTOON_MODULE_NAME "redisTOON"
 
+// RDB encoding version (0 = TOON text, 1 = binary tree, 2 = aux data also
+// carries the version clock)
+#define TOON_ENCODING_VERSION 2
+
 // TOON value types
 typedef enum {
     TOON_NULL,
@@ -22,8 +28,11 @@ typedef enum {
     TOON_TABULAR_ARRAY  // Special type for TOON tabular arrays
 } ToonType;
 
+#define TOON_NUM_TYPES (TOON_TABULAR_ARRAY + 1)
+
 // Forward declarations
 typedef struct ToonValue ToonValue;
+typedef struct ToonObjectIndex ToonObjectIndex;
 
 // TOON object entry (key-value pair)
 typedef struct {
@@ -31,17 +40,45 @@ typedef struct {
     ToonValue *value;
 } ToonObjectEntry;
 
-// TOON tabular array structure
+// Storage layout of a tabular column
+typedef enum {
+    TOON_COLUMN_NUMBER,     // One double per row
+    TOON_COLUMN_BOOLEAN,    // One bit per row
+    TOON_COLUMN_STRING,     // Offsets into a blob of NUL-terminated strings
+    TOON_COLUMN_MIXED       // One value pointer per row, for columns of mixed types
+} ToonColumnType;
+
+// TOON tabular column. Null cells are flagged in the null bitmap whatever
+// the layout; their slot in the typed vector is zero/empty.
+typedef struct {
+    ToonColumnType type;
+    uint64_t *nulls;            // Bit per row, set for null cells; NULL if there are none
+    union {
+        double *numbers;
+        uint64_t *booleans;     // Bit per row
+        struct {
+            uint32_t *offsets;  // Start of each row's string in blob
+            char *blob;
+            size_t blob_len;    // Bytes in use
+            size_t blob_cap;    // Bytes allocated
+        } strings;
+        ToonValue **values;
+    } data;
+} ToonColumn;
+
+// TOON tabular array structure, stored column by column
 typedef struct {
-    char **headers;     // Column headers
-    size_t num_headers; // Number of columns
-    ToonValue ***rows;  // Array of rows, each row is an array of values
-    size_t num_rows;    // Number of rows
+    char **headers;         // Column headers
+    size_t num_headers;     // Number of columns
+    ToonColumn *columns;    // One column per header
+    size_t num_rows;        // Number of rows
+    size_t row_capacity;    // Rows the column vectors have room for
 } ToonTabularArray;
 
 // TOON value structure
 struct ToonValue {
     ToonType type;
+    uint32_t tokens;    // Token estimate plus one, 0 until counted
     union {
         bool boolean;
         double number;
@@ -49,44 +86,539 @@ struct ToonValue {
         struct {
             ToonValue **elements;
             size_t length;
+            size_t capacity;
         } array;
         struct {
-            ToonObjectEntry *entries;
+            ToonObjectEntry *entries;   // In insertion order
             size_t length;
+            size_t capacity;
+            ToonObjectIndex *index;     // Key hash index for large objects, or NULL
         } object;
         ToonTabularArray tabular;
     } value;
 };
 
-// Redis data type for TOON
+// Nodes allocated from an arena and not discarded since, by type
+typedef struct {
+    size_t count[TOON_NUM_TYPES];
+    size_t string_bytes;        // Bytes of string nodes, inline text included
+} ToonNodeCounts;
+
+// Bump allocator owning every node, array and string of a document
+typedef struct ToonArenaChunk ToonArenaChunk;
+typedef struct ToonInternBatch ToonInternBatch;
+
+typedef struct {
+    ToonArenaChunk *head;       // Chunk being filled; older chunks follow
+    size_t num_chunks;
+    size_t next_chunk_size;     // Size of the next regular chunk
+    size_t reserved;            // Bytes held in chunks, including headers
+    size_t used;                // Bytes handed out
+    size_t wasted;              // Bytes handed out to nodes no longer reachable
+    ToonNodeCounts nodes;
+    bool tracked;               // Whether nodes are part of the module totals
+    bool borrows;               // Trees in it may point into shared arenas
+    atomic_size_t refs;         // Documents and snapshots holding it
+    ToonInternBatch *interning; // Parse holding back its intern pool inserts, or NULL
+} ToonArena;
+
+// Allocation point that an arena can be rewound to
+typedef struct {
+    ToonArenaChunk *chunk;
+    size_t chunk_used;
+    size_t used;
+    ToonNodeCounts nodes;
+} ToonArenaMark;
+
+// Moves active defrag makes to arena chunks. move returns the new address
+// of a chunk, freeing the old one, or NULL if it stays where it is; stop
+// says when to yield.
+typedef struct {
+    void *(*move)(void *chunk, void *ctx);
+    bool (*stop)(void *ctx);
+    void *ctx;
+} ToonChunkMover;
+
+// Chunks moved since the tree last followed them
+#define TOON_ARENA_MAX_MOVES 16
+
+typedef struct {
+    struct {
+        uintptr_t from;     // Old address of the chunk's data
+        size_t used;        // Bytes handed out from it
+        char *to;           // Its new address
+    } moved[TOON_ARENA_MAX_MOVES];
+    size_t count;
+} ToonArenaMoves;
+
+// Compiled path segment
+typedef enum {
+    TOON_SEGMENT_KEY,       // .name
+    TOON_SEGMENT_INDEX,     // [N], negative counts from the end
+    TOON_SEGMENT_WILDCARD,  // [*]
+    TOON_SEGMENT_SLICE,     // [start:end], either bound may be left out
+    TOON_SEGMENT_FILTER     // [?(@.key op literal)] or [?(@.key)]
+} ToonSegmentType;
+
+// Comparison made by a filter segment
+typedef enum {
+    TOON_FILTER_EXISTS,     // Key present and not null
+    TOON_FILTER_EQ,
+    TOON_FILTER_NE,
+    TOON_FILTER_LT,
+    TOON_FILTER_LE,
+    TOON_FILTER_GT,
+    TOON_FILTER_GE
+} ToonFilterOp;
+
+typedef struct {
+    ToonSegmentType type;
+    char *key;              // NUL-terminated key for KEY and FILTER segments
+    size_t key_len;
+    uint64_t hash;          // toon_hash_key of the key
+    long long index;        // Index for INDEX segments, start for SLICE
+    long long end;          // End (exclusive) for SLICE segments
+    bool has_start;         // Whether the SLICE bounds were given
+    bool has_end;
+    ToonFilterOp op;        // FILTER comparison
+    ToonValue literal;      // FILTER operand; strings point into the path
+} ToonPathSegment;
+
+// Compiled path expression; "$" compiles to zero segments
+typedef struct {
+    ToonPathSegment *segments;
+    size_t num_segments;
+    bool definite;          // No segment can select more than one value
+    char *source;           // Path text, followed by the buffer keys point into
+    size_t source_len;
+} ToonPath;
+
+// Receives each match of an evaluated path; value is only valid during the call
+typedef void (*ToonPathVisit)(ToonValue *value, void *ctx);
+
+// Up to four bytes a scan stops at, besides NUL; shorter sets repeat a byte
 typedef struct {
+    unsigned char bytes[4];
+} ToonScanSet;
+
+// Text forms of a whole document that can be cached
+typedef enum {
+    TOON_TEXT_TOON,
+    TOON_TEXT_JSON,
+    TOON_TEXT_FORMATS
+} ToonTextFormat;
+
+typedef struct ToonDocument ToonDocument;
+
+// Byte-pair encoding tokenizer loaded from a vocabulary file
+typedef struct ToonTokenizer ToonTokenizer;
+
+// Encodings of a document's root kept between reads, and its place in the
+// module-wide list of documents holding cached text
+typedef struct {
+    char *text[TOON_TEXT_FORMATS];      // malloc'd text, or NULL if not cached
+    size_t text_len[TOON_TEXT_FORMATS];
+    ToonDocument *prev;                 // Towards the most recently used
+    ToonDocument *next;                 // Towards the least recently used
+} ToonDocCache;
+
+// Tree of a document pinned for readers on worker threads. A writer
+// freezes its arena first and copies the nodes it changes, so a pinned
+// tree never changes; it is freed when the last reader releases it. Pins
+// are only taken and released on the main thread.
+typedef struct ToonSnapshot ToonSnapshot;
+
+struct ToonSnapshot {
+    ToonArena *arena;
     ToonValue *root;
-} ToonDocument;
+    ToonArena **shared;     // References to the document's shared arenas
+    size_t num_shared;
+    ToonDocument *doc;      // Document still using the tree, or NULL once it moved on
+    size_t readers;
+    ToonSnapshot *prev;     // Other snapshots still attached to a document
+    ToonSnapshot *next;
+};
+
+// A document's table as held by a secondary index
+typedef struct ToonIndexEntry ToonIndexEntry;
+
+// Redis data type for TOON
+struct ToonDocument {
+    ToonValue *root;
+    ToonArena *arena;       // Owns every node reachable from root, bar shared ones
+    ToonArena **shared;     // Frozen arenas the tree shares with its clones
+    size_t num_shared;
+    ToonDocCache cache;
+    ToonSnapshot *snapshot; // Pinned current tree, or NULL
+    uint64_t version;       // Starts above any version given out, bumped by every change
+    ToonIndexEntry *indexed; // Entries of the indexes holding its tables
+};
+
+// Growable output buffer shared by the TOON and JSON encoders
+typedef struct {
+    char *data;     // NUL-terminated contents
+    size_t len;     // Bytes written, excluding the NUL
+    size_t cap;     // Allocated size
+    bool failed;    // Set when an allocation failed; further appends are dropped
+} ToonBuffer;
+
+// Token budget of a truncated encoding, in toon_estimate_tokens units.
+// Arrays and tables that do not fit keep as many whole elements as do.
+typedef struct {
+    size_t remaining;
+    bool keep_tail;     // Keep the last elements rather than the first
+} ToonBudget;
 
 // Function declarations
 
+// Arena
+ToonArena *toon_arena_create(size_t size_hint);
+void toon_arena_destroy(ToonArena *arena);
+void *toon_arena_alloc(ToonArena *arena, size_t size);
+void *toon_arena_calloc(ToonArena *arena, size_t count, size_t size);
+char *toon_arena_strndup(ToonArena *arena, const char *str, size_t len);
+void *toon_arena_grow(ToonArena *arena, void *ptr, size_t old_size, size_t new_size);
+void toon_arena_waste(ToonArena *arena, size_t bytes);
+size_t toon_arena_alloc_size(size_t size);
+ToonArenaMark toon_arena_mark(ToonArena *arena);
+void toon_arena_rewind(ToonArena *arena, ToonArenaMark mark);
+void toon_arena_track(ToonArena *arena);
+void toon_arena_retain(ToonArena *arena);
+bool toon_arena_owns(const ToonArena *arena, const void *ptr);
+size_t toon_arena_move_chunks(ToonArena *arena, size_t first, const ToonChunkMover *mover, ToonArenaMoves *moves);
+void *toon_arena_relocated(const ToonArenaMoves *moves, void *ptr);
+
+// Point field at where active defrag moved its target. Fields that stay
+// are not written, so frozen arenas read by workers are left alone.
+#define TOON_RELOCATE(moves, field) do { \
+    void *relocated_ = toon_arena_relocated((moves), (void *)(field)); \
+    if (relocated_ != (void *)(field)) (field) = relocated_; \
+} while (0)
+
+// Interned strings, shared by every document. A parse notes the strings
+// it would add in a batch and adds them only once it succeeds, so input
+// that is rejected leaves nothing behind in the pool.
+struct ToonInternBatch {
+    ToonBuffer strings;         // Each string to add, NUL-terminated
+};
+
+const char *toon_intern_find(const char *str, size_t len);
+char *toon_intern_key(ToonArena *arena, const char *str, size_t len);
+const char *toon_intern_value(ToonArena *arena, const char *str, size_t len, bool *pending);
+void toon_intern_note(ToonArena *arena, const char *str);
+void toon_intern_begin(ToonArena *arena, ToonInternBatch *batch);
+void toon_intern_end(ToonArena *arena, ToonInternBatch *batch, bool commit);
+void toon_intern_usage(size_t *strings, size_t *bytes, size_t *rejected);
+bool toon_is_interned(const char *str);
+char *toon_string_copy(ToonArena *arena, const char *str);
+size_t toon_string_footprint(const char *str);
+bool toon_key_equals(const char *key, const char *other, size_t len);
+
+// Limits, set once at module load. Depth counts the containers around the
+// deepest value, a table counting as an array of objects; a document may
+// reach twice the limit through a path write. Input of more than max_input
+// bytes is not parsed; 0 leaves the size to the server's request limits.
+#define TOON_DEFAULT_MAX_DEPTH 128
+#define TOON_MAX_DEPTH_LIMIT 1024
+#define TOON_DOCUMENT_DEPTH_LIMIT (2 * TOON_MAX_DEPTH_LIMIT + 2)
+void toon_set_max_depth(size_t depth);
+size_t toon_max_depth(void);
+void toon_set_max_input(size_t bytes);
+size_t toon_max_input(void);
+
 // Memory management
-ToonValue *toon_value_create(ToonType type);
-void toon_value_free(ToonValue *value);
-ToonDocument *toon_document_create(void);
+size_t toon_node_size(ToonType type);
+ToonValue *toon_value_create(ToonArena *arena, ToonType type);
+ToonValue *toon_value_null(void);
+ToonValue *toon_value_boolean(bool boolean);
+ToonValue *toon_value_number(ToonArena *arena, double number);
+ToonValue *toon_value_string(ToonArena *arena, const char *str, size_t len);
+bool toon_value_is_shared(const ToonValue *value);
+ToonValue *toon_value_copy(ToonArena *arena, const ToonValue *value);
+ToonValue *toon_value_copy_node(ToonArena *arena, const ToonValue *value);
+size_t toon_value_footprint(const ToonValue *value);
+void toon_value_discard(ToonArena *arena, ToonValue *value);
+void toon_key_discard(ToonArena *arena, const char *key);
+ToonDocument *toon_document_create(ToonArena *arena, ToonValue *root);
+uint64_t toon_version_clock(void);
+void toon_version_observe(uint64_t version);
+void toon_document_unlink(ToonDocument *doc);
 void toon_document_free(ToonDocument *doc);
+size_t toon_document_free_effort(const ToonDocument *doc);
+void toon_arena_reclaim(ToonArena *arena);
+void toon_document_set_root(ToonDocument *doc, ToonArena *arena, ToonValue *root);
+void toon_document_compact(ToonDocument *doc);
+bool toon_document_defrag(ToonDocument *doc, const ToonChunkMover *mover, size_t *cursor);
+size_t toon_document_mem_usage(const ToonDocument *doc);
+ToonDocument *toon_document_copy(const ToonDocument *doc);
+ToonDocument *toon_document_clone(ToonDocument *doc);
+bool toon_document_owns(const ToonDocument *doc, const ToonValue *value);
+size_t toon_document_live_bytes(const ToonDocument *doc);
+ToonSnapshot *toon_document_pin(ToonDocument *doc);
+void toon_snapshot_release(ToonSnapshot *snapshot);
+void toon_snapshot_detach_all(void);
+bool toon_document_unshare(ToonDocument *doc);
+
+// Document cache
+#define TOON_CACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+const char *toon_document_text(ToonDocument *doc, ToonTextFormat format, bool may_cache,
+                               ToonBuffer *buf, size_t *len);
+void toon_document_changed(ToonDocument *doc);
+void toon_document_cache_text(ToonDocument *doc, ToonTextFormat format, ToonBuffer *buf);
+void toon_cache_release(ToonDocument *doc);
+void toon_cache_set_limit(size_t bytes);
+size_t toon_cache_used(void);
+void toon_cache_clear(void);
+
+// Objects
+void toon_object_index_build(ToonArena *arena, ToonValue *object);
+size_t toon_object_index_footprint(const ToonValue *object);
+ToonObjectEntry *toon_object_find(const ToonValue *object, const char *key, size_t len,
+                                  uint64_t hash, size_t *position);
+bool toon_object_append(ToonArena *arena, ToonValue *object, char *key, ToonValue *value);
+void toon_object_remove(ToonValue *object, size_t position);
+
+// Arrays
+bool toon_array_reserve(ToonArena *arena, ToonValue *array, size_t extra);
+bool toon_array_append(ToonArena *arena, ToonValue *array, ToonValue *element);
+
+// Tabular arrays
+ToonValue *toon_tabular_create(ToonArena *arena, char *const *headers, size_t num_headers,
+                               ToonValue *const *cells, size_t num_rows);
+ToonValue *toon_tabular_cell(const ToonTabularArray *tab, size_t row, size_t col, ToonValue *scratch);
+bool toon_tabular_find_column(const ToonTabularArray *tab, const char *header, size_t *col);
+bool toon_tabular_copy(ToonArena *arena, ToonTabularArray *dst, const ToonTabularArray *src);
+bool toon_tabular_append_row(ToonArena *arena, ToonTabularArray *tab, ToonValue *const *cells);
+size_t toon_tabular_footprint(const ToonTabularArray *tab);
+void toon_tabular_relocate(ToonTabularArray *tab, const ToonArenaMoves *moves);
+size_t toon_tabular_estimate_tokens(const ToonTabularArray *tab);
+size_t toon_tabular_header_tokens(const ToonTabularArray *tab);
+size_t toon_tabular_row_tokens(const ToonTabularArray *tab, size_t row);
+
+// Output buffer
+void toon_buffer_init(ToonBuffer *buf, size_t size_hint);
+bool toon_buffer_reserve(ToonBuffer *buf, size_t extra);
+void toon_buffer_append(ToonBuffer *buf, const char *str, size_t len);
+void toon_buffer_append_str(ToonBuffer *buf, const char *str);
+void toon_buffer_putc(ToonBuffer *buf, char c);
+void toon_buffer_fill(ToonBuffer *buf, char c, size_t count);
+void toon_buffer_append_size(ToonBuffer *buf, size_t n);
+void toon_buffer_append_number(ToonBuffer *buf, double num);
+void toon_buffer_reset(ToonBuffer *buf);
+char *toon_buffer_detach(ToonBuffer *buf, size_t *len);
+void toon_buffer_free(ToonBuffer *buf);
+size_t toon_encoded_size_hint(ToonValue *value);
+
+// Explicit stacks of fixed-size frames, for tree walks that must not
+// recurse. A zeroed buffer is an empty stack that allocates on its first
+// push. Push returns the new top, or NULL when out of memory.
+static inline void *toon_stack_push(ToonBuffer *stack, const void *frame, size_t size) {
+    if (stack->len + size >= stack->cap && !toon_buffer_reserve(stack, size)) return NULL;
+
+    void *top = stack->data + stack->len;
+    memcpy(top, frame, size);
+    stack->len += size;
+    return top;
+}
+
+static inline void *toon_stack_top(ToonBuffer *stack, size_t size) {
+    return stack->len >= size ? stack->data + stack->len - size : NULL;
+}
+
+static inline void toon_stack_pop(ToonBuffer *stack, size_t size) {
+    stack->len -= size;
+}
+
+// Numbers
+#define TOON_NUMBER_MAX_LEN 32  // Room for any formatted number
+bool toon_number_is_token(const char *str, size_t len);
+double toon_number_parse(const char *str, size_t len);
+size_t toon_number_format(double num, char *out);
+size_t toon_number_format_uint(uint64_t n, char *out);
+
+// Scanning
+const char *toon_scan_until(const char *s, const char *end, const ToonScanSet *set);
+const char *toon_scan_space(const char *s, const char *end);
+const char *toon_scan_backend(void);
 
 // Encoding/Decoding
 char *toon_encode(ToonValue *value, int indent_level);
-ToonValue *toon_decode(const char *toon_string, char **error);
+void toon_encode_to(ToonBuffer *buf, ToonValue *value, int indent_level);
+void toon_encode_budget_to(ToonBuffer *buf, ToonValue *value, int indent_level, ToonBudget *budget);
+ToonValue *toon_decode(ToonArena *arena, const char *toon_string, char **error);
+ToonValue *toon_decode_len(ToonArena *arena, const char *toon_string, size_t len, char **error);
 
 // JSON conversion
 char *toon_to_json(ToonValue *value);
-ToonValue *json_to_toon(const char *json_string, char **error);
+void toon_to_json_to(ToonBuffer *buf, ToonValue *value);
+ToonValue *json_to_toon(ToonArena *arena, const char *json_string, char **error);
+
+// Transcoding, text to text without building a tree
+bool toon_transcode_json(ToonBuffer *out, const char *json_string, char **error);
+bool toon_transcode_toon(ToonBuffer *out, const char *toon_string, size_t len, char **error);
 
 // Path operations
-ToonValue *toon_path_get(ToonValue *root, const char *path);
-int toon_path_set(ToonValue *root, const char *path, ToonValue *value);
-int toon_path_delete(ToonValue *root, const char *path);
+ToonPath *toon_path_compile(const char *path, size_t len);
+void toon_path_free(ToonPath *path);
+const ToonPath *toon_path_cache_lookup(const char *path, size_t len);
+void toon_path_cache_clear(void);
+ToonValue *toon_path_get(ToonValue *root, const ToonPath *path, ToonValue *scratch);
+bool toon_path_eval(ToonValue *root, const ToonPath *path, ToonPathVisit visit, void *ctx);
+bool toon_filter_match(const ToonPathSegment *segment, const ToonValue *value);
+int toon_path_set(ToonDocument *doc, const ToonPath *path, ToonValue *value);
+int toon_path_delete(ToonDocument *doc, const ToonPath *path);
+bool toon_path_writable(ToonValue *root, const ToonPath *path, bool create);
+bool toon_document_unshare_path(ToonDocument *doc, const ToonPath *path, size_t end);
+void toon_path_add_tokens(ToonValue *root, const ToonPath *path, long long delta);
+
+// Tokenizers
+#define TOON_TOKENIZER_MAX 8
+
+// Pre-tokenizer patterns, which differ between vocabularies
+typedef enum {
+    TOON_SPLIT_CL100K,      // cl100k_base and older
+    TOON_SPLIT_O200K        // o200k_base: case-split words, contractions kept on the word
+} ToonTokenizerSplit;
+
+bool toon_tokenizer_split_parse(const char *str, ToonTokenizerSplit *split);
+ToonTokenizerSplit toon_tokenizer_split_for(const char *path);
+bool toon_tokenizer_load(const char *name, const char *path, ToonTokenizerSplit split, char **error);
+ToonTokenizer *toon_tokenizer_find(const char *name, size_t len);
+size_t toon_tokenizer_size(const ToonTokenizer *tok);
+size_t toon_tokenizer_count(ToonTokenizer *tok, const char *text, size_t len);
+
+// Worker threads
+bool toon_pool_start(size_t num_threads);
+bool toon_pool_submit(void (*run)(void *arg), void *arg);
+size_t toon_pool_size(void);
+
+// Secondary indexes over the columns of the table at a path, in every
+// document that has one. Only used on the main thread.
+typedef struct ToonIndexColumn ToonIndexColumn;
+typedef struct ToonIndex ToonIndex;
+
+struct ToonIndexEntry {
+    ToonIndex *index;
+    ToonDocument *doc;          // NULL once dead
+    char *key;
+    size_t key_len;
+    int db;
+    size_t num_rows;            // Rows of the table indexed so far
+    size_t postings;            // Postings pointing at this entry
+    bool dead;                  // Left for postings until the next purge
+    ToonIndexEntry *next;       // Next entry of the index
+    ToonIndexEntry *next_in_doc;
+};
+
+struct ToonIndex {
+    char *name;
+    ToonPath *path;             // Definite path of the table
+    ToonIndexColumn *columns;
+    size_t num_columns;
+    ToonIndexEntry *entries;
+    size_t live_postings;
+    size_t dead_postings;
+    ToonIndex *next;
+};
+
+// Called with each row a query matches, in index order; false if the row
+// could not be read and should not count against the limit
+typedef bool (*ToonIndexVisit)(ToonDocument *doc, const char *key, size_t key_len, size_t row, void *ctx);
+
+ToonIndex *toon_index_create(const char *name, size_t name_len, const ToonPath *path,
+                             char *const *columns, const size_t *column_lens, size_t num_columns);
+ToonIndex *toon_index_find(const char *name, size_t len);
+ToonIndex *toon_index_list(void);
+const char *toon_index_column(const ToonIndex *index, size_t col);
+void toon_index_drop(ToonIndex *index);
+void toon_index_drop_all(void);
+void toon_index_add(ToonIndex *index, ToonDocument *doc, const char *key, size_t key_len, int db);
+void toon_index_update(ToonDocument *doc, const char *key, size_t key_len, int db,
+                       const ToonPath *path, bool rows_appended);
+void toon_index_forget(ToonDocument *doc);
+void toon_index_forget_db(int db);
+void toon_index_swap_db(int first, int second);
+bool toon_index_query(ToonIndex *index, const ToonPathSegment *filter, int db, size_t limit,
+                      ToonIndexVisit visit, void *ctx);
+
+// Statistics, cheap enough to keep on. Latencies are kept per command and
+// phase; TOTAL is the whole call on the main thread.
+typedef enum {
+    TOON_CMD_SET,
+    TOON_CMD_GET,
+    TOON_CMD_MGET,
+    TOON_CMD_VERSION,
+    TOON_CMD_DEL,
+    TOON_CMD_ARRAPPEND,
+    TOON_CMD_ROWAPPEND,
+    TOON_CMD_CLONE,
+    TOON_CMD_INDEX,
+    TOON_CMD_QUERY,
+    TOON_CMD_TYPE,
+    TOON_CMD_TOJSON,
+    TOON_CMD_FROMJSON,
+    TOON_CMD_TOKENCOUNT,
+    TOON_CMD_CONVERT,
+    TOON_NUM_COMMANDS
+} ToonCommand;
+
+typedef enum {
+    TOON_PHASE_PARSE,
+    TOON_PHASE_PATH,
+    TOON_PHASE_ENCODE,
+    TOON_PHASE_TOTAL,
+    TOON_NUM_PHASES
+} ToonPhase;
+
+typedef enum {
+    TOON_STATS_TEXT_CACHE,
+    TOON_STATS_PATH_CACHE,
+    TOON_NUM_CACHES
+} ToonStatsCache;
+
+// Latency summary of a command phase, in microseconds
+typedef struct {
+    uint64_t calls;
+    double p50;
+    double p99;
+    double p999;
+    double max;
+} ToonLatency;
+
+void toon_stats_count_document(bool removed);
+size_t toon_stats_documents(void);
+void toon_stats_count_node(ToonType type, size_t bytes, bool removed);
+void toon_stats_count_nodes(const ToonNodeCounts *counts, bool removed);
+void toon_stats_node_totals(ToonNodeCounts *totals);
+void toon_stats_cache_lookup(ToonStatsCache cache, bool hit);
+void toon_stats_cache_counts(ToonStatsCache cache, uint64_t *hits, uint64_t *misses);
+uint64_t toon_stats_now(void);
+void toon_stats_record(ToonCommand command, ToonPhase phase, uint64_t ns);
+void toon_stats_command_begin(ToonCommand command);
+void toon_stats_mark(void);
+void toon_stats_phase(ToonPhase phase);
+void toon_stats_command_end(void);
+bool toon_stats_latency(ToonCommand command, ToonPhase phase, ToonLatency *latency);
+
+// RDB serialization
+void toon_rdb_save(RedisModuleIO *rdb, const ToonDocument *doc);
+ToonValue *toon_rdb_load(ToonArena *arena, RedisModuleIO *rdb, uint64_t *version);
+void toon_rdb_save_aux(RedisModuleIO *rdb, int when);
+int toon_rdb_load_aux(RedisModuleIO *rdb, int encver, int when);
+
+// AOF rewrite
+void toon_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, ToonValue *root, size_t live_bytes);
+void toon_aof_replicate_indexes(RedisModuleCtx *ctx);
 
 // Utility functions
 const char *toon_type_string(ToonType type);
+uint64_t toon_hash_key(const char *key, size_t len);
 size_t toon_estimate_tokens(ToonValue *value);
+size_t toon_entry_tokens(const char *key);
+void toon_tokens_adjust(ToonValue *value, long long delta);
+
+// INFO section
+void toon_info(RedisModuleInfoCtx *ctx, int for_crash_report);
 
 // Redis Module Type
 extern RedisModuleType *ToonType_RMT;
@@ -96,6 +628,11 @@ void *ToonTypeRdbLoad(RedisModuleIO *rdb, int encver);
 void ToonTypeRdbSave(RedisModuleIO *rdb, void *value);
 void ToonTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value);
 void ToonTypeDigest(RedisModuleDigest *md, void *value);
+size_t ToonTypeMemUsage(const void *value);
+void *ToonTypeCopy(RedisModuleString *fromkey, RedisModuleString *tokey, const void *value);
+int ToonTypeDefrag(RedisModuleDefragCtx *ctx, RedisModuleString *key, void **value);
 void ToonTypeFree(void *value);
+size_t ToonTypeFreeEffort(RedisModuleString *key, const void *value);
+void ToonTypeUnlink(RedisModuleString *key, const void *value);
 
 #endif // REDISTOON_H
@@ -0,0 +1,256 @@
+#include "redistoon.h"
+
+// AOF rewrite
+//
+// A document whose tree is smaller than a chunk is rewritten as a single
+// TOON.SET of its text. A larger one is rebuilt by a series of commands,
+// none much larger than a chunk, so the rewrite never holds the whole text
+// and loading the AOF replays it piece by piece:
+//
+//   root object:   TOON.SET key $ <first entry>, then TOON.SET key $.k <value>
+//                  for each further entry
+//   root array:    TOON.SET key $ "[0]: ", then TOON.ARRAPPEND key $ batches
+//   root table:    TOON.SET key $ <headers, no rows>, then TOON.ROWAPPEND
+//                  key $ batches
+//
+// An entry holding an array or table, the first one included, is created
+// empty and filled with batched appends. Anything else (scalars, nested
+// objects, tables with nested cells) goes out whole, so only a single value
+// larger than a chunk makes a larger command. Documents that TOON.SET paths cannot rebuild in
+// order, with keys a path cannot name or duplicated keys, are written whole.
+
+// Target size of a rewritten command's payload
+#define TOON_AOF_CHUNK_SIZE (1024 * 1024)
+
+// Most values or cells carried by one append
+#define TOON_AOF_MAX_BATCH 4096
+
+// Pending arguments of an append, flushed once a chunk's worth is queued
+typedef struct {
+    RedisModuleIO *aof;
+    RedisModuleString *key;
+    const char *command;
+    const char *path;
+    RedisModuleString *args[TOON_AOF_MAX_BATCH];
+    size_t count;
+    size_t bytes;
+} AofBatch;
+
+static void batch_flush(AofBatch *batch) {
+    if (batch->count == 0) return;
+
+    RedisModule_EmitAOF(batch->aof, batch->command, "scv", batch->key, batch->path,
+                        batch->args, batch->count);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        RedisModule_FreeString(NULL, batch->args[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+}
+
+// Queue value, encoded on its own, as the next argument
+static void batch_push(AofBatch *batch, ToonValue *value, ToonBuffer *buf) {
+    toon_buffer_reset(buf);
+    toon_encode_to(buf, value, 0);
+    if (buf->failed) return;
+
+    batch->args[batch->count++] = RedisModule_CreateString(NULL, buf->data, buf->len);
+    batch->bytes += buf->len;
+}
+
+// Whether TOON.ROWAPPEND can carry every cell of a table
+static bool table_has_scalar_cells(const ToonTabularArray *tab) {
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        if (tab->columns[col].type != TOON_COLUMN_MIXED) continue;
+
+        for (size_t row = 0; row < tab->num_rows; row++) {
+            ToonValue scratch;
+            ToonType type = toon_tabular_cell(tab, row, col, &scratch)->type;
+            if (type == TOON_ARRAY || type == TOON_OBJECT || type == TOON_TABULAR_ARRAY) return false;
+        }
+    }
+    return true;
+}
+
+// Whether value is rebuilt empty and then appended to
+static bool is_appendable(ToonValue *value) {
+    if (value->type == TOON_ARRAY) return value->value.array.length > 0;
+    if (value->type == TOON_TABULAR_ARRAY) {
+        const ToonTabularArray *tab = &value->value.tabular;
+        return tab->num_rows > 0 && tab->num_headers > 0 &&
+               tab->num_headers <= TOON_AOF_MAX_BATCH && table_has_scalar_cells(tab);
+    }
+    return false;
+}
+
+// An array with no elements, or a table with its headers and no rows,
+// sharing value's storage. Nodes are sized for their type, so only the
+// member in use is copied.
+static ToonValue empty_of(const ToonValue *value) {
+    ToonValue empty = {.type = value->type};
+    if (value->type == TOON_TABULAR_ARRAY) {
+        empty.value.tabular = value->value.tabular;
+        empty.value.tabular.num_rows = 0;
+    }
+    return empty;
+}
+
+// Append the elements or rows of value to what path names
+static void emit_appends(RedisModuleIO *aof, RedisModuleString *key, const char *path,
+                         ToonValue *value, ToonBuffer *buf) {
+    AofBatch *batch = calloc(1, sizeof(AofBatch));
+    if (!batch) return;
+    batch->aof = aof;
+    batch->key = key;
+    batch->path = path;
+
+    if (value->type == TOON_ARRAY) {
+        batch->command = "TOON.ARRAPPEND";
+        for (size_t i = 0; i < value->value.array.length; i++) {
+            batch_push(batch, value->value.array.elements[i], buf);
+            if (batch->count == TOON_AOF_MAX_BATCH || batch->bytes >= TOON_AOF_CHUNK_SIZE) {
+                batch_flush(batch);
+            }
+        }
+    } else {
+        const ToonTabularArray *tab = &value->value.tabular;
+        size_t max_cells = TOON_AOF_MAX_BATCH - TOON_AOF_MAX_BATCH % tab->num_headers;
+
+        batch->command = "TOON.ROWAPPEND";
+        for (size_t row = 0; row < tab->num_rows; row++) {
+            for (size_t col = 0; col < tab->num_headers; col++) {
+                ToonValue scratch;
+                batch_push(batch, toon_tabular_cell(tab, row, col, &scratch), buf);
+            }
+            if (batch->count + tab->num_headers > max_cells || batch->bytes >= TOON_AOF_CHUNK_SIZE) {
+                batch_flush(batch);
+            }
+        }
+    }
+
+    batch_flush(batch);
+    free(batch);
+}
+
+// Whether every entry of the root object can be set by "$.key" in turn
+static bool entries_addressable(ToonValue *object) {
+    for (size_t i = 0; i < object->value.object.length; i++) {
+        const char *key = object->value.object.entries[i].key;
+        size_t len = strlen(key);
+        if (len == 0 || strpbrk(key, ".[")) return false;
+
+        size_t position;
+        toon_object_find(object, key, len, toon_hash_key(key, len), &position);
+        if (position != i) return false;
+    }
+    return true;
+}
+
+// Rewrite an entry of the root object other than the first
+static void emit_entry(RedisModuleIO *aof, RedisModuleString *key, ToonObjectEntry *entry,
+                       ToonBuffer *buf, ToonBuffer *path) {
+    toon_buffer_reset(path);
+    toon_buffer_append(path, "$.", 2);
+    toon_buffer_append_str(path, entry->key);
+    if (path->failed) return;
+
+    bool append = is_appendable(entry->value);
+    ToonValue empty;
+    if (append) empty = empty_of(entry->value);
+
+    toon_buffer_reset(buf);
+    toon_encode_to(buf, append ? &empty : entry->value, 0);
+    if (buf->failed) return;
+    RedisModule_EmitAOF(aof, "TOON.SET", "scb", key, path->data, buf->data, buf->len);
+
+    if (append) emit_appends(aof, key, path->data, entry->value, buf);
+}
+
+static void emit_whole(RedisModuleIO *aof, RedisModuleString *key, ToonValue *root) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, toon_encoded_size_hint(root));
+    toon_encode_to(&buf, root, 0);
+    if (!buf.failed) {
+        RedisModule_EmitAOF(aof, "TOON.SET", "scb", key, "$", buf.data, buf.len);
+    }
+    toon_buffer_free(&buf);
+}
+
+// Emit the commands that rebuild a document whose arena holds live_bytes
+void toon_aof_rewrite(RedisModuleIO *aof, RedisModuleString *key, ToonValue *root, size_t live_bytes) {
+    bool chunked = live_bytes >= TOON_AOF_CHUNK_SIZE &&
+                   ((root->type == TOON_OBJECT && root->value.object.length > 0 &&
+                     entries_addressable(root)) || is_appendable(root));
+    if (!chunked) {
+        emit_whole(aof, key, root);
+        return;
+    }
+
+    ToonBuffer buf;
+    toon_buffer_init(&buf, 0);
+
+    if (root->type != TOON_OBJECT) {
+        ToonValue empty = empty_of(root);
+        toon_encode_to(&buf, &empty, 0);
+        if (!buf.failed) {
+            RedisModule_EmitAOF(aof, "TOON.SET", "scb", key, "$", buf.data, buf.len);
+            emit_appends(aof, key, "$", root, &buf);
+        }
+        toon_buffer_free(&buf);
+        return;
+    }
+
+    // The base is an object holding only the first entry, emptied if it is
+    // appended to; the rest is set and appended to by path, in order
+    ToonBuffer path;
+    toon_buffer_init(&path, 0);
+
+    ToonObjectEntry *entries = root->value.object.entries;
+    bool append = is_appendable(entries[0].value);
+    ToonValue first_value;
+    if (append) first_value = empty_of(entries[0].value);
+    ToonObjectEntry first_entry = {.key = entries[0].key, .value = append ? &first_value : entries[0].value};
+
+    ToonValue base = {.type = TOON_OBJECT};
+    base.value.object.entries = &first_entry;
+    base.value.object.length = 1;
+    base.value.object.capacity = 1;
+    toon_encode_to(&buf, &base, 0);
+    if (!buf.failed) {
+        RedisModule_EmitAOF(aof, "TOON.SET", "scb", key, "$", buf.data, buf.len);
+
+        toon_buffer_append(&path, "$.", 2);
+        toon_buffer_append_str(&path, entries[0].key);
+        if (append && !path.failed) emit_appends(aof, key, path.data, entries[0].value, &buf);
+
+        for (size_t i = 1; i < root->value.object.length; i++) {
+            emit_entry(aof, key, &entries[i], &buf, &path);
+        }
+    }
+
+    toon_buffer_free(&path);
+    toon_buffer_free(&buf);
+}
+
+// Replicate a TOON.INDEX CREATE per index definition. Redis has no module
+// hook for AOF data outside keys, so the definitions reach a rewritten AOF
+// as commands that follow it.
+void toon_aof_replicate_indexes(RedisModuleCtx *ctx) {
+    for (ToonIndex *index = toon_index_list(); index; index = index->next) {
+        RedisModuleString **columns = malloc(sizeof(RedisModuleString *) * index->num_columns);
+        if (!columns) return;
+
+        for (size_t col = 0; col < index->num_columns; col++) {
+            const char *column = toon_index_column(index, col);
+            columns[col] = RedisModule_CreateString(NULL, column, strlen(column));
+        }
+        RedisModule_Replicate(ctx, "TOON.INDEX", "ccbv", "CREATE", index->name, index->path->source,
+                              index->path->source_len, columns, index->num_columns);
+
+        for (size_t col = 0; col < index->num_columns; col++) {
+            RedisModule_FreeString(NULL, columns[col]);
+        }
+        free(columns);
+    }
+}
@@ -0,0 +1,258 @@
+#include "redistoon.h"
+
+// Every allocation is rounded up to this alignment
+#define TOON_ARENA_ALIGN 8
+
+// Chunk sizing: the first chunk follows the caller's hint, later chunks
+// double up to the cap. Requests larger than half a chunk get their own.
+#define TOON_ARENA_MIN_CHUNK 256
+#define TOON_ARENA_MAX_CHUNK (1024 * 1024)
+
+struct ToonArenaChunk {
+    ToonArenaChunk *next;   // Older chunk
+    size_t size;            // Usable bytes after the header
+    size_t used;            // Bytes handed out from this chunk
+    char data[];
+};
+
+// Chunks come from the server's allocator when the module runs in one, so
+// they count in its memory and active defrag can move them. The native
+// benchmarks and fuzzer have no server and use libc.
+static ToonArenaChunk *chunk_alloc(size_t size) {
+    return RedisModule_TryAlloc ? RedisModule_TryAlloc(size) : malloc(size);
+}
+
+static void chunk_free(ToonArenaChunk *chunk) {
+    if (RedisModule_TryAlloc) RedisModule_Free(chunk);
+    else free(chunk);
+}
+
+static size_t align_up(size_t size) {
+    return (size + TOON_ARENA_ALIGN - 1) & ~(size_t)(TOON_ARENA_ALIGN - 1);
+}
+
+// Size actually consumed by an allocation of the given size
+size_t toon_arena_alloc_size(size_t size) {
+    return align_up(size ? size : 1);
+}
+
+// Create an empty arena; size_hint sizes the first chunk
+ToonArena *toon_arena_create(size_t size_hint) {
+    ToonArena *arena = calloc(1, sizeof(ToonArena));
+    if (!arena) return NULL;
+
+    size_t first = align_up(size_hint);
+    if (first < TOON_ARENA_MIN_CHUNK) first = TOON_ARENA_MIN_CHUNK;
+    if (first > TOON_ARENA_MAX_CHUNK) first = TOON_ARENA_MAX_CHUNK;
+    arena->next_chunk_size = first;
+    atomic_init(&arena->refs, 1);
+
+    return arena;
+}
+
+// Free an arena and everything allocated from it in O(chunks)
+void toon_arena_destroy(ToonArena *arena) {
+    if (!arena) return;
+
+    if (arena->tracked) toon_stats_count_nodes(&arena->nodes, true);
+
+    ToonArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ToonArenaChunk *next = chunk->next;
+        chunk_free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+// Start a new chunk able to hold at least size bytes
+static bool add_chunk(ToonArena *arena, size_t size) {
+    size_t chunk_size = arena->next_chunk_size;
+    if (size > chunk_size / 2) {
+        // Oversized request: give it a dedicated chunk and leave the growth schedule alone
+        chunk_size = size;
+    } else if (arena->next_chunk_size < TOON_ARENA_MAX_CHUNK) {
+        arena->next_chunk_size *= 2;
+    }
+
+    ToonArenaChunk *chunk = chunk_alloc(sizeof(ToonArenaChunk) + chunk_size);
+    if (!chunk) return false;
+
+    chunk->size = chunk_size;
+    chunk->used = 0;
+    chunk->next = arena->head;
+    arena->head = chunk;
+
+    arena->num_chunks++;
+    arena->reserved += sizeof(ToonArenaChunk) + chunk_size;
+    return true;
+}
+
+// Allocate size bytes (uninitialized)
+void *toon_arena_alloc(ToonArena *arena, size_t size) {
+    size = toon_arena_alloc_size(size);
+
+    ToonArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (!add_chunk(arena, size)) return NULL;
+        chunk = arena->head;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->used += size;
+    return ptr;
+}
+
+// Allocate zeroed memory for count items of size bytes
+void *toon_arena_calloc(ToonArena *arena, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+
+    void *ptr = toon_arena_alloc(arena, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+// Copy len bytes into a NUL-terminated arena string
+char *toon_arena_strndup(ToonArena *arena, const char *str, size_t len) {
+    char *copy = toon_arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Resize a block. Extends in place when it is the most recent allocation in
+// the head chunk; otherwise copies it and counts the old block as waste.
+void *toon_arena_grow(ToonArena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return toon_arena_alloc(arena, new_size);
+
+    old_size = toon_arena_alloc_size(old_size);
+    new_size = toon_arena_alloc_size(new_size);
+    if (new_size <= old_size) return ptr;
+
+    ToonArenaChunk *chunk = arena->head;
+    if (chunk && (char *)ptr + old_size == chunk->data + chunk->used &&
+        chunk->size - chunk->used >= new_size - old_size) {
+        chunk->used += new_size - old_size;
+        arena->used += new_size - old_size;
+        return ptr;
+    }
+
+    void *grown = toon_arena_alloc(arena, new_size);
+    if (!grown) return NULL;
+
+    memcpy(grown, ptr, old_size);
+    toon_arena_waste(arena, old_size);
+    return grown;
+}
+
+// Record bytes that are no longer reachable from the document
+void toon_arena_waste(ToonArena *arena, size_t bytes) {
+    arena->wasted += bytes;
+    if (arena->wasted > arena->used) arena->wasted = arena->used;
+}
+
+// Remember the current allocation point
+ToonArenaMark toon_arena_mark(ToonArena *arena) {
+    ToonArenaMark mark = {
+        .chunk = arena->head,
+        .chunk_used = arena->head ? arena->head->used : 0,
+        .used = arena->used,
+        .nodes = arena->nodes
+    };
+    return mark;
+}
+
+// Release everything allocated since mark. Only valid while nothing
+// allocated after the mark is still referenced.
+void toon_arena_rewind(ToonArena *arena, ToonArenaMark mark) {
+    // Chunks are linked newest first, so everything ahead of the marked
+    // chunk was created after the mark
+    while (arena->head && arena->head != mark.chunk) {
+        ToonArenaChunk *chunk = arena->head;
+        arena->head = chunk->next;
+        arena->num_chunks--;
+        arena->reserved -= sizeof(ToonArenaChunk) + chunk->size;
+        chunk_free(chunk);
+    }
+
+    if (mark.chunk) mark.chunk->used = mark.chunk_used;
+
+    arena->used = mark.used;
+    if (arena->wasted > arena->used) arena->wasted = arena->used;
+
+    if (arena->tracked) {
+        ToonNodeCounts dropped;
+        for (int type = 0; type < TOON_NUM_TYPES; type++) {
+            dropped.count[type] = arena->nodes.count[type] - mark.nodes.count[type];
+        }
+        dropped.string_bytes = arena->nodes.string_bytes - mark.nodes.string_bytes;
+        toon_stats_count_nodes(&dropped, true);
+    }
+    arena->nodes = mark.nodes;
+}
+
+// Count the arena's nodes in the module totals from now until it is
+// destroyed; called once a document owns it
+void toon_arena_track(ToonArena *arena) {
+    if (arena->tracked) return;
+
+    arena->tracked = true;
+    toon_stats_count_nodes(&arena->nodes, false);
+}
+
+// Take another reference to an arena shared between documents; each is
+// dropped with toon_arena_reclaim. May run on any thread.
+void toon_arena_retain(ToonArena *arena) {
+    atomic_fetch_add_explicit(&arena->refs, 1, memory_order_relaxed);
+}
+
+// Whether ptr was handed out by arena, in O(chunks)
+bool toon_arena_owns(const ToonArena *arena, const void *ptr) {
+    for (const ToonArenaChunk *chunk = arena->head; chunk; chunk = chunk->next) {
+        if ((uintptr_t)ptr - (uintptr_t)chunk->data < chunk->used) return true;
+    }
+    return false;
+}
+
+// Offer the arena's chunks to mover, newest first from chunk first on,
+// until it says to stop or moves is full. Every chunk it moves is recorded
+// in moves; until the tree has followed them with toon_arena_relocated,
+// its pointers into them are left dangling. Returns the position of the
+// first chunk not offered, the number of chunks when all were.
+size_t toon_arena_move_chunks(ToonArena *arena, size_t first, const ToonChunkMover *mover, ToonArenaMoves *moves) {
+    ToonArenaChunk **link = &arena->head;
+    size_t position = 0;
+
+    for (; *link && position < first; position++) link = &(*link)->next;
+
+    for (; *link; position++) {
+        if (moves->count == TOON_ARENA_MAX_MOVES || mover->stop(mover->ctx)) break;
+
+        ToonArenaChunk *chunk = *link;
+        uintptr_t from = (uintptr_t)chunk->data;
+        ToonArenaChunk *moved = mover->move(chunk, mover->ctx);
+        if (moved) {
+            *link = moved;
+            moves->moved[moves->count].from = from;
+            moves->moved[moves->count].used = moved->used;
+            moves->moved[moves->count].to = moved->data;
+            moves->count++;
+        }
+        link = &(*link)->next;
+    }
+    return position;
+}
+
+// Where a pointer into the arena is after the moves, ptr itself if its
+// chunk stayed or it points elsewhere
+void *toon_arena_relocated(const ToonArenaMoves *moves, void *ptr) {
+    for (size_t i = 0; i < moves->count; i++) {
+        uintptr_t offset = (uintptr_t)ptr - moves->moved[i].from;
+        if (offset < moves->moved[i].used) return moves->moved[i].to + offset;
+    }
+    return ptr;
+}
@@ -0,0 +1,210 @@
+#include "redistoon.h"
+
+// Smallest allocation made for a buffer that receives no size hint
+#define TOON_BUFFER_MIN_CAPACITY 64
+
+// Initialize a buffer, reserving room for size_hint bytes up front
+void toon_buffer_init(ToonBuffer *buf, size_t size_hint) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    buf->failed = false;
+
+    // Terminated from the start, so a buffer nothing is appended to still
+    // reads as an empty string
+    if (toon_buffer_reserve(buf, size_hint)) buf->data[0] = '\0';
+}
+
+// Make room for at least extra more bytes plus the trailing NUL
+bool toon_buffer_reserve(ToonBuffer *buf, size_t extra) {
+    if (buf->failed) return false;
+
+    size_t needed = buf->len + extra + 1;
+    if (needed <= buf->cap) return true;
+
+    // Grow geometrically so a long run of small appends stays amortized O(1)
+    size_t new_cap = buf->cap ? buf->cap : TOON_BUFFER_MIN_CAPACITY;
+    while (new_cap < needed) {
+        new_cap *= 2;
+    }
+
+    char *data = realloc(buf->data, new_cap);
+    if (!data) {
+        buf->failed = true;
+        return false;
+    }
+
+    buf->data = data;
+    buf->cap = new_cap;
+    return true;
+}
+
+// Append len bytes
+void toon_buffer_append(ToonBuffer *buf, const char *str, size_t len) {
+    if (!toon_buffer_reserve(buf, len)) return;
+
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+// Append a NUL-terminated string
+void toon_buffer_append_str(ToonBuffer *buf, const char *str) {
+    toon_buffer_append(buf, str, strlen(str));
+}
+
+// Append a single character
+void toon_buffer_putc(ToonBuffer *buf, char c) {
+    if (!toon_buffer_reserve(buf, 1)) return;
+
+    buf->data[buf->len++] = c;
+    buf->data[buf->len] = '\0';
+}
+
+// Append count copies of c (used for indentation)
+void toon_buffer_fill(ToonBuffer *buf, char c, size_t count) {
+    if (!toon_buffer_reserve(buf, count)) return;
+
+    memset(buf->data + buf->len, c, count);
+    buf->len += count;
+    buf->data[buf->len] = '\0';
+}
+
+// Append an unsigned decimal integer
+void toon_buffer_append_size(ToonBuffer *buf, size_t n) {
+    char digits[TOON_NUMBER_MAX_LEN];
+    toon_buffer_append(buf, digits, toon_number_format_uint(n, digits));
+}
+
+// Append a number in the format shared by the TOON and JSON encoders: the
+// shortest decimal that reads back as the same double
+void toon_buffer_append_number(ToonBuffer *buf, double num) {
+    char digits[TOON_NUMBER_MAX_LEN];
+    toon_buffer_append(buf, digits, toon_number_format(num, digits));
+}
+
+// Empty the buffer for reuse, keeping its storage
+void toon_buffer_reset(ToonBuffer *buf) {
+    buf->len = 0;
+    buf->failed = false;
+    if (buf->data) buf->data[0] = '\0';
+}
+
+// Hand the contents to the caller as a malloc'd NUL-terminated string
+char *toon_buffer_detach(ToonBuffer *buf, size_t *len) {
+    if (buf->failed || !toon_buffer_reserve(buf, 0)) {
+        toon_buffer_free(buf);
+        return NULL;
+    }
+
+    char *data = buf->data;
+    if (len) *len = buf->len;
+
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    return data;
+}
+
+// Release the buffer storage
+void toon_buffer_free(ToonBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+// Hint for a node on its own: the whole of a scalar or table, the syntax
+// of an array or object's children
+static size_t node_size_hint(const ToonValue *value) {
+    if (!value) return 4;
+
+    size_t size = 0;
+
+    switch (value->type) {
+        case TOON_NULL:
+        case TOON_BOOLEAN:
+            size = 5;
+            break;
+
+        case TOON_NUMBER:
+            size = 12;
+            break;
+
+        case TOON_STRING:
+            size = (value->value.string ? strlen(value->value.string) : 0) + 2;
+            break;
+
+        case TOON_ARRAY:
+            size = 8 + value->value.array.length * 4;
+            break;
+
+        case TOON_OBJECT:
+            for (size_t i = 0; i < value->value.object.length; i++) {
+                size += strlen(value->value.object.entries[i].key) + 4;
+            }
+            break;
+
+        case TOON_TABULAR_ARRAY: {
+            const ToonTabularArray *tab = &value->value.tabular;
+            ToonValue scratch;
+
+            size = 12 + tab->num_rows * 2;
+            for (size_t col = 0; col < tab->num_headers; col++) {
+                size += strlen(tab->headers[col]) + 1;
+                for (size_t row = 0; row < tab->num_rows; row++) {
+                    size += node_size_hint(toon_tabular_cell(tab, row, col, &scratch)) + 1;
+                }
+            }
+            break;
+        }
+    }
+
+    return size;
+}
+
+// A container whose children are still to be counted
+typedef struct {
+    ToonValue *value;
+    size_t next;
+} HintFrame;
+
+// Estimate the encoded size of a value so a buffer can be sized in one go.
+// Counts string payloads and a few bytes of syntax per node; escapes and
+// indentation may push the real output past it, in which case the buffer
+// simply grows. Only a hint, so a walk cut short by running out of memory
+// returns what it counted.
+size_t toon_encoded_size_hint(ToonValue *value) {
+    size_t size = node_size_hint(value);
+    if (!value || (value->type != TOON_ARRAY && value->type != TOON_OBJECT)) return size;
+
+    ToonBuffer stack = {0};
+
+    toon_stack_push(&stack, &(HintFrame){value, 0}, sizeof(HintFrame));
+
+    HintFrame *top;
+    while ((top = toon_stack_top(&stack, sizeof(HintFrame)))) {
+        ToonValue *node = top->value;
+        bool is_array = node->type == TOON_ARRAY;
+        size_t length = is_array ? node->value.array.length : node->value.object.length;
+
+        // Count children up to the next container, which is walked next
+        ToonValue *child = NULL;
+        while (top->next < length) {
+            size_t i = top->next++;
+            child = is_array ? node->value.array.elements[i] : node->value.object.entries[i].value;
+            size += node_size_hint(child);
+            if (child && (child->type == TOON_ARRAY || child->type == TOON_OBJECT)) break;
+            child = NULL;
+        }
+
+        if (!child) {
+            toon_stack_pop(&stack, sizeof(HintFrame));
+        } else if (!toon_stack_push(&stack, &(HintFrame){child, 0}, sizeof(HintFrame))) {
+            break;
+        }
+    }
+
+    toon_buffer_free(&stack);
+    return size;
+}
@@ -0,0 +1,142 @@
+#include "redistoon.h"
+
+// Documents are mostly written once and read many times, so the TOON and
+// JSON text of a whole document are kept on the document after the first
+// read, until it next changes. Cached text is
+// capped module-wide: documents holding text form a most-recently-used
+// list, and text is dropped from its tail to make room. The cache is only
+// used from the main thread.
+
+static struct {
+    ToonDocument *head;     // Most recently used
+    ToonDocument *tail;
+    size_t used;            // Bytes of cached text
+    size_t limit;
+} doc_cache = {.limit = TOON_CACHE_DEFAULT_LIMIT};
+
+static bool cache_holds_text(const ToonDocument *doc) {
+    for (int format = 0; format < TOON_TEXT_FORMATS; format++) {
+        if (doc->cache.text[format]) return true;
+    }
+    return false;
+}
+
+static void cache_unlink(ToonDocument *doc) {
+    ToonDocCache *cache = &doc->cache;
+
+    if (cache->prev) cache->prev->cache.next = cache->next;
+    else doc_cache.head = cache->next;
+
+    if (cache->next) cache->next->cache.prev = cache->prev;
+    else doc_cache.tail = cache->prev;
+
+    cache->prev = cache->next = NULL;
+}
+
+static void cache_push_front(ToonDocument *doc) {
+    doc->cache.prev = NULL;
+    doc->cache.next = doc_cache.head;
+    if (doc_cache.head) doc_cache.head->cache.prev = doc;
+    doc_cache.head = doc;
+    if (!doc_cache.tail) doc_cache.tail = doc;
+}
+
+// Free a document's cached text and take it off the list
+static void cache_drop_text(ToonDocument *doc) {
+    if (!cache_holds_text(doc)) return;
+
+    for (int format = 0; format < TOON_TEXT_FORMATS; format++) {
+        free(doc->cache.text[format]);
+        doc_cache.used -= doc->cache.text_len[format];
+        doc->cache.text[format] = NULL;
+        doc->cache.text_len[format] = 0;
+    }
+    cache_unlink(doc);
+}
+
+// Drop text from the least recently used documents until bytes more fit
+static void cache_make_room(size_t bytes) {
+    while (doc_cache.tail && doc_cache.used + bytes > doc_cache.limit) {
+        cache_drop_text(doc_cache.tail);
+    }
+}
+
+// Text of the whole document in format. Cached text is returned as is;
+// otherwise the document is encoded into buf, an initialized buffer, and
+// the text moves into the cache if may_cache is set and it fits under the
+// limit. Either way the result stays valid until the document changes or
+// buf is freed, which the caller always does. NULL when out of memory.
+const char *toon_document_text(ToonDocument *doc, ToonTextFormat format, bool may_cache,
+                               ToonBuffer *buf, size_t *len) {
+    ToonDocCache *cache = &doc->cache;
+
+    toon_stats_cache_lookup(TOON_STATS_TEXT_CACHE, cache->text[format] != NULL);
+    if (cache->text[format]) {
+        if (doc != doc_cache.head) {
+            cache_unlink(doc);
+            cache_push_front(doc);
+        }
+        *len = cache->text_len[format];
+        return cache->text[format];
+    }
+
+    toon_buffer_reserve(buf, toon_encoded_size_hint(doc->root));
+    if (format == TOON_TEXT_TOON) {
+        toon_encode_to(buf, doc->root, 0);
+    } else {
+        toon_to_json_to(buf, doc->root);
+    }
+    if (buf->failed) return NULL;
+
+    *len = buf->len;
+    if (!may_cache) return buf->data;
+
+    toon_document_cache_text(doc, format, buf);
+    return cache->text[format] ? cache->text[format] : buf->data;
+}
+
+// Move text encoded elsewhere, such as on a worker thread, into the cache
+// if it fits under the limit; otherwise buf keeps it
+void toon_document_cache_text(ToonDocument *doc, ToonTextFormat format, ToonBuffer *buf) {
+    ToonDocCache *cache = &doc->cache;
+    if (buf->failed || cache->text[format] || buf->len > doc_cache.limit) return;
+
+    size_t len;
+    char *text = toon_buffer_detach(buf, &len);
+    if (!text) return;
+
+    cache_make_room(len);
+    if (!cache_holds_text(doc)) cache_push_front(doc);
+
+    cache->text[format] = text;
+    cache->text_len[format] = len;
+    doc_cache.used += len;
+}
+
+// Forget the cached text of a document and move it to its next version;
+// every mutation calls this
+void toon_document_changed(ToonDocument *doc) {
+    cache_drop_text(doc);
+    toon_version_observe(++doc->version);
+}
+
+// Release a document's cached text before the document is freed
+void toon_cache_release(ToonDocument *doc) {
+    cache_drop_text(doc);
+}
+
+// Change the limit on cached text, dropping text that no longer fits
+void toon_cache_set_limit(size_t bytes) {
+    doc_cache.limit = bytes;
+    cache_make_room(0);
+}
+
+// Bytes of cached text across all documents
+size_t toon_cache_used(void) {
+    return doc_cache.used;
+}
+
+// Drop all cached text, which is the first memory to give back under pressure
+void toon_cache_clear(void) {
+    while (doc_cache.tail) cache_drop_text(doc_cache.tail);
+}
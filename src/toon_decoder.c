@@ -1,362 +1,464 @@
 #include "redistoon.h"
 #include <ctype.h>
 
+// The decoder works over a length-delimited buffer in a single pass.
+// Tokens are located in place and copied once, straight into the arena:
+// strings without escapes are a plain copy of their span into their node,
+// escaped strings are unescaped into a scratch buffer first, and keywords
+// and numbers are classified from the span without copying at all.
+
 // Parser state
 typedef struct {
     const char *input;
     const char *current;
-    int line;
-    int column;
+    const char *end;        // One past the last input byte
     char *error;
+    ToonArena *arena;       // Destination of every node
+    ToonBuffer values;      // Scratch stack of array elements
+    ToonBuffer entries;     // Scratch stack of object entries
+    ToonBuffer text;        // Scratch for an unescaped string
+    ToonBuffer frames;      // Stack of the arrays being parsed, innermost on top
+    size_t depth;           // Containers open around the cursor
+    ToonBuffer *out;        // Streaming to JSON: destination of the text
 } Parser;
 
-// Helper function to set parser error
+// A simple array whose elements are being parsed. Arrays nest without
+// recursion: each is a frame on p->frames, its elements on p->values.
+typedef struct {
+    size_t length;          // Declared length, untrusted
+    size_t count;           // Elements parsed so far
+} ArrayFrame;
+
+// Helper function to set parser error. The scans do not track lines, so
+// the position is worked out from the input only when an error is raised.
 static void set_error(Parser *p, const char *message) {
     if (p->error) return;  // Already have an error
 
+    int line = 1;
+    const char *line_start = p->input;
+    const char *nl;
+    while ((nl = memchr(line_start, '\n', p->current - line_start)) != NULL) {
+        line++;
+        line_start = nl + 1;
+    }
+
     size_t len = strlen(message) + 100;
     p->error = malloc(len);
     if (p->error) {
-        snprintf(p->error, len, "Line %d, Column %d: %s", p->line, p->column, message);
+        snprintf(p->error, len, "Line %d, Column %d: %s", line, (int)(p->current - line_start), message);
     }
 }
 
 // Skip whitespace and comments
 static void skip_whitespace(Parser *p) {
-    while (*p->current && isspace(*p->current)) {
-        if (*p->current == '\n') {
-            p->line++;
-            p->column = 0;
-        }
-        p->current++;
-        p->column++;
-    }
+    p->current = toon_scan_space(p->current, p->end);
 }
 
-// Check if current position matches a string
-static bool match(Parser *p, const char *str) {
-    size_t len = strlen(str);
-    if (strncmp(p->current, str, len) == 0) {
-        p->current += len;
-        p->column += len;
-        return true;
-    }
-    return false;
-}
-
-// Peek at current character
+// Peek at current character; the end of input reads as NUL
 static char peek(Parser *p) {
-    return *p->current;
+    return p->current < p->end ? *p->current : '\0';
 }
 
 // Consume and return current character
 static char consume(Parser *p) {
-    char c = *p->current;
-    if (c) {
-        p->current++;
-        p->column++;
-        if (c == '\n') {
-            p->line++;
-            p->column = 0;
-        }
-    }
+    char c = peek(p);
+    if (c) p->current++;
     return c;
 }
 
-// Parse a quoted string
-static char *parse_quoted_string(Parser *p) {
+// Stop bytes of the token scans
+static const ToonScanSet value_stops = {{',', '\n', '\r', ':'}};    // Values
+static const ToonScanSet cell_stops = {{',', '\n', '\r', ','}};     // Tabular cells
+static const ToonScanSet header_stops = {{',', '}', ',', '}'}};     // Tabular headers
+static const ToonScanSet key_stops = {{':', ':', ':', ':'}};        // Object keys
+static const ToonScanSet quote_stops = {{'"', '\\', '"', '\\'}};  // Quoted strings
+
+// Find the first delimiter, NUL or the end of input at or after the cursor
+static const char *scan_token(Parser *p, const ToonScanSet *delimiters) {
+    return toon_scan_until(p->current, p->end, delimiters);
+}
+
+// Trim whitespace from both ends of the span [*start, *end)
+static void trim_span(const char **start, const char **end) {
+    *start = toon_scan_space(*start, *end);
+    while (*end > *start && isspace((unsigned char)(*end)[-1])) (*end)--;
+}
+
+// Parse a run of digits as a count, saturating instead of overflowing
+static size_t parse_count(Parser *p) {
+    size_t count = 0;
+    while (isdigit((unsigned char)peek(p))) {
+        size_t digit = consume(p) - '0';
+        count = count > (SIZE_MAX - digit) / 10 ? SIZE_MAX : count * 10 + digit;
+    }
+    return count;
+}
+
+// Allocate a node in the document arena
+static ToonValue *new_value(Parser *p, ToonType type) {
+    ToonValue *value = toon_value_create(p->arena, type);
+    if (!value) set_error(p, "Out of memory");
+    return value;
+}
+
+// Copy a string into the document arena
+static char *new_string(Parser *p, const char *str, size_t len) {
+    char *copy = toon_arena_strndup(p->arena, str, len);
+    if (!copy) set_error(p, "Out of memory");
+    return copy;
+}
+
+// Copy a key, sharing it if it is interned
+static char *new_key(Parser *p, const char *str, size_t len) {
+    char *copy = toon_intern_key(p->arena, str, len);
+    if (!copy) set_error(p, "Out of memory");
+    return copy;
+}
+
+// Build a string node for the len bytes at str
+static ToonValue *new_string_value(Parser *p, const char *str, size_t len) {
+    ToonValue *value = toon_value_string(p->arena, str, len);
+    if (!value) set_error(p, "Out of memory");
+    return value;
+}
+
+// Push an item onto a scratch stack; the item count lives in the buffer length
+static void push_scratch(Parser *p, ToonBuffer *stack, const void *item, size_t size) {
+    toon_buffer_append(stack, item, size);
+    if (stack->failed) set_error(p, "Out of memory");
+}
+
+// Pop the top count items of a scratch stack into an exactly sized arena array
+static void *pop_scratch(Parser *p, ToonBuffer *stack, size_t count, size_t size) {
+    if (stack->failed) return NULL;
+
+    stack->len -= count * size;
+    if (count == 0) return NULL;
+
+    void *items = toon_arena_alloc(p->arena, count * size);
+    if (!items) {
+        set_error(p, "Out of memory");
+        return NULL;
+    }
+    memcpy(items, stack->data + stack->len, count * size);
+    return items;
+}
+
+// Find the span of a quoted string and count its escapes. The cursor ends
+// after the closing quote; NULL on error.
+static const char *scan_quoted_string(Parser *p, size_t *escapes) {
     if (consume(p) != '"') {
         set_error(p, "Expected opening quote");
         return NULL;
     }
 
-    char buffer[4096];
-    char *buf = buffer;
-    size_t remaining = sizeof(buffer) - 1;
-
-    while (peek(p) != '"' && peek(p) != '\0') {
-        char c = consume(p);
-        if (c == '\\') {
-            c = consume(p);
-            switch (c) {
-                case 'n':  c = '\n'; break;
-                case 'r':  c = '\r'; break;
-                case 't':  c = '\t'; break;
-                case '"':  c = '"'; break;
-                case '\\': c = '\\'; break;
-                default:
-                    set_error(p, "Invalid escape sequence");
-                    return NULL;
-            }
-        }
-        if (remaining > 0) {
-            *buf++ = c;
-            remaining--;
+    const char *start = p->current;
+    const char *s = start;
+    *escapes = 0;
+
+    while ((s = toon_scan_until(s, p->end, &quote_stops)) < p->end && *s == '\\') {
+        char c = s + 1 < p->end ? s[1] : '\0';
+        if (c != 'n' && c != 'r' && c != 't' && c != '"' && c != '\\') {
+            p->current = s + 1;
+            set_error(p, "Invalid escape sequence");
+            return NULL;
         }
+        (*escapes)++;
+        s += 2;
     }
 
+    p->current = s;
     if (consume(p) != '"') {
         set_error(p, "Expected closing quote");
         return NULL;
     }
 
-    *buf = '\0';
-    return strdup(buffer);
+    return start;
 }
 
-// Parse an unquoted string (until delimiter)
-static char *parse_unquoted_string(Parser *p, const char *delimiters) {
-    char buffer[4096];
-    char *buf = buffer;
-    size_t remaining = sizeof(buffer) - 1;
-
-    while (peek(p) && !strchr(delimiters, peek(p))) {
-        if (remaining > 0) {
-            *buf++ = consume(p);
-            remaining--;
-        } else {
-            consume(p);
+// Unescape the checked span [in, end) into out, which has room for it,
+// and NUL-terminate it
+static void unescape_string(char *out, const char *in, const char *end) {
+    for (; in < end; in++) {
+        if (*in != '\\') {
+            *out++ = *in;
+            continue;
         }
-    }
-
-    *buf = '\0';
 
-    // Trim trailing whitespace
-    buf--;
-    while (buf >= buffer && isspace(*buf)) {
-        *buf-- = '\0';
+        switch (*++in) {
+            case 'n':  *out++ = '\n'; break;
+            case 'r':  *out++ = '\r'; break;
+            case 't':  *out++ = '\t'; break;
+            default:   *out++ = *in; break;  // '"' or '\\'
+        }
     }
-
-    return strdup(buffer);
+    *out = '\0';
 }
 
-// Forward declaration
-static ToonValue *parse_value(Parser *p);
-
-// Parse a number
-static ToonValue *parse_number(Parser *p) {
-    char buffer[64];
-    char *buf = buffer;
-    size_t remaining = sizeof(buffer) - 1;
-
-    // Handle negative numbers
-    if (peek(p) == '-') {
-        *buf++ = consume(p);
-        remaining--;
+// Build a node from an unquoted token: a keyword, a number if the whole
+// token is one, and a string otherwise
+static ToonValue *scalar_value(Parser *p, const char *str, size_t len) {
+    if (len == 4 && memcmp(str, "null", 4) == 0) {
+        return toon_value_null();
     }
 
-    // Parse digits
-    while (remaining > 0 && (isdigit(peek(p)) || peek(p) == '.')) {
-        *buf++ = consume(p);
-        remaining--;
+    if ((len == 4 && memcmp(str, "true", 4) == 0) || (len == 5 && memcmp(str, "false", 5) == 0)) {
+        return toon_value_boolean(str[0] == 't');
     }
 
-    *buf = '\0';
-
-    ToonValue *value = toon_value_create(TOON_NUMBER);
-    if (value) {
-        value->value.number = strtod(buffer, NULL);
+    if (toon_number_is_token(str, len)) {
+        ToonValue *value = toon_value_number(p->arena, toon_number_parse(str, len));
+        if (!value) set_error(p, "Out of memory");
+        return value;
     }
 
-    return value;
+    return new_string_value(p, str, len);
 }
 
-// Parse a tabular array
-static ToonValue *parse_tabular_array(Parser *p) {
-    // Format: [N,]{header1,header2,...}:
-    if (consume(p) != '[') {
-        set_error(p, "Expected '['");
-        return NULL;
-    }
+// Parse an unquoted token up to one of delimiters, without surrounding whitespace
+static ToonValue *unquoted_value(Parser *p, const ToonScanSet *delimiters) {
+    const char *start = p->current;
+    const char *end = scan_token(p, delimiters);
+    p->current = end;
 
-    // Parse row count
-    char count_buf[32];
-    int i = 0;
-    while (isdigit(peek(p)) && i < 31) {
-        count_buf[i++] = consume(p);
-    }
-    count_buf[i] = '\0';
-    size_t num_rows = atoi(count_buf);
+    trim_span(&start, &end);
+    return scalar_value(p, start, end - start);
+}
 
-    if (consume(p) != ',') {
-        set_error(p, "Expected ','");
-        return NULL;
-    }
+// Build a string node from a quoted string. Without escapes its span is
+// copied as is; otherwise it is unescaped in p->text first.
+static ToonValue *quoted_string_value(Parser *p) {
+    size_t escapes;
+    const char *start = scan_quoted_string(p, &escapes);
+    if (!start) return NULL;
 
-    if (consume(p) != ']') {
-        set_error(p, "Expected ']'");
-        return NULL;
-    }
+    size_t len = (p->current - 1) - start;  // Up to the closing quote
+    if (escapes == 0) return new_string_value(p, start, len);
 
-    if (consume(p) != '{') {
-        set_error(p, "Expected '{'");
+    toon_buffer_reset(&p->text);
+    if (!toon_buffer_reserve(&p->text, len)) {
+        set_error(p, "Out of memory");
         return NULL;
     }
+    unescape_string(p->text.data, start, start + len);
+    return new_string_value(p, p->text.data, len - escapes);
+}
+
+// Forward declaration
+static ToonValue *parse_value(Parser *p);
 
-    // Parse headers
-    char **headers = malloc(sizeof(char *) * 256);
+// Parse the headers and rows of a tabular array into the scratch arena
+// p->arena, then pack them into a columnar array in arena
+static ToonValue *parse_tabular_body(Parser *p, size_t num_rows, ToonArena *arena) {
+    // Parse headers onto the scratch stack
     size_t num_headers = 0;
 
-    while (peek(p) != '}' && num_headers < 256) {
+    while (peek(p) != '}' && peek(p) != '\0') {
         skip_whitespace(p);
 
-        // Parse header name
-        char header_buf[256];
-        int j = 0;
-        while (peek(p) != ',' && peek(p) != '}' && j < 255) {
-            header_buf[j++] = consume(p);
-        }
-        header_buf[j] = '\0';
-
-        // Trim whitespace
-        char *start = header_buf;
-        while (isspace(*start)) start++;
-        char *end = start + strlen(start) - 1;
-        while (end > start && isspace(*end)) *end-- = '\0';
+        // Parse header name, trimming whitespace
+        const char *start = p->current;
+        const char *end = scan_token(p, &header_stops);
+        p->current = end;
+        trim_span(&start, &end);
 
-        headers[num_headers++] = strdup(start);
+        char *header = new_string(p, start, end - start);
+        if (!header) break;
+        push_scratch(p, &p->values, &header, sizeof(char *));
+        num_headers++;
 
         skip_whitespace(p);
         if (peek(p) == ',') consume(p);
     }
 
+    char **headers = pop_scratch(p, &p->values, num_headers, sizeof(char *));
+    if (p->error) return NULL;
+
     if (consume(p) != '}') {
         set_error(p, "Expected '}'");
-        for (size_t i = 0; i < num_headers; i++) free(headers[i]);
-        free(headers);
         return NULL;
     }
 
     if (consume(p) != ':') {
         set_error(p, "Expected ':'");
-        for (size_t i = 0; i < num_headers; i++) free(headers[i]);
-        free(headers);
         return NULL;
     }
 
     skip_whitespace(p);
 
-    // Parse rows
-    ToonValue ***rows = malloc(sizeof(ToonValue **) * num_rows);
-    for (size_t row = 0; row < num_rows; row++) {
+    // Parse rows. Like array lengths, the declared row count is untrusted:
+    // cells are collected row-major on the scratch stack until it or the
+    // input runs out.
+    size_t cells_start = p->values.len;
+    size_t parsed_rows = 0;
+    for (size_t row = 0; row < num_rows && num_headers > 0 && peek(p) != '\0'; row++) {
         skip_whitespace(p);
-        rows[row] = malloc(sizeof(ToonValue *) * num_headers);
 
         for (size_t col = 0; col < num_headers; col++) {
             skip_whitespace(p);
 
             // Parse cell value
-            if (peek(p) == '"') {
-                char *str = parse_quoted_string(p);
-                rows[row][col] = toon_value_create(TOON_STRING);
-                rows[row][col]->value.string = str;
-            } else if (isdigit(peek(p)) || peek(p) == '-') {
-                rows[row][col] = parse_number(p);
-            } else {
-                char *str = parse_unquoted_string(p, ",\n\r");
-
-                // Check for keywords
-                if (strcmp(str, "null") == 0) {
-                    free(str);
-                    rows[row][col] = toon_value_create(TOON_NULL);
-                } else if (strcmp(str, "true") == 0) {
-                    free(str);
-                    rows[row][col] = toon_value_create(TOON_BOOLEAN);
-                    rows[row][col]->value.boolean = true;
-                } else if (strcmp(str, "false") == 0) {
-                    free(str);
-                    rows[row][col] = toon_value_create(TOON_BOOLEAN);
-                    rows[row][col]->value.boolean = false;
-                } else {
-                    rows[row][col] = toon_value_create(TOON_STRING);
-                    rows[row][col]->value.string = str;
-                }
-            }
+            ToonValue *cell = peek(p) == '"' ? quoted_string_value(p) : unquoted_value(p, &cell_stops);
+            if (!cell) return NULL;
+            push_scratch(p, &p->values, &cell, sizeof(ToonValue *));
+            if (p->error) return NULL;
 
             skip_whitespace(p);
             if (col < num_headers - 1 && peek(p) == ',') consume(p);
         }
 
+        parsed_rows++;
+
         skip_whitespace(p);
     }
 
-    // Create tabular array value
-    ToonValue *value = toon_value_create(TOON_TABULAR_ARRAY);
-    value->value.tabular.headers = headers;
-    value->value.tabular.num_headers = num_headers;
-    value->value.tabular.rows = rows;
-    value->value.tabular.num_rows = num_rows;
+    ToonValue *const *cells = (ToonValue *const *)(p->values.data + cells_start);
+    ToonValue *value = toon_tabular_create(arena, headers, num_headers, cells, parsed_rows);
+    p->values.len = cells_start;
 
+    if (!value) set_error(p, "Out of memory");
     return value;
 }
 
-// Parse a simple array
-static ToonValue *parse_simple_array(Parser *p) {
-    // Format: [N]: val1,val2,val3
+// Parse a tabular array
+static ToonValue *parse_tabular_array(Parser *p) {
+    // Format: [N,]{header1,header2,...}:
     if (consume(p) != '[') {
         set_error(p, "Expected '['");
         return NULL;
     }
 
-    char count_buf[32];
-    int i = 0;
-    while (isdigit(peek(p)) && i < 31) {
-        count_buf[i++] = consume(p);
+    // Parse row count
+    size_t num_rows = parse_count(p);
+
+    if (consume(p) != ',') {
+        set_error(p, "Expected ','");
+        return NULL;
     }
-    count_buf[i] = '\0';
-    size_t length = atoi(count_buf);
 
     if (consume(p) != ']') {
         set_error(p, "Expected ']'");
         return NULL;
     }
 
+    if (consume(p) != '{') {
+        set_error(p, "Expected '{'");
+        return NULL;
+    }
+
+    // Headers and cells are parsed into a scratch arena and then packed
+    // into columns in the document arena
+    ToonArena *arena = p->arena;
+    ToonArena *scratch = toon_arena_create(0);
+    if (!scratch) {
+        set_error(p, "Out of memory");
+        return NULL;
+    }
+    p->arena = scratch;
+
+    ToonValue *value = parse_tabular_body(p, num_rows, arena);
+
+    p->arena = arena;
+    toon_arena_destroy(scratch);
+    return value;
+}
+
+// Enter levels more containers, unless that nests deeper than the limit
+static bool descend(Parser *p, size_t levels) {
+    if (p->depth + levels > toon_max_depth()) {
+        set_error(p, "Nesting too deep");
+        return false;
+    }
+    p->depth += levels;
+    return true;
+}
+
+// Open the simple array at the cursor, "[N]: ", pushing its frame
+static bool open_array(Parser *p) {
+    if (consume(p) != '[') {
+        set_error(p, "Expected '['");
+        return false;
+    }
+
+    ArrayFrame frame = {.length = parse_count(p)};
+
+    if (consume(p) != ']') {
+        set_error(p, "Expected ']'");
+        return false;
+    }
+
     if (consume(p) != ':') {
         set_error(p, "Expected ':'");
-        return NULL;
+        return false;
     }
 
     skip_whitespace(p);
 
-    ToonValue **elements = malloc(sizeof(ToonValue *) * length);
-    for (size_t j = 0; j < length; j++) {
-        skip_whitespace(p);
-        elements[j] = parse_value(p);
-        skip_whitespace(p);
-        if (j < length - 1 && peek(p) == ',') consume(p);
+    if (!descend(p, 1)) return false;
+    if (!toon_stack_push(&p->frames, &frame, sizeof(frame))) {
+        set_error(p, "Out of memory");
+        return false;
     }
+    return true;
+}
+
+// Whether the innermost array has more elements to parse
+static bool array_continues(Parser *p) {
+    const ArrayFrame *top = toon_stack_top(&p->frames, sizeof(ArrayFrame));
+    return top->count < top->length && peek(p) != '\0';
+}
+
+// Count an element of the innermost array and move past its comma
+static void array_element_done(Parser *p) {
+    ArrayFrame *top = toon_stack_top(&p->frames, sizeof(ArrayFrame));
+    top->count++;
 
-    ToonValue *value = toon_value_create(TOON_ARRAY);
+    skip_whitespace(p);
+    if (top->count < top->length && peek(p) == ',') consume(p);
+}
+
+// Pop the innermost array's frame and return how many elements it has
+static size_t close_array(Parser *p) {
+    const ArrayFrame *top = toon_stack_top(&p->frames, sizeof(ArrayFrame));
+    size_t count = top->count;
+    toon_stack_pop(&p->frames, sizeof(ArrayFrame));
+    p->depth--;
+    return count;
+}
+
+// Build the node of the innermost array out of its elements on the
+// scratch stack; the declared length is untrusted, so the node is sized
+// from what was actually parsed
+static ToonValue *build_array(Parser *p) {
+    size_t count = close_array(p);
+    ToonValue **elements = pop_scratch(p, &p->values, count, sizeof(ToonValue *));
+    if (p->error) return NULL;
+
+    ToonValue *value = new_value(p, TOON_ARRAY);
+    if (!value) return NULL;
     value->value.array.elements = elements;
-    value->value.array.length = length;
+    value->value.array.length = count;
+    value->value.array.capacity = count;
 
     return value;
 }
 
 // Parse an object
 static ToonValue *parse_object(Parser *p) {
-    ToonObjectEntry *entries = malloc(sizeof(ToonObjectEntry) * 256);
     size_t length = 0;
+    if (!descend(p, 1)) return NULL;
 
-    while (peek(p) != '\0' && length < 256) {
+    while (peek(p) != '\0') {
         skip_whitespace(p);
 
         // Check for end of object
         if (peek(p) == '\0') break;
 
-        // Parse key
-        char key_buf[256];
-        int i = 0;
-        while (peek(p) != ':' && peek(p) != '\0' && i < 255) {
-            key_buf[i++] = consume(p);
-        }
-        key_buf[i] = '\0';
-
-        // Trim whitespace from key
-        char *start = key_buf;
-        while (isspace(*start)) start++;
-        char *end = start + strlen(start) - 1;
-        while (end > start && isspace(*end)) *end-- = '\0';
+        // Parse key, trimming whitespace
+        const char *start = p->current;
+        const char *end = scan_token(p, &key_stops);
+        p->current = end;
+        trim_span(&start, &end);
 
         if (peek(p) != ':') break;
         consume(p);  // Consume ':'
@@ -364,115 +466,458 @@ static ToonValue *parse_object(Parser *p) {
         skip_whitespace(p);
 
         // Parse value
-        ToonValue *val = parse_value(p);
+        ToonObjectEntry entry;
+        entry.key = new_key(p, start, end - start);
+        entry.value = entry.key ? parse_value(p) : NULL;
+        if (!entry.value) break;
 
-        entries[length].key = strdup(start);
-        entries[length].value = val;
+        push_scratch(p, &p->entries, &entry, sizeof(ToonObjectEntry));
+        if (p->error) break;
         length++;
 
         skip_whitespace(p);
         if (peek(p) == '\n') consume(p);
     }
 
-    ToonValue *value = toon_value_create(TOON_OBJECT);
+    ToonObjectEntry *entries = pop_scratch(p, &p->entries, length, sizeof(ToonObjectEntry));
+    if (p->error) return NULL;
+    p->depth--;
+
+    ToonValue *value = new_value(p, TOON_OBJECT);
+    if (!value) return NULL;
     value->value.object.entries = entries;
     value->value.object.length = length;
+    value->value.object.capacity = length;
+    toon_object_index_build(p->arena, value);
 
     return value;
 }
 
-// Parse any value
-static ToonValue *parse_value(Parser *p) {
-    skip_whitespace(p);
+// Whether the array header at the cursor is a tabular one, "[N,]"
+static bool at_tabular_array(Parser *p) {
+    const char *lookahead = p->current + 1;
+    while (lookahead < p->end && isdigit((unsigned char)*lookahead)) lookahead++;
+    return lookahead < p->end && *lookahead == ',';
+}
 
+// Parse a value that is not a simple array
+static ToonValue *parse_leaf(Parser *p) {
     char c = peek(p);
 
     // Quoted string
     if (c == '"') {
-        char *str = parse_quoted_string(p);
-        ToonValue *value = toon_value_create(TOON_STRING);
-        value->value.string = str;
-        return value;
+        return quoted_string_value(p);
     }
 
-    // Number
-    if (isdigit(c) || c == '-') {
-        return parse_number(p);
+    // Tabular array, whose rows nest a level below it
+    if (c == '[') {
+        if (!descend(p, 2)) return NULL;
+        ToonValue *value = parse_tabular_array(p);
+        p->depth -= 2;
+        return value;
     }
 
-    // Array (tabular or simple)
-    if (c == '[') {
-        // Peek ahead to determine array type
-        const char *lookahead = p->current + 1;
-        while (isdigit(*lookahead)) lookahead++;
+    // Number, keyword or unquoted string
+    return unquoted_value(p, &value_stops);
+}
 
-        if (*lookahead == ',') {
-            return parse_tabular_array(p);
+// Parse any value. Simple arrays, the only values that nest, are parsed
+// on the frame stack, so the depth of the input costs heap rather than C
+// stack.
+static ToonValue *parse_value(Parser *p) {
+    size_t base = p->frames.len;
+
+    for (;;) {
+        skip_whitespace(p);
+
+        ToonValue *value;
+        if (peek(p) == '[' && !at_tabular_array(p)) {
+            // Format: [N]: val1,val2,val3
+            if (!open_array(p)) return NULL;
+            if (array_continues(p)) continue;
+            value = build_array(p);
         } else {
-            return parse_simple_array(p);
+            value = parse_leaf(p);
         }
-    }
 
-    // Unquoted string or keyword
-    char *str = parse_unquoted_string(p, ",\n\r:");
+        // Hand the value to the array it is an element of, and close every
+        // array that it completes
+        for (;;) {
+            if (!value || p->frames.len == base) return value;
 
-    if (strcmp(str, "null") == 0) {
-        free(str);
-        return toon_value_create(TOON_NULL);
-    } else if (strcmp(str, "true") == 0) {
-        free(str);
-        ToonValue *value = toon_value_create(TOON_BOOLEAN);
-        value->value.boolean = true;
-        return value;
-    } else if (strcmp(str, "false") == 0) {
-        free(str);
-        ToonValue *value = toon_value_create(TOON_BOOLEAN);
-        value->value.boolean = false;
-        return value;
+            push_scratch(p, &p->values, &value, sizeof(ToonValue *));
+            if (p->error) return NULL;
+            array_element_done(p);
+
+            if (array_continues(p)) break;
+            value = build_array(p);
+        }
     }
+}
 
-    ToonValue *value = toon_value_create(TOON_STRING);
-    value->value.string = str;
-    return value;
+// Check if the first line looks like an object (key: value format). The
+// colon closing an array header, after ']' or '}', does not count.
+static bool looks_like_object(Parser *p) {
+    for (const char *lookahead = p->current; lookahead < p->end && *lookahead && *lookahead != '\n';
+         lookahead++) {
+        if (*lookahead == ':' && lookahead > p->current &&
+            lookahead[-1] != ']' && lookahead[-1] != '}') {
+            return true;
+        }
+    }
+    return false;
 }
 
-// Public decoding function
-ToonValue *toon_decode(const char *toon_string, char **error) {
+// Check the length of the input against the module's limit
+static bool check_input(Parser *p) {
+    if (toon_max_input() && (size_t)(p->end - p->input) > toon_max_input()) {
+        set_error(p, "Input too large");
+        return false;
+    }
+    return true;
+}
+
+// Decode len bytes of TOON text. Nodes are allocated in arena; on error
+// everything allocated by this call is released again, and nothing is
+// added to the intern pool.
+ToonValue *toon_decode_len(ToonArena *arena, const char *toon_string, size_t len, char **error) {
     Parser p = {
         .input = toon_string,
         .current = toon_string,
-        .line = 1,
-        .column = 0,
-        .error = NULL
+        .end = toon_string + len,
+        .error = NULL,
+        .arena = arena
     };
+    toon_buffer_init(&p.values, 0);
+    toon_buffer_init(&p.entries, 0);
+    toon_buffer_init(&p.text, 0);
+    toon_buffer_init(&p.frames, 0);
+
+    ToonArenaMark mark = toon_arena_mark(arena);
+    ToonInternBatch batch;
+    toon_intern_begin(arena, &batch);
 
     skip_whitespace(&p);
 
     // Determine if this is an object or a single value
-    ToonValue *result;
-
-    // Check if it looks like an object (key: value format)
-    const char *lookahead = p.current;
-    bool looks_like_object = false;
-    while (*lookahead && *lookahead != '\n') {
-        if (*lookahead == ':' && *(lookahead - 1) != ']') {
-            looks_like_object = true;
-            break;
-        }
-        lookahead++;
+    ToonValue *result = NULL;
+    if (check_input(&p)) {
+        result = looks_like_object(&p) ? parse_object(&p) : parse_value(&p);
     }
 
-    if (looks_like_object) {
-        result = parse_object(&p);
-    } else {
-        result = parse_value(&p);
-    }
+    toon_buffer_free(&p.values);
+    toon_buffer_free(&p.entries);
+    toon_buffer_free(&p.text);
+    toon_buffer_free(&p.frames);
 
-    if (p.error) {
+    bool ok = !p.error && result;
+    toon_intern_end(arena, &batch, ok);
+    if (!ok) {
+        if (!p.error) set_error(&p, "Out of memory");
         *error = p.error;
-        if (result) toon_value_free(result);
+        toon_arena_rewind(arena, mark);
         return NULL;
     }
 
     return result;
 }
+
+// Decode a NUL-terminated TOON string
+ToonValue *toon_decode(ToonArena *arena, const char *toon_string, char **error) {
+    return toon_decode_len(arena, toon_string, strlen(toon_string), error);
+}
+
+// Streaming TOON to JSON text
+// ============================================================================
+
+// Writes the text toon_to_json gives for the tree toon_decode_len builds,
+// in the same single pass and without building it. Only a table's headers
+// are kept, prerendered, while its rows are written; memory is the output,
+// the longest token and the nesting depth.
+
+static void stream_value(Parser *p);
+
+// Write the span [str, str + len) to dest as a JSON string
+static void stream_string(Parser *p, ToonBuffer *dest, const char *str, size_t len) {
+    toon_buffer_reset(&p->text);
+    toon_buffer_append(&p->text, str, len);
+    toon_buffer_putc(&p->text, '\0');
+    if (p->text.failed) {
+        set_error(p, "Out of memory");
+        return;
+    }
+
+    ToonValue value = {.type = TOON_STRING, .value.string = p->text.data};
+    toon_to_json_to(dest, &value);
+}
+
+// Mirror of scalar_value
+static void stream_scalar(Parser *p, const char *str, size_t len) {
+    ToonValue value = {.type = TOON_NULL};
+
+    if (len == 4 && memcmp(str, "null", 4) == 0) {
+        value.type = TOON_NULL;
+    } else if ((len == 4 && memcmp(str, "true", 4) == 0) || (len == 5 && memcmp(str, "false", 5) == 0)) {
+        value.type = TOON_BOOLEAN;
+        value.value.boolean = (str[0] == 't');
+    } else if (toon_number_is_token(str, len)) {
+        value.type = TOON_NUMBER;
+        value.value.number = toon_number_parse(str, len);
+    } else {
+        stream_string(p, p->out, str, len);
+        return;
+    }
+
+    toon_to_json_to(p->out, &value);
+}
+
+// Mirror of unquoted_value
+static void stream_unquoted(Parser *p, const ToonScanSet *delimiters) {
+    const char *start = p->current;
+    const char *end = scan_token(p, delimiters);
+    p->current = end;
+
+    trim_span(&start, &end);
+    stream_scalar(p, start, end - start);
+}
+
+// Mirror of quoted_string_value; the span is unescaped in place in p->text
+static void stream_quoted_string(Parser *p) {
+    size_t escapes;
+    const char *start = scan_quoted_string(p, &escapes);
+    if (!start) return;
+
+    size_t len = (p->current - 1) - start;
+    toon_buffer_reset(&p->text);
+    toon_buffer_append(&p->text, start, len);
+    toon_buffer_putc(&p->text, '\0');
+    if (p->text.failed) {
+        set_error(p, "Out of memory");
+        return;
+    }
+    if (escapes > 0) unescape_string(p->text.data, p->text.data, p->text.data + len);
+
+    ToonValue value = {.type = TOON_STRING, .value.string = p->text.data};
+    toon_to_json_to(p->out, &value);
+}
+
+// Mirror of parse_tabular_body. Each header is rendered once as its
+// "name": prefix; p->values holds where each prefix ends.
+static void stream_tabular_body(Parser *p, size_t num_rows, ToonBuffer *names) {
+    size_t num_headers = 0;
+
+    while (peek(p) != '}' && peek(p) != '\0') {
+        skip_whitespace(p);
+
+        const char *start = p->current;
+        const char *end = scan_token(p, &header_stops);
+        p->current = end;
+        trim_span(&start, &end);
+
+        stream_string(p, names, start, end - start);
+        toon_buffer_putc(names, ':');
+        push_scratch(p, &p->values, &names->len, sizeof(size_t));
+        if (names->failed) set_error(p, "Out of memory");
+        if (p->error) return;
+        num_headers++;
+
+        skip_whitespace(p);
+        if (peek(p) == ',') consume(p);
+    }
+
+    if (consume(p) != '}') {
+        set_error(p, "Expected '}'");
+        return;
+    }
+
+    if (consume(p) != ':') {
+        set_error(p, "Expected ':'");
+        return;
+    }
+
+    skip_whitespace(p);
+
+    const size_t *ends = (const size_t *)p->values.data;
+    toon_buffer_putc(p->out, '[');
+    for (size_t row = 0; row < num_rows && num_headers > 0 && peek(p) != '\0'; row++) {
+        skip_whitespace(p);
+        if (row > 0) toon_buffer_putc(p->out, ',');
+        toon_buffer_putc(p->out, '{');
+
+        for (size_t col = 0; col < num_headers; col++) {
+            skip_whitespace(p);
+
+            size_t name_start = col > 0 ? ends[col - 1] : 0;
+            if (col > 0) toon_buffer_putc(p->out, ',');
+            toon_buffer_append(p->out, names->data + name_start, ends[col] - name_start);
+
+            if (peek(p) == '"') {
+                stream_quoted_string(p);
+            } else {
+                stream_unquoted(p, &cell_stops);
+            }
+            if (p->error) return;
+
+            skip_whitespace(p);
+            if (col < num_headers - 1 && peek(p) == ',') consume(p);
+        }
+
+        toon_buffer_putc(p->out, '}');
+        skip_whitespace(p);
+    }
+    toon_buffer_putc(p->out, ']');
+}
+
+// Mirror of parse_tabular_array
+static void stream_tabular_array(Parser *p) {
+    if (consume(p) != '[') {
+        set_error(p, "Expected '['");
+        return;
+    }
+
+    size_t num_rows = parse_count(p);
+
+    if (consume(p) != ',') {
+        set_error(p, "Expected ','");
+        return;
+    }
+
+    if (consume(p) != ']') {
+        set_error(p, "Expected ']'");
+        return;
+    }
+
+    if (consume(p) != '{') {
+        set_error(p, "Expected '{'");
+        return;
+    }
+
+    // Cells are scalars, so no other table is open while this one is
+    ToonBuffer names;
+    toon_buffer_init(&names, 0);
+    stream_tabular_body(p, num_rows, &names);
+    toon_buffer_free(&names);
+    p->values.len = 0;
+}
+
+// Mirror of parse_object
+static void stream_object(Parser *p) {
+    size_t length = 0;
+    if (!descend(p, 1)) return;
+
+    toon_buffer_putc(p->out, '{');
+    while (peek(p) != '\0') {
+        skip_whitespace(p);
+
+        if (peek(p) == '\0') break;
+
+        const char *start = p->current;
+        const char *end = scan_token(p, &key_stops);
+        p->current = end;
+        trim_span(&start, &end);
+
+        if (peek(p) != ':') break;
+        consume(p);
+
+        skip_whitespace(p);
+
+        if (length > 0) toon_buffer_putc(p->out, ',');
+        stream_string(p, p->out, start, end - start);
+        toon_buffer_putc(p->out, ':');
+        if (!p->error) stream_value(p);
+        if (p->error) return;
+        length++;
+
+        skip_whitespace(p);
+        if (peek(p) == '\n') consume(p);
+    }
+    toon_buffer_putc(p->out, '}');
+    p->depth--;
+}
+
+// Mirror of parse_leaf
+static void stream_leaf(Parser *p) {
+    char c = peek(p);
+
+    if (c == '"') {
+        stream_quoted_string(p);
+    } else if (c == '[') {
+        if (!descend(p, 2)) return;
+        stream_tabular_array(p);
+        p->depth -= 2;
+    } else {
+        stream_unquoted(p, &value_stops);
+    }
+}
+
+// Mirror of parse_value
+static void stream_value(Parser *p) {
+    size_t base = p->frames.len;
+
+    for (;;) {
+        skip_whitespace(p);
+
+        // Every element after an array's first follows a comma
+        const ArrayFrame *top = toon_stack_top(&p->frames, sizeof(ArrayFrame));
+        if (p->frames.len > base && top->count > 0) toon_buffer_putc(p->out, ',');
+
+        if (peek(p) == '[' && !at_tabular_array(p)) {
+            if (!open_array(p)) return;
+            toon_buffer_putc(p->out, '[');
+            if (array_continues(p)) continue;
+            close_array(p);
+            toon_buffer_putc(p->out, ']');
+        } else {
+            stream_leaf(p);
+            if (p->error) return;
+        }
+
+        // Count the value in its array, and close every array it completes
+        for (;;) {
+            if (p->frames.len == base) return;
+
+            array_element_done(p);
+            if (array_continues(p)) break;
+            close_array(p);
+            toon_buffer_putc(p->out, ']');
+        }
+    }
+}
+
+// Convert len bytes of TOON text to JSON text, appended to out. On error
+// nothing is appended and *error is set, as for toon_decode_len.
+bool toon_transcode_toon(ToonBuffer *out, const char *toon_string, size_t len, char **error) {
+    Parser p = {
+        .input = toon_string,
+        .current = toon_string,
+        .end = toon_string + len,
+        .error = NULL,
+        .out = out
+    };
+    toon_buffer_init(&p.values, 0);
+    toon_buffer_init(&p.text, 0);
+    toon_buffer_init(&p.frames, 0);
+
+    size_t start = out->len;
+
+    skip_whitespace(&p);
+    if (check_input(&p)) {
+        if (looks_like_object(&p)) {
+            stream_object(&p);
+        } else {
+            stream_value(&p);
+        }
+    }
+
+    toon_buffer_free(&p.values);
+    toon_buffer_free(&p.text);
+    toon_buffer_free(&p.frames);
+
+    if (p.error || out->failed) {
+        set_error(&p, "Out of memory");
+        *error = p.error;
+        if (!out->failed) out->len = start;
+        return false;
+    }
+    return true;
+}
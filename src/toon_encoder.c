@@ -11,14 +11,12 @@ static bool needs_quoting(const char *str) {
         return true;
     }
 
-    // Check if it looks like a number
-    char *endptr;
-    strtod(str, &endptr);
-    if (*endptr == '\0') return true;  // It's a valid number
-
-    // Check for leading/trailing whitespace or special characters
+    // Check if it would decode as a number
     size_t len = strlen(str);
-    if (isspace(str[0]) || isspace(str[len - 1])) return true;
+    if (toon_number_is_token(str, len)) return true;
+
+    // Check for leading/trailing whitespace or a leading quote
+    if (isspace((unsigned char)str[0]) || isspace((unsigned char)str[len - 1]) || str[0] == '"') return true;
 
     // Check for structural characters
     for (const char *p = str; *p; p++) {
@@ -32,236 +30,292 @@ static bool needs_quoting(const char *str) {
     return false;
 }
 
-// Helper function to escape string for TOON
-static char *escape_string(const char *str) {
-    size_t len = strlen(str);
-    size_t escaped_len = len * 2 + 3;  // Worst case: all chars escaped + quotes + null
-    char *escaped = malloc(escaped_len);
-    if (!escaped) return NULL;
-
-    char *p = escaped;
-    *p++ = '"';
+// Append a quoted, escaped string
+static void append_escaped(ToonBuffer *buf, const char *str) {
+    toon_buffer_putc(buf, '"');
 
+    const char *run = str;
     for (const char *s = str; *s; s++) {
+        char escape;
         switch (*s) {
-            case '"':  *p++ = '\\'; *p++ = '"'; break;
-            case '\\': *p++ = '\\'; *p++ = '\\'; break;
-            case '\n': *p++ = '\\'; *p++ = 'n'; break;
-            case '\r': *p++ = '\\'; *p++ = 'r'; break;
-            case '\t': *p++ = '\\'; *p++ = 't'; break;
-            default:   *p++ = *s; break;
+            case '"':  escape = '"'; break;
+            case '\\': escape = '\\'; break;
+            case '\n': escape = 'n'; break;
+            case '\r': escape = 'r'; break;
+            case '\t': escape = 't'; break;
+            default:   continue;
         }
+
+        // Copy the unescaped run in one go, then the escape pair
+        toon_buffer_append(buf, run, s - run);
+        toon_buffer_putc(buf, '\\');
+        toon_buffer_putc(buf, escape);
+        run = s + 1;
+    }
+
+    toon_buffer_append_str(buf, run);
+    toon_buffer_putc(buf, '"');
+}
+
+// Append indentation for the given nesting level
+static void append_indent(ToonBuffer *buf, int level) {
+    toon_buffer_fill(buf, ' ', level * 2);  // 2 spaces per indent level
+}
+
+// Encode a value that has no children to walk: a scalar, or a missing value
+static void encode_scalar(ToonBuffer *buf, const ToonValue *value) {
+    if (!value) {
+        toon_buffer_append(buf, "null", 4);
+        return;
     }
 
-    *p++ = '"';
-    *p = '\0';
+    switch (value->type) {
+        case TOON_BOOLEAN:
+            if (value->value.boolean) {
+                toon_buffer_append(buf, "true", 4);
+            } else {
+                toon_buffer_append(buf, "false", 5);
+            }
+            break;
+
+        case TOON_NUMBER:
+            toon_buffer_append_number(buf, value->value.number);
+            break;
+
+        case TOON_STRING:
+            if (needs_quoting(value->value.string)) {
+                append_escaped(buf, value->value.string);
+            } else {
+                toon_buffer_append_str(buf, value->value.string);
+            }
+            break;
+
+        default:
+            toon_buffer_append(buf, "null", 4);
+            break;
+    }
+}
 
-    return escaped;
+static size_t element_tokens(const void *array, size_t i) {
+    return toon_estimate_tokens(((const ToonValue *)array)->value.array.elements[i]);
 }
 
-// Helper function to create indentation
-static char *make_indent(int level) {
-    int spaces = level * 2;  // 2 spaces per indent level
-    char *indent = malloc(spaces + 1);
-    if (!indent) return NULL;
-    memset(indent, ' ', spaces);
-    indent[spaces] = '\0';
-    return indent;
+static size_t row_tokens(const void *tab, size_t i) {
+    return toon_tabular_row_tokens(tab, i);
 }
 
-// Forward declaration for recursive encoding
-static char *encode_value(ToonValue *value, int indent_level, bool inline_mode);
+// Spend a budget on a container of len elements that does not fit whole:
+// its own overhead, then whole elements from the kept end for as long as
+// they fit. Only the kept elements are counted.
+static void budget_range(ToonBudget *budget, size_t overhead, const void *container, size_t len,
+                         size_t (*cost)(const void *, size_t), size_t *first, size_t *count) {
+    budget->remaining -= overhead < budget->remaining ? overhead : budget->remaining;
+
+    size_t kept = 0;
+    while (kept < len) {
+        size_t tokens = cost(container, budget->keep_tail ? len - 1 - kept : kept);
+        if (tokens > budget->remaining) break;
+        budget->remaining -= tokens;
+        kept++;
+    }
+
+    *first = budget->keep_tail ? len - kept : 0;
+    *count = kept;
+}
 
 // Encode a tabular array
-static char *encode_tabular_array(ToonTabularArray *tab, int indent_level) {
-    char *result = malloc(65536);  // Start with 64KB buffer
-    if (!result) return NULL;
-
-    char *indent = make_indent(indent_level);
-    if (!indent) {
-        free(result);
-        return NULL;
-    }
+static void encode_tabular_array(ToonBuffer *buf, ToonTabularArray *tab, int indent_level, ToonBudget *budget) {
+    size_t first = 0;
+    size_t count = tab->num_rows;
+    if (budget) budget_range(budget, toon_tabular_header_tokens(tab), tab, tab->num_rows, row_tokens, &first, &count);
 
     // Format: [num_rows,]{header1,header2,...}:
-    char *p = result;
-    p += sprintf(p, "[%zu,]{", tab->num_rows);
+    toon_buffer_putc(buf, '[');
+    toon_buffer_append_size(buf, count);
+    toon_buffer_append(buf, ",]{", 3);
 
     for (size_t i = 0; i < tab->num_headers; i++) {
-        if (i > 0) *p++ = ',';
-        p += sprintf(p, "%s", tab->headers[i]);
+        if (i > 0) toon_buffer_putc(buf, ',');
+        toon_buffer_append_str(buf, tab->headers[i]);
     }
-    p += sprintf(p, "}:\n");
+    toon_buffer_append(buf, "}:\n", 3);
 
     // Encode each row
-    for (size_t row = 0; row < tab->num_rows; row++) {
-        p += sprintf(p, "%s", indent);
+    ToonValue scratch;
+    for (size_t row = first; row < first + count; row++) {
+        append_indent(buf, indent_level);
         for (size_t col = 0; col < tab->num_headers; col++) {
-            if (col > 0) *p++ = ',';
-            char *cell = encode_value(tab->rows[row][col], 0, true);
-            if (cell) {
-                p += sprintf(p, "%s", cell);
-                free(cell);
-            }
+            if (col > 0) toon_buffer_putc(buf, ',');
+            encode_scalar(buf, toon_tabular_cell(tab, row, col, &scratch));
         }
-        *p++ = '\n';
+        toon_buffer_putc(buf, '\n');
     }
-
-    free(indent);
-    return result;
 }
 
-// Encode a simple array
-static char *encode_array(ToonValue *value, int indent_level, bool inline_mode) {
-    size_t len = value->value.array.length;
-
-    // Check if all elements are primitives (for compact format)
-    bool all_primitives = true;
-    for (size_t i = 0; i < len; i++) {
-        ToonType type = value->value.array.elements[i]->type;
-        if (type == TOON_OBJECT || type == TOON_ARRAY || type == TOON_TABULAR_ARRAY) {
-            all_primitives = false;
-            break;
+// An array or object whose children are being encoded. The encoder walks
+// the tree on its own stack of these, so the depth of a document costs
+// heap rather than C stack.
+typedef struct {
+    ToonValue *value;
+    ToonBudget *budget;     // Budget its children are cut to, or NULL
+    size_t next;            // Next child
+    size_t end;             // One past the last child encoded
+    int indent_level;
+    bool inline_mode;
+    bool open;              // A child was started and its line is still open
+} EncodeFrame;
+
+// Start encoding a value. Scalars, tables and arrays of scalars are
+// written out; any other array or object is pushed for its children to be
+// encoded in turn. Within a budget, a value that fits is encoded whole and
+// a scalar that does not uses up what is left.
+static void encode_value(ToonBuffer *buf, ToonBuffer *stack, ToonValue *value, int indent_level,
+                         bool inline_mode, ToonBudget *budget) {
+    if (budget && value) {
+        size_t tokens = toon_estimate_tokens(value);
+        if (tokens <= budget->remaining) {
+            budget->remaining -= tokens;
+            budget = NULL;
+        } else if (value->type != TOON_ARRAY && value->type != TOON_OBJECT &&
+                   value->type != TOON_TABULAR_ARRAY) {
+            budget->remaining = 0;
         }
     }
 
-    char *result = malloc(65536);
-    if (!result) return NULL;
-    char *p = result;
-
-    if (all_primitives) {
-        // Compact format: [N]: val1,val2,val3
-        p += sprintf(p, "[%zu]: ", len);
-        for (size_t i = 0; i < len; i++) {
-            if (i > 0) *p++ = ',';
-            char *elem = encode_value(value->value.array.elements[i], 0, true);
-            if (elem) {
-                p += sprintf(p, "%s", elem);
-                free(elem);
-            }
-        }
-    } else {
-        // Multi-line format for complex arrays
-        p += sprintf(p, "[%zu]:\n", len);
-        char *indent = make_indent(indent_level + 1);
-        for (size_t i = 0; i < len; i++) {
-            p += sprintf(p, "%s- ", indent);
-            char *elem = encode_value(value->value.array.elements[i], indent_level + 1, false);
-            if (elem) {
-                p += sprintf(p, "%s\n", elem);
-                free(elem);
-            }
-        }
-        free(indent);
+    if (!value || (value->type != TOON_ARRAY && value->type != TOON_OBJECT &&
+                   value->type != TOON_TABULAR_ARRAY)) {
+        encode_scalar(buf, value);
+        return;
     }
 
-    return result;
-}
-
-// Encode an object
-static char *encode_object(ToonValue *value, int indent_level, bool inline_mode) {
-    char *result = malloc(65536);
-    if (!result) return NULL;
-    char *p = result;
-
-    char *indent = make_indent(indent_level);
-    if (!indent) {
-        free(result);
-        return NULL;
+    if (value->type == TOON_TABULAR_ARRAY) {
+        encode_tabular_array(buf, &value->value.tabular, indent_level, budget);
+        return;
     }
 
-    for (size_t i = 0; i < value->value.object.length; i++) {
-        ToonObjectEntry *entry = &value->value.object.entries[i];
-
-        if (!inline_mode && i > 0) {
-            p += sprintf(p, "%s", indent);
-        } else if (inline_mode && i > 0) {
-            *p++ = ',';
-            *p++ = ' ';
+    EncodeFrame frame = {
+        .value = value,
+        .indent_level = indent_level,
+        .inline_mode = inline_mode,
+        .budget = budget
+    };
+
+    if (value->type == TOON_ARRAY) {
+        // Elements within a budget are kept or dropped whole
+        size_t first = 0;
+        size_t len = value->value.array.length;
+        if (budget) budget_range(budget, 2, value, value->value.array.length, element_tokens, &first, &len);
+        ToonValue **elements = value->value.array.elements + first;
+
+        // Check if all elements are primitives (for compact format)
+        bool all_primitives = true;
+        for (size_t i = 0; i < len; i++) {
+            ToonType type = elements[i]->type;
+            if (type == TOON_OBJECT || type == TOON_ARRAY || type == TOON_TABULAR_ARRAY) {
+                all_primitives = false;
+                break;
+            }
         }
 
-        p += sprintf(p, "%s: ", entry->key);
+        toon_buffer_putc(buf, '[');
+        toon_buffer_append_size(buf, len);
 
-        char *val = encode_value(entry->value, indent_level + 1, false);
-        if (val) {
-            p += sprintf(p, "%s", val);
-            free(val);
+        if (all_primitives) {
+            // Compact format: [N]: val1,val2,val3
+            toon_buffer_append(buf, "]: ", 3);
+            for (size_t i = 0; i < len; i++) {
+                if (i > 0) toon_buffer_putc(buf, ',');
+                encode_scalar(buf, elements[i]);
+            }
+            return;
         }
 
-        if (!inline_mode) *p++ = '\n';
+        // Multi-line format for complex arrays
+        toon_buffer_append(buf, "]:\n", 3);
+        frame.budget = NULL;
+        frame.next = first;
+        frame.end = first + len;
+    } else {
+        frame.end = value->value.object.length;
     }
 
-    free(indent);
-    return result;
+    if (!toon_stack_push(stack, &frame, sizeof(frame))) buf->failed = true;
 }
 
-// Main value encoder
-static char *encode_value(ToonValue *value, int indent_level, bool inline_mode) {
-    if (!value) return strdup("null");
-
-    char *result = malloc(4096);
-    if (!result) return NULL;
+// Encode a value and everything under it
+static void encode_tree(ToonBuffer *buf, ToonValue *value, int indent_level, ToonBudget *budget) {
+    ToonBuffer stack = {0};
+    encode_value(buf, &stack, value, indent_level, false, budget);
 
-    switch (value->type) {
-        case TOON_NULL:
-            strcpy(result, "null");
-            break;
-
-        case TOON_BOOLEAN:
-            strcpy(result, value->value.boolean ? "true" : "false");
-            break;
+    EncodeFrame *top;
+    while (!buf->failed && (top = toon_stack_top(&stack, sizeof(EncodeFrame)))) {
+        bool is_array = top->value->type == TOON_ARRAY;
 
-        case TOON_NUMBER: {
-            // Format number, removing unnecessary trailing zeros
-            double num = value->value.number;
-            if (num == (long)num) {
-                sprintf(result, "%ld", (long)num);
-            } else {
-                sprintf(result, "%.10g", num);
-            }
-            break;
+        // Close the line of the child just encoded
+        if (top->open) {
+            if (is_array || !top->inline_mode) toon_buffer_putc(buf, '\n');
+            top->open = false;
         }
 
-        case TOON_STRING: {
-            if (needs_quoting(value->value.string)) {
-                char *escaped = escape_string(value->value.string);
-                if (escaped) {
-                    strcpy(result, escaped);
-                    free(escaped);
-                }
-            } else {
-                strcpy(result, value->value.string);
-            }
-            break;
+        if (top->next == top->end) {
+            toon_stack_pop(&stack, sizeof(EncodeFrame));
+            continue;
         }
 
-        case TOON_ARRAY: {
-            free(result);
-            result = encode_array(value, indent_level, inline_mode);
-            break;
-        }
+        size_t i = top->next++;
+        int indent = top->indent_level + 1;
+        ToonBudget *budget = top->budget;
+        ToonValue *child;
+        top->open = true;
+
+        if (is_array) {
+            append_indent(buf, indent);
+            toon_buffer_append(buf, "- ", 2);
+            child = top->value->value.array.elements[i];
+        } else {
+            // Every key is kept within a budget; their values are cut in
+            // turn once it runs out
+            ToonObjectEntry *entry = &top->value->value.object.entries[i];
+
+            if (!top->inline_mode && i > 0) {
+                append_indent(buf, top->indent_level);
+            } else if (top->inline_mode && i > 0) {
+                toon_buffer_append(buf, ", ", 2);
+            }
 
-        case TOON_OBJECT: {
-            free(result);
-            result = encode_object(value, indent_level, inline_mode);
-            break;
-        }
+            toon_buffer_append_str(buf, entry->key);
+            toon_buffer_append(buf, ": ", 2);
 
-        case TOON_TABULAR_ARRAY: {
-            free(result);
-            result = encode_tabular_array(&value->value.tabular, indent_level);
-            break;
+            if (budget) {
+                size_t tokens = toon_entry_tokens(entry->key);
+                budget->remaining -= tokens < budget->remaining ? tokens : budget->remaining;
+            }
+            child = entry->value;
         }
 
-        default:
-            strcpy(result, "null");
-            break;
+        // May move the stack, so top is not used past this
+        encode_value(buf, &stack, child, indent, false, budget);
     }
 
-    return result;
+    toon_buffer_free(&stack);
+}
+
+// Encode a value into an existing buffer
+void toon_encode_to(ToonBuffer *buf, ToonValue *value, int indent_level) {
+    encode_tree(buf, value, indent_level, NULL);
+}
+
+// Encode a value cut down to a token budget, which is left with what the
+// output did not use. Arrays and tables keep the [N] of what they emit, and
+// only the elements emitted are counted, so the work follows the output.
+void toon_encode_budget_to(ToonBuffer *buf, ToonValue *value, int indent_level, ToonBudget *budget) {
+    encode_tree(buf, value, indent_level, budget);
 }
 
 // Public encoding function
 char *toon_encode(ToonValue *value, int indent_level) {
-    return encode_value(value, indent_level, false);
+    ToonBuffer buf;
+    toon_buffer_init(&buf, toon_encoded_size_hint(value));
+    encode_tree(&buf, value, indent_level, NULL);
+    return toon_buffer_detach(&buf, NULL);
 }
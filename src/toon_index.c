@@ -0,0 +1,580 @@
+#include "redistoon.h"
+
+// Secondary indexes
+//
+// An index covers the columns of the table at one definite path, in every
+// document that has a table there. Each column keeps two structures:
+//
+//   inverted   hash of every string, boolean and null seen in the column
+//              to the rows holding it
+//   numeric    the column's numbers with their rows, sorted by value on
+//              demand, so ranges are two binary searches
+//
+// A posting names a row through the entry of its document, which carries
+// the key to reply with. Writes that reach the table reindex the
+// document: its old entry is marked dead, and its postings are skipped by
+// queries until enough are dead to be worth purging, which never touches a
+// document. Appended rows are added to the live entry as they come.
+
+// Purge dead postings once there are this many and they outnumber the live
+// ones
+#define TOON_INDEX_PURGE_MIN 4096
+
+typedef struct {
+    ToonIndexEntry *entry;
+    size_t row;
+} ToonPosting;
+
+typedef struct {
+    ToonPosting *items;
+    size_t count;
+    size_t capacity;
+} PostingList;
+
+// Rows holding one string, boolean or null
+typedef struct {
+    ToonValue value;            // Strings are malloc'd; NULL type marks a free slot with no text
+    uint64_t hash;
+    bool used;
+    PostingList postings;
+} InvertedBucket;
+
+typedef struct {
+    double number;
+    ToonPosting posting;
+} NumericEntry;
+
+struct ToonIndexColumn {
+    char *name;
+    InvertedBucket *buckets;    // Open addressing, power of two slots
+    size_t num_buckets;
+    size_t used_buckets;
+    NumericEntry *numbers;
+    size_t num_numbers;
+    size_t numbers_capacity;
+    bool sorted;
+};
+
+static ToonIndex *indexes = NULL;
+
+static bool postings_push(PostingList *list, ToonIndexEntry *entry, size_t row) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 4;
+        ToonPosting *items = realloc(list->items, sizeof(ToonPosting) * capacity);
+        if (!items) return false;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = (ToonPosting){.entry = entry, .row = row};
+    return true;
+}
+
+static uint64_t value_hash(const ToonValue *value) {
+    if (value->type == TOON_STRING) return toon_hash_key(value->value.string, strlen(value->value.string));
+    return value->type * 31 + (value->type == TOON_BOOLEAN && value->value.boolean);
+}
+
+static bool value_equals(const ToonValue *a, const ToonValue *b) {
+    if (a->type != b->type) return false;
+    if (a->type == TOON_STRING) return strcmp(a->value.string, b->value.string) == 0;
+    if (a->type == TOON_BOOLEAN) return a->value.boolean == b->value.boolean;
+    return true;
+}
+
+// Slot of value in the inverted index, or the free slot it would take
+static InvertedBucket *bucket_slot(ToonIndexColumn *column, const ToonValue *value, uint64_t hash) {
+    size_t mask = column->num_buckets - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        InvertedBucket *bucket = &column->buckets[slot];
+        if (!bucket->used || (bucket->hash == hash && value_equals(&bucket->value, value))) return bucket;
+    }
+}
+
+// Keep the table at most half full
+static bool buckets_grow(ToonIndexColumn *column) {
+    if ((column->used_buckets + 1) * 2 <= column->num_buckets) return true;
+
+    size_t num_buckets = column->num_buckets ? column->num_buckets * 2 : 16;
+    InvertedBucket *old = column->buckets;
+    size_t old_count = column->num_buckets;
+
+    column->buckets = calloc(num_buckets, sizeof(InvertedBucket));
+    if (!column->buckets) {
+        column->buckets = old;
+        return false;
+    }
+    column->num_buckets = num_buckets;
+
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].used) *bucket_slot(column, &old[i].value, old[i].hash) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+static InvertedBucket *bucket_find(ToonIndexColumn *column, const ToonValue *value) {
+    if (!column->num_buckets) return NULL;
+
+    InvertedBucket *bucket = bucket_slot(column, value, value_hash(value));
+    return bucket->used ? bucket : NULL;
+}
+
+static bool inverted_add(ToonIndexColumn *column, const ToonValue *value, ToonIndexEntry *entry, size_t row) {
+    if (!buckets_grow(column)) return false;
+
+    uint64_t hash = value_hash(value);
+    InvertedBucket *bucket = bucket_slot(column, value, hash);
+    if (!bucket->used) {
+        bucket->value = *value;
+        if (value->type == TOON_STRING) {
+            bucket->value.value.string = strdup(value->value.string);
+            if (!bucket->value.value.string) return false;
+        }
+        bucket->hash = hash;
+        bucket->used = true;
+        column->used_buckets++;
+    }
+    return postings_push(&bucket->postings, entry, row);
+}
+
+static bool numeric_add(ToonIndexColumn *column, double number, ToonIndexEntry *entry, size_t row) {
+    if (column->num_numbers == column->numbers_capacity) {
+        size_t capacity = column->numbers_capacity ? column->numbers_capacity * 2 : 16;
+        NumericEntry *numbers = realloc(column->numbers, sizeof(NumericEntry) * capacity);
+        if (!numbers) return false;
+        column->numbers = numbers;
+        column->numbers_capacity = capacity;
+    }
+
+    // Rows appended in order, such as timestamps, keep the column sorted
+    if (column->num_numbers > 0 && number < column->numbers[column->num_numbers - 1].number) {
+        column->sorted = false;
+    }
+    column->numbers[column->num_numbers++] = (NumericEntry){.number = number, .posting = {entry, row}};
+    return true;
+}
+
+static int numeric_compare(const void *a, const void *b) {
+    double x = ((const NumericEntry *)a)->number;
+    double y = ((const NumericEntry *)b)->number;
+    return (x > y) - (x < y);
+}
+
+static void numeric_sort(ToonIndexColumn *column) {
+    if (column->sorted) return;
+    qsort(column->numbers, column->num_numbers, sizeof(NumericEntry), numeric_compare);
+    column->sorted = true;
+}
+
+// First entry not below number, or past it when after is set
+static size_t numeric_bound(const ToonIndexColumn *column, double number, bool after) {
+    size_t low = 0;
+    size_t high = column->num_numbers;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        double value = column->numbers[mid].number;
+        if (value < number || (after && value == number)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+static void column_free(ToonIndexColumn *column) {
+    for (size_t i = 0; i < column->num_buckets; i++) {
+        InvertedBucket *bucket = &column->buckets[i];
+        if (!bucket->used) continue;
+        if (bucket->value.type == TOON_STRING) free(bucket->value.value.string);
+        free(bucket->postings.items);
+    }
+    free(column->buckets);
+    free(column->numbers);
+    free(column->name);
+}
+
+// ============================================================================
+// Entries
+// ============================================================================
+
+static void doc_unlist(ToonIndexEntry *entry) {
+    ToonIndexEntry **link = &entry->doc->indexed;
+    while (*link != entry) link = &(*link)->next_in_doc;
+    *link = entry->next_in_doc;
+    entry->next_in_doc = NULL;
+}
+
+// Drop the postings of dead entries, and the entries with them. Only the
+// index is scanned; no document is read.
+static void index_purge(ToonIndex *index) {
+    for (size_t col = 0; col < index->num_columns; col++) {
+        ToonIndexColumn *column = &index->columns[col];
+
+        for (size_t i = 0; i < column->num_buckets; i++) {
+            PostingList *list = &column->buckets[i].postings;
+            size_t kept = 0;
+            for (size_t p = 0; p < list->count; p++) {
+                if (!list->items[p].entry->dead) list->items[kept++] = list->items[p];
+            }
+            list->count = kept;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < column->num_numbers; i++) {
+            if (!column->numbers[i].posting.entry->dead) column->numbers[kept++] = column->numbers[i];
+        }
+        column->num_numbers = kept;
+    }
+
+    ToonIndexEntry **link = &index->entries;
+    while (*link) {
+        ToonIndexEntry *entry = *link;
+        if (entry->dead) {
+            *link = entry->next;
+            free(entry->key);
+            free(entry);
+        } else {
+            link = &entry->next;
+        }
+    }
+    index->dead_postings = 0;
+}
+
+static void entry_kill(ToonIndexEntry *entry) {
+    ToonIndex *index = entry->index;
+
+    doc_unlist(entry);
+    entry->doc = NULL;
+    entry->dead = true;
+    index->live_postings -= entry->postings;
+    index->dead_postings += entry->postings;
+}
+
+// Purging frees dead entries, so it waits until no loop is walking them
+static void index_maybe_purge(ToonIndex *index) {
+    if (index->dead_postings >= TOON_INDEX_PURGE_MIN && index->dead_postings > index->live_postings) {
+        index_purge(index);
+    }
+}
+
+static ToonIndexEntry *entry_find(ToonIndex *index, const ToonDocument *doc) {
+    for (ToonIndexEntry *entry = doc->indexed; entry; entry = entry->next_in_doc) {
+        if (entry->index == index) return entry;
+    }
+    return NULL;
+}
+
+// Post the rows of tab from first on. Out of memory leaves the rest of
+// them out of the index.
+static void entry_add_rows(ToonIndexEntry *entry, const ToonTabularArray *tab, size_t first) {
+    ToonIndex *index = entry->index;
+
+    for (size_t col = 0; col < index->num_columns; col++) {
+        ToonIndexColumn *column = &index->columns[col];
+        size_t table_col;
+        if (!toon_tabular_find_column(tab, column->name, &table_col)) continue;
+
+        for (size_t row = first; row < tab->num_rows; row++) {
+            ToonValue scratch;
+            const ToonValue *cell = toon_tabular_cell(tab, row, table_col, &scratch);
+            bool added;
+            if (cell->type == TOON_NUMBER) {
+                added = numeric_add(column, cell->value.number, entry, row);
+            } else if (cell->type == TOON_STRING || cell->type == TOON_BOOLEAN || cell->type == TOON_NULL) {
+                added = inverted_add(column, cell, entry, row);
+            } else {
+                continue;
+            }
+            if (!added) break;
+
+            entry->postings++;
+            index->live_postings++;
+        }
+    }
+    entry->num_rows = tab->num_rows;
+}
+
+static const ToonTabularArray *document_table(const ToonIndex *index, ToonDocument *doc) {
+    ToonValue scratch;
+    ToonValue *table = doc->root ? toon_path_get(doc->root, index->path, &scratch) : NULL;
+    return table && table->type == TOON_TABULAR_ARRAY ? &table->value.tabular : NULL;
+}
+
+// ============================================================================
+// Indexes
+// ============================================================================
+
+// Create an empty index over columns of the table at path, which must be
+// definite. NULL when out of memory.
+ToonIndex *toon_index_create(const char *name, size_t name_len, const ToonPath *path,
+                             char *const *columns, const size_t *column_lens, size_t num_columns) {
+    ToonIndex *index = calloc(1, sizeof(ToonIndex));
+    if (!index) return NULL;
+
+    index->name = strndup(name, name_len);
+    index->path = toon_path_compile(path->source, path->source_len);
+    index->columns = calloc(num_columns, sizeof(ToonIndexColumn));
+    bool ok = index->name && index->path && index->columns;
+
+    for (size_t col = 0; ok && col < num_columns; col++) {
+        index->columns[col].name = strndup(columns[col], column_lens[col]);
+        index->columns[col].sorted = true;
+        ok = index->columns[col].name != NULL;
+        index->num_columns++;
+    }
+    if (!ok) {
+        toon_index_drop(index);
+        return NULL;
+    }
+
+    index->next = indexes;
+    indexes = index;
+    return index;
+}
+
+ToonIndex *toon_index_find(const char *name, size_t len) {
+    for (ToonIndex *index = indexes; index; index = index->next) {
+        if (strlen(index->name) == len && memcmp(index->name, name, len) == 0) return index;
+    }
+    return NULL;
+}
+
+// Every index, newest first, linked through next
+ToonIndex *toon_index_list(void) {
+    return indexes;
+}
+
+const char *toon_index_column(const ToonIndex *index, size_t col) {
+    return index->columns[col].name;
+}
+
+// Remove an index, with every entry it holds
+void toon_index_drop(ToonIndex *index) {
+    ToonIndex **link = &indexes;
+    while (*link && *link != index) link = &(*link)->next;
+    if (*link) *link = index->next;
+
+    while (index->entries) {
+        ToonIndexEntry *entry = index->entries;
+        index->entries = entry->next;
+        if (!entry->dead) doc_unlist(entry);
+        free(entry->key);
+        free(entry);
+    }
+
+    for (size_t col = 0; col < index->num_columns; col++) {
+        column_free(&index->columns[col]);
+    }
+    free(index->columns);
+    toon_path_free(index->path);
+    free(index->name);
+    free(index);
+}
+
+void toon_index_drop_all(void) {
+    while (indexes) toon_index_drop(indexes);
+}
+
+// (Re)index the table of a document stored at key in db
+void toon_index_add(ToonIndex *index, ToonDocument *doc, const char *key, size_t key_len, int db) {
+    ToonIndexEntry *old = entry_find(index, doc);
+    if (old) {
+        entry_kill(old);
+        index_maybe_purge(index);
+    }
+
+    const ToonTabularArray *tab = document_table(index, doc);
+    if (!tab) return;
+
+    ToonIndexEntry *entry = calloc(1, sizeof(ToonIndexEntry));
+    char *key_copy = malloc(key_len + 1);
+    if (!entry || !key_copy) {
+        free(entry);
+        free(key_copy);
+        return;
+    }
+    memcpy(key_copy, key, key_len);
+    key_copy[key_len] = '\0';
+
+    entry->index = index;
+    entry->doc = doc;
+    entry->key = key_copy;
+    entry->key_len = key_len;
+    entry->db = db;
+    entry->next = index->entries;
+    index->entries = entry;
+    entry->next_in_doc = doc->indexed;
+    doc->indexed = entry;
+
+    entry_add_rows(entry, tab, 0);
+}
+
+// Whether two segments may select the same value. Indexes can be negative,
+// so any two are taken to overlap.
+static bool segments_overlap(const ToonPathSegment *a, const ToonPathSegment *b) {
+    if (a->type == TOON_SEGMENT_KEY && b->type == TOON_SEGMENT_KEY) {
+        return a->key_len == b->key_len && memcmp(a->key, b->key, a->key_len) == 0;
+    }
+    return a->type != TOON_SEGMENT_KEY && b->type != TOON_SEGMENT_KEY;
+}
+
+// Whether a write at path can change what the table at index_path holds:
+// one is a prefix of the other
+static bool paths_overlap(const ToonPath *index_path, const ToonPath *path) {
+    size_t n = index_path->num_segments < path->num_segments ? index_path->num_segments : path->num_segments;
+    for (size_t i = 0; i < n; i++) {
+        if (!segments_overlap(&index_path->segments[i], &path->segments[i])) return false;
+    }
+    return true;
+}
+
+static bool paths_equal(const ToonPath *a, const ToonPath *b) {
+    if (a->num_segments != b->num_segments || !paths_overlap(a, b)) return false;
+    for (size_t i = 0; i < a->num_segments; i++) {
+        if (a->segments[i].type != b->segments[i].type) return false;
+        if (a->segments[i].type == TOON_SEGMENT_INDEX && a->segments[i].index != b->segments[i].index) return false;
+    }
+    return true;
+}
+
+// Bring the indexes up to date after a write at path, which is the table
+// itself that gained rows when rows_appended is set
+void toon_index_update(ToonDocument *doc, const char *key, size_t key_len, int db,
+                       const ToonPath *path, bool rows_appended) {
+    for (ToonIndex *index = indexes; index; index = index->next) {
+        if (!paths_overlap(index->path, path)) continue;
+
+        ToonIndexEntry *entry = rows_appended && paths_equal(index->path, path) ? entry_find(index, doc) : NULL;
+        const ToonTabularArray *tab = entry ? document_table(index, doc) : NULL;
+        if (tab && tab->num_rows >= entry->num_rows) {
+            entry_add_rows(entry, tab, entry->num_rows);
+        } else {
+            toon_index_add(index, doc, key, key_len, db);
+        }
+    }
+}
+
+// Take a document out of every index, when it leaves the keyspace
+void toon_index_forget(ToonDocument *doc) {
+    while (doc->indexed) {
+        ToonIndex *index = doc->indexed->index;
+        entry_kill(doc->indexed);
+        index_maybe_purge(index);
+    }
+}
+
+// Take every document of db, or of all databases for -1, out of the
+// indexes, ahead of a flush
+void toon_index_forget_db(int db) {
+    for (ToonIndex *index = indexes; index; index = index->next) {
+        for (ToonIndexEntry *entry = index->entries; entry; entry = entry->next) {
+            if (!entry->dead && (db == -1 || entry->db == db)) entry_kill(entry);
+        }
+        index_maybe_purge(index);
+    }
+}
+
+void toon_index_swap_db(int first, int second) {
+    for (ToonIndex *index = indexes; index; index = index->next) {
+        for (ToonIndexEntry *entry = index->entries; entry; entry = entry->next) {
+            if (entry->db == first) entry->db = second;
+            else if (entry->db == second) entry->db = first;
+        }
+    }
+}
+
+// ============================================================================
+// Queries
+// ============================================================================
+
+typedef struct {
+    int db;
+    size_t limit;
+    size_t count;
+    ToonIndexVisit visit;
+    void *ctx;
+} IndexQuery;
+
+static bool query_done(const IndexQuery *query) {
+    return query->count >= query->limit;
+}
+
+static void query_emit(IndexQuery *query, const ToonPosting *posting) {
+    ToonIndexEntry *entry = posting->entry;
+    if (query_done(query) || entry->dead || entry->db != query->db) return;
+
+    if (query->visit(entry->doc, entry->key, entry->key_len, posting->row, query->ctx)) query->count++;
+}
+
+static void query_postings(IndexQuery *query, const PostingList *list) {
+    for (size_t i = 0; i < list->count && !query_done(query); i++) {
+        query_emit(query, &list->items[i]);
+    }
+}
+
+static void query_numbers(IndexQuery *query, ToonIndexColumn *column, const ToonPathSegment *filter) {
+    const ToonValue *literal = &filter->literal;
+    size_t first = 0;
+    size_t stop = column->num_numbers;
+
+    if (literal->type != TOON_NUMBER || filter->op == TOON_FILTER_NE || filter->op == TOON_FILTER_EXISTS) {
+        // No range to search: test each number, without reading a document
+        for (size_t i = 0; i < column->num_numbers && !query_done(query); i++) {
+            ToonValue value = {.type = TOON_NUMBER, .value.number = column->numbers[i].number};
+            if (toon_filter_match(filter, &value)) query_emit(query, &column->numbers[i].posting);
+        }
+        return;
+    }
+
+    numeric_sort(column);
+    double number = literal->value.number;
+    switch (filter->op) {
+        case TOON_FILTER_EQ:
+            first = numeric_bound(column, number, false);
+            stop = numeric_bound(column, number, true);
+            break;
+        case TOON_FILTER_LT: stop = numeric_bound(column, number, false); break;
+        case TOON_FILTER_LE: stop = numeric_bound(column, number, true); break;
+        case TOON_FILTER_GT: first = numeric_bound(column, number, true); break;
+        case TOON_FILTER_GE: first = numeric_bound(column, number, false); break;
+        case TOON_FILTER_NE:
+        case TOON_FILTER_EXISTS: break;
+    }
+
+    for (size_t i = first; i < stop && !query_done(query); i++) {
+        query_emit(query, &column->numbers[i].posting);
+    }
+}
+
+static void query_inverted(IndexQuery *query, ToonIndexColumn *column, const ToonPathSegment *filter) {
+    if (filter->op == TOON_FILTER_EQ) {
+        InvertedBucket *bucket = bucket_find(column, &filter->literal);
+        if (bucket) query_postings(query, &bucket->postings);
+        return;
+    }
+
+    for (size_t i = 0; i < column->num_buckets && !query_done(query); i++) {
+        InvertedBucket *bucket = &column->buckets[i];
+        if (bucket->used && toon_filter_match(filter, &bucket->value)) query_postings(query, &bucket->postings);
+    }
+}
+
+// Visit up to limit rows of documents in db whose cell in the filter's
+// column satisfies it, from the index alone: only matching documents are
+// read, by the visitor. Numbers come first, in ascending order, then the
+// other values. False if the column is not indexed.
+bool toon_index_query(ToonIndex *index, const ToonPathSegment *filter, int db, size_t limit,
+                      ToonIndexVisit visit, void *ctx) {
+    ToonIndexColumn *column = NULL;
+    for (size_t col = 0; col < index->num_columns && !column; col++) {
+        if (toon_key_equals(index->columns[col].name, filter->key, filter->key_len)) column = &index->columns[col];
+    }
+    if (!column) return false;
+
+    IndexQuery query = {.db = db, .limit = limit, .visit = visit, .ctx = ctx};
+
+    // Only a number equals or orders against a number literal
+    bool numeric_literal = filter->literal.type == TOON_NUMBER;
+    bool any_type = filter->op == TOON_FILTER_NE || filter->op == TOON_FILTER_EXISTS;
+    if (numeric_literal || any_type) query_numbers(&query, column, filter);
+    if (!numeric_literal || any_type) query_inverted(&query, column, filter);
+    return true;
+}
@@ -0,0 +1,135 @@
+#include "redistoon.h"
+
+// INFO sections
+//
+//   redistoon           documents, live nodes and node bytes by type, the
+//                       share of arrays stored as tables, cache hit rates
+//   redistoon_latency   one field per command phase that has run:
+//                       calls and p50/p99/p99.9/max in microseconds
+//
+// Nodes shared by every document (null, the booleans, small integers)
+// are not allocated and not counted. Trees still held by readers count
+// until they are released.
+
+static const char *type_names[TOON_NUM_TYPES] = {
+    [TOON_NULL] = "null",
+    [TOON_BOOLEAN] = "boolean",
+    [TOON_NUMBER] = "number",
+    [TOON_STRING] = "string",
+    [TOON_ARRAY] = "array",
+    [TOON_OBJECT] = "object",
+    [TOON_TABULAR_ARRAY] = "tabular"
+};
+
+static const char *command_names[TOON_NUM_COMMANDS] = {
+    [TOON_CMD_SET] = "set",
+    [TOON_CMD_GET] = "get",
+    [TOON_CMD_MGET] = "mget",
+    [TOON_CMD_VERSION] = "version",
+    [TOON_CMD_DEL] = "del",
+    [TOON_CMD_ARRAPPEND] = "arrappend",
+    [TOON_CMD_ROWAPPEND] = "rowappend",
+    [TOON_CMD_CLONE] = "clone",
+    [TOON_CMD_INDEX] = "index",
+    [TOON_CMD_QUERY] = "query",
+    [TOON_CMD_TYPE] = "type",
+    [TOON_CMD_TOJSON] = "tojson",
+    [TOON_CMD_FROMJSON] = "fromjson",
+    [TOON_CMD_TOKENCOUNT] = "tokencount",
+    [TOON_CMD_CONVERT] = "convert"
+};
+
+static const char *phase_names[TOON_NUM_PHASES] = {
+    [TOON_PHASE_PARSE] = "parse",
+    [TOON_PHASE_PATH] = "path",
+    [TOON_PHASE_ENCODE] = "encode",
+    [TOON_PHASE_TOTAL] = "total"
+};
+
+static const char *cache_names[TOON_NUM_CACHES] = {
+    [TOON_STATS_TEXT_CACHE] = "text_cache",
+    [TOON_STATS_PATH_CACHE] = "path_cache"
+};
+
+static double ratio(uint64_t part, uint64_t whole) {
+    return whole ? (double)part / (double)whole : 0;
+}
+
+static void info_documents(RedisModuleInfoCtx *ctx) {
+    RedisModule_InfoAddFieldULongLong(ctx, "documents", toon_stats_documents());
+
+    ToonNodeCounts totals;
+    toon_stats_node_totals(&totals);
+
+    char field[64];
+    for (int type = 0; type < TOON_NUM_TYPES; type++) {
+        size_t bytes = type == TOON_STRING ? totals.string_bytes
+                                           : totals.count[type] * toon_arena_alloc_size(toon_node_size(type));
+
+        snprintf(field, sizeof(field), "nodes_%s", type_names[type]);
+        RedisModule_InfoAddFieldULongLong(ctx, field, totals.count[type]);
+        snprintf(field, sizeof(field), "node_bytes_%s", type_names[type]);
+        RedisModule_InfoAddFieldULongLong(ctx, field, bytes);
+    }
+
+    size_t arrays = totals.count[TOON_ARRAY] + totals.count[TOON_TABULAR_ARRAY];
+    RedisModule_InfoAddFieldDouble(ctx, "tabular_array_ratio", ratio(totals.count[TOON_TABULAR_ARRAY], arrays));
+}
+
+static void info_caches(RedisModuleInfoCtx *ctx) {
+    char field[64];
+    for (int cache = 0; cache < TOON_NUM_CACHES; cache++) {
+        uint64_t hits, misses;
+        toon_stats_cache_counts(cache, &hits, &misses);
+
+        snprintf(field, sizeof(field), "%s_hits", cache_names[cache]);
+        RedisModule_InfoAddFieldULongLong(ctx, field, hits);
+        snprintf(field, sizeof(field), "%s_misses", cache_names[cache]);
+        RedisModule_InfoAddFieldULongLong(ctx, field, misses);
+        snprintf(field, sizeof(field), "%s_hit_rate", cache_names[cache]);
+        RedisModule_InfoAddFieldDouble(ctx, field, ratio(hits, hits + misses));
+    }
+    RedisModule_InfoAddFieldULongLong(ctx, "text_cache_bytes", toon_cache_used());
+}
+
+// The intern pool never shrinks; rejections climbing while strings stay
+// put mean it is full and new keys are no longer shared
+static void info_intern(RedisModuleInfoCtx *ctx) {
+    size_t strings, bytes, rejected;
+    toon_intern_usage(&strings, &bytes, &rejected);
+
+    RedisModule_InfoAddFieldULongLong(ctx, "intern_strings", strings);
+    RedisModule_InfoAddFieldULongLong(ctx, "intern_bytes", bytes);
+    RedisModule_InfoAddFieldULongLong(ctx, "intern_rejected", rejected);
+}
+
+static void info_latency(RedisModuleInfoCtx *ctx) {
+    char field[64];
+    for (int command = 0; command < TOON_NUM_COMMANDS; command++) {
+        for (int phase = 0; phase < TOON_NUM_PHASES; phase++) {
+            ToonLatency latency;
+            if (!toon_stats_latency(command, phase, &latency)) continue;
+
+            snprintf(field, sizeof(field), "%s_%s", command_names[command], phase_names[phase]);
+            RedisModule_InfoBeginDictField(ctx, field);
+            RedisModule_InfoAddFieldULongLong(ctx, "calls", latency.calls);
+            RedisModule_InfoAddFieldDouble(ctx, "p50_usec", latency.p50);
+            RedisModule_InfoAddFieldDouble(ctx, "p99_usec", latency.p99);
+            RedisModule_InfoAddFieldDouble(ctx, "p999_usec", latency.p999);
+            RedisModule_InfoAddFieldDouble(ctx, "max_usec", latency.max);
+            RedisModule_InfoEndDictField(ctx);
+        }
+    }
+}
+
+void toon_info(RedisModuleInfoCtx *ctx, int for_crash_report) {
+    (void)for_crash_report;
+
+    RedisModule_InfoAddSection(ctx, "");
+    info_documents(ctx);
+    info_caches(ctx);
+    info_intern(ctx);
+
+    RedisModule_InfoAddSection(ctx, "latency");
+    info_latency(ctx);
+}
@@ -0,0 +1,196 @@
+#include "redistoon.h"
+#include <stdatomic.h>
+
+// Module-wide string interning
+//
+// Documents share a small vocabulary of keys and headers (id, role,
+// content, ...) and of short string values (user, assistant, ...). A
+// short string is stored once in a static pool, and every document
+// pointing at it shares that copy instead of holding its own in its arena.
+//
+// The pool only grows. Its strings are immutable and never freed, which
+// lets documents be freed wholesale on any thread without reference
+// counts; in exchange the pool is bounded, and once it or the table is
+// full new strings simply stay in their arenas. Decoding runs on worker
+// threads too, so lookups and inserts are lock free: a slot is claimed by
+// a compare-and-swap and never changes again. Every string is in the table
+// at most once, so two interned strings are equal exactly when they are
+// the same pointer.
+//
+// Keys and headers are interned on first sight. Values have far more
+// distinct strings, so one is only admitted once a filter of hash bits
+// has seen it before, which keeps one-off values from filling the pool.
+// Client input only adds to the pool once it is known to be good: a parse
+// holds its new strings back in a batch until it succeeds, and compiled
+// paths only look keys up. Strings turned away because the pool is full
+// are counted, so a saturated pool shows in INFO.
+
+// Longest interned key and value
+#define TOON_INTERN_MAX_KEY_LEN 32
+#define TOON_INTERN_MAX_VALUE_LEN 16
+
+// Table slots, a power of two, kept at most half full
+#define TOON_INTERN_SLOTS (1 << 14)
+#define TOON_INTERN_MAX_STRINGS (TOON_INTERN_SLOTS / 2)
+
+// Bytes of string storage; each string takes its length, a length byte
+// and a NUL
+#define TOON_INTERN_POOL_SIZE (256 * 1024)
+
+// Bits of the filter values must pass before they are interned
+#define TOON_INTERN_SEEN_BITS (1 << 16)
+
+static char pool[TOON_INTERN_POOL_SIZE];
+static atomic_size_t pool_used;
+static atomic_size_t num_strings;
+static _Atomic(const char *) slots[TOON_INTERN_SLOTS];
+static atomic_uint_fast64_t seen[TOON_INTERN_SEEN_BITS / 64];
+static atomic_size_t rejected;
+
+// Store a copy in the pool, preceded by its length; NULL once it is full
+static char *pool_copy(const char *str, size_t len) {
+    size_t offset = atomic_fetch_add_explicit(&pool_used, len + 2, memory_order_relaxed);
+    if (offset + len + 2 > TOON_INTERN_POOL_SIZE) return NULL;
+
+    char *copy = pool + offset + 1;
+    copy[-1] = (char)len;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Find the interned copy of a string, adding it if insert is set and
+// there is room. NULL if it is not interned.
+static const char *intern(const char *str, size_t len, uint64_t hash, bool insert) {
+    size_t slot = hash & (TOON_INTERN_SLOTS - 1);
+
+    for (;; slot = (slot + 1) & (TOON_INTERN_SLOTS - 1)) {
+        const char *interned = atomic_load_explicit(&slots[slot], memory_order_acquire);
+
+        if (!interned) {
+            if (!insert) return NULL;
+
+            char *copy = NULL;
+            if (atomic_load_explicit(&num_strings, memory_order_relaxed) < TOON_INTERN_MAX_STRINGS) {
+                copy = pool_copy(str, len);
+            }
+            if (!copy) {
+                atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+                return NULL;
+            }
+
+            // A thread that claimed the slot first may have added the same
+            // string; then the copy is left unused in the pool
+            if (atomic_compare_exchange_strong_explicit(&slots[slot], &interned, copy,
+                                                        memory_order_acq_rel, memory_order_acquire)) {
+                atomic_fetch_add_explicit(&num_strings, 1, memory_order_relaxed);
+                return copy;
+            }
+        }
+
+        if ((unsigned char)interned[-1] == len && memcmp(interned, str, len) == 0) return interned;
+    }
+}
+
+static bool internable(const char *str, size_t len, size_t max_len) {
+    return len <= max_len && !memchr(str, '\0', len);
+}
+
+// The interned copy of a key if there is one, without adding it
+const char *toon_intern_find(const char *str, size_t len) {
+    if (!internable(str, len, TOON_INTERN_MAX_KEY_LEN)) return NULL;
+    return intern(str, len, toon_hash_key(str, len), false);
+}
+
+// A key or header: the interned copy, interning it if there is room, or a
+// copy in arena. During a parse a new key is copied into arena and noted
+// for the pool instead.
+char *toon_intern_key(ToonArena *arena, const char *str, size_t len) {
+    if (!internable(str, len, TOON_INTERN_MAX_KEY_LEN)) return toon_arena_strndup(arena, str, len);
+
+    const char *interned = intern(str, len, toon_hash_key(str, len), !arena->interning);
+    if (interned) return (char *)interned;
+
+    char *copy = toon_arena_strndup(arena, str, len);
+    if (copy) toon_intern_note(arena, copy);
+    return copy;
+}
+
+// The interned copy of a string value if it is short and has been seen
+// before; NULL otherwise. During a parse a value that would be added is
+// not, and *pending is set for the caller to note its copy.
+const char *toon_intern_value(ToonArena *arena, const char *str, size_t len, bool *pending) {
+    *pending = false;
+    if (!internable(str, len, TOON_INTERN_MAX_VALUE_LEN)) return NULL;
+
+    uint64_t hash = toon_hash_key(str, len);
+    uint64_t bit = (uint64_t)1 << (hash >> 32 & 63);
+    uint64_t seen_before = atomic_fetch_or_explicit(&seen[(hash >> 38) % (TOON_INTERN_SEEN_BITS / 64)],
+                                                    bit, memory_order_relaxed);
+    if (!(seen_before & bit)) return NULL;
+
+    const char *interned = intern(str, len, hash, !arena->interning);
+    *pending = !interned && arena->interning;
+    return interned;
+}
+
+// Note a NUL-terminated string allocated from arena for the pool, once
+// the parse filling arena succeeds. The batch keeps a copy, as a parse
+// may rewind the arena and build the same strings again.
+void toon_intern_note(ToonArena *arena, const char *str) {
+    if (arena->interning) toon_buffer_append(&arena->interning->strings, str, strlen(str) + 1);
+}
+
+// Hold back the pool inserts of the strings allocated from arena until
+// toon_intern_end
+void toon_intern_begin(ToonArena *arena, ToonInternBatch *batch) {
+    toon_buffer_init(&batch->strings, 0);
+    arena->interning = batch;
+}
+
+// Add the strings noted since toon_intern_begin to the pool if commit is
+// set, or forget them. The document keeps its own copies either way.
+void toon_intern_end(ToonArena *arena, ToonInternBatch *batch, bool commit) {
+    arena->interning = NULL;
+
+    const char *str = batch->strings.data;
+    const char *end = str + (commit && !batch->strings.failed ? batch->strings.len : 0);
+    while (str < end) {
+        size_t len = strlen(str);
+        intern(str, len, toon_hash_key(str, len), true);
+        str += len + 1;
+    }
+    toon_buffer_free(&batch->strings);
+}
+
+// Strings in the pool, bytes of the pool they take, and strings turned away
+// because the pool or its table was full
+void toon_intern_usage(size_t *strings, size_t *bytes, size_t *rejections) {
+    size_t used = atomic_load_explicit(&pool_used, memory_order_relaxed);
+    *strings = atomic_load_explicit(&num_strings, memory_order_relaxed);
+    *bytes = used < TOON_INTERN_POOL_SIZE ? used : TOON_INTERN_POOL_SIZE;
+    *rejections = atomic_load_explicit(&rejected, memory_order_relaxed);
+}
+
+bool toon_is_interned(const char *str) {
+    return (uintptr_t)str - (uintptr_t)pool < TOON_INTERN_POOL_SIZE;
+}
+
+// Copy a string into arena, unless it is interned and can be shared
+char *toon_string_copy(ToonArena *arena, const char *str) {
+    if (toon_is_interned(str)) return (char *)str;
+    return toon_arena_strndup(arena, str, strlen(str));
+}
+
+// Bytes of arena memory held by a string; interned strings hold none
+size_t toon_string_footprint(const char *str) {
+    return toon_is_interned(str) ? 0 : toon_arena_alloc_size(strlen(str) + 1);
+}
+
+// Whether the NUL-terminated key equals other, of length len. Interned
+// strings compare by pointer.
+bool toon_key_equals(const char *key, const char *other, size_t len) {
+    if (key == other) return true;
+    if (toon_is_interned(key) && toon_is_interned(other)) return false;
+    return strncmp(key, other, len) == 0 && key[len] == '\0';
+}
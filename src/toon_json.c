@@ -1,136 +1,271 @@
 #include "redistoon.h"
 #include <ctype.h>
 
-// Simple JSON encoder (converts TOON to JSON)
-char *toon_to_json(ToonValue *value) {
-    if (!value) return strdup("null");
+// Append a JSON string literal, escaping quotes, backslashes and control characters
+static void append_json_string(ToonBuffer *buf, const char *str) {
+    toon_buffer_putc(buf, '"');
+
+    const char *run = str;
+    for (const char *s = str; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        char escape;
+        switch (c) {
+            case '"':  escape = '"'; break;
+            case '\\': escape = '\\'; break;
+            case '\n': escape = 'n'; break;
+            case '\r': escape = 'r'; break;
+            case '\t': escape = 't'; break;
+            default:
+                if (c >= 0x20) continue;
+                escape = 0;
+                break;
+        }
+
+        toon_buffer_append(buf, run, s - run);
+        if (escape) {
+            toon_buffer_putc(buf, '\\');
+            toon_buffer_putc(buf, escape);
+        } else {
+            char unicode[8];
+            snprintf(unicode, sizeof(unicode), "\\u%04x", c);
+            toon_buffer_append(buf, unicode, 6);
+        }
+        run = s + 1;
+    }
+
+    toon_buffer_append_str(buf, run);
+    toon_buffer_putc(buf, '"');
+}
 
-    char *result = malloc(65536);
-    if (!result) return NULL;
-    char *p = result;
+static bool json_container(const ToonValue *value) {
+    return value && (value->type == TOON_ARRAY || value->type == TOON_OBJECT);
+}
+
+// Whether a value is an array or object holding another one, whose
+// children are walked rather than written out in one go
+static bool json_nested(const ToonValue *value) {
+    if (!json_container(value)) return false;
+
+    if (value->type == TOON_ARRAY) {
+        for (size_t i = 0; i < value->value.array.length; i++) {
+            if (json_container(value->value.array.elements[i])) return true;
+        }
+    } else {
+        for (size_t i = 0; i < value->value.object.length; i++) {
+            if (json_container(value->value.object.entries[i].value)) return true;
+        }
+    }
+    return false;
+}
+
+// Write a value that has no children to walk: a scalar, a table, an array
+// or object of those, or a missing value
+static void json_leaf(ToonBuffer *buf, const ToonValue *value) {
+    if (!value) {
+        toon_buffer_append(buf, "null", 4);
+        return;
+    }
 
     switch (value->type) {
         case TOON_NULL:
-            strcpy(p, "null");
+            toon_buffer_append(buf, "null", 4);
             break;
 
-        case TOON_BOOLEAN:
-            strcpy(p, value->value.boolean ? "true" : "false");
+        case TOON_ARRAY:
+            toon_buffer_putc(buf, '[');
+            for (size_t i = 0; i < value->value.array.length; i++) {
+                if (i > 0) toon_buffer_putc(buf, ',');
+                json_leaf(buf, value->value.array.elements[i]);
+            }
+            toon_buffer_putc(buf, ']');
             break;
 
-        case TOON_NUMBER:
-            if (value->value.number == (long)value->value.number) {
-                sprintf(p, "%ld", (long)value->value.number);
-            } else {
-                sprintf(p, "%.10g", value->value.number);
+        case TOON_OBJECT:
+            toon_buffer_putc(buf, '{');
+            for (size_t i = 0; i < value->value.object.length; i++) {
+                if (i > 0) toon_buffer_putc(buf, ',');
+                append_json_string(buf, value->value.object.entries[i].key);
+                toon_buffer_putc(buf, ':');
+                json_leaf(buf, value->value.object.entries[i].value);
             }
+            toon_buffer_putc(buf, '}');
             break;
 
-        case TOON_STRING: {
-            *p++ = '"';
-            for (const char *s = value->value.string; *s; s++) {
-                switch (*s) {
-                    case '"':  *p++ = '\\'; *p++ = '"'; break;
-                    case '\\': *p++ = '\\'; *p++ = '\\'; break;
-                    case '\n': *p++ = '\\'; *p++ = 'n'; break;
-                    case '\r': *p++ = '\\'; *p++ = 'r'; break;
-                    case '\t': *p++ = '\\'; *p++ = 't'; break;
-                    default:   *p++ = *s; break;
-                }
+        case TOON_BOOLEAN:
+            if (value->value.boolean) {
+                toon_buffer_append(buf, "true", 4);
+            } else {
+                toon_buffer_append(buf, "false", 5);
             }
-            *p++ = '"';
-            *p = '\0';
             break;
-        }
 
-        case TOON_ARRAY: {
-            *p++ = '[';
-            for (size_t i = 0; i < value->value.array.length; i++) {
-                if (i > 0) *p++ = ',';
-                char *elem = toon_to_json(value->value.array.elements[i]);
-                if (elem) {
-                    strcpy(p, elem);
-                    p += strlen(elem);
-                    free(elem);
-                }
-            }
-            *p++ = ']';
-            *p = '\0';
+        case TOON_NUMBER:
+            toon_buffer_append_number(buf, value->value.number);
             break;
-        }
 
-        case TOON_OBJECT: {
-            *p++ = '{';
-            for (size_t i = 0; i < value->value.object.length; i++) {
-                if (i > 0) *p++ = ',';
-
-                *p++ = '"';
-                strcpy(p, value->value.object.entries[i].key);
-                p += strlen(value->value.object.entries[i].key);
-                *p++ = '"';
-                *p++ = ':';
-
-                char *val = toon_to_json(value->value.object.entries[i].value);
-                if (val) {
-                    strcpy(p, val);
-                    p += strlen(val);
-                    free(val);
-                }
-            }
-            *p++ = '}';
-            *p = '\0';
+        case TOON_STRING:
+            append_json_string(buf, value->value.string);
             break;
-        }
 
         case TOON_TABULAR_ARRAY: {
             // Convert tabular array to array of objects
-            *p++ = '[';
-            for (size_t row = 0; row < value->value.tabular.num_rows; row++) {
-                if (row > 0) *p++ = ',';
-                *p++ = '{';
-
-                for (size_t col = 0; col < value->value.tabular.num_headers; col++) {
-                    if (col > 0) *p++ = ',';
-
-                    *p++ = '"';
-                    strcpy(p, value->value.tabular.headers[col]);
-                    p += strlen(value->value.tabular.headers[col]);
-                    *p++ = '"';
-                    *p++ = ':';
-
-                    char *cell = toon_to_json(value->value.tabular.rows[row][col]);
-                    if (cell) {
-                        strcpy(p, cell);
-                        p += strlen(cell);
-                        free(cell);
-                    }
+            const ToonTabularArray *tab = &value->value.tabular;
+            ToonValue scratch;
+
+            toon_buffer_putc(buf, '[');
+            for (size_t row = 0; row < tab->num_rows; row++) {
+                if (row > 0) toon_buffer_putc(buf, ',');
+                toon_buffer_putc(buf, '{');
+
+                for (size_t col = 0; col < tab->num_headers; col++) {
+                    if (col > 0) toon_buffer_putc(buf, ',');
+                    append_json_string(buf, tab->headers[col]);
+                    toon_buffer_putc(buf, ':');
+                    json_leaf(buf, toon_tabular_cell(tab, row, col, &scratch));
                 }
 
-                *p++ = '}';
+                toon_buffer_putc(buf, '}');
             }
-            *p++ = ']';
-            *p = '\0';
+            toon_buffer_putc(buf, ']');
             break;
         }
     }
+}
 
-    return result;
+// An array or object whose children are being written
+typedef struct {
+    const ToonValue *value;
+    size_t next;
+} JsonFrame;
+
+// Open a container and push it for its children to be written
+static void json_open(ToonBuffer *buf, ToonBuffer *stack, const ToonValue *value) {
+    toon_buffer_putc(buf, value->type == TOON_ARRAY ? '[' : '{');
+    if (!toon_stack_push(stack, &(JsonFrame){value, 0}, sizeof(JsonFrame))) buf->failed = true;
+}
+
+// JSON encoder (converts TOON to JSON) writing into an existing buffer.
+// Arrays and objects are walked on a stack of their own rather than by
+// recursion, so the depth of a document costs heap rather than C stack.
+void toon_to_json_to(ToonBuffer *buf, ToonValue *value) {
+    if (!json_nested(value)) {
+        json_leaf(buf, value);
+        return;
+    }
+
+    ToonBuffer stack = {0};
+    json_open(buf, &stack, value);
+
+    JsonFrame *top;
+    while (!buf->failed && (top = toon_stack_top(&stack, sizeof(JsonFrame)))) {
+        const ToonValue *node = top->value;
+        bool is_array = node->type == TOON_ARRAY;
+        size_t length = is_array ? node->value.array.length : node->value.object.length;
+
+        // Write children up to the next container, which is opened next
+        const ToonValue *child = NULL;
+        while (top->next < length) {
+            size_t i = top->next++;
+            if (i > 0) toon_buffer_putc(buf, ',');
+
+            if (is_array) {
+                child = node->value.array.elements[i];
+            } else {
+                append_json_string(buf, node->value.object.entries[i].key);
+                toon_buffer_putc(buf, ':');
+                child = node->value.object.entries[i].value;
+            }
+
+            if (json_nested(child)) break;
+            json_leaf(buf, child);
+            child = NULL;
+        }
+
+        if (child) {
+            json_open(buf, &stack, child);
+        } else {
+            toon_buffer_putc(buf, is_array ? ']' : '}');
+            toon_stack_pop(&stack, sizeof(JsonFrame));
+        }
+    }
+
+    toon_buffer_free(&stack);
 }
 
+// Simple JSON encoder (converts TOON to JSON)
+char *toon_to_json(ToonValue *value) {
+    ToonBuffer buf;
+    toon_buffer_init(&buf, toon_encoded_size_hint(value));
+    toon_to_json_to(&buf, value);
+    return toon_buffer_detach(&buf, NULL);
+}
+
+// A parsed array element. Objects directly inside an array stay pending on
+// the scratch stacks until the array closes, so a uniform array can become
+// a tabular array without first materializing one object per row.
+typedef struct {
+    ToonValue *value;       // NULL while the element is a pending object
+    size_t entry_start;     // Pending object: index of its first entry
+    size_t entry_count;
+} JsonItem;
+
+// An object entry whose key is still on the key scratch stack
+typedef struct {
+    size_t key_offset;
+    size_t key_len;
+    ToonValue *value;
+} JsonEntry;
+
 // Simple JSON parser state
 typedef struct {
     const char *json;
     const char *current;
+    const char *end;        // The terminating NUL
     char *error;
+    ToonArena *arena;       // Destination of every node
+    ToonBuffer items;       // Scratch stack of JsonItem
+    ToonBuffer entries;     // Scratch stack of JsonEntry
+    ToonBuffer keys;        // Scratch bytes for keys and strings being parsed
+    size_t depth;           // Containers open around the cursor
+    size_t arrays;          // Arrays open around the cursor, when streaming
+    bool rebuild;           // Streaming gave up for the tree path
 } JsonParser;
 
+#define JSON_ITEMS(jp) ((JsonItem *)(jp)->items.data)
+#define JSON_ENTRIES(jp) ((JsonEntry *)(jp)->entries.data)
+#define JSON_ITEM_COUNT(jp) ((jp)->items.len / sizeof(JsonItem))
+#define JSON_ENTRY_COUNT(jp) ((jp)->entries.len / sizeof(JsonEntry))
+
 // Forward declarations
 static ToonValue *parse_json_value(JsonParser *jp);
 
-static void skip_json_whitespace(JsonParser *jp) {
-    while (*jp->current && isspace(*jp->current)) {
-        jp->current++;
+// Record the first error only
+static void json_error(JsonParser *jp, const char *message) {
+    if (!jp->error) jp->error = strdup(message);
+}
+
+// Enter a container, unless that nests deeper than the limit. Errors end
+// the parse, so only containers that close normally leave again.
+static bool json_descend(JsonParser *jp) {
+    if (jp->depth >= toon_max_depth()) {
+        json_error(jp, "Nesting too deep");
+        return false;
+    }
+    jp->depth++;
+    return true;
+}
+
+// Check the length of the input against the module's limit
+static bool json_check_input(JsonParser *jp) {
+    if (toon_max_input() && (size_t)(jp->end - jp->json) > toon_max_input()) {
+        json_error(jp, "Input too large");
+        return false;
     }
+    return true;
+}
+
+static void skip_json_whitespace(JsonParser *jp) {
+    jp->current = toon_scan_space(jp->current, jp->end);
 }
 
 static bool json_match(JsonParser *jp, const char *str) {
@@ -150,84 +285,302 @@ static char json_consume(JsonParser *jp) {
     return *jp->current ? *jp->current++ : '\0';
 }
 
-static char *parse_json_string(JsonParser *jp) {
+static ToonValue *json_new_value(JsonParser *jp, ToonType type) {
+    ToonValue *value = toon_value_create(jp->arena, type);
+    if (!value) json_error(jp, "Out of memory");
+    return value;
+}
+
+static void *json_arena_alloc(JsonParser *jp, size_t size) {
+    void *ptr = toon_arena_alloc(jp->arena, size);
+    if (!ptr) json_error(jp, "Out of memory");
+    return ptr;
+}
+
+static void json_push(JsonParser *jp, ToonBuffer *stack, const void *item, size_t size) {
+    toon_buffer_append(stack, item, size);
+    if (stack->failed) json_error(jp, "Out of memory");
+}
+
+// Stop bytes of the string scan
+static const ToonScanSet string_stops = {{'"', '\\', '"', '\\'}};
+
+// Parse a string literal, appending its unescaped bytes to the key stack
+static bool parse_json_string(JsonParser *jp) {
     if (json_consume(jp) != '"') {
-        jp->error = strdup("Expected '\"'");
-        return NULL;
+        json_error(jp, "Expected '\"'");
+        return false;
     }
 
-    char buffer[4096];
-    char *buf = buffer;
-    size_t remaining = sizeof(buffer) - 1;
+    const char *run = jp->current;
+    for (;;) {
+        jp->current = toon_scan_until(jp->current, jp->end, &string_stops);
+        if (json_peek(jp) != '\\') break;
+
+        toon_buffer_append(&jp->keys, run, jp->current - run);
+        jp->current++;
 
-    while (json_peek(jp) != '"' && json_peek(jp) != '\0') {
         char c = json_consume(jp);
-        if (c == '\\') {
-            c = json_consume(jp);
-            switch (c) {
-                case 'n':  c = '\n'; break;
-                case 'r':  c = '\r'; break;
-                case 't':  c = '\t'; break;
-                case '"':  c = '"'; break;
-                case '\\': c = '\\'; break;
-                case '/':  c = '/'; break;
-                default: break;
-            }
-        }
-        if (remaining > 0) {
-            *buf++ = c;
-            remaining--;
+        switch (c) {
+            case 'n':  c = '\n'; break;
+            case 'r':  c = '\r'; break;
+            case 't':  c = '\t'; break;
+            case '"':  c = '"'; break;
+            case '\\': c = '\\'; break;
+            case '/':  c = '/'; break;
+            default: break;
         }
+        if (c) toon_buffer_putc(&jp->keys, c);
+        run = jp->current;
     }
+    toon_buffer_append(&jp->keys, run, jp->current - run);
 
     if (json_consume(jp) != '"') {
-        jp->error = strdup("Expected closing '\"'");
-        return NULL;
+        json_error(jp, "Expected closing '\"'");
+        return false;
+    }
+
+    if (jp->keys.failed) {
+        json_error(jp, "Out of memory");
+        return false;
     }
 
-    *buf = '\0';
-    return strdup(buffer);
+    return true;
+}
+
+// Parse a string value straight into the arena
+static ToonValue *parse_json_string_value(JsonParser *jp) {
+    size_t start = jp->keys.len;
+    if (!parse_json_string(jp)) return NULL;
+
+    ToonValue *value = toon_value_string(jp->arena, jp->keys.data + start, jp->keys.len - start);
+    if (!value) json_error(jp, "Out of memory");
+
+    jp->keys.len = start;
+    return value;
+}
+
+// Move past a number's span and return where it starts
+static const char *scan_json_number(JsonParser *jp) {
+    const char *start = jp->current;
+
+    if (json_peek(jp) == '-') jp->current++;
+
+    while (isdigit((unsigned char)json_peek(jp)) || json_peek(jp) == '.' ||
+           json_peek(jp) == 'e' || json_peek(jp) == 'E' || json_peek(jp) == '+' || json_peek(jp) == '-') {
+        jp->current++;
+    }
+
+    return start;
 }
 
 static ToonValue *parse_json_number(JsonParser *jp) {
-    char buffer[64];
-    char *buf = buffer;
-    size_t remaining = sizeof(buffer) - 1;
+    const char *start = scan_json_number(jp);
+
+    ToonValue *value = toon_value_number(jp->arena, toon_number_parse(start, jp->current - start));
+    if (!value) json_error(jp, "Out of memory");
+
+    return value;
+}
+
+// Turn count entries starting at entry_start into an object node
+static ToonValue *materialize_object(JsonParser *jp, size_t entry_start, size_t count) {
+    ToonValue *value = json_new_value(jp, TOON_OBJECT);
+    if (!value || count == 0) return value;
+
+    ToonObjectEntry *entries = json_arena_alloc(jp, sizeof(ToonObjectEntry) * count);
+    if (!entries) return NULL;
+
+    for (size_t i = 0; i < count; i++) {
+        JsonEntry *entry = &JSON_ENTRIES(jp)[entry_start + i];
+        entries[i].key = toon_intern_key(jp->arena, jp->keys.data + entry->key_offset, entry->key_len);
+        entries[i].value = entry->value;
+        if (!entries[i].key) {
+            json_error(jp, "Out of memory");
+            return NULL;
+        }
+    }
+
+    value->value.object.entries = entries;
+    value->value.object.length = count;
+    value->value.object.capacity = count;
+    toon_object_index_build(jp->arena, value);
+    return value;
+}
+
+// Drop entries (and their keys) from entry_start to the top of the stack
+static void pop_entries(JsonParser *jp, size_t entry_start) {
+    if (entry_start < JSON_ENTRY_COUNT(jp)) {
+        jp->keys.len = JSON_ENTRIES(jp)[entry_start].key_offset;
+    }
+    jp->entries.len = entry_start * sizeof(JsonEntry);
+}
+
+// Parse an object. When pending is set the entries are left on the scratch
+// stack and described by item instead of being turned into a node.
+static bool parse_json_object(JsonParser *jp, bool pending, JsonItem *item) {
+    if (json_consume(jp) != '{') {
+        json_error(jp, "Expected '{'");
+        return false;
+    }
+    if (!json_descend(jp)) return false;
+
+    skip_json_whitespace(jp);
+
+    size_t entry_start = JSON_ENTRY_COUNT(jp);
+    size_t length = 0;
+
+    while (json_peek(jp) != '}' && json_peek(jp) != '\0') {
+        skip_json_whitespace(jp);
+
+        // Parse key
+        JsonEntry entry = { .key_offset = jp->keys.len };
+        if (!parse_json_string(jp)) return false;
+        entry.key_len = jp->keys.len - entry.key_offset;
+
+        skip_json_whitespace(jp);
+
+        if (json_consume(jp) != ':') {
+            json_error(jp, "Expected ':'");
+            return false;
+        }
+
+        skip_json_whitespace(jp);
+
+        // Parse value
+        entry.value = parse_json_value(jp);
+        if (!entry.value) return false;
+
+        json_push(jp, &jp->entries, &entry, sizeof(JsonEntry));
+        if (jp->error) return false;
+        length++;
+
+        skip_json_whitespace(jp);
 
-    if (json_peek(jp) == '-') {
-        *buf++ = json_consume(jp);
-        remaining--;
+        if (json_peek(jp) == ',') {
+            json_consume(jp);
+            skip_json_whitespace(jp);
+        }
     }
 
-    while (remaining > 0 && (isdigit(json_peek(jp)) || json_peek(jp) == '.' ||
-           json_peek(jp) == 'e' || json_peek(jp) == 'E' || json_peek(jp) == '+' || json_peek(jp) == '-')) {
-        *buf++ = json_consume(jp);
-        remaining--;
+    if (json_consume(jp) != '}') {
+        json_error(jp, "Expected '}'");
+        return false;
     }
 
-    *buf = '\0';
+    item->entry_start = entry_start;
+    item->entry_count = length;
+    jp->depth--;
 
-    ToonValue *value = toon_value_create(TOON_NUMBER);
-    if (value) {
-        value->value.number = strtod(buffer, NULL);
+    if (pending) {
+        item->value = NULL;
+        return true;
     }
 
-    return value;
+    item->value = materialize_object(jp, entry_start, length);
+    pop_entries(jp, entry_start);
+    return item->value != NULL;
+}
+
+// Check whether every element is a pending object with the same keys in the
+// same order and only scalar values, so the array can be stored as a
+// tabular array
+static bool items_are_uniform(JsonParser *jp, size_t item_start, size_t count) {
+    if (count < 2) return false;
+
+    JsonItem *items = &JSON_ITEMS(jp)[item_start];
+    if (items[0].value || items[0].entry_count == 0) return false;
+
+    JsonEntry *first = &JSON_ENTRIES(jp)[items[0].entry_start];
+    for (size_t i = 0; i < count; i++) {
+        if (items[i].value || items[i].entry_count != items[0].entry_count) return false;
+
+        JsonEntry *row = &JSON_ENTRIES(jp)[items[i].entry_start];
+        for (size_t col = 0; col < items[0].entry_count; col++) {
+            ToonType type = row[col].value->type;
+            if (type == TOON_ARRAY || type == TOON_OBJECT || type == TOON_TABULAR_ARRAY) {
+                return false;
+            }
+
+            if (row[col].key_len != first[col].key_len ||
+                memcmp(jp->keys.data + row[col].key_offset,
+                       jp->keys.data + first[col].key_offset, first[col].key_len) != 0) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Build a tabular array out of uniform pending objects. Their values were
+// parsed into the arena after mark; the columns are packed in a scratch
+// arena, the cells rewound away, and the packed array copied back.
+static ToonValue *build_tabular(JsonParser *jp, size_t item_start, size_t count, ToonArenaMark mark) {
+    JsonItem *items = &JSON_ITEMS(jp)[item_start];
+    size_t num_headers = items[0].entry_count;
+
+    ToonArena *scratch = toon_arena_create(0);
+    if (scratch) scratch->interning = jp->arena->interning;
+    bool sized = num_headers <= SIZE_MAX / sizeof(ToonValue *);
+    char **headers = scratch && sized ? toon_arena_calloc(scratch, num_headers, sizeof(char *)) : NULL;
+    ToonValue **cells = headers ? toon_arena_calloc(scratch, count, sizeof(ToonValue *) * num_headers) : NULL;
+    ToonValue *tabular = NULL;
+
+    if (headers && cells) {
+        // Headers come from the first object
+        bool ok = true;
+        for (size_t col = 0; ok && col < num_headers; col++) {
+            JsonEntry *entry = &JSON_ENTRIES(jp)[items[0].entry_start + col];
+            headers[col] = toon_arena_strndup(scratch, jp->keys.data + entry->key_offset, entry->key_len);
+            ok = headers[col] != NULL;
+        }
+
+        for (size_t row = 0; ok && row < count; row++) {
+            for (size_t col = 0; col < num_headers; col++) {
+                cells[row * num_headers + col] = JSON_ENTRIES(jp)[items[row].entry_start + col].value;
+            }
+        }
+
+        ToonValue *packed = ok ? toon_tabular_create(scratch, headers, num_headers, cells, count) : NULL;
+        if (packed) {
+            toon_arena_rewind(jp->arena, mark);
+            tabular = toon_value_copy(jp->arena, packed);
+        }
+    }
+
+    toon_arena_destroy(scratch);
+    if (!tabular) json_error(jp, "Out of memory");
+    return tabular;
 }
 
 static ToonValue *parse_json_array(JsonParser *jp) {
     if (json_consume(jp) != '[') {
-        jp->error = strdup("Expected '['");
+        json_error(jp, "Expected '['");
         return NULL;
     }
+    if (!json_descend(jp)) return NULL;
 
     skip_json_whitespace(jp);
 
-    ToonValue **elements = malloc(sizeof(ToonValue *) * 256);
+    ToonArenaMark mark = toon_arena_mark(jp->arena);
+    size_t item_start = JSON_ITEM_COUNT(jp);
+    size_t entry_start = JSON_ENTRY_COUNT(jp);
     size_t length = 0;
 
-    while (json_peek(jp) != ']' && json_peek(jp) != '\0' && length < 256) {
-        elements[length++] = parse_json_value(jp);
+    while (json_peek(jp) != ']' && json_peek(jp) != '\0') {
+        JsonItem item = { 0 };
+        if (json_peek(jp) == '{') {
+            if (!parse_json_object(jp, true, &item)) return NULL;
+        } else {
+            item.value = parse_json_value(jp);
+            if (!item.value) return NULL;
+        }
+
+        json_push(jp, &jp->items, &item, sizeof(JsonItem));
+        if (jp->error) return NULL;
+        length++;
+
         skip_json_whitespace(jp);
 
         if (json_peek(jp) == ',') {
@@ -237,186 +590,544 @@ static ToonValue *parse_json_array(JsonParser *jp) {
     }
 
     if (json_consume(jp) != ']') {
-        jp->error = strdup("Expected ']'");
-        for (size_t i = 0; i < length; i++) {
-            toon_value_free(elements[i]);
-        }
-        free(elements);
+        json_error(jp, "Expected ']'");
         return NULL;
     }
 
+    ToonValue *value;
+
     // Check if this should be a tabular array (array of uniform objects)
-    bool is_tabular = length > 0 && elements[0]->type == TOON_OBJECT;
-    if (is_tabular && length > 1) {
-        // Check if all objects have the same keys
-        size_t first_len = elements[0]->value.object.length;
-        for (size_t i = 1; i < length; i++) {
-            if (elements[i]->type != TOON_OBJECT ||
-                elements[i]->value.object.length != first_len) {
-                is_tabular = false;
-                break;
+    if (items_are_uniform(jp, item_start, length)) {
+        value = build_tabular(jp, item_start, length, mark);
+    } else {
+        value = json_new_value(jp, TOON_ARRAY);
+        ToonValue **elements = NULL;
+        if (value && length > 0) {
+            elements = json_arena_alloc(jp, sizeof(ToonValue *) * length);
+            for (size_t i = 0; elements && i < length; i++) {
+                JsonItem *item = &JSON_ITEMS(jp)[item_start + i];
+                elements[i] = item->value ? item->value
+                                          : materialize_object(jp, item->entry_start, item->entry_count);
+                if (!elements[i]) {
+                    elements = NULL;
+                }
             }
+            if (!elements) value = NULL;
         }
 
-        // Convert to tabular array if uniform
-        if (is_tabular && first_len > 0) {
-            ToonValue *tabular = toon_value_create(TOON_TABULAR_ARRAY);
+        if (value) {
+            value->value.array.elements = elements;
+            value->value.array.length = length;
+            value->value.array.capacity = length;
+        }
+    }
 
-            // Copy headers from first object
-            tabular->value.tabular.num_headers = first_len;
-            tabular->value.tabular.headers = malloc(sizeof(char *) * first_len);
-            for (size_t i = 0; i < first_len; i++) {
-                tabular->value.tabular.headers[i] = strdup(elements[0]->value.object.entries[i].key);
-            }
+    jp->items.len = item_start * sizeof(JsonItem);
+    pop_entries(jp, entry_start);
+    jp->depth--;
+    return value;
+}
 
-            // Copy values into rows
-            tabular->value.tabular.num_rows = length;
-            tabular->value.tabular.rows = malloc(sizeof(ToonValue **) * length);
-            for (size_t row = 0; row < length; row++) {
-                tabular->value.tabular.rows[row] = malloc(sizeof(ToonValue *) * first_len);
-                for (size_t col = 0; col < first_len; col++) {
-                    // Transfer ownership of the value
-                    tabular->value.tabular.rows[row][col] = elements[row]->value.object.entries[col].value;
-                    elements[row]->value.object.entries[col].value = NULL;
-                }
-            }
+static ToonValue *parse_json_value(JsonParser *jp) {
+    skip_json_whitespace(jp);
 
-            // Free original array elements (shallow)
-            for (size_t i = 0; i < length; i++) {
-                toon_value_free(elements[i]);
-            }
-            free(elements);
+    char c = json_peek(jp);
 
-            return tabular;
-        }
+    if (c == '"') {
+        return parse_json_string_value(jp);
+    } else if (c == '{') {
+        JsonItem item;
+        return parse_json_object(jp, false, &item) ? item.value : NULL;
+    } else if (c == '[') {
+        return parse_json_array(jp);
+    } else if (json_match(jp, "true")) {
+        return toon_value_boolean(true);
+    } else if (json_match(jp, "false")) {
+        return toon_value_boolean(false);
+    } else if (json_match(jp, "null")) {
+        return toon_value_null();
+    } else if (isdigit(c) || c == '-') {
+        return parse_json_number(jp);
     }
 
-    ToonValue *value = toon_value_create(TOON_ARRAY);
-    value->value.array.elements = elements;
-    value->value.array.length = length;
-
-    return value;
+    json_error(jp, "Unexpected character");
+    return NULL;
 }
 
-static ToonValue *parse_json_object(JsonParser *jp) {
-    if (json_consume(jp) != '{') {
-        jp->error = strdup("Expected '{'");
+// Public JSON to TOON conversion. Nodes are allocated in arena; on error
+// everything allocated by this call is released again, and nothing is
+// added to the intern pool.
+ToonValue *json_to_toon(ToonArena *arena, const char *json_string, char **error) {
+    JsonParser jp = {
+        .json = json_string,
+        .current = json_string,
+        .end = json_string + strlen(json_string),
+        .error = NULL,
+        .arena = arena
+    };
+    toon_buffer_init(&jp.items, 0);
+    toon_buffer_init(&jp.entries, 0);
+    toon_buffer_init(&jp.keys, 0);
+
+    ToonArenaMark mark = toon_arena_mark(arena);
+    ToonInternBatch batch;
+    toon_intern_begin(arena, &batch);
+    ToonValue *result = json_check_input(&jp) ? parse_json_value(&jp) : NULL;
+
+    toon_buffer_free(&jp.items);
+    toon_buffer_free(&jp.entries);
+    toon_buffer_free(&jp.keys);
+
+    toon_intern_end(arena, &batch, !jp.error && result);
+    if (jp.error || !result) {
+        json_error(&jp, "Out of memory");
+        *error = jp.error;
+        toon_arena_rewind(arena, mark);
         return NULL;
     }
 
+    return result;
+}
+
+// ============================================================================
+// Streaming JSON to TOON text
+// ============================================================================
+
+// Writes the text toon_encode gives for the tree json_to_toon builds, in
+// one pass over the JSON and without building the tree. The encoder needs
+// an array's length and layout before its first element, so each array is
+// classified by a lookahead over its own span first; the lookahead keeps
+// nothing but the first element's keys. Memory is the output, the longest
+// string and the nesting depth.
+//
+// Each lookahead rescans the spans of the arrays nested in its own, so
+// the scan costs the size times the depth of arrays in arrays. Past a few
+// levels the stream stops and the text is converted through a tree.
+
+// Arrays the stream opens inside each other before it gives up
+#define TOON_JSON_STREAM_ARRAYS 4
+
+// What an array turns into, found by the lookahead
+typedef struct {
+    size_t length;
+    bool all_primitives;    // Written inline, comma separated
+    bool uniform;           // Written as a tabular array; headers are on jp->entries
+    size_t num_headers;
+} JsonArrayShape;
+
+static void stream_json_value(JsonParser *jp, ToonBuffer *out, int indent_level);
+
+// Move past a string literal without unescaping it
+static bool skip_json_string(JsonParser *jp) {
+    if (json_consume(jp) != '"') return false;
+
+    for (;;) {
+        jp->current = toon_scan_until(jp->current, jp->end, &string_stops);
+        if (json_peek(jp) != '\\') break;
+        jp->current++;
+        if (json_consume(jp) == '\0') return false;
+    }
+    return json_consume(jp) == '"';
+}
+
+// Move past a value without keeping anything; false if it is malformed
+static bool skip_json_value(JsonParser *jp) {
     skip_json_whitespace(jp);
+    char c = json_peek(jp);
 
-    ToonObjectEntry *entries = malloc(sizeof(ToonObjectEntry) * 256);
-    size_t length = 0;
+    if (c == '"') return skip_json_string(jp);
 
-    while (json_peek(jp) != '}' && json_peek(jp) != '\0' && length < 256) {
+    if (c == '{' || c == '[') {
+        // Too deep reads as malformed; the stream proper reports it
+        if (jp->depth >= toon_max_depth()) return false;
+        jp->depth++;
+
+        char close = c == '{' ? '}' : ']';
+        json_consume(jp);
         skip_json_whitespace(jp);
 
-        // Parse key
-        char *key = parse_json_string(jp);
-        if (!key) {
-            for (size_t i = 0; i < length; i++) {
-                free(entries[i].key);
-                toon_value_free(entries[i].value);
+        bool ok = true;
+        while (ok && json_peek(jp) != close && json_peek(jp) != '\0') {
+            if (close == '}') {
+                skip_json_whitespace(jp);
+                ok = skip_json_string(jp);
+                skip_json_whitespace(jp);
+                ok = ok && json_consume(jp) == ':';
+            }
+            ok = ok && skip_json_value(jp);
+
+            skip_json_whitespace(jp);
+            if (json_peek(jp) == ',') {
+                json_consume(jp);
+                skip_json_whitespace(jp);
             }
-            free(entries);
-            return NULL;
         }
 
+        jp->depth--;
+        return ok && json_consume(jp) == close;
+    }
+
+    if (json_match(jp, "true") || json_match(jp, "false") || json_match(jp, "null")) return true;
+
+    if (isdigit((unsigned char)c) || c == '-') {
+        scan_json_number(jp);
+        return true;
+    }
+    return false;
+}
+
+static bool json_is_container(char c) {
+    return c == '{' || c == '[';
+}
+
+// Check one object element of an array against the headers, or record them
+// from the first. Leaves the cursor after the object.
+static bool shape_object(JsonParser *jp, JsonArrayShape *shape) {
+    json_consume(jp);
+    skip_json_whitespace(jp);
+
+    bool first = shape->length == 0;
+    size_t col = 0;
+
+    while (json_peek(jp) != '}' && json_peek(jp) != '\0') {
         skip_json_whitespace(jp);
 
-        if (json_consume(jp) != ':') {
-            jp->error = strdup("Expected ':'");
-            free(key);
-            for (size_t i = 0; i < length; i++) {
-                free(entries[i].key);
-                toon_value_free(entries[i].value);
+        size_t key_start = jp->keys.len;
+        if (!parse_json_string(jp)) return false;
+        size_t key_len = jp->keys.len - key_start;
+
+        if (first) {
+            // Headers stay on the key stack, described by entries
+            JsonEntry header = {.key_offset = key_start, .key_len = key_len};
+            json_push(jp, &jp->entries, &header, sizeof(JsonEntry));
+            if (jp->error) return false;
+            shape->num_headers++;
+        } else {
+            JsonEntry *header = col < shape->num_headers ? &JSON_ENTRIES(jp)[col] : NULL;
+            if (!header || header->key_len != key_len ||
+                memcmp(jp->keys.data + header->key_offset, jp->keys.data + key_start, key_len) != 0) {
+                shape->uniform = false;
             }
-            free(entries);
-            return NULL;
+            jp->keys.len = key_start;
         }
+        col++;
 
+        skip_json_whitespace(jp);
+        if (json_consume(jp) != ':') return false;
         skip_json_whitespace(jp);
 
-        // Parse value
-        ToonValue *val = parse_json_value(jp);
+        if (json_is_container(json_peek(jp))) shape->uniform = false;
+        if (!skip_json_value(jp)) return false;
 
-        entries[length].key = key;
-        entries[length].value = val;
-        length++;
+        skip_json_whitespace(jp);
+        if (json_peek(jp) == ',') {
+            json_consume(jp);
+            skip_json_whitespace(jp);
+        }
+    }
+
+    if (col != shape->num_headers) shape->uniform = false;
+    return json_consume(jp) == '}';
+}
+
+// Look ahead over the array at the cursor, which is left where it was.
+// A malformed array stops the lookahead early.
+static void shape_json_array(JsonParser *jp, JsonArrayShape *shape) {
+    const char *start = jp->current;
+    size_t keys_len = jp->keys.len;
+
+    memset(shape, 0, sizeof(*shape));
+    shape->all_primitives = true;
+    shape->uniform = true;
+
+    json_consume(jp);
+    skip_json_whitespace(jp);
+
+    while (json_peek(jp) != ']' && json_peek(jp) != '\0') {
+        char c = json_peek(jp);
+        if (json_is_container(c)) shape->all_primitives = false;
+
+        bool ok;
+        if (c == '{' && shape->uniform) {
+            ok = shape_object(jp, shape);
+        } else {
+            shape->uniform = false;
+            ok = skip_json_value(jp);
+        }
+        if (!ok) {
+            shape->uniform = false;
+            break;
+        }
+        shape->length++;
 
         skip_json_whitespace(jp);
+        if (json_peek(jp) == ',') {
+            json_consume(jp);
+            skip_json_whitespace(jp);
+        }
+    }
 
+    // As in items_are_uniform, a table needs two rows and a column. Rows
+    // are written trusting the lookahead, so a malformed array takes the
+    // general path, which finds the error.
+    if (shape->length < 2 || shape->num_headers == 0 || json_peek(jp) != ']') shape->uniform = false;
+    if (!shape->uniform) {
+        jp->entries.len = 0;
+        jp->keys.len = keys_len;
+        shape->num_headers = 0;
+    }
+
+    jp->current = start;
+}
+
+// Write a scalar exactly as the encoder writes its node
+static void stream_json_scalar(JsonParser *jp, ToonBuffer *out) {
+    ToonValue value = {.type = TOON_NULL};
+    char c = json_peek(jp);
+
+    if (c == '"') {
+        size_t start = jp->keys.len;
+        if (!parse_json_string(jp)) return;
+        toon_buffer_putc(&jp->keys, '\0');
+        if (jp->keys.failed) {
+            json_error(jp, "Out of memory");
+            return;
+        }
+
+        value.type = TOON_STRING;
+        value.value.string = jp->keys.data + start;
+        toon_encode_to(out, &value, 0);
+        jp->keys.len = start;
+        return;
+    }
+
+    if (json_match(jp, "true")) {
+        value.type = TOON_BOOLEAN;
+        value.value.boolean = true;
+    } else if (json_match(jp, "false")) {
+        value.type = TOON_BOOLEAN;
+    } else if (json_match(jp, "null")) {
+        value.type = TOON_NULL;
+    } else if (isdigit((unsigned char)c) || c == '-') {
+        const char *start = scan_json_number(jp);
+        value.type = TOON_NUMBER;
+        value.value.number = toon_number_parse(start, jp->current - start);
+    } else {
+        json_error(jp, "Unexpected character");
+        return;
+    }
+
+    toon_encode_to(out, &value, 0);
+}
+
+// Write a key from the key stack as far as a NUL in it, as the encoder
+// would
+static void stream_json_key(JsonParser *jp, ToonBuffer *out, size_t offset, size_t len) {
+    const char *key = jp->keys.data + offset;
+    const char *nul = memchr(key, '\0', len);
+    toon_buffer_append(out, key, nul ? (size_t)(nul - key) : len);
+}
+
+// Mirror of encode_object
+static void stream_json_object(JsonParser *jp, ToonBuffer *out, int indent_level) {
+    json_consume(jp);
+    if (!json_descend(jp)) return;
+    skip_json_whitespace(jp);
+
+    size_t i = 0;
+    while (!jp->error && json_peek(jp) != '}' && json_peek(jp) != '\0') {
+        skip_json_whitespace(jp);
+
+        size_t key_start = jp->keys.len;
+        if (!parse_json_string(jp)) return;
+
+        skip_json_whitespace(jp);
+        if (json_consume(jp) != ':') {
+            json_error(jp, "Expected ':'");
+            return;
+        }
+
+        if (i > 0) toon_buffer_fill(out, ' ', indent_level * 2);
+        stream_json_key(jp, out, key_start, jp->keys.len - key_start);
+        toon_buffer_append(out, ": ", 2);
+        jp->keys.len = key_start;
+
+        stream_json_value(jp, out, indent_level + 1);
+        toon_buffer_putc(out, '\n');
+        i++;
+
+        skip_json_whitespace(jp);
         if (json_peek(jp) == ',') {
             json_consume(jp);
             skip_json_whitespace(jp);
         }
     }
 
-    if (json_consume(jp) != '}') {
-        jp->error = strdup("Expected '}'");
-        for (size_t i = 0; i < length; i++) {
-            free(entries[i].key);
-            toon_value_free(entries[i].value);
+    if (!jp->error && json_consume(jp) != '}') json_error(jp, "Expected '}'");
+    jp->depth--;
+}
+
+// Mirror of encode_tabular_array; every row has the headers' keys in order
+// and scalar values, as the lookahead found
+static void stream_json_tabular(JsonParser *jp, ToonBuffer *out, const JsonArrayShape *shape,
+                                int indent_level) {
+    // Rows nest as deep as the objects they were
+    if (!json_descend(jp)) return;
+
+    toon_buffer_putc(out, '[');
+    toon_buffer_append_size(out, shape->length);
+    toon_buffer_append(out, ",]{", 3);
+    for (size_t col = 0; col < shape->num_headers; col++) {
+        if (col > 0) toon_buffer_putc(out, ',');
+        stream_json_key(jp, out, JSON_ENTRIES(jp)[col].key_offset, JSON_ENTRIES(jp)[col].key_len);
+    }
+    toon_buffer_append(out, "}:\n", 3);
+
+    json_consume(jp);
+    for (size_t row = 0; row < shape->length && !jp->error; row++) {
+        skip_json_whitespace(jp);
+        json_consume(jp);  // {
+        toon_buffer_fill(out, ' ', indent_level * 2);
+
+        for (size_t col = 0; col < shape->num_headers && !jp->error; col++) {
+            skip_json_whitespace(jp);
+            skip_json_string(jp);
+            skip_json_whitespace(jp);
+            json_consume(jp);  // :
+            skip_json_whitespace(jp);
+
+            if (col > 0) toon_buffer_putc(out, ',');
+            stream_json_scalar(jp, out);
+
+            skip_json_whitespace(jp);
+            if (json_peek(jp) == ',') json_consume(jp);
         }
-        free(entries);
-        return NULL;
+        skip_json_whitespace(jp);
+        json_consume(jp);  // }
+        toon_buffer_putc(out, '\n');
+
+        skip_json_whitespace(jp);
+        if (json_peek(jp) == ',') json_consume(jp);
     }
 
-    ToonValue *value = toon_value_create(TOON_OBJECT);
-    value->value.object.entries = entries;
-    value->value.object.length = length;
+    skip_json_whitespace(jp);
+    if (!jp->error && json_consume(jp) != ']') json_error(jp, "Expected ']'");
+    jp->depth--;
+}
 
-    return value;
+// Mirror of encode_array
+static void stream_json_array(JsonParser *jp, ToonBuffer *out, int indent_level) {
+    if (jp->arrays == TOON_JSON_STREAM_ARRAYS) {
+        jp->rebuild = true;
+        json_error(jp, "Arrays nest too deep to stream");
+        return;
+    }
+    if (!json_descend(jp)) return;
+    jp->arrays++;
+
+    JsonArrayShape shape;
+    shape_json_array(jp, &shape);
+
+    if (shape.uniform) {
+        stream_json_tabular(jp, out, &shape, indent_level);
+
+        // Drop the headers; no other array can be open inside a table
+        if (jp->entries.len) jp->keys.len = JSON_ENTRIES(jp)[0].key_offset;
+        jp->entries.len = 0;
+        jp->depth--;
+        jp->arrays--;
+        return;
+    }
+
+    toon_buffer_putc(out, '[');
+    toon_buffer_append_size(out, shape.length);
+    toon_buffer_append(out, shape.all_primitives ? "]: " : "]:\n", 3);
+
+    json_consume(jp);
+    skip_json_whitespace(jp);
+
+    size_t i = 0;
+    while (!jp->error && json_peek(jp) != ']' && json_peek(jp) != '\0') {
+        if (shape.all_primitives) {
+            if (i > 0) toon_buffer_putc(out, ',');
+            stream_json_value(jp, out, 0);
+        } else {
+            toon_buffer_fill(out, ' ', (indent_level + 1) * 2);
+            toon_buffer_append(out, "- ", 2);
+            stream_json_value(jp, out, indent_level + 1);
+            toon_buffer_putc(out, '\n');
+        }
+        i++;
+
+        skip_json_whitespace(jp);
+        if (json_peek(jp) == ',') {
+            json_consume(jp);
+            skip_json_whitespace(jp);
+        }
+    }
+
+    if (!jp->error && json_consume(jp) != ']') json_error(jp, "Expected ']'");
+    jp->depth--;
+    jp->arrays--;
 }
 
-static ToonValue *parse_json_value(JsonParser *jp) {
+static void stream_json_value(JsonParser *jp, ToonBuffer *out, int indent_level) {
     skip_json_whitespace(jp);
 
     char c = json_peek(jp);
-
-    if (c == '"') {
-        char *str = parse_json_string(jp);
-        ToonValue *value = toon_value_create(TOON_STRING);
-        value->value.string = str;
-        return value;
-    } else if (c == '{') {
-        return parse_json_object(jp);
+    if (c == '{') {
+        stream_json_object(jp, out, indent_level);
     } else if (c == '[') {
-        return parse_json_array(jp);
-    } else if (json_match(jp, "true")) {
-        ToonValue *value = toon_value_create(TOON_BOOLEAN);
-        value->value.boolean = true;
-        return value;
-    } else if (json_match(jp, "false")) {
-        ToonValue *value = toon_value_create(TOON_BOOLEAN);
-        value->value.boolean = false;
-        return value;
-    } else if (json_match(jp, "null")) {
-        return toon_value_create(TOON_NULL);
-    } else if (isdigit(c) || c == '-') {
-        return parse_json_number(jp);
+        stream_json_array(jp, out, indent_level);
+    } else {
+        stream_json_scalar(jp, out);
     }
+}
 
-    jp->error = strdup("Unexpected character");
-    return NULL;
+// Convert JSON text through a tree, for arrays nested too deep to stream
+static bool transcode_json_tree(ToonBuffer *out, const char *json_string, char **error) {
+    ToonArena *arena = toon_arena_create(strlen(json_string));
+    if (!arena) {
+        *error = strdup("Out of memory");
+        return false;
+    }
+
+    ToonValue *root = json_to_toon(arena, json_string, error);
+    if (root) toon_encode_to(out, root, 0);
+    toon_arena_destroy(arena);
+
+    if (root && out->failed) *error = strdup("Out of memory");
+    return root && !out->failed;
 }
 
-// Public JSON to TOON conversion
-ToonValue *json_to_toon(const char *json_string, char **error) {
+// Convert JSON text to TOON text, appended to out. On error nothing is
+// appended and *error is set, as for json_to_toon.
+bool toon_transcode_json(ToonBuffer *out, const char *json_string, char **error) {
     JsonParser jp = {
         .json = json_string,
         .current = json_string,
+        .end = json_string + strlen(json_string),
         .error = NULL
     };
+    toon_buffer_init(&jp.entries, 0);
+    toon_buffer_init(&jp.keys, 0);
 
-    ToonValue *result = parse_json_value(&jp);
+    size_t start = out->len;
+    if (json_check_input(&jp)) stream_json_value(&jp, out, 0);
 
-    if (jp.error) {
+    toon_buffer_free(&jp.entries);
+    toon_buffer_free(&jp.keys);
+
+    if (jp.rebuild && !out->failed) {
+        free(jp.error);
+        out->len = start;
+        return transcode_json_tree(out, json_string, error);
+    }
+    if (jp.error || out->failed) {
+        json_error(&jp, "Out of memory");
         *error = jp.error;
-        if (result) toon_value_free(result);
-        return NULL;
+        if (!out->failed) out->len = start;
+        return false;
     }
-
-    return result;
+    return true;
 }
@@ -1,126 +1,973 @@
 #include "redistoon.h"
+#include <math.h>
+#include <stddef.h>
 
-// Create a new TOON value
-ToonValue *toon_value_create(ToonType type) {
-    ToonValue *value = calloc(1, sizeof(ToonValue));
+// Compact a document once this much of its arena is unreachable and the
+// waste is at least half of everything allocated
+#define TOON_COMPACT_MIN_WASTE (16 * 1024)
+
+// Active defrag compacts documents with less waste than that, up to this
+// much live tree
+#define TOON_DEFRAG_MIN_WASTE (4 * 1024)
+#define TOON_DEFRAG_MAX_REBUILD (64 * 1024)
+
+// Freeing effort comes in units of this much arena. Redis frees a value on
+// its lazyfree thread once the effort passes 64, and arenas past the same
+// threshold go to a worker, so documents from 4MB on are freed off the
+// main thread.
+#define TOON_FREE_EFFORT_UNIT (64 * 1024)
+#define TOON_LAZYFREE_THRESHOLD 64
+
+// Most frozen arenas a document's tree may point into. A clone of a
+// document with this many is a deep copy instead, so ownership checks and
+// releases stay short.
+#define TOON_MAX_SHARED 8
+
+// Pinned snapshots whose document still uses the tree, so a flush can
+// detach them all before the keyspace is freed on another thread
+static ToonSnapshot *attached_snapshots = NULL;
+
+// Limits on what the parsers accept
+static size_t max_depth = TOON_DEFAULT_MAX_DEPTH;
+static size_t max_input = 0;
+
+// Nodes are allocated only as large as their type's member of the union:
+// 16 bytes for a scalar, 32 for an array and 40 for an object, against
+// 48 for a full ToonValue. A string node carries its bytes inline after
+// it, or points at the interned copy. Null, the booleans and the integers
+// from 0 to TOON_SMALL_INT_MAX are shared, immutable nodes that are never
+// allocated, so an array of them costs a pointer per element.
+//
+// A node may therefore be smaller than sizeof(ToonValue): it is only ever
+// used through a pointer and never copied whole.
+
+#define TOON_NODE_SIZE(member) (offsetof(ToonValue, value) + sizeof(((ToonValue *)0)->value.member))
+
+#define TOON_SMALL_INT_MAX 255
+
+// Shared nodes, with their token estimate already counted
+#define SHARED_NUMBER(n) {.type = TOON_NUMBER, .tokens = 2, .value.number = (n)}
+#define SHARED_NUMBERS_4(n) SHARED_NUMBER(n), SHARED_NUMBER((n) + 1), SHARED_NUMBER((n) + 2), SHARED_NUMBER((n) + 3)
+#define SHARED_NUMBERS_16(n) SHARED_NUMBERS_4(n), SHARED_NUMBERS_4((n) + 4), SHARED_NUMBERS_4((n) + 8), \
+                             SHARED_NUMBERS_4((n) + 12)
+#define SHARED_NUMBERS_64(n) SHARED_NUMBERS_16(n), SHARED_NUMBERS_16((n) + 16), SHARED_NUMBERS_16((n) + 32), \
+                             SHARED_NUMBERS_16((n) + 48)
+
+static ToonValue shared_values[] = {
+    {.type = TOON_NULL, .tokens = 2},
+    {.type = TOON_BOOLEAN, .tokens = 2, .value.boolean = false},
+    {.type = TOON_BOOLEAN, .tokens = 2, .value.boolean = true},
+    SHARED_NUMBERS_64(0), SHARED_NUMBERS_64(64), SHARED_NUMBERS_64(128), SHARED_NUMBERS_64(192)
+};
+
+#define SHARED_NUMBERS_START 3
+
+// Bytes a node of type takes
+size_t toon_node_size(ToonType type) {
+    switch (type) {
+        case TOON_ARRAY:         return TOON_NODE_SIZE(array);
+        case TOON_OBJECT:        return TOON_NODE_SIZE(object);
+        case TOON_TABULAR_ARRAY: return sizeof(ToonValue);
+        default:                 return TOON_NODE_SIZE(number);
+    }
+}
+
+// Set the deepest nesting the parsers accept, up to TOON_MAX_DEPTH_LIMIT.
+// Only called at module load, before any parsing.
+void toon_set_max_depth(size_t depth) {
+    max_depth = depth < TOON_MAX_DEPTH_LIMIT ? depth : TOON_MAX_DEPTH_LIMIT;
+}
+
+size_t toon_max_depth(void) {
+    return max_depth;
+}
+
+// Set the most bytes of text the parsers accept, 0 for no limit of their own
+void toon_set_max_input(size_t bytes) {
+    max_input = bytes;
+}
+
+size_t toon_max_input(void) {
+    return max_input;
+}
+
+// Count a node allocated from arena, and in the module totals too once
+// the arena belongs to a document; bytes only matter for strings
+static void count_node(ToonArena *arena, ToonType type, size_t bytes) {
+    arena->nodes.count[type]++;
+    if (type == TOON_STRING) arena->nodes.string_bytes += bytes;
+    if (arena->tracked) toon_stats_count_node(type, bytes, false);
+}
+
+static void uncount_node(ToonArena *arena, ToonType type, size_t bytes) {
+    arena->nodes.count[type]--;
+    if (type == TOON_STRING) arena->nodes.string_bytes -= bytes;
+    if (arena->tracked) toon_stats_count_node(type, bytes, true);
+}
+
+// Create a new TOON value in an arena
+ToonValue *toon_value_create(ToonArena *arena, ToonType type) {
+    ToonValue *value = toon_arena_calloc(arena, 1, toon_node_size(type));
     if (!value) return NULL;
+    count_node(arena, type, toon_arena_alloc_size(toon_node_size(type)));
 
+    // calloc leaves strings, arrays, objects and tabular arrays empty
     value->type = type;
+    return value;
+}
+
+ToonValue *toon_value_null(void) {
+    return &shared_values[0];
+}
+
+ToonValue *toon_value_boolean(bool boolean) {
+    return &shared_values[boolean ? 2 : 1];
+}
+
+// A number node, shared for small non-negative integers
+ToonValue *toon_value_number(ToonArena *arena, double number) {
+    if (number >= 0 && number <= TOON_SMALL_INT_MAX && number == (int)number && !signbit(number)) {
+        return &shared_values[SHARED_NUMBERS_START + (int)number];
+    }
+
+    ToonValue *value = toon_value_create(arena, TOON_NUMBER);
+    if (value) value->value.number = number;
+    return value;
+}
+
+// A string node pointing at shared, or holding a copy of the len bytes at
+// str inline when shared is NULL
+static ToonValue *string_node(ToonArena *arena, const char *str, size_t len, const char *shared) {
+    size_t size = TOON_NODE_SIZE(string) + (shared ? 0 : len + 1);
+    ToonValue *value = toon_arena_alloc(arena, size);
+    if (!value) return NULL;
+    count_node(arena, TOON_STRING, toon_arena_alloc_size(size));
+
+    value->type = TOON_STRING;
+    value->tokens = 0;
+    if (shared) {
+        value->value.string = (char *)shared;
+    } else {
+        value->value.string = (char *)value + TOON_NODE_SIZE(string);
+        memcpy(value->value.string, str, len);
+        value->value.string[len] = '\0';
+    }
+    return value;
+}
+
+// A string node for the len bytes at str, sharing the interned copy of
+// short repeated values
+ToonValue *toon_value_string(ToonArena *arena, const char *str, size_t len) {
+    bool pending;
+    ToonValue *value = string_node(arena, str, len, toon_intern_value(arena, str, len, &pending));
+    if (value && pending) toon_intern_note(arena, value->value.string);
+    return value;
+}
+
+// Whether value is one of the shared nodes, which belong to no arena
+bool toon_value_is_shared(const ToonValue *value) {
+    return (uintptr_t)value - (uintptr_t)shared_values < sizeof(shared_values);
+}
+
+static bool string_is_inline(const ToonValue *value) {
+    return value->value.string == (const char *)value + TOON_NODE_SIZE(string);
+}
+
+// Bytes of a string node, with its bytes when they are inline
+static size_t string_node_size(const ToonValue *value) {
+    size_t size = TOON_NODE_SIZE(string);
+    if (string_is_inline(value)) size += strlen(value->value.string) + 1;
+    return toon_arena_alloc_size(size);
+}
+
+// Bytes of arena memory held by a string node and its bytes
+static size_t string_footprint(const ToonValue *value) {
+    const char *str = value->value.string;
+    size_t bytes = string_node_size(value);
+    if (!string_is_inline(value) && str) bytes += toon_string_footprint(str);
+    return bytes;
+}
+
+// Children of an array or object, for the walks below
+static bool is_container(const ToonValue *value) {
+    return value && (value->type == TOON_ARRAY || value->type == TOON_OBJECT);
+}
+
+static size_t container_length(const ToonValue *value) {
+    return value->type == TOON_ARRAY ? value->value.array.length : value->value.object.length;
+}
+
+// Child i of a container, setting *key to its key in an object
+static ToonValue *container_child(const ToonValue *value, size_t i, const char **key) {
+    if (value->type == TOON_ARRAY) {
+        *key = NULL;
+        return value->value.array.elements[i];
+    }
+
+    *key = value->value.object.entries[i].key;
+    return value->value.object.entries[i].value;
+}
+
+// Whether a node counts towards the arena memory owner handed out, or
+// towards any arena when owner is NULL
+static bool node_owned(const ToonValue *value, const ToonArena *owner) {
+    return value && !toon_value_is_shared(value) && (!owner || toon_arena_owns(owner, value));
+}
+
+// Bytes of arena memory an owned node holds, not counting its children
+static size_t node_footprint(const ToonValue *value, const ToonArena *owner) {
+    if (value->type == TOON_STRING) return string_footprint(value);
+
+    size_t bytes = toon_arena_alloc_size(toon_node_size(value->type));
+
+    switch (value->type) {
+        case TOON_ARRAY:
+            if (value->value.array.elements) {
+                bytes += toon_arena_alloc_size(sizeof(ToonValue *) * value->value.array.capacity);
+            }
+            break;
+
+        case TOON_OBJECT:
+            if (value->value.object.entries) {
+                bytes += toon_arena_alloc_size(sizeof(ToonObjectEntry) * value->value.object.capacity);
+            }
+            for (size_t i = 0; i < value->value.object.length; i++) {
+                const char *key = value->value.object.entries[i].key;
+                if (!owner || toon_arena_owns(owner, key)) bytes += toon_string_footprint(key);
+            }
+            bytes += toon_object_index_footprint(value);
+            break;
+
+        case TOON_TABULAR_ARRAY:
+            bytes += toon_tabular_footprint(&value->value.tabular);
+            break;
 
-    switch (type) {
         case TOON_NULL:
         case TOON_BOOLEAN:
         case TOON_NUMBER:
-            // No additional initialization needed
+        case TOON_STRING:
             break;
+    }
+
+    return bytes;
+}
+
+// Take an owned node out of arena's node counts, with a table's mixed
+// cells, which are nodes of their own but never containers
+static void node_uncount(ToonArena *arena, const ToonValue *value) {
+    if (value->type == TOON_TABULAR_ARRAY) {
+        const ToonTabularArray *tab = &value->value.tabular;
+        const ToonArena *owner = arena->borrows ? arena : NULL;
+        for (size_t col = 0; col < tab->num_headers; col++) {
+            if (tab->columns[col].type != TOON_COLUMN_MIXED) continue;
+            for (size_t row = 0; row < tab->num_rows; row++) {
+                const ToonValue *cell = tab->columns[col].data.values[row];
+                if (node_owned(cell, owner)) node_uncount(arena, cell);
+            }
+        }
+    }
+
+    uncount_node(arena, value->type, value->type == TOON_STRING ? string_node_size(value) : 0);
+}
+
+// A container whose children are still to be walked
+typedef struct {
+    const ToonValue *value;
+    size_t next;
+} WalkFrame;
+
+// Bytes of arena memory held by value and its descendants, counting only
+// what owner handed out when it is not NULL, and taking them out of the
+// node counts of uncount when that is not NULL. A node that is not counted
+// has no counted descendants. The walk keeps its own stack, so no tree is
+// too deep for it; out of memory, it returns what it reached.
+static size_t footprint(const ToonValue *value, const ToonArena *owner, ToonArena *uncount) {
+    if (!node_owned(value, owner)) return 0;
+
+    size_t bytes = node_footprint(value, owner);
+    if (uncount) node_uncount(uncount, value);
+    if (!is_container(value)) return bytes;
+
+    ToonBuffer stack = {0};
+    toon_stack_push(&stack, &(WalkFrame){value, 0}, sizeof(WalkFrame));
+
+    WalkFrame *top;
+    while ((top = toon_stack_top(&stack, sizeof(WalkFrame)))) {
+        if (top->next == container_length(top->value)) {
+            toon_stack_pop(&stack, sizeof(WalkFrame));
+            continue;
+        }
+
+        const char *key;
+        const ToonValue *child = container_child(top->value, top->next++, &key);
+        if (!node_owned(child, owner)) continue;
 
+        bytes += node_footprint(child, owner);
+        if (uncount) node_uncount(uncount, child);
+        if (is_container(child) && !toon_stack_push(&stack, &(WalkFrame){child, 0}, sizeof(WalkFrame))) break;
+    }
+
+    toon_buffer_free(&stack);
+    return bytes;
+}
+
+size_t toon_value_footprint(const ToonValue *value) {
+    return footprint(value, NULL, NULL);
+}
+
+// Drop a value that has been unlinked from its document. Nodes live in the
+// document arena, so this only records their bytes as waste; nodes of a
+// shared arena stay where they are for the other documents.
+void toon_value_discard(ToonArena *arena, ToonValue *value) {
+    if (!arena || !value) return;
+    toon_arena_waste(arena, footprint(value, arena->borrows ? arena : NULL, arena));
+}
+
+// Drop the key of an entry removed from its document
+void toon_key_discard(ToonArena *arena, const char *key) {
+    if (!arena->borrows || toon_arena_owns(arena, key)) toon_arena_waste(arena, toon_string_footprint(key));
+}
+
+// Deep copy a value into an arena, sizing every array to its length
+ToonValue *toon_value_copy(ToonArena *arena, const ToonValue *value) {
+    if (!value) return NULL;
+    if (toon_value_is_shared(value)) return (ToonValue *)value;
+
+    // Scalars, which may be scratch nodes of a tabular column
+    switch (value->type) {
+        case TOON_NULL:
+            return toon_value_null();
+
+        case TOON_BOOLEAN:
+            return toon_value_boolean(value->value.boolean);
+
+        case TOON_NUMBER:
+            return toon_value_number(arena, value->value.number);
+
+        case TOON_STRING: {
+            const char *str = value->value.string ? value->value.string : "";
+            ToonValue *copy = string_node(arena, str, strlen(str), toon_is_interned(str) ? str : NULL);
+            if (copy) copy->tokens = value->tokens;
+            return copy;
+        }
+
+        default:
+            break;
+    }
+
+    ToonValue *copy = toon_value_create(arena, value->type);
+    if (!copy) return NULL;
+    copy->tokens = value->tokens;
+
+    switch (value->type) {
+        case TOON_NULL:
+        case TOON_BOOLEAN:
+        case TOON_NUMBER:
         case TOON_STRING:
-            value->value.string = NULL;
             break;
 
-        case TOON_ARRAY:
-            value->value.array.elements = NULL;
-            value->value.array.length = 0;
+        case TOON_ARRAY: {
+            size_t length = value->value.array.length;
+            if (length == 0) break;
+
+            copy->value.array.elements = toon_arena_alloc(arena, sizeof(ToonValue *) * length);
+            if (!copy->value.array.elements) return NULL;
+            copy->value.array.capacity = length;
+
+            for (size_t i = 0; i < length; i++) {
+                copy->value.array.elements[i] = toon_value_copy(arena, value->value.array.elements[i]);
+                if (!copy->value.array.elements[i]) return NULL;
+                copy->value.array.length++;
+            }
             break;
+        }
 
-        case TOON_OBJECT:
-            value->value.object.entries = NULL;
-            value->value.object.length = 0;
+        case TOON_OBJECT: {
+            size_t length = value->value.object.length;
+            if (length == 0) break;
+
+            copy->value.object.entries = toon_arena_alloc(arena, sizeof(ToonObjectEntry) * length);
+            if (!copy->value.object.entries) return NULL;
+            copy->value.object.capacity = length;
+
+            for (size_t i = 0; i < length; i++) {
+                const ToonObjectEntry *entry = &value->value.object.entries[i];
+                ToonObjectEntry *dst = &copy->value.object.entries[i];
+
+                dst->key = toon_string_copy(arena, entry->key);
+                dst->value = toon_value_copy(arena, entry->value);
+                if (!dst->key || !dst->value) return NULL;
+                copy->value.object.length++;
+            }
+            toon_object_index_build(arena, copy);
             break;
+        }
 
         case TOON_TABULAR_ARRAY:
-            value->value.tabular.headers = NULL;
-            value->value.tabular.num_headers = 0;
-            value->value.tabular.rows = NULL;
-            value->value.tabular.num_rows = 0;
+            if (!toon_tabular_copy(arena, &copy->value.tabular, &value->value.tabular)) return NULL;
             break;
     }
 
-    return value;
+    return copy;
+}
+
+// Copy a single array or object node into arena, sharing its children
+// with the original, so it can be changed without touching the original.
+// Anything else is copied whole: a table's cells are not nodes of their
+// own, and scalars have no children. NULL when out of memory.
+ToonValue *toon_value_copy_node(ToonArena *arena, const ToonValue *value) {
+    if (value->type != TOON_ARRAY && value->type != TOON_OBJECT) return toon_value_copy(arena, value);
+
+    ToonValue *copy = toon_value_create(arena, value->type);
+    if (!copy) return NULL;
+    copy->tokens = value->tokens;
+
+    if (value->type == TOON_ARRAY) {
+        size_t length = value->value.array.length;
+        if (length == 0) return copy;
+
+        copy->value.array.elements = toon_arena_alloc(arena, sizeof(ToonValue *) * length);
+        if (!copy->value.array.elements) return NULL;
+        memcpy(copy->value.array.elements, value->value.array.elements, sizeof(ToonValue *) * length);
+        copy->value.array.length = copy->value.array.capacity = length;
+        return copy;
+    }
+
+    size_t length = value->value.object.length;
+    if (length == 0) return copy;
+
+    copy->value.object.entries = toon_arena_alloc(arena, sizeof(ToonObjectEntry) * length);
+    if (!copy->value.object.entries) return NULL;
+    memcpy(copy->value.object.entries, value->value.object.entries, sizeof(ToonObjectEntry) * length);
+    copy->value.object.length = copy->value.object.capacity = length;
+    toon_object_index_build(arena, copy);
+    return copy;
+}
+
+// Make room for extra more elements. Storage grows by doubling so a run
+// of appends stays amortized O(1) in copying and waste.
+bool toon_array_reserve(ToonArena *arena, ToonValue *array, size_t extra) {
+    size_t length = array->value.array.length;
+    size_t capacity = array->value.array.capacity;
+    if (length + extra <= capacity) return true;
+
+    size_t new_capacity = capacity ? capacity * 2 : 4;
+    while (new_capacity < length + extra) new_capacity *= 2;
+
+    ToonValue **elements = toon_arena_grow(arena, array->value.array.elements,
+                                           sizeof(ToonValue *) * capacity,
+                                           sizeof(ToonValue *) * new_capacity);
+    if (!elements) return false;
+
+    array->value.array.elements = elements;
+    array->value.array.capacity = new_capacity;
+    return true;
+}
+
+// Append an element that is already in the arena
+bool toon_array_append(ToonArena *arena, ToonValue *array, ToonValue *element) {
+    if (!toon_array_reserve(arena, array, 1)) return false;
+
+    array->value.array.elements[array->value.array.length++] = element;
+    return true;
 }
 
-// Free a TOON value
-void toon_value_free(ToonValue *value) {
-    if (!value) return;
+// Highest version any document has had. A new document starts above it,
+// so a key deleted and created again never repeats a version a client may
+// hold. Only read and written on the main thread.
+static uint64_t version_clock = 0;
 
+uint64_t toon_version_clock(void) {
+    return version_clock;
+}
+
+// Raise the clock to a version a document has reached
+void toon_version_observe(uint64_t version) {
+    if (version > version_clock) version_clock = version;
+}
+
+// Create a document owning arena, whose tree is rooted at root
+ToonDocument *toon_document_create(ToonArena *arena, ToonValue *root) {
+    ToonDocument *doc = calloc(1, sizeof(ToonDocument));
+    if (!doc) return NULL;
+
+    doc->arena = arena;
+    doc->root = root;
+    doc->version = ++version_clock;
+    toon_arena_track(arena);
+    toon_stats_count_document(false);
+    return doc;
+}
+
+static size_t arena_free_effort(const ToonArena *arena) {
+    return arena ? arena->reserved / TOON_FREE_EFFORT_UNIT + 1 : 0;
+}
+
+static void arena_destroy_job(void *arg) {
+    toon_arena_destroy(arg);
+}
+
+// Drop a reference to an arena, and free it once no one references it
+// any more. Large ones go to a worker so the caller does not wait on
+// thousands of pages being returned; small ones, or all of them without
+// workers, are freed right away.
+void toon_arena_reclaim(ToonArena *arena) {
+    if (!arena) return;
+    if (atomic_fetch_sub_explicit(&arena->refs, 1, memory_order_acq_rel) > 1) return;
+
+    if (arena_free_effort(arena) <= TOON_LAZYFREE_THRESHOLD ||
+        !toon_pool_submit(arena_destroy_job, arena)) {
+        toon_arena_destroy(arena);
+    }
+}
+
+// Cost of freeing a document, for the type's free_effort callback. A
+// pinned document reports none, so the server frees it on the main thread,
+// where its snapshot can be handed the tree.
+size_t toon_document_free_effort(const ToonDocument *doc) {
+    return doc && !doc->snapshot ? arena_free_effort(doc->arena) : 0;
+}
+
+// Drop every reference in a list of shared arenas
+static void release_shared(ToonArena **shared, size_t num_shared) {
+    for (size_t i = 0; i < num_shared; i++) toon_arena_reclaim(shared[i]);
+    free(shared);
+}
+
+// Stop sharing anything: the tree has been replaced by one the document
+// owns outright
+static void document_release_shared(ToonDocument *doc) {
+    release_shared(doc->shared, doc->num_shared);
+    doc->shared = NULL;
+    doc->num_shared = 0;
+}
+
+static void snapshot_unlist(ToonSnapshot *snapshot) {
+    if (snapshot->prev) snapshot->prev->next = snapshot->next;
+    else attached_snapshots = snapshot->next;
+    if (snapshot->next) snapshot->next->prev = snapshot->prev;
+    snapshot->prev = snapshot->next = NULL;
+}
+
+// Hand the current tree over to its snapshot, if pinned, and report
+// whether it was
+static bool document_detach(ToonDocument *doc) {
+    ToonSnapshot *snapshot = doc->snapshot;
+    if (!snapshot) return false;
+
+    snapshot_unlist(snapshot);
+    snapshot->doc = NULL;
+    doc->snapshot = NULL;
+    return true;
+}
+
+// Release the cached text and index entries of a document, on the main
+// thread, when its key goes away. RENAME and MOVE unlink a document that
+// lives on under another key, so its tree and snapshot are left as they
+// are; a pinned document is freed on the main thread, which detaches it.
+void toon_document_unlink(ToonDocument *doc) {
+    toon_cache_release(doc);
+    toon_index_forget(doc);
+}
+
+// Free a TOON document. The whole tree goes with its arena in O(chunks),
+// unless readers still hold it.
+void toon_document_free(ToonDocument *doc) {
+    if (!doc) return;
+
+    toon_document_unlink(doc);
+    if (!document_detach(doc)) toon_arena_reclaim(doc->arena);
+    release_shared(doc->shared, doc->num_shared);
+    toon_stats_count_document(true);
+    free(doc);
+}
+
+// Replace the whole tree with a root allocated in its own arena. The
+// document takes ownership of the arena and reclaims the previous one.
+void toon_document_set_root(ToonDocument *doc, ToonArena *arena, ToonValue *root) {
+    toon_document_changed(doc);
+    if (!document_detach(doc)) toon_arena_reclaim(doc->arena);
+    document_release_shared(doc);
+    toon_arena_track(arena);
+    doc->arena = arena;
+    doc->root = root;
+}
+
+// Pin the current tree for a reader on another thread. The tree stays as
+// it is until toon_snapshot_release, whatever happens to the document.
+// NULL when out of memory.
+ToonSnapshot *toon_document_pin(ToonDocument *doc) {
+    if (!doc->snapshot) {
+        ToonSnapshot *snapshot = calloc(1, sizeof(ToonSnapshot));
+        if (!snapshot) return NULL;
+
+        // Shared arenas are frozen, so references to them are all it takes
+        if (doc->num_shared) {
+            snapshot->shared = malloc(sizeof(ToonArena *) * doc->num_shared);
+            if (!snapshot->shared) {
+                free(snapshot);
+                return NULL;
+            }
+            for (size_t i = 0; i < doc->num_shared; i++) {
+                toon_arena_retain(doc->shared[i]);
+                snapshot->shared[i] = doc->shared[i];
+            }
+            snapshot->num_shared = doc->num_shared;
+        }
+
+        snapshot->arena = doc->arena;
+        snapshot->root = doc->root;
+        snapshot->doc = doc;
+        snapshot->next = attached_snapshots;
+        if (attached_snapshots) attached_snapshots->prev = snapshot;
+        attached_snapshots = snapshot;
+        doc->snapshot = snapshot;
+    }
+
+    doc->snapshot->readers++;
+    return doc->snapshot;
+}
+
+// Drop a reader; the last one frees the tree if the document moved on
+void toon_snapshot_release(ToonSnapshot *snapshot) {
+    if (--snapshot->readers > 0) return;
+
+    if (snapshot->doc) {
+        snapshot_unlist(snapshot);
+        snapshot->doc->snapshot = NULL;
+    } else {
+        toon_arena_reclaim(snapshot->arena);
+    }
+    release_shared(snapshot->shared, snapshot->num_shared);
+    free(snapshot);
+}
+
+// Continue on an empty arena on top of the pinned tree, whose arena joins
+// the shared ones whatever their number. False when out of memory.
+static bool document_freeze_pinned(ToonDocument *doc) {
+    ToonArena **shared = realloc(doc->shared, sizeof(ToonArena *) * (doc->num_shared + 1));
+    if (!shared) return false;
+    doc->shared = shared;
+
+    ToonArena *arena = toon_arena_create(0);
+    if (!arena) return false;
+
+    // The readers take over the document's reference to the pinned arena
+    // and the document keeps one of its own. Same content, so the cached
+    // text stays valid.
+    toon_arena_retain(doc->arena);
+    document_detach(doc);
+    doc->shared[doc->num_shared++] = doc->arena;
+    arena->borrows = true;
+    toon_arena_track(arena);
+    doc->arena = arena;
+    return true;
+}
+
+// Hand every pinned tree to its readers, ahead of an asynchronous flush
+// that frees documents on another thread. Documents in other databases
+// live on, so each continues on top of its pinned tree as a writer would.
+void toon_snapshot_detach_all(void) {
+    while (attached_snapshots) {
+        ToonDocument *doc = attached_snapshots->doc;
+        if (document_freeze_pinned(doc)) continue;
+
+        // Out of memory: the readers get a reference of their own and the
+        // document keeps the tree as it is
+        toon_arena_retain(doc->arena);
+        document_detach(doc);
+    }
+}
+
+// Leave a pinned tree to its readers and continue on a full copy of it
+static bool document_unpin_copy(ToonDocument *doc) {
+    ToonArena *arena = toon_arena_create(toon_document_live_bytes(doc));
+    if (!arena) return false;
+
+    ToonValue *root = toon_value_copy(arena, doc->root);
+    if (!root) {
+        toon_arena_destroy(arena);
+        return false;
+    }
+
+    // Same content, so the cached text stays valid
+    document_detach(doc);
+    document_release_shared(doc);
+    toon_arena_track(arena);
+    doc->arena = arena;
+    doc->root = root;
+    return true;
+}
+
+// Make the tree safe to change in place: a pinned tree is left to its
+// readers and the document continues on top of it, its arena frozen and
+// shared with the snapshot as with a clone, so writes copy only the nodes
+// on their path with toon_document_unshare_path. A document already
+// sharing as many arenas as it may continues on a full copy instead.
+// False when out of memory.
+bool toon_document_unshare(ToonDocument *doc) {
+    if (!doc->snapshot) return true;
+    if (doc->num_shared >= TOON_MAX_SHARED) return document_unpin_copy(doc);
+    return document_freeze_pinned(doc);
+}
+
+// Move the live tree into a fresh arena sized to it. The content is the
+// same, so cached text stays valid. False when out of memory, in which case
+// the document keeps its current tree.
+static bool document_rebuild(ToonDocument *doc) {
+    ToonArena *old = doc->arena;
+
+    ToonArena *arena = toon_arena_create(toon_document_live_bytes(doc));
+    if (!arena) return false;
+
+    ToonValue *root = toon_value_copy(arena, doc->root);
+    if (!root) {
+        toon_arena_destroy(arena);
+        return false;
+    }
+
+    toon_arena_reclaim(old);
+    document_release_shared(doc);
+    toon_arena_track(arena);
+    doc->arena = arena;
+    doc->root = root;
+    return true;
+}
+
+// Bytes a document's tree holds in the arenas it shares with its clones,
+// counted in full for every document that shares them
+static size_t shared_bytes(const ToonDocument *doc) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < doc->num_shared; i++) {
+        bytes += doc->shared[i]->used - doc->shared[i]->wasted;
+    }
+    return bytes;
+}
+
+// Copy the live tree into a fresh arena when path mutations have left too
+// much of the current one unreachable. Shared arenas count as live, so a
+// clone is only collapsed into a tree of its own once its edits have
+// wasted as much as the whole tree holds.
+void toon_document_compact(ToonDocument *doc) {
+    ToonArena *old = doc->arena;
+    if (doc->snapshot) return;
+    if (old->wasted < TOON_COMPACT_MIN_WASTE || old->wasted * 2 < old->used + shared_bytes(doc)) return;
+
+    // Out of memory: keep the current tree, compaction is only an optimization
+    document_rebuild(doc);
+}
+
+// Follow the chunks active defrag moved from a node's own pointers: its
+// string, its vectors and keys, its table, and the links to its children
+static void node_relocate(ToonValue *value, const ToonArenaMoves *moves) {
     switch (value->type) {
         case TOON_STRING:
-            if (value->value.string) {
-                free(value->value.string);
-            }
+            TOON_RELOCATE(moves, value->value.string);
             break;
 
         case TOON_ARRAY:
-            if (value->value.array.elements) {
-                for (size_t i = 0; i < value->value.array.length; i++) {
-                    toon_value_free(value->value.array.elements[i]);
-                }
-                free(value->value.array.elements);
+            if (!value->value.array.elements) break;
+            TOON_RELOCATE(moves, value->value.array.elements);
+            for (size_t i = 0; i < value->value.array.length; i++) {
+                TOON_RELOCATE(moves, value->value.array.elements[i]);
             }
             break;
 
         case TOON_OBJECT:
-            if (value->value.object.entries) {
-                for (size_t i = 0; i < value->value.object.length; i++) {
-                    if (value->value.object.entries[i].key) {
-                        free(value->value.object.entries[i].key);
-                    }
-                    toon_value_free(value->value.object.entries[i].value);
-                }
-                free(value->value.object.entries);
+            if (value->value.object.index) TOON_RELOCATE(moves, value->value.object.index);
+            if (!value->value.object.entries) break;
+            TOON_RELOCATE(moves, value->value.object.entries);
+            for (size_t i = 0; i < value->value.object.length; i++) {
+                TOON_RELOCATE(moves, value->value.object.entries[i].key);
+                TOON_RELOCATE(moves, value->value.object.entries[i].value);
             }
             break;
 
         case TOON_TABULAR_ARRAY:
-            if (value->value.tabular.headers) {
-                for (size_t i = 0; i < value->value.tabular.num_headers; i++) {
-                    if (value->value.tabular.headers[i]) {
-                        free(value->value.tabular.headers[i]);
-                    }
-                }
-                free(value->value.tabular.headers);
-            }
-            if (value->value.tabular.rows) {
-                for (size_t i = 0; i < value->value.tabular.num_rows; i++) {
-                    if (value->value.tabular.rows[i]) {
-                        for (size_t j = 0; j < value->value.tabular.num_headers; j++) {
-                            toon_value_free(value->value.tabular.rows[i][j]);
-                        }
-                        free(value->value.tabular.rows[i]);
-                    }
-                }
-                free(value->value.tabular.rows);
-            }
+            toon_tabular_relocate(&value->value.tabular, moves);
             break;
 
         case TOON_NULL:
         case TOON_BOOLEAN:
         case TOON_NUMBER:
-            // No additional cleanup needed
             break;
     }
+}
+
+// Follow the moved chunks through a document's tree, on a stack reserved
+// for its deepest nesting before anything moved, as the walk must finish.
+// Frozen nodes never point into a newer arena, so a tree that borrows is
+// only walked through its own nodes.
+static void document_relocate(ToonDocument *doc, const ToonArenaMoves *moves, ToonBuffer *stack) {
+    const ToonArena *owner = doc->arena->borrows ? doc->arena : NULL;
+
+    TOON_RELOCATE(moves, doc->root);
+    if (!node_owned(doc->root, owner)) return;
+
+    node_relocate(doc->root, moves);
+    if (!is_container(doc->root)) return;
+
+    stack->len = 0;
+    toon_stack_push(stack, &(WalkFrame){doc->root, 0}, sizeof(WalkFrame));
+
+    WalkFrame *top;
+    while ((top = toon_stack_top(stack, sizeof(WalkFrame)))) {
+        if (top->next == container_length(top->value)) {
+            toon_stack_pop(stack, sizeof(WalkFrame));
+            continue;
+        }
+
+        const char *key;
+        ToonValue *child = container_child(top->value, top->next++, &key);
+        if (!node_owned(child, owner)) continue;
 
-    free(value);
+        node_relocate(child, moves);
+        if (is_container(child)) toon_stack_push(stack, &(WalkFrame){child, 0}, sizeof(WalkFrame));
+    }
 }
 
-// Create a new TOON document
-ToonDocument *toon_document_create(void) {
-    ToonDocument *doc = calloc(1, sizeof(ToonDocument));
-    if (!doc) return NULL;
+// Defrag on behalf of the server, resuming at arena chunk *cursor. A small
+// document whose arena is a quarter unreachable is rebuilt into fresh
+// chunks in one go; a larger one is left to write-time compaction, as a
+// copy cannot stop halfway. Otherwise mover is offered the arena's chunks
+// and the tree follows the ones it moves, a batch at a time. Returns true
+// when mover asked to stop first, with *cursor at the next chunk; a pinned
+// or shared arena has readers that cannot follow, and is skipped.
+bool toon_document_defrag(ToonDocument *doc, const ToonChunkMover *mover, size_t *cursor) {
+    ToonArena *arena = doc->arena;
+    if (doc->snapshot || atomic_load_explicit(&arena->refs, memory_order_relaxed) > 1) return false;
 
-    doc->root = toon_value_create(TOON_NULL);
-    return doc;
+    if (*cursor == 0 && arena->wasted >= TOON_DEFRAG_MIN_WASTE &&
+        arena->wasted * 4 >= arena->used + shared_bytes(doc) &&
+        arena->used - arena->wasted <= TOON_DEFRAG_MAX_REBUILD && document_rebuild(doc)) {
+        return false;
+    }
+
+    ToonBuffer stack = {0};
+    if (!toon_buffer_reserve(&stack, (TOON_DOCUMENT_DEPTH_LIMIT + 2) * sizeof(WalkFrame))) return false;
+
+    bool stopped = false;
+    while (*cursor < arena->num_chunks) {
+        ToonArenaMoves moves = {.count = 0};
+        *cursor = toon_arena_move_chunks(arena, *cursor, mover, &moves);
+        if (moves.count) document_relocate(doc, &moves, &stack);
+
+        if (moves.count < TOON_ARENA_MAX_MOVES && *cursor < arena->num_chunks) {
+            stopped = true;
+            break;
+        }
+    }
+
+    toon_buffer_free(&stack);
+    return stopped;
 }
 
-// Free a TOON document
-void toon_document_free(ToonDocument *doc) {
-    if (!doc) return;
+// Bytes held by a document: its arena chunks, its share of the arenas it
+// shares with clones, cached text and headers. Arenas keep their own
+// totals, so this is O(1) whatever the tree's size.
+size_t toon_document_mem_usage(const ToonDocument *doc) {
+    size_t bytes = sizeof(ToonDocument);
+    if (doc->arena) bytes += sizeof(ToonArena) + doc->arena->reserved;
 
-    if (doc->root) {
-        toon_value_free(doc->root);
+    for (size_t i = 0; i < doc->num_shared; i++) {
+        size_t refs = atomic_load_explicit(&doc->shared[i]->refs, memory_order_relaxed);
+        bytes += sizeof(ToonArena *) + (sizeof(ToonArena) + doc->shared[i]->reserved) / (refs ? refs : 1);
     }
 
-    free(doc);
+    for (int format = 0; format < TOON_TEXT_FORMATS; format++) {
+        bytes += doc->cache.text_len[format];
+    }
+    return bytes;
+}
+
+// Deep copy a document into a new arena, sized to its live tree. NULL when
+// out of memory.
+ToonDocument *toon_document_copy(const ToonDocument *doc) {
+    ToonArena *arena = toon_arena_create(toon_document_live_bytes(doc));
+    if (!arena) return NULL;
+
+    ToonValue *root = toon_value_copy(arena, doc->root);
+    ToonDocument *copy = root ? toon_document_create(arena, root) : NULL;
+    if (!copy) {
+        toon_arena_destroy(arena);
+        return NULL;
+    }
+    return copy;
+}
+
+// Share a document's tree with a new document in O(1) of its size: the
+// current arena is frozen and shared by both, each continuing with an empty
+// arena of its own that writes copy the nodes they change into, along with
+// the nodes on the way from the root. NULL when out of memory.
+ToonDocument *toon_document_clone(ToonDocument *doc) {
+    // An arena nothing was written to since the last clone is not worth
+    // freezing; a template cloned again and again shares the same arenas
+    bool freeze = doc->arena->used > 0 || doc->num_shared == 0;
+    if (freeze && doc->num_shared >= TOON_MAX_SHARED) return toon_document_copy(doc);
+
+    size_t num_shared = doc->num_shared + freeze;
+    ToonArena **shared = malloc(sizeof(ToonArena *) * num_shared);
+    ToonArena **clone_shared = malloc(sizeof(ToonArena *) * num_shared);
+    ToonArena *arena = freeze ? toon_arena_create(0) : doc->arena;
+    ToonArena *clone_arena = toon_arena_create(0);
+    ToonDocument *clone = clone_arena ? toon_document_create(clone_arena, doc->root) : NULL;
+    if (!shared || !clone_shared || !arena || !clone) {
+        free(shared);
+        free(clone_shared);
+        if (freeze) toon_arena_destroy(arena);
+        if (clone) toon_document_free(clone);
+        else toon_arena_destroy(clone_arena);
+        return NULL;
+    }
+
+    // A pinned tree in a frozen arena goes to its readers, who keep a
+    // reference of their own
+    if (freeze && doc->snapshot) {
+        toon_arena_retain(doc->arena);
+        document_detach(doc);
+    }
+
+    if (doc->num_shared) memcpy(shared, doc->shared, sizeof(ToonArena *) * doc->num_shared);
+    if (freeze) shared[doc->num_shared] = doc->arena;
+    for (size_t i = 0; i < num_shared; i++) {
+        toon_arena_retain(shared[i]);
+        clone_shared[i] = shared[i];
+    }
+    free(doc->shared);
+
+    // The text is the same, so the cache stays valid
+    doc->shared = shared;
+    doc->num_shared = num_shared;
+    arena->borrows = true;
+    toon_arena_track(arena);
+    doc->arena = arena;
+
+    clone->shared = clone_shared;
+    clone->num_shared = num_shared;
+    clone_arena->borrows = true;
+    return clone;
+}
+
+// Whether a value may be changed in place: it is not shared with another
+// document, or is an immutable shared scalar. O(chunks) for a clone.
+bool toon_document_owns(const ToonDocument *doc, const ToonValue *value) {
+    return doc->num_shared == 0 || toon_value_is_shared(value) || toon_arena_owns(doc->arena, value);
+}
+
+// Bytes of arena reachable from a document's root, at most; arenas shared
+// with clones count in full
+size_t toon_document_live_bytes(const ToonDocument *doc) {
+    return doc->arena->used - doc->arena->wasted + shared_bytes(doc);
+}
+
+// FNV-1a hash of a key, shared by compiled paths and object indexes
+uint64_t toon_hash_key(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
 // Get type string
@@ -137,59 +984,92 @@ const char *toon_type_string(ToonType type) {
     }
 }
 
-// Estimate token count for a TOON value (approximate)
-size_t toon_estimate_tokens(ToonValue *value) {
+// Tokens an object entry's key costs on top of its value
+size_t toon_entry_tokens(const char *key) {
+    return (strlen(key) / 4) + 2;  // key:
+}
+
+// Cache a node's count; counts too large for the field are recomputed
+// each time
+static size_t cache_tokens(ToonValue *value, size_t tokens) {
+    if (tokens < UINT32_MAX) value->tokens = (uint32_t)tokens + 1;
+    return tokens;
+}
+
+// Count of a node that is not an array or object
+static size_t leaf_tokens(ToonValue *value) {
     if (!value) return 0;
+    if (value->tokens) return value->tokens - 1;
 
-    size_t tokens = 0;
+    size_t tokens = 1;
+    if (value->type == TOON_STRING) {
+        // Rough estimate: 1 token per 4 characters
+        tokens = (strlen(value->value.string) / 4) + 1;
+    } else if (value->type == TOON_TABULAR_ARRAY) {
+        tokens = toon_tabular_estimate_tokens(&value->value.tabular);
+    }
+    return cache_tokens(value, tokens);
+}
 
-    switch (value->type) {
-        case TOON_NULL:
-            tokens = 1;
-            break;
+// An array or object whose children are still being counted
+typedef struct {
+    ToonValue *value;
+    size_t next;
+    size_t tokens;      // Its own syntax and the children counted so far
+} TokenFrame;
 
-        case TOON_BOOLEAN:
-            tokens = 1;
-            break;
+// Estimate token count for a TOON value (approximate). Every node caches
+// its count after the first estimate and mutators keep the counts on the
+// way to the root current with toon_tokens_adjust, so counting any subtree
+// that has been counted before is O(1). The first count walks the tree on
+// its own stack; out of memory, a count cut short is returned uncached.
+size_t toon_estimate_tokens(ToonValue *value) {
+    if (!is_container(value) || value->tokens) return leaf_tokens(value);
 
-        case TOON_NUMBER:
-            tokens = 1;
-            break;
+    ToonBuffer stack = {0};
+    toon_stack_push(&stack, &(TokenFrame){value, 0, value->type == TOON_ARRAY ? 2 : 0}, sizeof(TokenFrame));
 
-        case TOON_STRING:
-            // Rough estimate: 1 token per 4 characters
-            tokens = (strlen(value->value.string) / 4) + 1;
-            break;
+    size_t tokens = 0;
+    TokenFrame *top;
+    while ((top = toon_stack_top(&stack, sizeof(TokenFrame)))) {
+        if (top->next == container_length(top->value)) {
+            // Done with a container: cache it and add it to its parent
+            size_t counted = cache_tokens(top->value, top->tokens);
+            toon_stack_pop(&stack, sizeof(TokenFrame));
 
-        case TOON_ARRAY:
-            tokens = 2;  // [N]:
-            for (size_t i = 0; i < value->value.array.length; i++) {
-                tokens += toon_estimate_tokens(value->value.array.elements[i]);
+            top = toon_stack_top(&stack, sizeof(TokenFrame));
+            if (top) {
+                top->tokens += counted;
+            } else {
+                tokens = counted;
             }
-            break;
+            continue;
+        }
 
-        case TOON_OBJECT:
-            for (size_t i = 0; i < value->value.object.length; i++) {
-                tokens += (strlen(value->value.object.entries[i].key) / 4) + 2;  // key:
-                tokens += toon_estimate_tokens(value->value.object.entries[i].value);
-            }
-            break;
+        const char *key;
+        ToonValue *child = container_child(top->value, top->next++, &key);
+        if (key) top->tokens += toon_entry_tokens(key);  // key:
 
-        case TOON_TABULAR_ARRAY: {
-            // Headers
-            tokens += 3;  // [N,]{}:
-            for (size_t i = 0; i < value->value.tabular.num_headers; i++) {
-                tokens += (strlen(value->value.tabular.headers[i]) / 4) + 1;
-            }
-            // Rows
-            for (size_t i = 0; i < value->value.tabular.num_rows; i++) {
-                for (size_t j = 0; j < value->value.tabular.num_headers; j++) {
-                    tokens += toon_estimate_tokens(value->value.tabular.rows[i][j]);
-                }
-            }
+        if (!is_container(child) || child->tokens) {
+            top->tokens += leaf_tokens(child);
+        } else if (!toon_stack_push(&stack, &(TokenFrame){child, 0, child->type == TOON_ARRAY ? 2 : 0},
+                                    sizeof(TokenFrame))) {
+            // Sum what was counted on the way down
+            const TokenFrame *frames = (const TokenFrame *)stack.data;
+            for (size_t i = 0; i < stack.len / sizeof(TokenFrame); i++) tokens += frames[i].tokens;
             break;
         }
     }
 
+    toon_buffer_free(&stack);
     return tokens;
 }
+
+// Account for a change of delta tokens somewhere under value. Values whose
+// count was never cached are left to be counted when first asked for.
+void toon_tokens_adjust(ToonValue *value, long long delta) {
+    if (!value || !value->tokens) return;
+
+    long long tokens = (long long)value->tokens + delta;
+    value->tokens = tokens > 0 && tokens <= UINT32_MAX ? (uint32_t)tokens : 0;
+}
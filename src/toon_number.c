@@ -0,0 +1,222 @@
+#include "redistoon.h"
+#include <float.h>
+#include <math.h>
+
+// Number tokens shared by the parsers and encoders. Parsing and formatting
+// both take an exact fast path for the common cases (integers and short
+// decimals, which is most of what metric tables hold) and fall back to
+// strtod/snprintf for the rest.
+
+// Largest integer below which every integer is exactly representable
+#define TOON_EXACT_INT_LIMIT 9007199254740992.0     // 2^53
+
+// Powers of ten that are exact as doubles
+static const double pow10_exact[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t pow10_int[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL
+};
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Check a token against the JSON number grammar
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+bool toon_number_is_token(const char *str, size_t len) {
+    size_t i = 0;
+
+    if (i < len && str[i] == '-') i++;
+    if (i == len) return false;
+
+    if (str[i] == '0') {
+        i++;
+    } else if (is_digit(str[i])) {
+        while (i < len && is_digit(str[i])) i++;
+    } else {
+        return false;
+    }
+
+    if (i < len && str[i] == '.') {
+        i++;
+        if (i == len || !is_digit(str[i])) return false;
+        while (i < len && is_digit(str[i])) i++;
+    }
+
+    if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+        i++;
+        if (i < len && (str[i] == '+' || str[i] == '-')) i++;
+        if (i == len || !is_digit(str[i])) return false;
+        while (i < len && is_digit(str[i])) i++;
+    }
+
+    return i == len;
+}
+
+// strtod on a span that is not NUL-terminated
+static double parse_slow(const char *str, size_t len) {
+    char buffer[64];
+    if (len < sizeof(buffer)) {
+        memcpy(buffer, str, len);
+        buffer[len] = '\0';
+        return strtod(buffer, NULL);
+    }
+
+    // Literals this long are rare enough to take a heap copy
+    char *copy = malloc(len + 1);
+    if (!copy) return 0;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    double number = strtod(copy, NULL);
+    free(copy);
+    return number;
+}
+
+// Convert a number token. When the significant digits fit in 53 bits and
+// the decimal exponent is within the range of exact powers of ten, one
+// exact multiply or divide gives the correctly rounded result; anything
+// else, including malformed tokens, is left to strtod.
+double toon_number_parse(const char *str, size_t len) {
+    size_t i = 0;
+    bool negative = false;
+    uint64_t mantissa = 0;
+    int digits = 0;         // Significant digits in mantissa
+    int exponent = 0;
+
+    if (i < len && str[i] == '-') {
+        negative = true;
+        i++;
+    }
+
+    size_t int_start = i;
+    for (; i < len && is_digit(str[i]); i++) {
+        if (digits >= 19) return parse_slow(str, len);
+        mantissa = mantissa * 10 + (str[i] - '0');
+        if (mantissa) digits++;
+    }
+    if (i == int_start) return parse_slow(str, len);
+
+    if (i < len && str[i] == '.') {
+        size_t frac_start = ++i;
+        for (; i < len && is_digit(str[i]); i++) {
+            if (digits >= 19) return parse_slow(str, len);
+            mantissa = mantissa * 10 + (str[i] - '0');
+            if (mantissa) digits++;
+            exponent--;
+        }
+        if (i == frac_start) return parse_slow(str, len);
+    }
+
+    if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+        i++;
+        bool exp_negative = false;
+        if (i < len && (str[i] == '+' || str[i] == '-')) exp_negative = str[i++] == '-';
+
+        size_t exp_start = i;
+        int exp_value = 0;
+        for (; i < len && is_digit(str[i]); i++) {
+            if (exp_value < 10000) exp_value = exp_value * 10 + (str[i] - '0');
+        }
+        if (i == exp_start) return parse_slow(str, len);
+        exponent += exp_negative ? -exp_value : exp_value;
+    }
+
+    if (i != len || mantissa > (uint64_t)TOON_EXACT_INT_LIMIT || exponent < -22 || exponent > 22) {
+        return parse_slow(str, len);
+    }
+
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / pow10_exact[-exponent] : value * pow10_exact[exponent];
+    return negative ? -value : value;
+}
+
+// Write n in decimal to out, which holds at least 20 bytes, and return
+// its length (no NUL is written)
+size_t toon_number_format_uint(uint64_t n, char *out) {
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    while (n >= 100) {
+        const char *pair = &digit_pairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (n >= 10) {
+        const char *pair = &digit_pairs[n * 2];
+        *--p = pair[1];
+        *--p = pair[0];
+    } else {
+        *--p = (char)('0' + n);
+    }
+
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
+// Write the shortest decimal that reads back as num to out, which holds
+// at least TOON_NUMBER_MAX_LEN bytes, and return its length (no NUL is
+// written). Non-finite numbers, which neither TOON nor JSON can spell,
+// come out as null.
+size_t toon_number_format(double num, char *out) {
+    if (!isfinite(num)) {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+
+    size_t len = 0;
+    double magnitude = fabs(num);
+
+    // Integers
+    if (magnitude < TOON_EXACT_INT_LIMIT && magnitude == floor(magnitude)) {
+        if (num < 0) out[len++] = '-';
+        return len + toon_number_format_uint((uint64_t)magnitude, out + len);
+    }
+
+    // Short decimals: the fewest fraction digits k for which the scaled
+    // integer m reads back as num. m and 10^k are exact, so m / 10^k is
+    // exactly what a correctly rounded parser will produce.
+    if (magnitude >= 1e-5 && magnitude < 1e15) {
+        for (int k = 1; k < (int)(sizeof(pow10_int) / sizeof(pow10_int[0])); k++) {
+            double scaled = magnitude * pow10_exact[k];
+            if (scaled >= TOON_EXACT_INT_LIMIT) break;
+
+            double m = round(scaled);
+            if (m / pow10_exact[k] != magnitude) continue;
+
+            uint64_t mantissa = (uint64_t)m;
+            if (num < 0) out[len++] = '-';
+            len += toon_number_format_uint(mantissa / pow10_int[k], out + len);
+            out[len++] = '.';
+
+            // Fraction digits, zero padded to k
+            char frac[20];
+            size_t frac_len = toon_number_format_uint(mantissa % pow10_int[k], frac);
+            memset(out + len, '0', k - frac_len);
+            memcpy(out + len + (k - frac_len), frac, frac_len);
+            return len + k;
+        }
+    }
+
+    // Everything else: the lowest precision that round-trips. Any decimal
+    // of up to DBL_DIG digits survives a trip through a normal double, so
+    // only subnormals can need fewer than that.
+    int written = 0;
+    for (int precision = magnitude < DBL_MIN ? 1 : DBL_DIG; precision <= 17; precision++) {
+        written = snprintf(out, TOON_NUMBER_MAX_LEN, "%.*g", precision, num);
+        if (strtod(out, NULL) == num) break;
+    }
+    return (size_t)written;
+}
@@ -0,0 +1,178 @@
+#include "redistoon.h"
+
+// Objects keep their entries in insertion order. Once an object reaches
+// TOON_OBJECT_INDEX_MIN entries it also gets an open-addressing hash index
+// over entry positions, so key lookups stop being linear scans. The index
+// is built when an object is constructed or grows past the threshold,
+// never while reading, so lookups have no side effects. Like the linear
+// scan, the index resolves a duplicated key to its first entry, so only
+// first occurrences get a slot.
+
+#define TOON_OBJECT_INDEX_MIN 32
+
+struct ToonObjectIndex {
+    size_t mask;        // Slot count - 1; the slot count is a power of two
+    uint32_t slots[];   // Entry position + 1, or 0 for an empty slot
+};
+
+static size_t index_bytes(size_t num_slots) {
+    return sizeof(ToonObjectIndex) + sizeof(uint32_t) * num_slots;
+}
+
+// Bytes of arena memory held by an object's index
+size_t toon_object_index_footprint(const ToonValue *object) {
+    const ToonObjectIndex *index = object->value.object.index;
+    return index ? toon_arena_alloc_size(index_bytes(index->mask + 1)) : 0;
+}
+
+static uint64_t entry_hash(const ToonObjectEntry *entry) {
+    return toon_hash_key(entry->key, strlen(entry->key));
+}
+
+// Give the entry at position a slot unless an earlier entry has its key
+static void index_put(ToonObjectIndex *index, const ToonObjectEntry *entries, size_t position) {
+    const char *key = entries[position].key;
+    size_t len = strlen(key);
+    size_t slot = toon_hash_key(key, len) & index->mask;
+
+    for (; index->slots[slot]; slot = (slot + 1) & index->mask) {
+        if (toon_key_equals(entries[index->slots[slot] - 1].key, key, len)) return;
+    }
+    index->slots[slot] = (uint32_t)(position + 1);
+}
+
+// (Re)build the index for objects at or above the threshold, sized for
+// the entry capacity at half load. On failure the object simply stays
+// unindexed.
+void toon_object_index_build(ToonArena *arena, ToonValue *object) {
+    size_t length = object->value.object.length;
+    ToonObjectIndex *old = object->value.object.index;
+
+    if (length < TOON_OBJECT_INDEX_MIN || length >= UINT32_MAX) return;
+
+    size_t capacity = object->value.object.capacity > length ? object->value.object.capacity : length;
+    size_t num_slots = TOON_OBJECT_INDEX_MIN * 2;
+    while (num_slots < capacity * 2) num_slots *= 2;
+
+    ToonObjectIndex *index = toon_arena_calloc(arena, 1, index_bytes(num_slots));
+    if (!index) return;
+    index->mask = num_slots - 1;
+
+    for (size_t i = 0; i < length; i++) {
+        index_put(index, object->value.object.entries, i);
+    }
+
+    if (old) toon_arena_waste(arena, toon_object_index_footprint(object));
+    object->value.object.index = index;
+}
+
+// Find the entry for key, which has length len and hash toon_hash_key(key, len)
+ToonObjectEntry *toon_object_find(const ToonValue *object, const char *key, size_t len,
+                                  uint64_t hash, size_t *position) {
+    ToonObjectEntry *entries = object->value.object.entries;
+    const ToonObjectIndex *index = object->value.object.index;
+
+    if (index) {
+        for (size_t slot = hash & index->mask; index->slots[slot]; slot = (slot + 1) & index->mask) {
+            size_t i = index->slots[slot] - 1;
+            if (toon_key_equals(entries[i].key, key, len)) {
+                if (position) *position = i;
+                return &entries[i];
+            }
+        }
+        return NULL;
+    }
+
+    for (size_t i = 0; i < object->value.object.length; i++) {
+        if (toon_key_equals(entries[i].key, key, len)) {
+            if (position) *position = i;
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Append an entry whose key is already in the arena. Entries grow by
+// doubling so repeated inserts stay amortized O(1) in copying and waste.
+bool toon_object_append(ToonArena *arena, ToonValue *object, char *key, ToonValue *value) {
+    size_t length = object->value.object.length;
+
+    if (length == object->value.object.capacity) {
+        size_t new_capacity = length ? length * 2 : 4;
+        ToonObjectEntry *entries = toon_arena_grow(arena, object->value.object.entries,
+                                                   sizeof(ToonObjectEntry) * object->value.object.capacity,
+                                                   sizeof(ToonObjectEntry) * new_capacity);
+        if (!entries) return false;
+        object->value.object.entries = entries;
+        object->value.object.capacity = new_capacity;
+    }
+
+    object->value.object.entries[length].key = key;
+    object->value.object.entries[length].value = value;
+    object->value.object.length = length + 1;
+
+    // Keep the index at most half full; a missing index appears once the
+    // object reaches the threshold
+    ToonObjectIndex *index = object->value.object.index;
+    if (!index || (length + 1) * 2 > index->mask + 1) {
+        toon_object_index_build(arena, object);
+    } else {
+        index_put(index, object->value.object.entries, length);
+    }
+
+    return true;
+}
+
+// Remove the index slot of the entry at position, if it has one, using
+// backward-shift deletion, then renumber the entries that follow it.
+// Returns whether the entry had a slot.
+static bool index_remove(ToonObjectIndex *index, const ToonObjectEntry *entries, size_t position) {
+    size_t slot = entry_hash(&entries[position]) & index->mask;
+    while (index->slots[slot] && index->slots[slot] != position + 1) slot = (slot + 1) & index->mask;
+    bool indexed = index->slots[slot] != 0;
+
+    if (indexed) {
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & index->mask; index->slots[next]; next = (next + 1) & index->mask) {
+            size_t home = entry_hash(&entries[index->slots[next] - 1]) & index->mask;
+
+            // Move the entry back unless its home lies cyclically in (hole, next]
+            bool stays = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+            if (!stays) {
+                index->slots[hole] = index->slots[next];
+                hole = next;
+            }
+        }
+        index->slots[hole] = 0;
+    }
+
+    for (size_t i = 0; i <= index->mask; i++) {
+        if (index->slots[i] > position + 1) index->slots[i]--;
+    }
+
+    return indexed;
+}
+
+// Remove the entry at position, keeping the order of the others. Its key
+// and value are left to the caller.
+void toon_object_remove(ToonValue *object, size_t position) {
+    ToonObjectEntry *entries = object->value.object.entries;
+    size_t length = object->value.object.length;
+    ToonObjectIndex *index = object->value.object.index;
+    const char *key = entries[position].key;
+
+    bool indexed = index && index_remove(index, entries, position);
+
+    memmove(&entries[position], &entries[position + 1], sizeof(ToonObjectEntry) * (length - position - 1));
+    object->value.object.length = length - 1;
+
+    // A later entry with the same key now becomes the first occurrence
+    if (indexed) {
+        for (size_t i = position; i < length - 1; i++) {
+            if (strcmp(entries[i].key, key) == 0) {
+                index_put(index, entries, i);
+                break;
+            }
+        }
+    }
+}
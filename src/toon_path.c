@@ -1,295 +1,880 @@
 #include "redistoon.h"
 #include <ctype.h>
+#include <limits.h>
 
 // Simple path parser - supports basic JSONPath-like syntax
 // Examples:
 //   $ - root
 //   $.name - object property
 //   $.users[0] - array index
+//   $.users[-1] - array index from the end
 //   $.users[*] - all array elements
 //   $.users[*].name - all names in users array
+//   $.users[1:3] - elements 1 and 2; either bound may be left out or negative
+//   $.users[?(@.score>0.8)] - elements whose score compares true; the
+//       operators are == != < <= > >=, the literal a number, a quoted
+//       string, true, false or null, and [?(@.key)] tests for a non-null key
+//
+// Paths are compiled once into typed segments: keys carry their length and
+// hash, indices are parsed up front. Commands look paths up through a small
+// LRU cache so that repeating a path costs no parsing and no allocation.
+
+// Number of compiled paths kept by the cache
+#define TOON_PATH_CACHE_SIZE 128
+
+// Longer paths are compiled into a single overflow slot instead of the cache
+#define TOON_PATH_CACHE_MAX_LEN 1024
+
+#define TOON_PATH_CACHE_BUCKETS 256
+
+// Append a segment, growing the segment array by doubling. A path may not
+// reach deeper than a document could be parsed, so it never takes a write
+// past twice the depth limit.
+static ToonPathSegment *path_push(ToonPath *path, size_t *capacity) {
+    if (path->num_segments == toon_max_depth()) return NULL;
+
+    if (path->num_segments == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        ToonPathSegment *segments = realloc(path->segments, sizeof(ToonPathSegment) * new_capacity);
+        if (!segments) return NULL;
+        path->segments = segments;
+        *capacity = new_capacity;
+    }
 
-typedef struct {
-    char **segments;
-    size_t num_segments;
-} Path;
+    ToonPathSegment *segment = &path->segments[path->num_segments++];
+    memset(segment, 0, sizeof(ToonPathSegment));
+    return segment;
+}
+
+// Parse an optionally negative integer filling all of [start, start + len)
+static bool parse_integer(const char *start, size_t len, long long *out) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < len && start[0] == '-') {
+        negative = true;
+        i++;
+    }
+    if (i == len) return false;
+
+    long long value = 0;
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char)start[i])) return false;
+        if (value > (LLONG_MAX - 9) / 10) return false;
+        value = value * 10 + (start[i] - '0');
+    }
+
+    *out = negative ? -value : value;
+    return true;
+}
+
+static char *skip_spaces(char *p, char *end) {
+    while (p < end && *p == ' ') p++;
+    return p;
+}
+
+// Parse a filter "?(@.key)" or "?(@.key op literal)". The key and a string
+// literal are terminated in place, as nothing after them is parsed again.
+static bool parse_filter(ToonPathSegment *segment, char *start, size_t len) {
+    if (len < 5 || start[1] != '(' || start[len - 1] != ')') return false;
 
-// Parse a path string into segments
-static Path *path_parse(const char *path_str) {
-    if (!path_str || *path_str != '$') {
+    char *p = skip_spaces(start + 2, start + len - 1);
+    char *end = start + len - 1;
+
+    if (end - p < 3 || p[0] != '@' || p[1] != '.') return false;
+    p += 2;
+
+    char *key = p;
+    while (p < end && *p != ' ' && *p != '=' && *p != '!' && *p != '<' && *p != '>') p++;
+    if (p == key) return false;
+
+    segment->type = TOON_SEGMENT_FILTER;
+    segment->key = key;
+    segment->key_len = p - key;
+    segment->hash = toon_hash_key(key, p - key);
+
+    p = skip_spaces(p, end);
+    if (p == end) {
+        segment->op = TOON_FILTER_EXISTS;
+        key[segment->key_len] = '\0';
+        return true;
+    }
+
+    static const struct { const char *text; ToonFilterOp op; } ops[] = {
+        {"==", TOON_FILTER_EQ}, {"!=", TOON_FILTER_NE}, {"<=", TOON_FILTER_LE},
+        {">=", TOON_FILTER_GE}, {"<", TOON_FILTER_LT}, {">", TOON_FILTER_GT}
+    };
+    size_t op = 0;
+    size_t num_ops = sizeof(ops) / sizeof(ops[0]);
+    while (op < num_ops && strncmp(p, ops[op].text, strlen(ops[op].text)) != 0) op++;
+    if (op == num_ops) return false;
+    segment->op = ops[op].op;
+    p = skip_spaces(p + strlen(ops[op].text), end);
+
+    // Literal: a quoted string, without escapes, or a bare token
+    ToonValue *literal = &segment->literal;
+    char *literal_end;
+    if (p < end && (*p == '\'' || *p == '"')) {
+        char *close = memchr(p + 1, *p, end - (p + 1));
+        if (!close) return false;
+
+        literal->type = TOON_STRING;
+        literal->value.string = p + 1;
+        literal_end = close + 1;
+        *close = '\0';
+    } else {
+        literal_end = p;
+        while (literal_end < end && *literal_end != ' ') literal_end++;
+        size_t token_len = literal_end - p;
+
+        if (token_len == 4 && memcmp(p, "null", 4) == 0) {
+            literal->type = TOON_NULL;
+        } else if (token_len == 4 && memcmp(p, "true", 4) == 0) {
+            literal->type = TOON_BOOLEAN;
+            literal->value.boolean = true;
+        } else if (token_len == 5 && memcmp(p, "false", 5) == 0) {
+            literal->type = TOON_BOOLEAN;
+            literal->value.boolean = false;
+        } else if (toon_number_is_token(p, token_len)) {
+            literal->type = TOON_NUMBER;
+            literal->value.number = toon_number_parse(p, token_len);
+        } else {
+            return false;
+        }
+    }
+
+    if (skip_spaces(literal_end, end) != end) return false;
+
+    key[segment->key_len] = '\0';
+    return true;
+}
+
+// Parse the contents of a [...] segment: an integer index, a wildcard, a
+// slice or a filter
+static bool parse_bracket(ToonPathSegment *segment, char *start, size_t len) {
+    if (len == 1 && start[0] == '*') {
+        segment->type = TOON_SEGMENT_WILDCARD;
+        return true;
+    }
+
+    if (start[0] == '?') {
+        return parse_filter(segment, start, len);
+    }
+
+    const char *colon = memchr(start, ':', len);
+    if (colon) {
+        size_t start_len = colon - start;
+        size_t end_len = len - start_len - 1;
+
+        segment->type = TOON_SEGMENT_SLICE;
+        segment->has_start = start_len > 0;
+        segment->has_end = end_len > 0;
+        return (!segment->has_start || parse_integer(start, start_len, &segment->index)) &&
+               (!segment->has_end || parse_integer(colon + 1, end_len, &segment->end));
+    }
+
+    segment->type = TOON_SEGMENT_INDEX;
+    return parse_integer(start, len, &segment->index);
+}
+
+// Compile a path string into segments; NULL if it is not a valid path
+ToonPath *toon_path_compile(const char *path_str, size_t len) {
+    if (!path_str || len == 0 || path_str[0] != '$') {
         return NULL;
     }
 
-    Path *path = malloc(sizeof(Path));
+    ToonPath *path = calloc(1, sizeof(ToonPath));
     if (!path) return NULL;
 
-    path->segments = malloc(sizeof(char *) * 64);
-    path->num_segments = 0;
+    // One allocation holds the source text, kept for cache lookups, and a
+    // second copy that keys point into
+    path->source = malloc(2 * (len + 1));
+    if (!path->source) {
+        free(path);
+        return NULL;
+    }
+    memcpy(path->source, path_str, len);
+    path->source[len] = '\0';
+    path->source_len = len;
 
-    const char *p = path_str + 1;  // Skip $
+    char *keys = path->source + len + 1;
+    memcpy(keys, path_str, len + 1);
 
-    while (*p) {
+    size_t capacity = 0;
+    char *p = keys + 1;  // Skip $
+    char *end = keys + len;
+
+    while (p < end) {
         if (*p == '.') {
             p++;  // Skip .
 
             // Parse property name
-            char segment[256];
-            size_t i = 0;
-            while (*p && *p != '.' && *p != '[' && i < 255) {
-                segment[i++] = *p++;
-            }
-            segment[i] = '\0';
-
-            if (i > 0) {
-                path->segments[path->num_segments++] = strdup(segment);
+            char *start = p;
+            while (p < end && *p != '.' && *p != '[') p++;
+
+            if (p > start) {
+                ToonPathSegment *segment = path_push(path, &capacity);
+                if (!segment) goto fail;
+                segment->type = TOON_SEGMENT_KEY;
+                segment->key = start;
+                segment->key_len = p - start;
+                segment->hash = toon_hash_key(start, p - start);
             }
         } else if (*p == '[') {
             p++;  // Skip [
 
-            // Parse array index or wildcard
-            char segment[256];
-            size_t i = 0;
-            while (*p && *p != ']' && i < 255) {
-                segment[i++] = *p++;
+            // Parse the bracket contents; a ']' inside a quoted filter
+            // literal does not close it
+            char *start = p;
+            char quote = 0;
+            while (p < end && (quote || *p != ']')) {
+                if (quote) {
+                    if (*p == quote) quote = 0;
+                } else if (*p == '\'' || *p == '"') {
+                    quote = *p;
+                }
+                p++;
             }
-            segment[i] = '\0';
+            if (p == end) goto fail;
 
-            if (*p == ']') p++;  // Skip ]
+            size_t segment_len = p - start;
+            p++;  // Skip ]
 
-            if (i > 0) {
-                char index_segment[260];
-                sprintf(index_segment, "[%s]", segment);
-                path->segments[path->num_segments++] = strdup(index_segment);
+            if (segment_len > 0) {
+                ToonPathSegment *segment = path_push(path, &capacity);
+                if (!segment || !parse_bracket(segment, start, segment_len)) goto fail;
             }
         } else {
-            break;
+            goto fail;
+        }
+    }
+
+    // Terminate keys in their copy. The byte after a key is a separator or
+    // the end, never part of another segment.
+    path->definite = true;
+    for (size_t i = 0; i < path->num_segments; i++) {
+        ToonPathSegment *segment = &path->segments[i];
+        if (segment->type == TOON_SEGMENT_KEY) {
+            segment->key[segment->key_len] = '\0';
+        } else if (segment->type != TOON_SEGMENT_INDEX) {
+            path->definite = false;
+        }
+
+        // Point keys at their interned copy, so they match document keys
+        // by pointer. Paths come from clients, so a key that is not
+        // interned yet is not added.
+        if (segment->type == TOON_SEGMENT_KEY || segment->type == TOON_SEGMENT_FILTER) {
+            const char *interned = toon_intern_find(segment->key, segment->key_len);
+            if (interned) segment->key = (char *)interned;
         }
     }
 
     return path;
+
+fail:
+    toon_path_free(path);
+    return NULL;
 }
 
-// Free a parsed path
-static void path_free(Path *path) {
+// Free a compiled path
+void toon_path_free(ToonPath *path) {
     if (!path) return;
 
-    for (size_t i = 0; i < path->num_segments; i++) {
-        free(path->segments[i]);
-    }
     free(path->segments);
+    free(path->source);
     free(path);
 }
 
-// Navigate to a value using path
-static ToonValue *path_navigate(ToonValue *root, Path *path, size_t segment_index) {
-    if (!root || !path || segment_index >= path->num_segments) {
-        return root;
+// ============================================================================
+// Compiled path cache
+// ============================================================================
+
+// The cache is module-global and only used from the main thread
+
+typedef struct ToonPathCacheEntry {
+    ToonPath *path;
+    uint64_t hash;                        // Hash of the source text
+    struct ToonPathCacheEntry *bucket_next;
+    struct ToonPathCacheEntry *lru_prev;  // Towards the most recently used
+    struct ToonPathCacheEntry *lru_next;  // Towards the least recently used
+} ToonPathCacheEntry;
+
+static struct {
+    ToonPathCacheEntry *buckets[TOON_PATH_CACHE_BUCKETS];
+    ToonPathCacheEntry *lru_head;
+    ToonPathCacheEntry *lru_tail;
+    size_t count;
+    ToonPath *overflow;  // Last path served without a cache entry
+} path_cache;
+
+static void lru_unlink(ToonPathCacheEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else path_cache.lru_head = entry->lru_next;
+
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else path_cache.lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(ToonPathCacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = path_cache.lru_head;
+    if (path_cache.lru_head) path_cache.lru_head->lru_prev = entry;
+    path_cache.lru_head = entry;
+    if (!path_cache.lru_tail) path_cache.lru_tail = entry;
+}
+
+// Remove the least recently used entry
+static void cache_evict(void) {
+    ToonPathCacheEntry *victim = path_cache.lru_tail;
+    if (!victim) return;
+
+    ToonPathCacheEntry **link = &path_cache.buckets[victim->hash % TOON_PATH_CACHE_BUCKETS];
+    while (*link != victim) link = &(*link)->bucket_next;
+    *link = victim->bucket_next;
+
+    lru_unlink(victim);
+    toon_path_free(victim->path);
+    free(victim);
+    path_cache.count--;
+}
+
+// Serve a path without a cache entry; it lives until the next such path
+static const ToonPath *cache_overflow(ToonPath *path) {
+    toon_path_free(path_cache.overflow);
+    path_cache.overflow = path;
+    return path;
+}
+
+// Look up a compiled path, compiling and caching it on a miss. The cache
+// owns the result, which stays valid until the next lookup. NULL if the
+// path is invalid.
+const ToonPath *toon_path_cache_lookup(const char *path_str, size_t len) {
+    if (len > TOON_PATH_CACHE_MAX_LEN) {
+        toon_stats_cache_lookup(TOON_STATS_PATH_CACHE, false);
+        return cache_overflow(toon_path_compile(path_str, len));
     }
 
-    const char *segment = path->segments[segment_index];
+    uint64_t hash = toon_hash_key(path_str, len);
+    ToonPathCacheEntry **bucket = &path_cache.buckets[hash % TOON_PATH_CACHE_BUCKETS];
 
-    // Handle array indexing
-    if (segment[0] == '[') {
-        if (root->type != TOON_ARRAY && root->type != TOON_TABULAR_ARRAY) {
-            return NULL;
+    for (ToonPathCacheEntry *entry = *bucket; entry; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->path->source_len == len &&
+            memcmp(entry->path->source, path_str, len) == 0) {
+            if (entry != path_cache.lru_head) {
+                lru_unlink(entry);
+                lru_push_front(entry);
+            }
+            toon_stats_cache_lookup(TOON_STATS_PATH_CACHE, true);
+            return entry->path;
         }
+    }
+    toon_stats_cache_lookup(TOON_STATS_PATH_CACHE, false);
 
-        // Check for wildcard
-        if (strcmp(segment, "[*]") == 0) {
-            // For now, return NULL for wildcards (requires multiple results)
-            return NULL;
-        }
+    // Invalid paths are not cached; they are cheap to reject again
+    ToonPath *path = toon_path_compile(path_str, len);
+    if (!path) return NULL;
 
-        // Parse index
-        int index = atoi(segment + 1);
+    ToonPathCacheEntry *entry = calloc(1, sizeof(ToonPathCacheEntry));
+    if (!entry) return cache_overflow(path);
 
-        if (root->type == TOON_ARRAY) {
-            if (index < 0) {
-                index = root->value.array.length + index;
-            }
+    if (path_cache.count >= TOON_PATH_CACHE_SIZE) cache_evict();
 
-            if (index < 0 || (size_t)index >= root->value.array.length) {
-                return NULL;
-            }
+    entry->path = path;
+    entry->hash = hash;
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push_front(entry);
+    path_cache.count++;
 
-            return path_navigate(root->value.array.elements[index], path, segment_index + 1);
-        } else if (root->type == TOON_TABULAR_ARRAY) {
-            if (index < 0) {
-                index = root->value.tabular.num_rows + index;
-            }
+    return path;
+}
+
+// Drop every cached path
+void toon_path_cache_clear(void) {
+    while (path_cache.lru_tail) cache_evict();
+
+    toon_path_free(path_cache.overflow);
+    path_cache.overflow = NULL;
+}
 
-            if (index < 0 || (size_t)index >= root->value.tabular.num_rows) {
+// ============================================================================
+// Path evaluation
+// ============================================================================
+
+// Resolve a possibly negative index against length
+static bool resolve_index(long long index, size_t length, size_t *out) {
+    if (index < 0) index += (long long)length;
+    if (index < 0 || (unsigned long long)index >= length) return false;
+
+    *out = (size_t)index;
+    return true;
+}
+
+// Find the entry for a key segment in an object
+static ToonObjectEntry *object_find(ToonValue *object, const ToonPathSegment *segment, size_t *position) {
+    return toon_object_find(object, segment->key, segment->key_len, segment->hash, position);
+}
+
+// Walk segments [0, end) from root. A tabular cell is unpacked into scratch.
+// A nonzero tokens_delta is added to the count of every value passed
+// through, including the one returned.
+static ToonValue *path_navigate(ToonValue *root, const ToonPath *path, size_t end,
+                                ToonValue *scratch, long long tokens_delta) {
+    ToonValue *current = root;
+
+    for (size_t i = 0; current && i < end; i++) {
+        const ToonPathSegment *segment = &path->segments[i];
+        size_t index;
+
+        if (tokens_delta) toon_tokens_adjust(current, tokens_delta);
+
+        switch (segment->type) {
+            case TOON_SEGMENT_WILDCARD:
+            case TOON_SEGMENT_SLICE:
+            case TOON_SEGMENT_FILTER:
+                // These select several values and cannot be navigated
                 return NULL;
+
+            case TOON_SEGMENT_INDEX:
+                if (current->type == TOON_ARRAY) {
+                    if (!resolve_index(segment->index, current->value.array.length, &index)) return NULL;
+                    current = current->value.array.elements[index];
+                } else if (current->type == TOON_TABULAR_ARRAY) {
+                    const ToonTabularArray *tab = &current->value.tabular;
+                    if (!resolve_index(segment->index, tab->num_rows, &index)) return NULL;
+
+                    // A row is only addressable through one of its columns;
+                    // the cell is read straight from the column
+                    if (i + 1 >= end || path->segments[i + 1].type != TOON_SEGMENT_KEY) return NULL;
+
+                    size_t col;
+                    if (!toon_tabular_find_column(tab, path->segments[i + 1].key, &col)) return NULL;
+
+                    current = toon_tabular_cell(tab, index, col, scratch);
+                    i++;
+                } else {
+                    return NULL;
+                }
+                break;
+
+            case TOON_SEGMENT_KEY: {
+                if (current->type != TOON_OBJECT) return NULL;
+
+                ToonObjectEntry *entry = object_find(current, segment, NULL);
+                if (!entry) return NULL;
+                current = entry->value;
+                break;
             }
+        }
+    }
+
+    if (tokens_delta) toon_tokens_adjust(current, tokens_delta);
+    return current;
+}
+
+// Public path get function. scratch receives the result when the path
+// ends in a tabular cell, so it must outlive any use of the result.
+ToonValue *toon_path_get(ToonValue *root, const ToonPath *path, ToonValue *scratch) {
+    if (!root || !path) return NULL;
+
+    return path_navigate(root, path, path->num_segments, scratch, 0);
+}
+
+// Carry a change of delta tokens in the value at path up to the root, for
+// mutations made outside toon_path_set and toon_path_delete
+void toon_path_add_tokens(ToonValue *root, const ToonPath *path, long long delta) {
+    ToonValue scratch;
+    if (root && path && delta) path_navigate(root, path, path->num_segments, &scratch, delta);
+}
+
+// Carry a change of delta tokens in the parent of the last segment up to the root
+static void parent_add_tokens(ToonValue *root, const ToonPath *path, long long delta) {
+    ToonValue scratch;
+    if (delta) path_navigate(root, path, path->num_segments - 1, &scratch, delta);
+}
+
+// ============================================================================
+// Multi-value evaluation
+// ============================================================================
+
+typedef struct {
+    const ToonPath *path;
+    ToonPathVisit visit;
+    void *ctx;
+    bool failed;            // Out of memory; the walk stops
+} PathEval;
+
+// Resolve a slice against length into the rows [*first, *stop)
+static void resolve_slice(const ToonPathSegment *segment, size_t length, size_t *first, size_t *stop) {
+    long long n = (long long)length;
+    long long a = segment->has_start ? segment->index : 0;
+    long long b = segment->has_end ? segment->end : n;
+
+    if (a < 0) a += n;
+    if (b < 0) b += n;
+    a = a < 0 ? 0 : (a > n ? n : a);
+    b = b < a ? a : (b > n ? n : b);
+
+    *first = (size_t)a;
+    *stop = (size_t)b;
+}
+
+// Resolve a selector into the range of positions it can match; filters
+// test every position
+static bool resolve_range(const ToonPathSegment *segment, size_t length, size_t *first, size_t *stop) {
+    switch (segment->type) {
+        case TOON_SEGMENT_INDEX:
+            if (!resolve_index(segment->index, length, first)) return false;
+            *stop = *first + 1;
+            return true;
+
+        case TOON_SEGMENT_SLICE:
+            resolve_slice(segment, length, first, stop);
+            return true;
+
+        case TOON_SEGMENT_WILDCARD:
+        case TOON_SEGMENT_FILTER:
+            *first = 0;
+            *stop = length;
+            return true;
+
+        case TOON_SEGMENT_KEY:
+            break;
+    }
+    return false;
+}
+
+// Whether value, the filter key of a candidate (NULL if it has none),
+// satisfies a filter. Numbers and strings order naturally; booleans and
+// nulls only compare for equality, and values of different types are
+// only ever unequal.
+bool toon_filter_match(const ToonPathSegment *segment, const ToonValue *value) {
+    if (!value) return false;
+    if (segment->op == TOON_FILTER_EXISTS) return value->type != TOON_NULL;
+
+    const ToonValue *literal = &segment->literal;
+    int cmp;
+
+    if (value->type == TOON_NUMBER && literal->type == TOON_NUMBER) {
+        cmp = (value->value.number > literal->value.number) - (value->value.number < literal->value.number);
+    } else if (value->type == TOON_STRING && literal->type == TOON_STRING) {
+        cmp = strcmp(value->value.string, literal->value.string);
+    } else if (value->type == literal->type) {
+        if (segment->op != TOON_FILTER_EQ && segment->op != TOON_FILTER_NE) return false;
+        cmp = value->type == TOON_BOOLEAN && value->value.boolean != literal->value.boolean;
+    } else {
+        return segment->op == TOON_FILTER_NE;
+    }
 
-            // For tabular arrays, we need to return a row as an object
-            // For simplicity, just return NULL for now
-            return NULL;
+    switch (segment->op) {
+        case TOON_FILTER_EQ: return cmp == 0;
+        case TOON_FILTER_NE: return cmp != 0;
+        case TOON_FILTER_LT: return cmp < 0;
+        case TOON_FILTER_LE: return cmp <= 0;
+        case TOON_FILTER_GT: return cmp > 0;
+        case TOON_FILTER_GE: return cmp >= 0;
+        case TOON_FILTER_EXISTS: break;
+    }
+    return false;
+}
+
+static void eval_node(PathEval *eval, ToonValue *node, size_t i);
+
+// Apply a row selector to a tabular array and continue with segment next.
+// A path that goes on into a column reads that column directly, with the
+// column looked up once for all rows. A path that ends at the rows gets
+// each one as an object whose entries point at the headers and at cells
+// unpacked into a reused scratch row.
+static void eval_rows(PathEval *eval, ToonTabularArray *tab, const ToonPathSegment *selector, size_t next) {
+    const ToonPath *path = eval->path;
+    size_t first, stop;
+    size_t col = 0, filter_col = 0;
+
+    if (!resolve_range(selector, tab->num_rows, &first, &stop)) return;
+    if (selector->type == TOON_SEGMENT_FILTER &&
+        !toon_tabular_find_column(tab, selector->key, &filter_col)) {
+        return;
+    }
+
+    bool project = next < path->num_segments;
+    if (project && (path->segments[next].type != TOON_SEGMENT_KEY ||
+                    !toon_tabular_find_column(tab, path->segments[next].key, &col))) {
+        return;
+    }
+
+    ToonValue row = {.type = TOON_OBJECT};
+    ToonValue *cells = NULL;
+    if (!project && first < stop && tab->num_headers > 0) {
+        row.value.object.entries = malloc(sizeof(ToonObjectEntry) * tab->num_headers);
+        cells = malloc(sizeof(ToonValue) * tab->num_headers);
+        if (!row.value.object.entries || !cells) {
+            eval->failed = true;
+            free(row.value.object.entries);
+            free(cells);
+            return;
         }
+        row.value.object.length = row.value.object.capacity = tab->num_headers;
     }
 
-    // Handle object property access
-    if (root->type == TOON_OBJECT) {
-        for (size_t i = 0; i < root->value.object.length; i++) {
-            if (strcmp(root->value.object.entries[i].key, segment) == 0) {
-                return path_navigate(root->value.object.entries[i].value, path, segment_index + 1);
-            }
+    for (size_t r = first; r < stop && !eval->failed; r++) {
+        ToonValue scratch;
+
+        if (selector->type == TOON_SEGMENT_FILTER &&
+            !toon_filter_match(selector, toon_tabular_cell(tab, r, filter_col, &scratch))) {
+            continue;
         }
-        return NULL;
+
+        if (project) {
+            eval_node(eval, toon_tabular_cell(tab, r, col, &scratch), next + 1);
+            continue;
+        }
+
+        // The row is reused, so a count cached on it by the visitor is reset
+        for (size_t c = 0; c < tab->num_headers; c++) {
+            row.value.object.entries[c].key = tab->headers[c];
+            row.value.object.entries[c].value = toon_tabular_cell(tab, r, c, &cells[c]);
+        }
+        row.tokens = 0;
+        eval->visit(&row, eval->ctx);
     }
 
-    return NULL;
+    free(row.value.object.entries);
+    free(cells);
 }
 
-// Public path get function
-ToonValue *toon_path_get(ToonValue *root, const char *path_str) {
-    if (!root || !path_str) return NULL;
+// Match segments [i, end) against node
+static void eval_node(PathEval *eval, ToonValue *node, size_t i) {
+    if (eval->failed || !node) return;
 
-    // Handle root path
-    if (strcmp(path_str, "$") == 0) {
-        return root;
+    if (i == eval->path->num_segments) {
+        eval->visit(node, eval->ctx);
+        return;
     }
 
-    Path *path = path_parse(path_str);
-    if (!path) return NULL;
+    const ToonPathSegment *segment = &eval->path->segments[i];
+    size_t first, stop;
+
+    switch (node->type) {
+        case TOON_OBJECT:
+            if (segment->type == TOON_SEGMENT_KEY) {
+                ToonObjectEntry *entry = object_find(node, segment, NULL);
+                if (entry) eval_node(eval, entry->value, i + 1);
+            } else if (segment->type == TOON_SEGMENT_WILDCARD) {
+                for (size_t e = 0; e < node->value.object.length; e++) {
+                    eval_node(eval, node->value.object.entries[e].value, i + 1);
+                }
+            }
+            break;
+
+        case TOON_ARRAY:
+            if (!resolve_range(segment, node->value.array.length, &first, &stop)) break;
+
+            for (size_t e = first; e < stop && !eval->failed; e++) {
+                ToonValue *element = node->value.array.elements[e];
+
+                if (segment->type == TOON_SEGMENT_FILTER) {
+                    ToonObjectEntry *entry = element && element->type == TOON_OBJECT
+                                                 ? object_find(element, segment, NULL) : NULL;
+                    if (!toon_filter_match(segment, entry ? entry->value : NULL)) continue;
+                }
+                eval_node(eval, element, i + 1);
+            }
+            break;
+
+        case TOON_TABULAR_ARRAY:
+            eval_rows(eval, &node->value.tabular, segment, i + 1);
+            break;
 
-    ToonValue *result = path_navigate(root, path, 0);
+        case TOON_NULL:
+        case TOON_BOOLEAN:
+        case TOON_NUMBER:
+        case TOON_STRING:
+            break;
+    }
+}
 
-    path_free(path);
-    return result;
+// Evaluate path from root, calling visit for every match in document
+// order. Nothing is copied: matches are the document's own nodes, except
+// tabular cells and rows, which are unpacked into scratch values that
+// only live for their visit. Returns false if it ran out of memory, in
+// which case the matches visited so far are all there is.
+bool toon_path_eval(ToonValue *root, const ToonPath *path, ToonPathVisit visit, void *ctx) {
+    if (!root || !path) return true;
+
+    PathEval eval = {.path = path, .visit = visit, .ctx = ctx};
+    eval_node(&eval, root, 0);
+    return !eval.failed;
 }
 
-// Set value at path (simplified version - doesn't handle all cases)
-int toon_path_set(ToonValue *root, const char *path_str, ToonValue *value) {
-    if (!root || !path_str || !value) return -1;
+// Make the values on the way to segment end of path, that one included,
+// safe to change in place: each one the document shares with its clones is
+// replaced by a copy of the node alone in its own arena, so a write costs
+// the depth of the path rather than the size of the tree. Stops early where
+// the path leads nowhere, or at a table, which is copied whole. A copy is
+// linked in as soon as it is made, so this must come before taking an
+// arena mark. False when out of memory.
+bool toon_document_unshare_path(ToonDocument *doc, const ToonPath *path, size_t end) {
+    if (!doc->num_shared || !doc->root || !path) return true;
+
+    ToonValue **slot = &doc->root;
+    for (size_t i = 0;; i++) {
+        ToonValue *current = *slot;
+        if (current->type != TOON_ARRAY && current->type != TOON_OBJECT &&
+            current->type != TOON_TABULAR_ARRAY) {
+            return true;
+        }
 
-    // Handle root path
-    if (strcmp(path_str, "$") == 0) {
-        // Can't replace root directly, need to copy value contents
-        return -1;
+        if (!toon_document_owns(doc, current)) {
+            current = toon_value_copy_node(doc->arena, current);
+            if (!current) return false;
+            *slot = current;
+        }
+        if (i == end) return true;
+
+        const ToonPathSegment *segment = &path->segments[i];
+        size_t index;
+        if (segment->type == TOON_SEGMENT_INDEX && current->type == TOON_ARRAY) {
+            if (!resolve_index(segment->index, current->value.array.length, &index)) return true;
+            slot = &current->value.array.elements[index];
+        } else if (segment->type == TOON_SEGMENT_KEY && current->type == TOON_OBJECT) {
+            ToonObjectEntry *entry = object_find(current, segment, NULL);
+            if (!entry) return true;
+            slot = &entry->value;
+        } else {
+            return true;
+        }
     }
+}
+
+// Whether toon_path_set (create) or toon_path_delete would find the value
+// the last segment of path names: an element of an array, or an entry of
+// an object, which a set may add. Reads only, so a write can be refused
+// before anything is copied or decoded.
+bool toon_path_writable(ToonValue *root, const ToonPath *path, bool create) {
+    if (!root || !path || path->num_segments == 0) return false;
+
+    ToonValue scratch;
+    ToonValue *parent = path_navigate(root, path, path->num_segments - 1, &scratch, 0);
+    if (!parent) return false;
+
+    const ToonPathSegment *last = &path->segments[path->num_segments - 1];
+    size_t index;
+    if (last->type == TOON_SEGMENT_INDEX) {
+        return parent->type == TOON_ARRAY && resolve_index(last->index, parent->value.array.length, &index);
+    }
+    if (last->type == TOON_SEGMENT_KEY && parent->type == TOON_OBJECT) {
+        return create || object_find(parent, last, NULL);
+    }
+    return false;
+}
+
+// Set value at path (simplified version - doesn't handle all cases).
+// value must be allocated in the document arena; the replaced value is
+// discarded and the document compacted once enough of it is unreachable.
+// Once the path is known to lead somewhere, nodes on the way that the
+// document shares with clones or a snapshot are copied.
+int toon_path_set(ToonDocument *doc, const ToonPath *path, ToonValue *value) {
+    if (!doc || !doc->root || !path || !value) return -1;
 
-    Path *path = path_parse(path_str);
-    if (!path || path->num_segments == 0) {
-        path_free(path);
+    // Can't replace root directly, need to copy value contents
+    if (path->num_segments == 0) return -1;
+
+    ToonArena *arena = doc->arena;
+    if (!toon_path_writable(doc->root, path, true) ||
+        !toon_document_unshare_path(doc, path, path->num_segments - 1)) {
         return -1;
     }
 
     // Navigate to parent
-    ToonValue *parent = root;
-    for (size_t i = 0; i < path->num_segments - 1; i++) {
-        parent = path_navigate(parent, path, i);
-        if (!parent) {
-            path_free(path);
-            return -1;
-        }
-    }
+    ToonValue scratch;
+    ToonValue *parent = path_navigate(doc->root, path, path->num_segments - 1, &scratch, 0);
+    if (!parent) return -1;
 
-    const char *last_segment = path->segments[path->num_segments - 1];
+    const ToonPathSegment *last = &path->segments[path->num_segments - 1];
 
     // Handle array indexing
-    if (last_segment[0] == '[') {
-        if (parent->type != TOON_ARRAY) {
-            path_free(path);
+    if (last->type == TOON_SEGMENT_INDEX) {
+        size_t index;
+        if (parent->type != TOON_ARRAY ||
+            !resolve_index(last->index, parent->value.array.length, &index)) {
             return -1;
         }
 
-        int index = atoi(last_segment + 1);
-        if (index < 0) {
-            index = parent->value.array.length + index;
-        }
-
-        if (index < 0 || (size_t)index >= parent->value.array.length) {
-            path_free(path);
-            return -1;
-        }
+        ToonValue *old = parent->value.array.elements[index];
+        long long delta = (long long)toon_estimate_tokens(value) - (long long)toon_estimate_tokens(old);
 
-        toon_value_free(parent->value.array.elements[index]);
+        toon_value_discard(arena, old);
         parent->value.array.elements[index] = value;
 
-        path_free(path);
+        parent_add_tokens(doc->root, path, delta);
+        toon_document_changed(doc);
+        toon_document_compact(doc);
         return 0;
     }
 
     // Handle object property
-    if (parent->type == TOON_OBJECT) {
-        for (size_t i = 0; i < parent->value.object.length; i++) {
-            if (strcmp(parent->value.object.entries[i].key, last_segment) == 0) {
-                toon_value_free(parent->value.object.entries[i].value);
-                parent->value.object.entries[i].value = value;
-                path_free(path);
-                return 0;
-            }
-        }
-
-        // Property doesn't exist, add it
-        size_t new_length = parent->value.object.length + 1;
-        ToonObjectEntry *new_entries = realloc(parent->value.object.entries,
-                                               sizeof(ToonObjectEntry) * new_length);
-        if (!new_entries) {
-            path_free(path);
-            return -1;
+    if (last->type == TOON_SEGMENT_KEY && parent->type == TOON_OBJECT) {
+        ToonObjectEntry *entry = object_find(parent, last, NULL);
+        if (entry) {
+            long long delta = (long long)toon_estimate_tokens(value) -
+                              (long long)toon_estimate_tokens(entry->value);
+
+            toon_value_discard(arena, entry->value);
+            entry->value = value;
+            parent_add_tokens(doc->root, path, delta);
+            toon_document_changed(doc);
+            toon_document_compact(doc);
+            return 0;
         }
 
-        new_entries[parent->value.object.length].key = strdup(last_segment);
-        new_entries[parent->value.object.length].value = value;
-        parent->value.object.entries = new_entries;
-        parent->value.object.length = new_length;
+        // Property doesn't exist, add it. The key is allocated first so a
+        // failed grow leaves nothing referenced past the caller's arena mark.
+        char *key = toon_intern_key(arena, last->key, last->key_len);
+        if (!key || !toon_object_append(arena, parent, key, value)) return -1;
 
-        path_free(path);
+        parent_add_tokens(doc->root, path, toon_entry_tokens(key) + toon_estimate_tokens(value));
+        toon_document_changed(doc);
+        toon_document_compact(doc);
         return 0;
     }
 
-    path_free(path);
     return -1;
 }
 
-// Delete value at path
-int toon_path_delete(ToonValue *root, const char *path_str) {
-    if (!root || !path_str) return -1;
+// Delete value at path. The removed value stays in the arena as waste
+// until the document is compacted.
+int toon_path_delete(ToonDocument *doc, const ToonPath *path) {
+    if (!doc || !doc->root || !path) return -1;
 
     // Can't delete root
-    if (strcmp(path_str, "$") == 0) {
-        return -1;
-    }
+    if (path->num_segments == 0) return -1;
 
-    Path *path = path_parse(path_str);
-    if (!path || path->num_segments == 0) {
-        path_free(path);
+    ToonArena *arena = doc->arena;
+    if (!toon_path_writable(doc->root, path, false) ||
+        !toon_document_unshare_path(doc, path, path->num_segments - 1)) {
         return -1;
     }
 
     // Navigate to parent
-    ToonValue *parent = root;
-    for (size_t i = 0; i < path->num_segments - 1; i++) {
-        parent = path_navigate(parent, path, i);
-        if (!parent) {
-            path_free(path);
-            return -1;
-        }
-    }
+    ToonValue scratch;
+    ToonValue *parent = path_navigate(doc->root, path, path->num_segments - 1, &scratch, 0);
+    if (!parent) return -1;
 
-    const char *last_segment = path->segments[path->num_segments - 1];
+    const ToonPathSegment *last = &path->segments[path->num_segments - 1];
 
     // Handle array indexing
-    if (last_segment[0] == '[') {
-        if (parent->type != TOON_ARRAY) {
-            path_free(path);
+    if (last->type == TOON_SEGMENT_INDEX) {
+        size_t index;
+        if (parent->type != TOON_ARRAY ||
+            !resolve_index(last->index, parent->value.array.length, &index)) {
             return -1;
         }
 
-        int index = atoi(last_segment + 1);
-        if (index < 0) {
-            index = parent->value.array.length + index;
-        }
-
-        if (index < 0 || (size_t)index >= parent->value.array.length) {
-            path_free(path);
-            return -1;
-        }
-
-        // Free the element and shift remaining elements
-        toon_value_free(parent->value.array.elements[index]);
+        // Discard the element and shift remaining elements
+        ToonValue *old = parent->value.array.elements[index];
+        long long delta = -(long long)toon_estimate_tokens(old);
+        toon_value_discard(arena, old);
 
         for (size_t i = index; i < parent->value.array.length - 1; i++) {
             parent->value.array.elements[i] = parent->value.array.elements[i + 1];
@@ -297,30 +882,31 @@ int toon_path_delete(ToonValue *root, const char *path_str) {
 
         parent->value.array.length--;
 
-        path_free(path);
+        parent_add_tokens(doc->root, path, delta);
+        toon_document_changed(doc);
+        toon_document_compact(doc);
         return 0;
     }
 
     // Handle object property
-    if (parent->type == TOON_OBJECT) {
-        for (size_t i = 0; i < parent->value.object.length; i++) {
-            if (strcmp(parent->value.object.entries[i].key, last_segment) == 0) {
-                free(parent->value.object.entries[i].key);
-                toon_value_free(parent->value.object.entries[i].value);
-
-                // Shift remaining entries
-                for (size_t j = i; j < parent->value.object.length - 1; j++) {
-                    parent->value.object.entries[j] = parent->value.object.entries[j + 1];
-                }
+    if (last->type == TOON_SEGMENT_KEY && parent->type == TOON_OBJECT) {
+        size_t i;
+        ToonObjectEntry *entry = object_find(parent, last, &i);
+        if (!entry) return -1;
 
-                parent->value.object.length--;
+        long long delta = -(long long)(toon_entry_tokens(entry->key) + toon_estimate_tokens(entry->value));
 
-                path_free(path);
-                return 0;
-            }
-        }
+        toon_key_discard(arena, entry->key);
+        toon_value_discard(arena, entry->value);
+
+        // Shift remaining entries
+        toon_object_remove(parent, i);
+
+        parent_add_tokens(doc->root, path, delta);
+        toon_document_changed(doc);
+        toon_document_compact(doc);
+        return 0;
     }
 
-    path_free(path);
     return -1;
 }
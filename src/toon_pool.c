@@ -0,0 +1,90 @@
+#include "redistoon.h"
+#include <pthread.h>
+#include <signal.h>
+
+// Worker threads for parsing and encoding too large to do on the main
+// thread. A job only touches memory handed to it (a copy of its input or a
+// pinned snapshot) and reports back by unblocking its client, so the pool
+// is a plain FIFO with no results of its own. Workers run until the
+// process exits.
+
+typedef struct PoolJob {
+    void (*run)(void *arg);
+    void *arg;
+    struct PoolJob *next;
+} PoolJob;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    PoolJob *head;
+    PoolJob *tail;
+    size_t num_threads;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER
+};
+
+static void *pool_worker(void *unused) {
+    (void)unused;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.head) pthread_cond_wait(&pool.ready, &pool.lock);
+
+        PoolJob *job = pool.head;
+        pool.head = job->next;
+        if (!pool.head) pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        job->run(job->arg);
+        free(job);
+    }
+
+    return NULL;
+}
+
+// Start num_threads workers; false if none could be started. Workers block
+// every signal so the server's handlers keep running on its own threads.
+bool toon_pool_start(size_t num_threads) {
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        pool.num_threads++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return pool.num_threads > 0;
+}
+
+// Queue run(arg) for a worker; false if there are no workers or no memory
+bool toon_pool_submit(void (*run)(void *arg), void *arg) {
+    if (pool.num_threads == 0) return false;
+
+    PoolJob *job = malloc(sizeof(PoolJob));
+    if (!job) return false;
+    job->run = run;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.tail) {
+        pool.tail->next = job;
+    } else {
+        pool.head = job;
+    }
+    pool.tail = job;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    return true;
+}
+
+// Number of running workers
+size_t toon_pool_size(void) {
+    return pool.num_threads;
+}
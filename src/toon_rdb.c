@@ -0,0 +1,365 @@
+#include "redistoon.h"
+
+// Binary RDB encoding (encver 1 and 2)
+//
+// A document is saved as a metadata block followed by the root value:
+//
+//   meta:   <count> { <meta tag> <unsigned> }*
+//   value:  <tag> <payload>
+//
+// Tags and payloads:
+//   NULL, FALSE, TRUE    no payload
+//   NUMBER               raw double
+//   STRING               length-prefixed string buffer
+//   ARRAY                <length> value*
+//   OBJECT               <length> { key-string value }*
+//   TABULAR              <num_headers> header-string* <num_rows> column*
+//
+// Tabular columns are stored column-major. A number column without nulls
+// is written as a NUMBER_COLUMN block of raw doubles; any other column is
+// a VALUE_COLUMN block holding one tagged value per row.
+//
+// Meta tags:
+//   VERSION              the document's version counter
+//
+// Loaders skip metadata tags they do not know, so new document-level
+// fields can be added without bumping the encoding version.
+//
+// Index definitions, and from encver 2 the version clock, are saved as
+// module aux data ahead of the keyspace:
+//
+//   <count> { name path-text <num_columns> column-string* }* <clock>
+
+typedef enum {
+    TOON_RDB_NULL = 0,
+    TOON_RDB_FALSE = 1,
+    TOON_RDB_TRUE = 2,
+    TOON_RDB_NUMBER = 3,
+    TOON_RDB_STRING = 4,
+    TOON_RDB_ARRAY = 5,
+    TOON_RDB_OBJECT = 6,
+    TOON_RDB_TABULAR = 7
+} ToonRdbTag;
+
+typedef enum {
+    TOON_RDB_META_VERSION = 0
+} ToonRdbMetaTag;
+
+typedef enum {
+    TOON_RDB_VALUE_COLUMN = 0,
+    TOON_RDB_NUMBER_COLUMN = 1
+} ToonRdbColumnTag;
+
+// Copy a key loaded through the module allocator into the arena, or share
+// its interned copy
+static char *load_key(ToonArena *arena, RedisModuleIO *rdb) {
+    size_t len;
+    char *loaded = RedisModule_LoadStringBuffer(rdb, &len);
+    if (!loaded) return NULL;
+
+    char *key = toon_intern_key(arena, loaded, len);
+    RedisModule_Free(loaded);
+    return key;
+}
+
+// Build a string node from a string loaded through the module allocator
+static ToonValue *load_string(ToonArena *arena, RedisModuleIO *rdb) {
+    size_t len;
+    char *loaded = RedisModule_LoadStringBuffer(rdb, &len);
+    if (!loaded) return NULL;
+
+    ToonValue *value = toon_value_string(arena, loaded, len);
+    RedisModule_Free(loaded);
+    return value;
+}
+
+static void save_value(RedisModuleIO *rdb, ToonValue *value);
+
+// Save one tabular column as a block of raw doubles or of tagged values
+static void save_column(RedisModuleIO *rdb, ToonTabularArray *tab, size_t col) {
+    ToonColumn *column = &tab->columns[col];
+
+    if (column->type == TOON_COLUMN_NUMBER && !column->nulls) {
+        RedisModule_SaveUnsigned(rdb, TOON_RDB_NUMBER_COLUMN);
+        for (size_t row = 0; row < tab->num_rows; row++) {
+            RedisModule_SaveDouble(rdb, column->data.numbers[row]);
+        }
+    } else {
+        ToonValue scratch;
+        RedisModule_SaveUnsigned(rdb, TOON_RDB_VALUE_COLUMN);
+        for (size_t row = 0; row < tab->num_rows; row++) {
+            save_value(rdb, toon_tabular_cell(tab, row, col, &scratch));
+        }
+    }
+}
+
+static void save_value(RedisModuleIO *rdb, ToonValue *value) {
+    if (!value) {
+        RedisModule_SaveUnsigned(rdb, TOON_RDB_NULL);
+        return;
+    }
+
+    switch (value->type) {
+        case TOON_NULL:
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_NULL);
+            break;
+
+        case TOON_BOOLEAN:
+            RedisModule_SaveUnsigned(rdb, value->value.boolean ? TOON_RDB_TRUE : TOON_RDB_FALSE);
+            break;
+
+        case TOON_NUMBER:
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_NUMBER);
+            RedisModule_SaveDouble(rdb, value->value.number);
+            break;
+
+        case TOON_STRING:
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_STRING);
+            RedisModule_SaveStringBuffer(rdb, value->value.string, strlen(value->value.string));
+            break;
+
+        case TOON_ARRAY:
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_ARRAY);
+            RedisModule_SaveUnsigned(rdb, value->value.array.length);
+            for (size_t i = 0; i < value->value.array.length; i++) {
+                save_value(rdb, value->value.array.elements[i]);
+            }
+            break;
+
+        case TOON_OBJECT:
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_OBJECT);
+            RedisModule_SaveUnsigned(rdb, value->value.object.length);
+            for (size_t i = 0; i < value->value.object.length; i++) {
+                ToonObjectEntry *entry = &value->value.object.entries[i];
+                RedisModule_SaveStringBuffer(rdb, entry->key, strlen(entry->key));
+                save_value(rdb, entry->value);
+            }
+            break;
+
+        case TOON_TABULAR_ARRAY: {
+            ToonTabularArray *tab = &value->value.tabular;
+            RedisModule_SaveUnsigned(rdb, TOON_RDB_TABULAR);
+            RedisModule_SaveUnsigned(rdb, tab->num_headers);
+            for (size_t i = 0; i < tab->num_headers; i++) {
+                RedisModule_SaveStringBuffer(rdb, tab->headers[i], strlen(tab->headers[i]));
+            }
+            RedisModule_SaveUnsigned(rdb, tab->num_rows);
+            for (size_t col = 0; col < tab->num_headers; col++) {
+                save_column(rdb, tab, col);
+            }
+            break;
+        }
+    }
+}
+
+// Save a document in the binary encoding
+void toon_rdb_save(RedisModuleIO *rdb, const ToonDocument *doc) {
+    RedisModule_SaveUnsigned(rdb, 1);
+    RedisModule_SaveUnsigned(rdb, TOON_RDB_META_VERSION);
+    RedisModule_SaveUnsigned(rdb, doc->version);
+
+    save_value(rdb, doc->root);
+}
+
+static ToonValue *load_value(ToonArena *arena, RedisModuleIO *rdb, size_t depth);
+
+// Load a tabular array body. Cells are read column by column into a
+// scratch arena and then packed into columns in arena. Counts come from
+// the payload, so every array sized by them is allocated through
+// toon_arena_calloc, which rejects a product that overflows.
+static ToonValue *load_tabular_cells(ToonArena *arena, ToonArena *scratch, RedisModuleIO *rdb, size_t depth) {
+    size_t num_headers = RedisModule_LoadUnsigned(rdb);
+    if (num_headers > SIZE_MAX / sizeof(ToonValue *)) return NULL;
+    char **headers = toon_arena_calloc(scratch, num_headers, sizeof(char *));
+    if (!headers) return NULL;
+
+    for (size_t i = 0; i < num_headers; i++) {
+        headers[i] = load_key(scratch, rdb);
+        if (!headers[i]) return NULL;
+    }
+
+    size_t num_rows = RedisModule_LoadUnsigned(rdb);
+    ToonValue **cells = toon_arena_calloc(scratch, num_rows, sizeof(ToonValue *) * (num_headers ? num_headers : 1));
+    if (!cells) return NULL;
+
+    for (size_t col = 0; col < num_headers; col++) {
+        uint64_t column_tag = RedisModule_LoadUnsigned(rdb);
+
+        for (size_t row = 0; row < num_rows; row++) {
+            ToonValue *cell;
+            if (column_tag == TOON_RDB_NUMBER_COLUMN) {
+                cell = toon_value_number(scratch, RedisModule_LoadDouble(rdb));
+            } else if (column_tag == TOON_RDB_VALUE_COLUMN) {
+                cell = load_value(scratch, rdb, depth + 2);
+            } else {
+                return NULL;
+            }
+
+            if (!cell) return NULL;
+            cells[row * num_headers + col] = cell;
+        }
+    }
+
+    return toon_tabular_create(arena, headers, num_headers, cells, num_rows);
+}
+
+static ToonValue *load_tabular(ToonArena *arena, RedisModuleIO *rdb, size_t depth) {
+    ToonArena *scratch = toon_arena_create(0);
+    if (!scratch) return NULL;
+
+    ToonValue *value = load_tabular_cells(arena, scratch, rdb, depth);
+    toon_arena_destroy(scratch);
+    return value;
+}
+
+// Load a value with depth containers around it. Any document the module
+// builds stays within TOON_DOCUMENT_DEPTH_LIMIT whatever MAX_DEPTH is now,
+// so only a corrupt file goes deeper.
+static ToonValue *load_value(ToonArena *arena, RedisModuleIO *rdb, size_t depth) {
+    uint64_t tag = RedisModule_LoadUnsigned(rdb);
+    ToonValue *value = NULL;
+
+    bool container = tag == TOON_RDB_ARRAY || tag == TOON_RDB_OBJECT || tag == TOON_RDB_TABULAR;
+    if (container && depth >= TOON_DOCUMENT_DEPTH_LIMIT) return NULL;
+
+    switch (tag) {
+        case TOON_RDB_NULL:
+            return toon_value_null();
+
+        case TOON_RDB_FALSE:
+        case TOON_RDB_TRUE:
+            return toon_value_boolean(tag == TOON_RDB_TRUE);
+
+        case TOON_RDB_NUMBER:
+            return toon_value_number(arena, RedisModule_LoadDouble(rdb));
+
+        case TOON_RDB_STRING:
+            return load_string(arena, rdb);
+
+        case TOON_RDB_ARRAY: {
+            size_t length = RedisModule_LoadUnsigned(rdb);
+            value = toon_value_create(arena, TOON_ARRAY);
+            if (!value) return NULL;
+
+            value->value.array.elements = toon_arena_calloc(arena, length, sizeof(ToonValue *));
+            if (!value->value.array.elements) return NULL;
+            value->value.array.capacity = length;
+
+            for (size_t i = 0; i < length; i++) {
+                ToonValue *elem = load_value(arena, rdb, depth + 1);
+                if (!elem) return NULL;
+                value->value.array.elements[i] = elem;
+            }
+            value->value.array.length = length;
+            return value;
+        }
+
+        case TOON_RDB_OBJECT: {
+            size_t length = RedisModule_LoadUnsigned(rdb);
+            value = toon_value_create(arena, TOON_OBJECT);
+            if (!value) return NULL;
+
+            value->value.object.entries = toon_arena_calloc(arena, length, sizeof(ToonObjectEntry));
+            if (!value->value.object.entries) return NULL;
+            value->value.object.capacity = length;
+
+            for (size_t i = 0; i < length; i++) {
+                ToonObjectEntry *entry = &value->value.object.entries[i];
+                entry->key = load_key(arena, rdb);
+                if (!entry->key) return NULL;
+
+                entry->value = load_value(arena, rdb, depth + 1);
+                if (!entry->value) return NULL;
+            }
+            value->value.object.length = length;
+            toon_object_index_build(arena, value);
+            return value;
+        }
+
+        case TOON_RDB_TABULAR:
+            return load_tabular(arena, rdb, depth);
+
+        default:
+            return NULL;
+    }
+}
+
+// Load a document root saved by toon_rdb_save into arena. version is left
+// as it is when the save carries none.
+ToonValue *toon_rdb_load(ToonArena *arena, RedisModuleIO *rdb, uint64_t *version) {
+    uint64_t num_meta = RedisModule_LoadUnsigned(rdb);
+    for (uint64_t i = 0; i < num_meta; i++) {
+        uint64_t tag = RedisModule_LoadUnsigned(rdb);
+        uint64_t value = RedisModule_LoadUnsigned(rdb);
+        if (tag == TOON_RDB_META_VERSION && value > 0) *version = value;
+    }
+
+    return load_value(arena, rdb, 0);
+}
+
+// ============================================================================
+// Index definitions and version clock
+// ============================================================================
+
+void toon_rdb_save_aux(RedisModuleIO *rdb, int when) {
+    (void)when;
+
+    uint64_t count = 0;
+    for (ToonIndex *index = toon_index_list(); index; index = index->next) count++;
+    RedisModule_SaveUnsigned(rdb, count);
+
+    for (ToonIndex *index = toon_index_list(); index; index = index->next) {
+        RedisModule_SaveStringBuffer(rdb, index->name, strlen(index->name));
+        RedisModule_SaveStringBuffer(rdb, index->path->source, index->path->source_len);
+        RedisModule_SaveUnsigned(rdb, index->num_columns);
+        for (size_t col = 0; col < index->num_columns; col++) {
+            const char *column = toon_index_column(index, col);
+            RedisModule_SaveStringBuffer(rdb, column, strlen(column));
+        }
+    }
+    RedisModule_SaveUnsigned(rdb, toon_version_clock());
+}
+
+// Replace the index definitions with the saved ones. Their entries are
+// built once loading ends.
+static bool load_index(RedisModuleIO *rdb) {
+    size_t name_len, path_len;
+    char *name = RedisModule_LoadStringBuffer(rdb, &name_len);
+    char *path_str = RedisModule_LoadStringBuffer(rdb, &path_len);
+    uint64_t num_columns = RedisModule_LoadUnsigned(rdb);
+
+    char **columns = calloc(num_columns ? num_columns : 1, sizeof(char *));
+    size_t *column_lens = calloc(num_columns ? num_columns : 1, sizeof(size_t));
+    bool ok = name && path_str && columns && column_lens;
+    for (uint64_t col = 0; ok && col < num_columns; col++) {
+        columns[col] = RedisModule_LoadStringBuffer(rdb, &column_lens[col]);
+        ok = columns[col] != NULL;
+    }
+
+    ToonPath *path = ok ? toon_path_compile(path_str, path_len) : NULL;
+    ok = path && path->definite &&
+         toon_index_create(name, name_len, path, columns, column_lens, num_columns) != NULL;
+
+    toon_path_free(path);
+    for (uint64_t col = 0; columns && col < num_columns; col++) {
+        if (columns[col]) RedisModule_Free(columns[col]);
+    }
+    free(columns);
+    free(column_lens);
+    if (name) RedisModule_Free(name);
+    if (path_str) RedisModule_Free(path_str);
+    return ok;
+}
+
+int toon_rdb_load_aux(RedisModuleIO *rdb, int encver, int when) {
+    (void)when;
+    if (encver > TOON_ENCODING_VERSION) return REDISMODULE_ERR;
+
+    toon_index_drop_all();
+    uint64_t count = RedisModule_LoadUnsigned(rdb);
+    for (uint64_t i = 0; i < count; i++) {
+        if (!load_index(rdb)) return REDISMODULE_ERR;
+    }
+    if (encver >= 2) toon_version_observe(RedisModule_LoadUnsigned(rdb));
+    return REDISMODULE_OK;
+}
@@ -0,0 +1,215 @@
+#include "redistoon.h"
+
+// Byte-class scans used by the TOON and JSON parsers. Each scan has a
+// scalar version and vector versions (SSE2 and AVX2 on x86, NEON on ARM)
+// that test 16 or 32 bytes per step. The best version for the running
+// CPU is chosen once, when the module is loaded. Building with
+// TOON_NO_SIMD keeps only the scalar code.
+
+#if !defined(TOON_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOON_SCAN_X86 1
+#include <immintrin.h>
+#elif !defined(TOON_NO_SIMD) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define TOON_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+typedef const char *(*ScanUntilFn)(const char *s, const char *end, const ToonScanSet *set);
+typedef const char *(*ScanSpaceFn)(const char *s, const char *end);
+
+// Whitespace as classified by isspace() in the C locale
+static inline bool is_space(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static const char *scan_until_scalar(const char *s, const char *end, const ToonScanSet *set) {
+    for (; s < end; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '\0' || c == set->bytes[0] || c == set->bytes[1] ||
+            c == set->bytes[2] || c == set->bytes[3]) {
+            break;
+        }
+    }
+    return s;
+}
+
+static const char *scan_space_scalar(const char *s, const char *end) {
+    while (s < end && is_space((unsigned char)*s)) s++;
+    return s;
+}
+
+#if defined(TOON_SCAN_X86) && defined(__SSE2__)
+static const char *scan_until_sse2(const char *s, const char *end, const ToonScanSet *set) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c0 = _mm_set1_epi8((char)set->bytes[0]);
+    const __m128i c1 = _mm_set1_epi8((char)set->bytes[1]);
+    const __m128i c2 = _mm_set1_epi8((char)set->bytes[2]);
+    const __m128i c3 = _mm_set1_epi8((char)set->bytes[3]);
+
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0), _mm_cmpeq_epi8(v, c1)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, c2), _mm_cmpeq_epi8(v, c3)));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, zero));
+
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask) return s + __builtin_ctz(mask);
+        s += 16;
+    }
+    return scan_until_scalar(s, end, set);
+}
+
+static const char *scan_space_sse2(const char *s, const char *end) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i range = _mm_set1_epi8('\r' - '\t');
+
+    while (end - s >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)s);
+        // '\t'..'\r' as an unsigned range check: min(v - '\t', 4) == v - '\t'
+        __m128i ctl = _mm_sub_epi8(v, tab);
+        ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, range), ctl);
+        __m128i ws = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, space));
+
+        unsigned mask = ~(unsigned)_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask) return s + __builtin_ctz(mask);
+        s += 16;
+    }
+    return scan_space_scalar(s, end);
+}
+#endif
+
+#ifdef TOON_SCAN_X86
+__attribute__((target("avx2")))
+static const char *scan_until_avx2(const char *s, const char *end, const ToonScanSet *set) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c0 = _mm256_set1_epi8((char)set->bytes[0]);
+    const __m256i c1 = _mm256_set1_epi8((char)set->bytes[1]);
+    const __m256i c2 = _mm256_set1_epi8((char)set->bytes[2]);
+    const __m256i c3 = _mm256_set1_epi8((char)set->bytes[3]);
+
+    while (end - s >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3)));
+        hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, zero));
+
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return s + __builtin_ctz(mask);
+        s += 32;
+    }
+    return scan_until_scalar(s, end, set);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_space_avx2(const char *s, const char *end) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i range = _mm256_set1_epi8('\r' - '\t');
+
+    while (end - s >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)s);
+        __m256i ctl = _mm256_sub_epi8(v, tab);
+        ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, range), ctl);
+        __m256i ws = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, space));
+
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(ws);
+        if (mask) return s + __builtin_ctz(mask);
+        s += 32;
+    }
+    return scan_space_scalar(s, end);
+}
+#endif
+
+#ifdef TOON_SCAN_NEON
+// Index of the first set lane of a byte mask, or 16 if there is none.
+// Narrowing keeps four bits per lane in a 64-bit word.
+static inline size_t neon_first(uint8x16_t mask) {
+    uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+    return bits ? (size_t)__builtin_ctzll(bits) >> 2 : 16;
+}
+
+static const char *scan_until_neon(const char *s, const char *end, const ToonScanSet *set) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t c0 = vdupq_n_u8(set->bytes[0]);
+    const uint8x16_t c1 = vdupq_n_u8(set->bytes[1]);
+    const uint8x16_t c2 = vdupq_n_u8(set->bytes[2]);
+    const uint8x16_t c3 = vdupq_n_u8(set->bytes[3]);
+
+    while (end - s >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)s);
+        uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, c0), vceqq_u8(v, c1)),
+                                  vorrq_u8(vceqq_u8(v, c2), vceqq_u8(v, c3)));
+        hit = vorrq_u8(hit, vceqq_u8(v, zero));
+
+        size_t i = neon_first(hit);
+        if (i < 16) return s + i;
+        s += 16;
+    }
+    return scan_until_scalar(s, end, set);
+}
+
+static const char *scan_space_neon(const char *s, const char *end) {
+    const uint8x16_t space = vdupq_n_u8(' ');
+    const uint8x16_t tab = vdupq_n_u8('\t');
+    const uint8x16_t range = vdupq_n_u8('\r' - '\t');
+
+    while (end - s >= 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)s);
+        uint8x16_t ws = vorrq_u8(vcleq_u8(vsubq_u8(v, tab), range), vceqq_u8(v, space));
+
+        size_t i = neon_first(vmvnq_u8(ws));
+        if (i < 16) return s + i;
+        s += 16;
+    }
+    return scan_space_scalar(s, end);
+}
+#endif
+
+// Versions in use; the defaults are valid before selection has run
+#if defined(TOON_SCAN_X86) && defined(__SSE2__)
+static ScanUntilFn scan_until_impl = scan_until_sse2;
+static ScanSpaceFn scan_space_impl = scan_space_sse2;
+static const char *scan_backend = "sse2";
+#elif defined(TOON_SCAN_NEON)
+static ScanUntilFn scan_until_impl = scan_until_neon;
+static ScanSpaceFn scan_space_impl = scan_space_neon;
+static const char *scan_backend = "neon";
+#else
+static ScanUntilFn scan_until_impl = scan_until_scalar;
+static ScanSpaceFn scan_space_impl = scan_space_scalar;
+static const char *scan_backend = "scalar";
+#endif
+
+// Pick the widest version the CPU supports. This runs from a load-time
+// constructor, before any command can reach the parsers.
+__attribute__((constructor))
+static void scan_select(void) {
+#ifdef TOON_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_until_impl = scan_until_avx2;
+        scan_space_impl = scan_space_avx2;
+        scan_backend = "avx2";
+    }
+#endif
+}
+
+// Find the first byte in [s, end) that is NUL or in set; returns end if
+// there is none
+const char *toon_scan_until(const char *s, const char *end, const ToonScanSet *set) {
+    return scan_until_impl(s, end, set);
+}
+
+// Find the first byte in [s, end) that is not whitespace. Most runs
+// between tokens are a byte or two, so those are handled inline.
+const char *toon_scan_space(const char *s, const char *end) {
+    if (s == end || !is_space((unsigned char)*s)) return s;
+    if (++s == end || !is_space((unsigned char)*s)) return s;
+    return scan_space_impl(s + 1, end);
+}
+
+// Name of the scan version in use
+const char *toon_scan_backend(void) {
+    return scan_backend;
+}
@@ -0,0 +1,188 @@
+#include "redistoon.h"
+#include <stdatomic.h>
+#include <time.h>
+
+// Module statistics
+//
+// Everything here is a relaxed atomic counter, bumped a handful of times
+// per command, so it stays on in production. Documents can be freed and
+// phases run on other threads; readers only need each counter to be
+// right on its own.
+//
+// Node totals are kept per arena, without atomics, while an arena is
+// built; the arena's counts join the totals in one step once a document
+// takes it over, and only nodes added to such an arena afterwards, by
+// writes on the main thread, touch the totals one by one.
+//
+// Latencies go into log-linear histograms in the manner of HDR: exact
+// below 8ns, then 8 buckets for every power of two, so a reported
+// percentile is within 12.5% of the true one. A sample is one atomic
+// increment.
+
+// Sub-buckets per power of two, and the powers covered: up to 2^36ns, 68
+// seconds, past which samples land in the last bucket
+#define TOON_HIST_SUB_BITS 3
+#define TOON_HIST_SUB (1 << TOON_HIST_SUB_BITS)
+#define TOON_HIST_MAX_BITS 36
+#define TOON_HIST_BUCKETS ((TOON_HIST_MAX_BITS - TOON_HIST_SUB_BITS + 1) * TOON_HIST_SUB)
+
+typedef struct {
+    atomic_uint_fast64_t buckets[TOON_HIST_BUCKETS];
+} Histogram;
+
+static atomic_size_t documents;
+static atomic_size_t node_counts[TOON_NUM_TYPES];
+static atomic_size_t string_bytes;
+static atomic_uint_fast64_t cache_hits[TOON_NUM_CACHES];
+static atomic_uint_fast64_t cache_misses[TOON_NUM_CACHES];
+static Histogram histograms[TOON_NUM_COMMANDS][TOON_NUM_PHASES];
+
+// The command running on the main thread. Commands never nest, so one
+// timer serves them all.
+static struct {
+    bool active;
+    ToonCommand command;
+    uint64_t start;
+    uint64_t mark;                      // End of the last timed stretch
+    uint64_t phases[TOON_NUM_PHASES];
+    unsigned timed;                     // Bit per phase that was entered
+} timer;
+
+static void counter_add(atomic_size_t *counter, size_t delta, bool removed) {
+    if (removed) {
+        atomic_fetch_sub_explicit(counter, delta, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(counter, delta, memory_order_relaxed);
+    }
+}
+
+void toon_stats_count_document(bool removed) {
+    counter_add(&documents, 1, removed);
+}
+
+size_t toon_stats_documents(void) {
+    return atomic_load_explicit(&documents, memory_order_relaxed);
+}
+
+// Count a node of a tracked arena; bytes only matter for strings
+void toon_stats_count_node(ToonType type, size_t bytes, bool removed) {
+    counter_add(&node_counts[type], 1, removed);
+    if (type == TOON_STRING) counter_add(&string_bytes, bytes, removed);
+}
+
+void toon_stats_count_nodes(const ToonNodeCounts *counts, bool removed) {
+    for (int type = 0; type < TOON_NUM_TYPES; type++) {
+        if (counts->count[type]) counter_add(&node_counts[type], counts->count[type], removed);
+    }
+    if (counts->string_bytes) counter_add(&string_bytes, counts->string_bytes, removed);
+}
+
+// Nodes of every document, and of trees readers still hold
+void toon_stats_node_totals(ToonNodeCounts *totals) {
+    for (int type = 0; type < TOON_NUM_TYPES; type++) {
+        totals->count[type] = atomic_load_explicit(&node_counts[type], memory_order_relaxed);
+    }
+    totals->string_bytes = atomic_load_explicit(&string_bytes, memory_order_relaxed);
+}
+
+void toon_stats_cache_lookup(ToonStatsCache cache, bool hit) {
+    atomic_fetch_add_explicit(hit ? &cache_hits[cache] : &cache_misses[cache], 1, memory_order_relaxed);
+}
+
+void toon_stats_cache_counts(ToonStatsCache cache, uint64_t *hits, uint64_t *misses) {
+    *hits = atomic_load_explicit(&cache_hits[cache], memory_order_relaxed);
+    *misses = atomic_load_explicit(&cache_misses[cache], memory_order_relaxed);
+}
+
+// Monotonic time in nanoseconds
+uint64_t toon_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns) {
+    if (ns < TOON_HIST_SUB) return ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    size_t bucket = (size_t)(msb - TOON_HIST_SUB_BITS + 1) * TOON_HIST_SUB +
+                    ((ns >> (msb - TOON_HIST_SUB_BITS)) & (TOON_HIST_SUB - 1));
+    return bucket < TOON_HIST_BUCKETS ? bucket : TOON_HIST_BUCKETS - 1;
+}
+
+// Smallest value that lands past bucket
+static uint64_t bucket_end(size_t bucket) {
+    if (bucket < TOON_HIST_SUB) return bucket + 1;
+
+    int msb = (int)(bucket / TOON_HIST_SUB) + TOON_HIST_SUB_BITS - 1;
+    uint64_t sub = bucket % TOON_HIST_SUB;
+    return (TOON_HIST_SUB + sub + 1) << (msb - TOON_HIST_SUB_BITS);
+}
+
+// Record a sample taken on any thread
+void toon_stats_record(ToonCommand command, ToonPhase phase, uint64_t ns) {
+    atomic_fetch_add_explicit(&histograms[command][phase].buckets[bucket_of(ns)], 1, memory_order_relaxed);
+}
+
+// Start timing a command on the main thread
+void toon_stats_command_begin(ToonCommand command) {
+    timer.active = true;
+    timer.command = command;
+    timer.start = toon_stats_now();
+    timer.mark = timer.start;
+    timer.timed = 0;
+    memset(timer.phases, 0, sizeof(timer.phases));
+}
+
+// Start a stretch of the running command that belongs to no phase yet
+void toon_stats_mark(void) {
+    if (timer.active) timer.mark = toon_stats_now();
+}
+
+// Count the time since the last mark towards phase
+void toon_stats_phase(ToonPhase phase) {
+    if (!timer.active) return;
+
+    uint64_t now = toon_stats_now();
+    timer.phases[phase] += now - timer.mark;
+    timer.timed |= 1u << phase;
+    timer.mark = now;
+}
+
+// Record the running command: its whole call, and each phase it entered
+// once, however many times
+void toon_stats_command_end(void) {
+    if (!timer.active) return;
+    timer.active = false;
+
+    for (int phase = 0; phase < TOON_PHASE_TOTAL; phase++) {
+        if (timer.timed & (1u << phase)) toon_stats_record(timer.command, phase, timer.phases[phase]);
+    }
+    toon_stats_record(timer.command, TOON_PHASE_TOTAL, toon_stats_now() - timer.start);
+}
+
+// Summarize a command phase. False if it has no samples.
+bool toon_stats_latency(ToonCommand command, ToonPhase phase, ToonLatency *latency) {
+    uint64_t counts[TOON_HIST_BUCKETS];
+    uint64_t calls = 0;
+    for (size_t i = 0; i < TOON_HIST_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histograms[command][phase].buckets[i], memory_order_relaxed);
+        calls += counts[i];
+    }
+    if (calls == 0) return false;
+
+    // Each percentile is the end of the bucket holding its sample
+    const double quantiles[] = {0.5, 0.99, 0.999, 1.0};
+    double *results[] = {&latency->p50, &latency->p99, &latency->p999, &latency->max};
+    size_t bucket = 0;
+    uint64_t seen = counts[0];
+    for (size_t q = 0; q < 4; q++) {
+        uint64_t rank = (uint64_t)(quantiles[q] * (double)calls + 0.5);
+        if (rank == 0) rank = 1;
+        while (seen < rank) seen += counts[++bucket];
+        *results[q] = (double)bucket_end(bucket) / 1000.0;
+    }
+
+    latency->calls = calls;
+    return true;
+}
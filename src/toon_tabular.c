@@ -0,0 +1,606 @@
+#include "redistoon.h"
+
+// Columnar storage for tabular arrays. Each column is packed into a single
+// typed vector picked from its cells: doubles, a bitmap of booleans, or a
+// blob of strings addressed by offsets. Only a column mixing several types
+// falls back to one value node per row. Vectors have room for row_capacity
+// rows and string blobs for blob_cap bytes; both grow by doubling as rows
+// are appended.
+
+#define BITMAP_WORDS(rows) (((rows) + 63) / 64)
+
+static bool bit_test(const uint64_t *bits, size_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static void bit_set(uint64_t *bits, size_t i) {
+    bits[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+static void bit_clear(uint64_t *bits, size_t i) {
+    bits[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static bool cell_is_null(const ToonValue *cell) {
+    return !cell || cell->type == TOON_NULL;
+}
+
+// Pick the layout for column col. A column of only nulls is stored as
+// booleans, the smallest layout.
+static ToonColumnType column_type(ToonValue *const *cells, size_t num_headers,
+                                  size_t num_rows, size_t col, size_t *blob_len) {
+    ToonType seen = TOON_NULL;
+    *blob_len = 0;
+
+    for (size_t row = 0; row < num_rows; row++) {
+        const ToonValue *cell = cells[row * num_headers + col];
+        if (cell_is_null(cell)) {
+            *blob_len += 1;
+            continue;
+        }
+
+        if (seen == TOON_NULL) {
+            seen = cell->type;
+        } else if (cell->type != seen) {
+            return TOON_COLUMN_MIXED;
+        }
+
+        if (cell->type == TOON_STRING) {
+            *blob_len += strlen(cell->value.string) + 1;
+        }
+    }
+
+    switch (seen) {
+        case TOON_NULL:
+        case TOON_BOOLEAN:
+            return TOON_COLUMN_BOOLEAN;
+        case TOON_NUMBER:
+            return TOON_COLUMN_NUMBER;
+        case TOON_STRING:
+            // Offsets are 32-bit; a larger column keeps its nodes instead
+            return *blob_len <= UINT32_MAX ? TOON_COLUMN_STRING : TOON_COLUMN_MIXED;
+        default:
+            return TOON_COLUMN_MIXED;
+    }
+}
+
+// Pack column col of row-major cells into column, with vectors for
+// capacity rows
+static bool pack_column(ToonArena *arena, ToonColumn *column, ToonValue *const *cells,
+                        size_t num_headers, size_t num_rows, size_t capacity, size_t col) {
+    size_t blob_len;
+    column->type = column_type(cells, num_headers, num_rows, col, &blob_len);
+
+    for (size_t row = 0; row < num_rows; row++) {
+        if (!cell_is_null(cells[row * num_headers + col])) continue;
+
+        if (!column->nulls) {
+            column->nulls = toon_arena_calloc(arena, BITMAP_WORDS(capacity), sizeof(uint64_t));
+            if (!column->nulls) return false;
+        }
+        bit_set(column->nulls, row);
+    }
+
+    switch (column->type) {
+        case TOON_COLUMN_NUMBER:
+            column->data.numbers = toon_arena_calloc(arena, capacity, sizeof(double));
+            if (!column->data.numbers) return false;
+            for (size_t row = 0; row < num_rows; row++) {
+                const ToonValue *cell = cells[row * num_headers + col];
+                if (!cell_is_null(cell)) column->data.numbers[row] = cell->value.number;
+            }
+            break;
+
+        case TOON_COLUMN_BOOLEAN:
+            column->data.booleans = toon_arena_calloc(arena, BITMAP_WORDS(capacity), sizeof(uint64_t));
+            if (!column->data.booleans) return false;
+            for (size_t row = 0; row < num_rows; row++) {
+                const ToonValue *cell = cells[row * num_headers + col];
+                if (!cell_is_null(cell) && cell->value.boolean) bit_set(column->data.booleans, row);
+            }
+            break;
+
+        case TOON_COLUMN_STRING: {
+            column->data.strings.offsets = toon_arena_alloc(arena, sizeof(uint32_t) * capacity);
+            column->data.strings.blob = toon_arena_alloc(arena, blob_len);
+            if (!column->data.strings.offsets || !column->data.strings.blob) return false;
+
+            // Null rows get an empty string so lengths follow from offsets
+            size_t offset = 0;
+            for (size_t row = 0; row < num_rows; row++) {
+                const ToonValue *cell = cells[row * num_headers + col];
+                const char *str = cell_is_null(cell) ? "" : cell->value.string;
+                size_t len = strlen(str) + 1;
+
+                column->data.strings.offsets[row] = (uint32_t)offset;
+                memcpy(column->data.strings.blob + offset, str, len);
+                offset += len;
+            }
+            column->data.strings.blob_len = blob_len;
+            column->data.strings.blob_cap = blob_len;
+            break;
+        }
+
+        case TOON_COLUMN_MIXED:
+            column->data.values = toon_arena_calloc(arena, capacity, sizeof(ToonValue *));
+            if (!column->data.values) return false;
+            for (size_t row = 0; row < num_rows; row++) {
+                const ToonValue *cell = cells[row * num_headers + col];
+                if (cell_is_null(cell)) continue;
+
+                column->data.values[row] = toon_value_copy(arena, cell);
+                if (!column->data.values[row]) return false;
+            }
+            break;
+    }
+
+    return true;
+}
+
+// Build a tabular array from num_rows rows of num_headers row-major cells.
+// Headers and cells are copied, so they may live in a scratch arena.
+ToonValue *toon_tabular_create(ToonArena *arena, char *const *headers, size_t num_headers,
+                               ToonValue *const *cells, size_t num_rows) {
+    ToonValue *value = toon_value_create(arena, TOON_TABULAR_ARRAY);
+    if (!value) return NULL;
+    ToonTabularArray *tab = &value->value.tabular;
+
+    if (num_headers > 0) {
+        tab->headers = toon_arena_alloc(arena, sizeof(char *) * num_headers);
+        tab->columns = toon_arena_calloc(arena, num_headers, sizeof(ToonColumn));
+        if (!tab->headers || !tab->columns) return NULL;
+    }
+
+    for (size_t col = 0; col < num_headers; col++) {
+        tab->headers[col] = toon_intern_key(arena, headers[col], strlen(headers[col]));
+        if (!tab->headers[col]) return NULL;
+
+        if (!pack_column(arena, &tab->columns[col], cells, num_headers, num_rows, num_rows, col)) return NULL;
+    }
+
+    tab->num_headers = num_headers;
+    tab->num_rows = num_rows;
+    tab->row_capacity = num_rows;
+    return value;
+}
+
+// Read one cell. Typed columns are unpacked into scratch, which stays valid
+// until it is reused; mixed columns return the stored node.
+ToonValue *toon_tabular_cell(const ToonTabularArray *tab, size_t row, size_t col, ToonValue *scratch) {
+    const ToonColumn *column = &tab->columns[col];
+
+    memset(scratch, 0, sizeof(ToonValue));
+    scratch->type = TOON_NULL;
+    if (column->nulls && bit_test(column->nulls, row)) return scratch;
+
+    switch (column->type) {
+        case TOON_COLUMN_NUMBER:
+            scratch->type = TOON_NUMBER;
+            scratch->value.number = column->data.numbers[row];
+            break;
+
+        case TOON_COLUMN_BOOLEAN:
+            scratch->type = TOON_BOOLEAN;
+            scratch->value.boolean = bit_test(column->data.booleans, row);
+            break;
+
+        case TOON_COLUMN_STRING:
+            scratch->type = TOON_STRING;
+            scratch->value.string = column->data.strings.blob + column->data.strings.offsets[row];
+            break;
+
+        case TOON_COLUMN_MIXED:
+            return column->data.values[row];
+    }
+
+    return scratch;
+}
+
+// Find the column for header
+bool toon_tabular_find_column(const ToonTabularArray *tab, const char *header, size_t *col) {
+    size_t len = strlen(header);
+    for (size_t i = 0; i < tab->num_headers; i++) {
+        if (toon_key_equals(tab->headers[i], header, len)) {
+            *col = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Bytes of arena memory held by one column's vectors and nodes
+static size_t column_footprint(const ToonColumn *column, size_t num_rows, size_t capacity) {
+    size_t bytes = 0;
+    size_t bitmap = toon_arena_alloc_size(sizeof(uint64_t) * BITMAP_WORDS(capacity));
+
+    if (column->nulls) bytes += bitmap;
+
+    switch (column->type) {
+        case TOON_COLUMN_NUMBER:
+            bytes += toon_arena_alloc_size(sizeof(double) * capacity);
+            break;
+
+        case TOON_COLUMN_BOOLEAN:
+            bytes += bitmap;
+            break;
+
+        case TOON_COLUMN_STRING:
+            bytes += toon_arena_alloc_size(sizeof(uint32_t) * capacity);
+            bytes += toon_arena_alloc_size(column->data.strings.blob_cap);
+            break;
+
+        case TOON_COLUMN_MIXED:
+            bytes += toon_arena_alloc_size(sizeof(ToonValue *) * capacity);
+            for (size_t row = 0; row < num_rows; row++) {
+                bytes += toon_value_footprint(column->data.values[row]);
+            }
+            break;
+    }
+
+    return bytes;
+}
+
+// Bytes of arena memory held by a tabular array's headers and columns
+size_t toon_tabular_footprint(const ToonTabularArray *tab) {
+    if (tab->num_headers == 0) return 0;
+
+    size_t bytes = toon_arena_alloc_size(sizeof(char *) * tab->num_headers);
+    bytes += toon_arena_alloc_size(sizeof(ToonColumn) * tab->num_headers);
+
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        bytes += toon_string_footprint(tab->headers[col]);
+        bytes += column_footprint(&tab->columns[col], tab->num_rows, tab->row_capacity);
+    }
+
+    return bytes;
+}
+
+// Follow the chunks active defrag moved from a table's headers and
+// columns. Mixed cells are scalars, so a string is all they point at.
+void toon_tabular_relocate(ToonTabularArray *tab, const ToonArenaMoves *moves) {
+    if (tab->num_headers == 0) return;
+
+    TOON_RELOCATE(moves, tab->headers);
+    TOON_RELOCATE(moves, tab->columns);
+
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        ToonColumn *column = &tab->columns[col];
+        TOON_RELOCATE(moves, tab->headers[col]);
+        if (column->nulls) TOON_RELOCATE(moves, column->nulls);
+
+        switch (column->type) {
+            case TOON_COLUMN_NUMBER:
+                TOON_RELOCATE(moves, column->data.numbers);
+                break;
+
+            case TOON_COLUMN_BOOLEAN:
+                TOON_RELOCATE(moves, column->data.booleans);
+                break;
+
+            case TOON_COLUMN_STRING:
+                TOON_RELOCATE(moves, column->data.strings.offsets);
+                TOON_RELOCATE(moves, column->data.strings.blob);
+                break;
+
+            case TOON_COLUMN_MIXED:
+                TOON_RELOCATE(moves, column->data.values);
+                for (size_t row = 0; row < tab->num_rows; row++) {
+                    TOON_RELOCATE(moves, column->data.values[row]);
+                    ToonValue *cell = column->data.values[row];
+                    if (cell && cell->type == TOON_STRING) TOON_RELOCATE(moves, cell->value.string);
+                }
+                break;
+        }
+    }
+}
+
+static void *copy_block(ToonArena *arena, const void *src, size_t size) {
+    void *dst = toon_arena_alloc(arena, size);
+    if (dst) memcpy(dst, src, size);
+    return dst;
+}
+
+// Deep copy a tabular array into arena
+bool toon_tabular_copy(ToonArena *arena, ToonTabularArray *dst, const ToonTabularArray *src) {
+    size_t num_rows = src->num_rows;
+    size_t bitmap = sizeof(uint64_t) * BITMAP_WORDS(num_rows);
+
+    memset(dst, 0, sizeof(ToonTabularArray));
+    if (src->num_headers == 0) {
+        dst->num_rows = num_rows;
+        dst->row_capacity = num_rows;
+        return true;
+    }
+
+    dst->headers = toon_arena_alloc(arena, sizeof(char *) * src->num_headers);
+    dst->columns = toon_arena_calloc(arena, src->num_headers, sizeof(ToonColumn));
+    if (!dst->headers || !dst->columns) return false;
+
+    for (size_t col = 0; col < src->num_headers; col++) {
+        const ToonColumn *column = &src->columns[col];
+        ToonColumn *copy = &dst->columns[col];
+
+        dst->headers[col] = toon_string_copy(arena, src->headers[col]);
+        if (!dst->headers[col]) return false;
+
+        copy->type = column->type;
+        if (column->nulls) {
+            copy->nulls = copy_block(arena, column->nulls, bitmap);
+            if (!copy->nulls) return false;
+        }
+
+        switch (column->type) {
+            case TOON_COLUMN_NUMBER:
+                copy->data.numbers = copy_block(arena, column->data.numbers, sizeof(double) * num_rows);
+                if (!copy->data.numbers) return false;
+                break;
+
+            case TOON_COLUMN_BOOLEAN:
+                copy->data.booleans = copy_block(arena, column->data.booleans, bitmap);
+                if (!copy->data.booleans) return false;
+                break;
+
+            case TOON_COLUMN_STRING:
+                copy->data.strings.offsets = copy_block(arena, column->data.strings.offsets,
+                                                        sizeof(uint32_t) * num_rows);
+                copy->data.strings.blob = copy_block(arena, column->data.strings.blob,
+                                                     column->data.strings.blob_len);
+                if (!copy->data.strings.offsets || !copy->data.strings.blob) return false;
+                copy->data.strings.blob_len = column->data.strings.blob_len;
+                copy->data.strings.blob_cap = column->data.strings.blob_len;
+                break;
+
+            case TOON_COLUMN_MIXED:
+                copy->data.values = toon_arena_calloc(arena, num_rows, sizeof(ToonValue *));
+                if (!copy->data.values) return false;
+                for (size_t row = 0; row < num_rows; row++) {
+                    if (!column->data.values[row]) continue;
+                    copy->data.values[row] = toon_value_copy(arena, column->data.values[row]);
+                    if (!copy->data.values[row]) return false;
+                }
+                break;
+        }
+    }
+
+    dst->num_headers = src->num_headers;
+    dst->num_rows = num_rows;
+    dst->row_capacity = num_rows;
+    return true;
+}
+
+// Grow a bitmap from room for old_rows to new_rows bits, clearing the new words
+static bool grow_bitmap(ToonArena *arena, uint64_t **bits, size_t old_rows, size_t new_rows) {
+    size_t old_words = BITMAP_WORDS(old_rows);
+    size_t new_words = BITMAP_WORDS(new_rows);
+
+    uint64_t *grown = toon_arena_grow(arena, *bits, sizeof(uint64_t) * old_words, sizeof(uint64_t) * new_words);
+    if (!grown) return false;
+
+    memset(grown + old_words, 0, sizeof(uint64_t) * (new_words - old_words));
+    *bits = grown;
+    return true;
+}
+
+// Give every column of tab room for capacity rows
+static bool reserve_rows(ToonArena *arena, ToonTabularArray *tab, size_t capacity) {
+    size_t old = tab->row_capacity;
+
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        ToonColumn *column = &tab->columns[col];
+        void *grown = NULL;
+
+        if (column->nulls && !grow_bitmap(arena, &column->nulls, old, capacity)) return false;
+
+        switch (column->type) {
+            case TOON_COLUMN_NUMBER:
+                grown = toon_arena_grow(arena, column->data.numbers, sizeof(double) * old, sizeof(double) * capacity);
+                if (grown) column->data.numbers = grown;
+                break;
+
+            case TOON_COLUMN_BOOLEAN:
+                if (grow_bitmap(arena, &column->data.booleans, old, capacity)) grown = column->data.booleans;
+                break;
+
+            case TOON_COLUMN_STRING:
+                grown = toon_arena_grow(arena, column->data.strings.offsets,
+                                        sizeof(uint32_t) * old, sizeof(uint32_t) * capacity);
+                if (grown) column->data.strings.offsets = grown;
+                break;
+
+            case TOON_COLUMN_MIXED:
+                grown = toon_arena_grow(arena, column->data.values,
+                                        sizeof(ToonValue *) * old, sizeof(ToonValue *) * capacity);
+                if (grown) column->data.values = grown;
+                break;
+        }
+        if (!grown) return false;
+    }
+
+    tab->row_capacity = capacity;
+    return true;
+}
+
+// Whether cell can be stored in column's layout as it stands
+static bool cell_fits(const ToonColumn *column, const ToonValue *cell) {
+    if (cell_is_null(cell)) return true;
+
+    switch (column->type) {
+        case TOON_COLUMN_NUMBER:
+            return cell->type == TOON_NUMBER;
+        case TOON_COLUMN_BOOLEAN:
+            return cell->type == TOON_BOOLEAN;
+        case TOON_COLUMN_STRING:
+            return cell->type == TOON_STRING &&
+                   column->data.strings.blob_len + strlen(cell->value.string) + 1 <= UINT32_MAX;
+        case TOON_COLUMN_MIXED:
+            return true;
+    }
+    return false;
+}
+
+// Repack column col with cell appended as a new last row, letting the
+// layout change to one that can hold it (a string in a number column
+// makes it mixed, a number in an all-null column makes it numeric)
+static bool repack_column(ToonArena *arena, ToonTabularArray *tab, size_t col, ToonValue *cell) {
+    size_t num_rows = tab->num_rows;
+    ToonValue *scratch = malloc(sizeof(ToonValue) * (num_rows ? num_rows : 1));
+    ToonValue **cells = malloc(sizeof(ToonValue *) * (num_rows + 1));
+    bool ok = scratch && cells;
+
+    if (ok) {
+        for (size_t row = 0; row < num_rows; row++) {
+            cells[row] = toon_tabular_cell(tab, row, col, &scratch[row]);
+        }
+        cells[num_rows] = cell;
+
+        ToonColumn packed = {0};
+        ok = pack_column(arena, &packed, cells, 1, num_rows + 1, tab->row_capacity, 0);
+        if (ok) {
+            toon_arena_waste(arena, column_footprint(&tab->columns[col], num_rows, tab->row_capacity));
+            tab->columns[col] = packed;
+        }
+    }
+
+    free(scratch);
+    free(cells);
+    return ok;
+}
+
+// Store cell as row of column, which has room for it
+static bool store_cell(ToonArena *arena, ToonColumn *column, size_t row, size_t capacity, const ToonValue *cell) {
+    bool is_null = cell_is_null(cell);
+
+    if (is_null && !column->nulls) {
+        column->nulls = toon_arena_calloc(arena, BITMAP_WORDS(capacity), sizeof(uint64_t));
+        if (!column->nulls) return false;
+    }
+    if (column->nulls) {
+        if (is_null) bit_set(column->nulls, row);
+        else bit_clear(column->nulls, row);
+    }
+
+    switch (column->type) {
+        case TOON_COLUMN_NUMBER:
+            column->data.numbers[row] = is_null ? 0 : cell->value.number;
+            break;
+
+        case TOON_COLUMN_BOOLEAN:
+            if (!is_null && cell->value.boolean) bit_set(column->data.booleans, row);
+            else bit_clear(column->data.booleans, row);
+            break;
+
+        case TOON_COLUMN_STRING: {
+            const char *str = is_null ? "" : cell->value.string;
+            size_t len = strlen(str) + 1;
+            size_t blob_len = column->data.strings.blob_len;
+
+            if (blob_len + len > column->data.strings.blob_cap) {
+                size_t blob_cap = column->data.strings.blob_cap * 2;
+                if (blob_cap < blob_len + len) blob_cap = blob_len + len;
+                if (blob_cap < 64) blob_cap = 64;
+
+                char *blob = toon_arena_grow(arena, column->data.strings.blob,
+                                             column->data.strings.blob_cap, blob_cap);
+                if (!blob) return false;
+                column->data.strings.blob = blob;
+                column->data.strings.blob_cap = blob_cap;
+            }
+
+            column->data.strings.offsets[row] = (uint32_t)blob_len;
+            memcpy(column->data.strings.blob + blob_len, str, len);
+            column->data.strings.blob_len = blob_len + len;
+            break;
+        }
+
+        case TOON_COLUMN_MIXED:
+            column->data.values[row] = NULL;
+            if (!is_null) {
+                column->data.values[row] = toon_value_copy(arena, cell);
+                if (!column->data.values[row]) return false;
+            }
+            break;
+    }
+
+    return true;
+}
+
+// Append one row of num_headers cells, which are copied. Column vectors
+// grow by doubling, so a run of appends is amortized O(1) per cell. On
+// failure the row count is unchanged and the table stays readable.
+bool toon_tabular_append_row(ToonArena *arena, ToonTabularArray *tab, ToonValue *const *cells) {
+    size_t row = tab->num_rows;
+
+    if (row == tab->row_capacity && !reserve_rows(arena, tab, row ? row * 2 : 4)) return false;
+
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        ToonColumn *column = &tab->columns[col];
+
+        bool ok = cell_fits(column, cells[col])
+                      ? store_cell(arena, column, row, tab->row_capacity, cells[col])
+                      : repack_column(arena, tab, col, cells[col]);
+        if (!ok) return false;
+    }
+
+    tab->num_rows = row + 1;
+    return true;
+}
+
+// Tokens of a tabular array's header line, [N,]{headers}:
+size_t toon_tabular_header_tokens(const ToonTabularArray *tab) {
+    size_t tokens = 3;
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        tokens += (strlen(tab->headers[col]) / 4) + 1;
+    }
+    return tokens;
+}
+
+// Estimate the token count of a tabular array one column at a time. Every
+// scalar but a string costs one token, so only string columns are scanned.
+size_t toon_tabular_estimate_tokens(const ToonTabularArray *tab) {
+    size_t tokens = toon_tabular_header_tokens(tab);
+
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        const ToonColumn *column = &tab->columns[col];
+
+        switch (column->type) {
+            case TOON_COLUMN_NUMBER:
+            case TOON_COLUMN_BOOLEAN:
+                tokens += tab->num_rows;
+                break;
+
+            case TOON_COLUMN_STRING: {
+                const uint32_t *offsets = column->data.strings.offsets;
+                for (size_t row = 0; row < tab->num_rows; row++) {
+                    if (column->nulls && bit_test(column->nulls, row)) {
+                        tokens += 1;
+                        continue;
+                    }
+                    size_t end = row + 1 < tab->num_rows ? offsets[row + 1] : column->data.strings.blob_len;
+                    tokens += ((end - offsets[row] - 1) / 4) + 1;
+                }
+                break;
+            }
+
+            case TOON_COLUMN_MIXED:
+                for (size_t row = 0; row < tab->num_rows; row++) {
+                    ToonValue *cell = column->data.values[row];
+                    tokens += cell ? toon_estimate_tokens(cell) : 1;
+                }
+                break;
+        }
+    }
+
+    return tokens;
+}
+
+// Estimate the tokens of one row, as toon_tabular_estimate_tokens counts
+// them: the table's estimate is its header's plus every row's
+size_t toon_tabular_row_tokens(const ToonTabularArray *tab, size_t row) {
+    size_t tokens = 0;
+    for (size_t col = 0; col < tab->num_headers; col++) {
+        ToonValue scratch;
+        ToonValue *cell = toon_tabular_cell(tab, row, col, &scratch);
+        tokens += cell ? toon_estimate_tokens(cell) : 1;
+    }
+    return tokens;
+}
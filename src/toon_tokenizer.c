@@ -0,0 +1,557 @@
+#include "redistoon.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Byte-pair encoding tokenizers for exact token counts. A vocabulary is a
+// tiktoken file (cl100k_base.tiktoken, o200k_base.tiktoken, ...), one
+// "base64-token rank" line per token, where the rank is also the merge
+// priority. Text is split into pieces the way the vocabulary's pattern
+// (cl100k or o200k) does, except that every non-ASCII byte counts as a
+// letter of no case, and each piece is merged pair by pair from its bytes,
+// lowest rank first, in O(n log n) of its length. Pieces repeat
+// a lot (keys, headers, common words), so short ones have their count
+// cached per tokenizer. Tokenizers are loaded once at module load and only
+// used from the main thread.
+
+#define TOKENIZER_RANK_NONE UINT32_MAX
+
+// Pieces up to this many bytes have their count cached
+#define PIECE_CACHE_MAX_LEN 19
+#define PIECE_CACHE_SLOTS 32768     // Power of two
+
+// Pieces this short are merged with stack buffers
+#define PIECE_STACK_LEN 64
+
+// Token bytes live in the blob; a slot is empty when len is 0
+typedef struct {
+    uint32_t offset;
+    uint32_t len;
+    uint32_t rank;
+} VocabSlot;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t tokens;
+    uint8_t len;                        // 0 for an empty slot
+    char bytes[PIECE_CACHE_MAX_LEN];
+} PieceSlot;
+
+struct ToonTokenizer {
+    char *name;
+    unsigned char *blob;
+    VocabSlot *slots;
+    size_t mask;                        // Slot count minus one
+    size_t num_tokens;
+    size_t max_token_len;               // No pair longer than this can merge
+    ToonTokenizerSplit split;
+    PieceSlot *pieces;                  // PIECE_CACHE_SLOTS entries
+};
+
+static ToonTokenizer *tokenizers[TOON_TOKENIZER_MAX];
+static size_t num_tokenizers;
+
+static char *make_error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *error = len >= 0 ? malloc(len + 1) : NULL;
+    if (error) {
+        va_start(args, format);
+        vsnprintf(error, len + 1, format, args);
+        va_end(args);
+    }
+    return error;
+}
+
+// ============================================================================
+// Vocabulary
+// ============================================================================
+
+static int base64_digit(unsigned char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+// Decode len base64 characters to out; -1 if they are not valid base64
+static long base64_decode(const unsigned char *in, size_t len, unsigned char *out) {
+    uint32_t bits = 0;
+    int num_bits = 0;
+    long written = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == '=') break;
+
+        int digit = base64_digit(in[i]);
+        if (digit < 0) return -1;
+
+        bits = (bits << 6) | (uint32_t)digit;
+        num_bits += 6;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            out[written++] = (unsigned char)(bits >> num_bits);
+        }
+    }
+    return written;
+}
+
+static uint32_t vocab_rank(const ToonTokenizer *tok, const unsigned char *bytes, size_t len) {
+    size_t slot = toon_hash_key((const char *)bytes, len) & tok->mask;
+
+    for (;; slot = (slot + 1) & tok->mask) {
+        const VocabSlot *entry = &tok->slots[slot];
+        if (entry->len == 0) return TOKENIZER_RANK_NONE;
+        if (entry->len == len && memcmp(tok->blob + entry->offset, bytes, len) == 0) {
+            return entry->rank;
+        }
+    }
+}
+
+static bool vocab_insert(ToonTokenizer *tok, uint32_t offset, uint32_t len, uint32_t rank) {
+    const unsigned char *bytes = tok->blob + offset;
+    size_t slot = toon_hash_key((const char *)bytes, len) & tok->mask;
+
+    for (;; slot = (slot + 1) & tok->mask) {
+        VocabSlot *entry = &tok->slots[slot];
+        if (entry->len == 0) break;
+        if (entry->len == len && memcmp(tok->blob + entry->offset, bytes, len) == 0) return false;
+    }
+
+    tok->slots[slot] = (VocabSlot){.offset = offset, .len = len, .rank = rank};
+    return true;
+}
+
+// Build the vocabulary from a mapped tiktoken file; an error message on failure
+static const char *vocab_parse(ToonTokenizer *tok, const unsigned char *data, size_t size) {
+    size_t num_lines = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '\n') num_lines++;
+    }
+    if (size > 0 && data[size - 1] != '\n') num_lines++;
+
+    size_t capacity = 16;
+    while (capacity < num_lines * 2) capacity *= 2;
+
+    // Decoded tokens are never longer than their base64
+    tok->blob = malloc(size + 1);
+    tok->slots = calloc(capacity, sizeof(VocabSlot));
+    if (!tok->blob || !tok->slots) return "Out of memory";
+    tok->mask = capacity - 1;
+
+    size_t blob_len = 0;
+    const unsigned char *line = data, *end = data + size;
+    while (line < end) {
+        const unsigned char *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+
+        const unsigned char *space = memchr(line, ' ', eol - line);
+        if (space == line) return "malformed vocabulary line";
+        if (!space) {
+            // Blank lines are allowed, anything else needs a rank
+            if (eol > line && !(eol - line == 1 && line[0] == '\r')) {
+                return "malformed vocabulary line";
+            }
+            line = eol + 1;
+            continue;
+        }
+
+        char *rank_end;
+        char number[16];
+        size_t number_len = eol - space - 1;
+        if (number_len == 0 || number_len >= sizeof(number)) return "malformed vocabulary rank";
+        memcpy(number, space + 1, number_len);
+        number[number_len] = '\0';
+        unsigned long rank = strtoul(number, &rank_end, 10);
+        if ((*rank_end && *rank_end != '\r') || rank >= TOKENIZER_RANK_NONE) {
+            return "malformed vocabulary rank";
+        }
+
+        long len = base64_decode(line, space - line, tok->blob + blob_len);
+        if (len <= 0) return "malformed vocabulary token";
+        if (!vocab_insert(tok, (uint32_t)blob_len, (uint32_t)len, (uint32_t)rank)) {
+            return "duplicate vocabulary token";
+        }
+
+        blob_len += len;
+        tok->num_tokens++;
+        if ((size_t)len > tok->max_token_len) tok->max_token_len = len;
+        line = eol + 1;
+    }
+
+    if (tok->num_tokens == 0) return "empty vocabulary";
+    return NULL;
+}
+
+static void tokenizer_free(ToonTokenizer *tok) {
+    if (!tok) return;
+    free(tok->name);
+    free(tok->blob);
+    free(tok->slots);
+    free(tok->pieces);
+    free(tok);
+}
+
+// Split pattern named by str, "cl100k" or "o200k"
+bool toon_tokenizer_split_parse(const char *str, ToonTokenizerSplit *split) {
+    if (strcasecmp(str, "cl100k") == 0) {
+        *split = TOON_SPLIT_CL100K;
+    } else if (strcasecmp(str, "o200k") == 0) {
+        *split = TOON_SPLIT_O200K;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Split pattern of the vocabulary file at path when none is given: o200k
+// for o200k_base.tiktoken and its like, cl100k otherwise
+ToonTokenizerSplit toon_tokenizer_split_for(const char *path) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    return strncasecmp(base, "o200k", 5) == 0 ? TOON_SPLIT_O200K : TOON_SPLIT_CL100K;
+}
+
+// Load the vocabulary at path under name, splitting text with the split
+// pattern. The file is mapped rather than read, and only the decoded table
+// is kept. On failure *error is set to a malloc'd message.
+bool toon_tokenizer_load(const char *name, const char *path, ToonTokenizerSplit split, char **error) {
+    if (toon_tokenizer_find(name, strlen(name))) {
+        *error = make_error("tokenizer %s already loaded", name);
+        return false;
+    }
+    if (num_tokenizers == TOON_TOKENIZER_MAX) {
+        *error = make_error("too many tokenizers loading %s", name);
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *error = make_error("cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *error = make_error("cannot read %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        *error = make_error("%s: empty vocabulary", path);
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *error = make_error("cannot map %s: %s", path, strerror(errno));
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    ToonTokenizer *tok = calloc(1, sizeof(ToonTokenizer));
+    const char *message = tok ? NULL : "Out of memory";
+    if (tok) {
+        tok->name = strdup(name);
+        tok->split = split;
+        tok->pieces = calloc(PIECE_CACHE_SLOTS, sizeof(PieceSlot));
+        message = tok->name && tok->pieces ? vocab_parse(tok, data, st.st_size) : "Out of memory";
+    }
+    munmap(data, st.st_size);
+
+    if (message) {
+        *error = make_error("%s: %s", path, message);
+        tokenizer_free(tok);
+        return false;
+    }
+
+    tokenizers[num_tokenizers++] = tok;
+    return true;
+}
+
+// Tokenizer loaded under name, or NULL
+ToonTokenizer *toon_tokenizer_find(const char *name, size_t len) {
+    for (size_t i = 0; i < num_tokenizers; i++) {
+        if (strlen(tokenizers[i]->name) == len && strncasecmp(tokenizers[i]->name, name, len) == 0) {
+            return tokenizers[i];
+        }
+    }
+    return NULL;
+}
+
+// Tokens in the vocabulary, for logging
+size_t toon_tokenizer_size(const ToonTokenizer *tok) {
+    return tok->num_tokens;
+}
+
+// ============================================================================
+// Pre-tokenizer
+// ============================================================================
+
+static inline bool is_letter(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static inline bool is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static inline bool is_newline(unsigned char c) {
+    return c == '\n' || c == '\r';
+}
+
+static inline bool is_punct(unsigned char c) {
+    return !is_letter(c) && !is_digit(c) && !is_space(c);
+}
+
+// Letters that may start a word in o200k: upper, title and other case
+static inline bool is_upper_letter(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// Letters that may continue one: lower and other case
+static inline bool is_lower_letter(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || c >= 0x80;
+}
+
+static inline unsigned char lower(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// End of the contraction 's, 't, 're, 've, 'm, 'll or 'd at pos, in any
+// case, or pos if there is none
+static size_t contraction_end(const unsigned char *s, size_t len, size_t pos) {
+    if (s[pos] != '\'' || pos + 1 >= len) return pos;
+
+    unsigned char c1 = lower(s[pos + 1]);
+    unsigned char c2 = pos + 2 < len ? lower(s[pos + 2]) : 0;
+    if ((c1 == 'l' && c2 == 'l') || (c1 == 'v' && c2 == 'e') || (c1 == 'r' && c2 == 'e')) return pos + 3;
+    if (c1 == 's' || c1 == 'd' || c1 == 'm' || c1 == 't') return pos + 2;
+    return pos;
+}
+
+// End of the word at p, pos being where its piece starts, or pos if there
+// is none. cl100k takes any run of letters; o200k takes upper case letters
+// then lower case ones, so "camelCase" splits in two, and keeps a
+// contraction on the word.
+static size_t word_end(const ToonTokenizer *tok, const unsigned char *s, size_t len, size_t pos, size_t p) {
+    if (p >= len || !is_letter(s[p])) return pos;
+
+    if (tok->split == TOON_SPLIT_CL100K) {
+        while (p < len && is_letter(s[p])) p++;
+        return p;
+    }
+
+    // [Lu]*[Ll]+ or [Lu]+[Ll]*, which end at the same place
+    while (p < len && is_upper_letter(s[p])) p++;
+    while (p < len && is_lower_letter(s[p])) p++;
+    return p < len ? contraction_end(s, len, p) : p;
+}
+
+// End of the piece starting at pos. cl100k follows
+//   's|'t|'re|'ve|'m|'ll|'d | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3}
+//   | ?[^\s\p{L}\p{N}]+[\r\n]* | \s*[\r\n] | \s+(?!\S) | \s+
+// and o200k
+//   [^\r\n\p{L}\p{N}]?[Lu]*[Ll]+('s|...)? | [^\r\n\p{L}\p{N}]?[Lu]+[Ll]*('s|...)?
+//   | \p{N}{1,3} | ?[^\s\p{L}\p{N}]+[\r\n/]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+static size_t next_piece(const ToonTokenizer *tok, const unsigned char *s, size_t len, size_t pos) {
+    unsigned char c = s[pos];
+    bool o200k = tok->split == TOON_SPLIT_O200K;
+
+    // Contractions on their own
+    size_t p = o200k ? pos : contraction_end(s, len, pos);
+    if (p > pos) return p;
+
+    // Words, with at most one leading non-letter that is not a newline
+    if (!is_letter(c) && !is_digit(c) && !is_newline(c)) p++;
+    size_t end = word_end(tok, s, len, pos, p);
+    if (end > pos) return end;
+
+    // Numbers, three digits at a time
+    if (is_digit(c)) {
+        p = pos;
+        while (p < len && p - pos < 3 && is_digit(s[p])) p++;
+        return p;
+    }
+
+    // Punctuation runs, with an optional leading space and trailing
+    // newlines, and in o200k slashes
+    p = c == ' ' ? pos + 1 : pos;
+    if (p < len && is_punct(s[p])) {
+        while (p < len && is_punct(s[p])) p++;
+        while (p < len && (is_newline(s[p]) || (o200k && s[p] == '/'))) p++;
+        return p;
+    }
+
+    // Whitespace: up to the last newline of the run, else all of it but the
+    // space that leads the next word
+    end = pos;
+    size_t last_newline = 0;
+    bool has_newline = false;
+    while (end < len && is_space(s[end])) {
+        if (is_newline(s[end])) {
+            last_newline = end;
+            has_newline = true;
+        }
+        end++;
+    }
+    if (has_newline) return last_newline + 1;
+    if (end < len && end - pos > 1) return end - 1;
+    return end > pos ? end : pos + 1;
+}
+
+// ============================================================================
+// Byte-pair merging
+// ============================================================================
+
+// A candidate merge of the part at start with the one after it, the two
+// ending at end. It goes stale once either part has been merged since.
+typedef struct {
+    uint32_t rank;
+    size_t start;
+    size_t end;
+} MergeCandidate;
+
+#define PART_MERGED SIZE_MAX
+
+// Min-heap of candidates by rank, then position, so the lowest rank wins
+// and ties go to the leftmost pair
+static inline bool candidate_before(const MergeCandidate *a, const MergeCandidate *b) {
+    return a->rank != b->rank ? a->rank < b->rank : a->start < b->start;
+}
+
+static void heap_push(MergeCandidate *heap, size_t *count, MergeCandidate candidate) {
+    size_t i = (*count)++;
+    while (i > 0 && candidate_before(&candidate, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = candidate;
+}
+
+static MergeCandidate heap_pop(MergeCandidate *heap, size_t *count) {
+    MergeCandidate top = heap[0];
+    MergeCandidate last = heap[--*count];
+
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && candidate_before(&heap[child + 1], &heap[child])) child++;
+        if (!candidate_before(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*count > 0) heap[i] = last;
+    return top;
+}
+
+// Queue the merge of the bytes from start to end if it is a token
+static void push_pair(const ToonTokenizer *tok, const unsigned char *piece, size_t start, size_t end,
+                      MergeCandidate *heap, size_t *count) {
+    if (end - start > tok->max_token_len) return;
+
+    uint32_t rank = vocab_rank(tok, piece + start, end - start);
+    if (rank != TOKENIZER_RANK_NONE) heap_push(heap, count, (MergeCandidate){rank, start, end});
+}
+
+// Tokens in one piece: merge the adjacent pair of lowest rank until no pair
+// is in the vocabulary. Parts are a list over the bytes, ends[i] being the
+// end of the part starting at i, and candidate merges wait in a heap, so a
+// piece of n bytes takes O(n log n) however long a run it is.
+static size_t piece_merge(const ToonTokenizer *tok, const unsigned char *piece, size_t len) {
+    if (len == 1 || vocab_rank(tok, piece, len) != TOKENIZER_RANK_NONE) return 1;
+
+    size_t stack_ends[PIECE_STACK_LEN], stack_starts[PIECE_STACK_LEN + 1];
+    MergeCandidate stack_heap[PIECE_STACK_LEN * 3];
+    size_t *ends = stack_ends, *starts = stack_starts;
+    MergeCandidate *heap = stack_heap;
+    if (len > PIECE_STACK_LEN) {
+        ends = malloc(sizeof(size_t) * len);
+        starts = malloc(sizeof(size_t) * (len + 1));
+        heap = malloc(sizeof(MergeCandidate) * len * 3);
+        if (!ends || !starts || !heap) {
+            // One token per byte is the most the merges can leave
+            free(ends);
+            free(starts);
+            free(heap);
+            return len;
+        }
+    }
+
+    // One part per byte to start with; starts[i] is where the part ending
+    // at i starts
+    size_t num_heap = 0;
+    for (size_t i = 0; i < len; i++) {
+        ends[i] = i + 1;
+        starts[i + 1] = i;
+        if (i + 2 <= len) push_pair(tok, piece, i, i + 2, heap, &num_heap);
+    }
+
+    size_t parts = len;
+    while (num_heap > 0) {
+        MergeCandidate merge = heap_pop(heap, &num_heap);
+        size_t middle = ends[merge.start];
+        if (middle == PART_MERGED || middle >= len || ends[middle] != merge.end) continue;
+
+        ends[merge.start] = merge.end;
+        ends[middle] = PART_MERGED;
+        starts[merge.end] = merge.start;
+        parts--;
+
+        if (merge.end < len) push_pair(tok, piece, merge.start, ends[merge.end], heap, &num_heap);
+        if (merge.start > 0) push_pair(tok, piece, starts[merge.start], merge.end, heap, &num_heap);
+    }
+
+    if (ends != stack_ends) {
+        free(ends);
+        free(starts);
+        free(heap);
+    }
+    return parts;
+}
+
+static size_t piece_tokens(ToonTokenizer *tok, const unsigned char *piece, size_t len) {
+    if (len > PIECE_CACHE_MAX_LEN) return piece_merge(tok, piece, len);
+
+    uint64_t hash = toon_hash_key((const char *)piece, len);
+    PieceSlot *slot = &tok->pieces[hash & (PIECE_CACHE_SLOTS - 1)];
+    if (slot->len == len && slot->hash == hash && memcmp(slot->bytes, piece, len) == 0) {
+        return slot->tokens;
+    }
+
+    size_t tokens = piece_merge(tok, piece, len);
+    slot->hash = hash;
+    slot->tokens = (uint32_t)tokens;
+    slot->len = (uint8_t)len;
+    memcpy(slot->bytes, piece, len);
+    return tokens;
+}
+
+// Number of tokens tok splits text into
+size_t toon_tokenizer_count(ToonTokenizer *tok, const char *text, size_t len) {
+    const unsigned char *s = (const unsigned char *)text;
+    size_t tokens = 0;
+
+    for (size_t pos = 0; pos < len;) {
+        size_t end = next_piece(tok, s, len, pos);
+        tokens += piece_tokens(tok, s + pos, end - pos);
+        pos = end;
+    }
+    return tokens;
+}
@@ -7,8 +7,18 @@ Run with: pytest tests/test_redistoon.py
 
 import pytest
 import json
+import os
+import shutil
+import socket
+import subprocess
+import time
 from redistoon import RedisTOON
 
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+MODULE_PATH = os.environ.get('REDISTOON_MODULE',
+                             os.path.join(TESTS_DIR, '..', 'build', 'redistoon.so'))
+TINY_VOCABULARY = os.path.join(TESTS_DIR, 'fixtures', 'tiny.tiktoken')
+
 
 @pytest.fixture
 def redis_client():
@@ -16,6 +26,65 @@ def redis_client():
     return RedisTOON()
 
 
+def start_server(options, module_args=()):
+    """Start a server of our own with the module loaded, skipping the test
+    when there is none to start. Returns the process and a client."""
+    if not shutil.which('redis-server') or not os.path.exists(MODULE_PATH):
+        pytest.skip('needs redis-server and the built module (set REDISTOON_MODULE)')
+
+    with socket.socket() as sock:
+        sock.bind(('localhost', 0))
+        port = sock.getsockname()[1]
+
+    server = subprocess.Popen(
+        ['redis-server', '--port', str(port)] + list(options) +
+        ['--loadmodule', os.path.abspath(MODULE_PATH)] + list(module_args),
+        stdout=subprocess.DEVNULL)
+    client = RedisTOON(port=port)
+    for _ in range(50):
+        try:
+            client.redis.ping()
+            return server, client
+        except Exception:
+            time.sleep(0.1)
+
+    stop_server(server)
+    pytest.skip('redis-server did not start')
+
+
+def stop_server(server):
+    server.terminate()
+    server.wait()
+
+
+@pytest.fixture(scope='module')
+def bpe_client():
+    """Start a server of our own with the tiny vocabulary loaded under both
+    split patterns, which the shared server is not started with."""
+    server, client = start_server(
+        ['--save', '', '--appendonly', 'no'],
+        ['TOKENIZER', 'tiny', TINY_VOCABULARY, 'SPLIT', 'cl100k',
+         'TOKENIZER', 'tiny_o200k', TINY_VOCABULARY, 'SPLIT', 'o200k'])
+    yield client
+    stop_server(server)
+
+
+# A pure AOF, without an RDB preamble, so that a rewrite goes through the
+# module's AOF callback
+AOF_OPTIONS = ['--save', '', '--appendonly', 'yes', '--aof-use-rdb-preamble', 'no']
+
+
+def rewrite_aof(client):
+    """Rewrite the AOF and wait for the rewrite to finish."""
+    client.redis.execute_command('BGREWRITEAOF')
+    for _ in range(600):
+        info = client.redis.info('persistence')
+        if not info['aof_rewrite_in_progress'] and not info['aof_rewrite_scheduled']:
+            break
+        time.sleep(0.1)
+    assert info['aof_last_bgrewrite_status'] == 'ok'
+
+
 @pytest.fixture(autouse=True)
 def cleanup(redis_client):
     """Clean up test keys after each test."""
@@ -86,6 +155,319 @@ class TestBasicOperations:
         assert isinstance(result, list)
         assert len(result) == 3
 
+    def test_tabular_cell_path(self, redis_client):
+        """Test reading single cells of a tabular array by path."""
+        data = {
+            'users': [
+                {'id': 1, 'name': 'Alice', 'active': True},
+                {'id': 2, 'name': 'Bob', 'active': None}
+            ]
+        }
+        assert redis_client.from_json('test:tabular_cell', data) is True
+
+        assert redis_client.type('test:tabular_cell', '$.users') == 'tabular_array'
+        assert redis_client.to_json('test:tabular_cell', '$.users[0].name') == '"Alice"'
+        assert redis_client.to_json('test:tabular_cell', '$.users[-1].id') == '2'
+        assert redis_client.type('test:tabular_cell', '$.users[1].active') == 'null'
+
+    def test_multi_value_paths(self, redis_client):
+        """Test wildcard, slice and filter paths on arrays and tabular arrays."""
+        data = {
+            'users': [
+                {'name': 'Alice', 'score': 0.9},
+                {'name': 'Bob', 'score': 0.5},
+                {'name': 'Carol', 'score': 0.85}
+            ],
+            'tags': ['a', 'b', 'c', 'd']
+        }
+        assert redis_client.from_json('test:multi', data) is True
+
+        assert redis_client.to_json('test:multi', '$.users[*].name') == '["Alice","Bob","Carol"]'
+        assert redis_client.to_json('test:multi', '$.users[?(@.score>0.8)].name') == '["Alice","Carol"]'
+        assert redis_client.to_json('test:multi', "$.users[?(@.name=='Bob')]") == '[{"name":"Bob","score":0.5}]'
+        assert redis_client.to_json('test:multi', '$.users[1]') == '{"name":"Bob","score":0.5}'
+        assert redis_client.to_json('test:multi', '$.tags[1:3]') == '["b","c"]'
+        assert redis_client.to_json('test:multi', '$.tags[-2:]') == '["c","d"]'
+        assert redis_client.to_json('test:multi', '$.tags[?(@.x)]') == '[]'
+
+        result = redis_client.redis.execute_command('TOON.GET', 'test:multi', '$.users[:2].name')
+        assert result == [b'Alice', b'Bob']
+        result = redis_client.redis.execute_command('TOON.TYPE', 'test:multi', '$.tags[*]')
+        assert result == [b'string'] * 4
+
+    def test_nested_path_set_delete(self, redis_client):
+        """Test updating and deleting values below the top level."""
+        assert redis_client.from_json('test:nested', {'a': {'b': 1}, 'list': [1, 2, 3]}) is True
+
+        redis_client.redis.execute_command('TOON.SET', 'test:nested', '$.a.c', '2')
+        redis_client.redis.execute_command('TOON.SET', 'test:nested', '$.list[-1]', '30')
+        assert redis_client.to_json('test:nested') == '{"a":{"b":1,"c":2},"list":[1,2,30]}'
+
+        assert redis_client.delete('test:nested', '$.a.b') == 1
+        assert redis_client.delete('test:nested', '$.a.missing') == 0
+        assert redis_client.to_json('test:nested', '$.a') == '{"c":2}'
+
+    def test_large_object_keys(self, redis_client):
+        """Test key lookups, updates and deletes on an indexed object."""
+        features = {f'f{i}': i for i in range(1000)}
+        assert redis_client.from_json('test:features', {'features': features}) is True
+
+        assert redis_client.to_json('test:features', '$.features.f500') == '500'
+        assert redis_client.delete('test:features', '$.features.f10') == 1
+        assert redis_client.to_json('test:features', '$.features.f10') is None
+        assert redis_client.to_json('test:features', '$.features.f999') == '999'
+
+        redis_client.redis.execute_command('TOON.SET', 'test:features', '$.features.extra', '1')
+        keys = list(json.loads(redis_client.to_json('test:features', '$.features')).keys())
+        assert keys[-1] == 'extra'
+        assert len(keys) == 1000
+
+
+    def test_mget(self, redis_client):
+        """Test reading one path from several keys at once."""
+        assert redis_client.from_json('test:mget:1', {'name': 'Alice', 'age': 30}) is True
+        assert redis_client.from_json('test:mget:2', {'name': 'Bob'}) is True
+        redis_client.redis.set('test:mget:string', 'plain')
+
+        result = redis_client.redis.execute_command(
+            'TOON.MGET', 'test:mget:1', 'test:mget:missing', 'test:mget:2', 'test:mget:string', '$.name')
+        assert result == [b'Alice', None, b'Bob', None]
+
+        result = redis_client.redis.execute_command('TOON.MGET', 'test:mget:1', 'test:mget:2', '$.age')
+        assert result == [b'30', None]
+
+        with pytest.raises(Exception):
+            redis_client.redis.execute_command('TOON.MGET', 'test:mget:1')
+
+    @pytest.mark.parametrize('command', ['TOON.GET', 'TOON.DEL', 'TOON.TYPE', 'TOON.TOJSON', 'TOON.TOKENCOUNT'])
+    def test_invalid_path(self, redis_client, command):
+        """Test a path that does not parse is an error, not a miss."""
+        assert redis_client.from_json('test:badpath', {'a': 1}) is True
+
+        with pytest.raises(Exception, match='invalid path'):
+            redis_client.redis.execute_command(command, 'test:badpath', '$.a[')
+
+
+    def test_arrappend(self, redis_client):
+        """Test appending values to an array in place."""
+        assert redis_client.from_json('test:arrappend', {'tags': ['a'], 'n': 1}) is True
+
+        assert redis_client.arr_append('test:arrappend', '$.tags', 'b', '2', 'true') == 4
+        assert redis_client.to_json('test:arrappend', '$.tags') == '["a","b",2,true]'
+
+        with pytest.raises(Exception):
+            redis_client.arr_append('test:arrappend', '$.n', 'x')
+        with pytest.raises(Exception):
+            redis_client.arr_append('test:missing', '$.tags', 'x')
+
+    def test_rowappend(self, redis_client):
+        """Test appending rows to a tabular array, including type changes in a column."""
+        data = {'messages': [{'id': 1, 'role': 'user', 'score': 0.5},
+                             {'id': 2, 'role': 'assistant', 'score': None}]}
+        assert redis_client.from_json('test:rowappend', data) is True
+
+        assert redis_client.row_append('test:rowappend', '$.messages',
+                                       [3, 'user', 1], ['four', 'tool', None]) == 4
+        messages = json.loads(redis_client.to_json('test:rowappend', '$.messages'))
+        assert messages[2] == {'id': 3, 'role': 'user', 'score': 1}
+        assert messages[3] == {'id': 'four', 'role': 'tool', 'score': None}
+        assert redis_client.type('test:rowappend', '$.messages') == 'tabular_array'
+
+        with pytest.raises(Exception):
+            redis_client.row_append('test:rowappend', '$.messages', [5, 'user'])
+
+    def test_large_document_on_workers(self, redis_client):
+        """Test that documents above the thread threshold convert like small ones."""
+        data = {'rows': [{'id': i, 'text': 'x' * 40, 'ok': i % 2 == 0} for i in range(30000)]}
+        assert redis_client.from_json('test:large', data) is True
+
+        assert json.loads(redis_client.to_json('test:large')) == data
+        toon = redis_client.redis.execute_command('TOON.GET', 'test:large')
+        assert redis_client.redis.execute_command('TOON.SET', 'test:large_copy', '$', toon) == b'OK'
+        assert redis_client.to_json('test:large_copy') == redis_client.to_json('test:large')
+
+        # Text cached by a worker is dropped by the next write
+        assert redis_client.delete('test:large', '$.rows[0]') == 1
+        assert json.loads(redis_client.to_json('test:large'))['rows'][0]['id'] == 1
+
+    def test_large_document_freed_in_background(self, redis_client):
+        """Test that large documents can be replaced and unlinked after cached reads."""
+        data = {'rows': [{'id': i, 'text': 'y' * 60} for i in range(80000)]}
+        assert redis_client.from_json('test:lazyfree', data) is True
+        assert json.loads(redis_client.to_json('test:lazyfree')) == data
+
+        # The old tree goes to a worker; the key sees only the new one
+        assert redis_client.from_json('test:lazyfree', data) is True
+        assert redis_client.from_json('test:lazyfree', {'n': 1}) is True
+        assert json.loads(redis_client.to_json('test:lazyfree')) == {'n': 1}
+
+        assert redis_client.from_json('test:lazyfree', data) is True
+        redis_client.get('test:lazyfree')
+        assert redis_client.redis.unlink('test:lazyfree') == 1
+        assert redis_client.get('test:lazyfree') is None
+
+    def test_memory_usage_and_copy(self, redis_client):
+        """Test that MEMORY USAGE sees the tree and COPY makes an independent document."""
+        data = {'rows': [{'id': i, 'text': 'z' * 20} for i in range(1000)]}
+        assert redis_client.from_json('test:mem', data) is True
+        assert redis_client.redis.memory_usage('test:mem') > 20 * 1000
+
+        assert redis_client.redis.copy('test:mem', 'test:mem_copy') is True
+        assert redis_client.delete('test:mem', '$.rows[0]') == 1
+        assert json.loads(redis_client.to_json('test:mem_copy')) == data
+
+    def test_cached_reads_follow_writes(self, redis_client):
+        """Test that whole-document reads, which are cached, see every write."""
+        assert redis_client.from_json('test:cache', {'tags': ['a'], 'n': 1}) is True
+        assert redis_client.to_json('test:cache') == '{"tags":["a"],"n":1}'
+        tokens = redis_client.token_count('test:cache')
+
+        redis_client.arr_append('test:cache', '$.tags', 'b')
+        assert redis_client.to_json('test:cache') == '{"tags":["a","b"],"n":1}'
+        assert redis_client.token_count('test:cache') > tokens
+
+        redis_client.redis.execute_command('TOON.SET', 'test:cache', '$.n', '2')
+        assert redis_client.to_json('test:cache') == '{"tags":["a","b"],"n":2}'
+
+        redis_client.delete('test:cache', '$.tags')
+        assert redis_client.to_json('test:cache') == '{"n":2}'
+        assert redis_client.get('test:cache') == redis_client.get('test:cache')
+
+    def test_version_and_ifnewer(self, redis_client):
+        """Test that writes bump the version and IFNEWER skips unchanged documents."""
+        r = redis_client.redis
+        assert r.execute_command('TOON.VERSION', 'test:version') == 0
+        assert redis_client.from_json('test:version', {'tags': ['a'], 'n': 1}) is True
+        created = r.execute_command('TOON.VERSION', 'test:version')
+        assert created > 0
+
+        assert r.execute_command('TOON.GET', 'test:version', 'IFNEWER', created) is None
+        assert r.execute_command('TOON.GET', 'test:version', '$.n', 'IFNEWER', 0) is not None
+
+        redis_client.arr_append('test:version', '$.tags', 'b')
+        r.execute_command('TOON.SET', 'test:version', '$.n', '2')
+        assert r.execute_command('TOON.VERSION', 'test:version') == created + 2
+        assert r.execute_command('TOON.GET', 'test:version', '$.n', 'IFNEWER', created) == b'2'
+
+        # Copies and recreated keys start above every version given out
+        r.copy('test:version', 'test:version_copy')
+        assert r.execute_command('TOON.VERSION', 'test:version_copy') > created + 2
+        r.delete('test:version')
+        assert redis_client.from_json('test:version', {'n': 1}) is True
+        assert r.execute_command('TOON.GET', 'test:version', 'IFNEWER', created + 2) is not None
+
+        with pytest.raises(Exception):
+            r.execute_command('TOON.GET', 'test:version', '$.n', 'SINCE', 1)
+    def test_info_section(self, redis_client):
+        """Test that INFO reports documents, nodes and per-phase latencies."""
+        r = redis_client.redis
+        assert redis_client.from_json('test:info', {'rows': [{'id': i, 'tag': 'x'} for i in range(300)]}) is True
+        redis_client.get('test:info', '$.rows[0]')
+
+        # Fields are prefixed with the module name, in its own case
+        info = {k.lower(): v for k, v in r.info('everything').items()}
+        assert info['redistoon_documents'] >= 1
+        assert info['redistoon_nodes_tabular'] >= 1
+        assert 0 < info['redistoon_tabular_array_ratio'] <= 1
+        assert info['redistoon_get_path']['calls'] >= 1
+        assert info['redistoon_fromjson_total']['p50_usec'] > 0
+
+    def test_get_format_resp3(self, redis_client):
+        """Test that FORMAT RESP3 replies with values instead of TOON text."""
+        r = redis_client.redis
+        data = {'name': 'Alice', 'age': 30, 'active': True, 'nothing': None,
+                'rows': [{'id': 1, 'tag': 'a'}, {'id': 2, 'tag': 'b'}]}
+        assert redis_client.from_json('test:resp3', data) is True
+
+        assert r.execute_command('TOON.GET', 'test:resp3', '$.age', 'FORMAT', 'RESP3') == 30
+        assert r.execute_command('TOON.GET', 'test:resp3', '$.name', 'FORMAT', 'RESP3') == b'Alice'
+        assert r.execute_command('TOON.GET', 'test:resp3', '$.rows', 'FORMAT', 'RESP3') == \
+            [[b'id', b'tag'], [1, b'a'], [2, b'b']]
+
+        # The connection speaks RESP2, so the map arrives as a flat array
+        root = r.execute_command('TOON.GET', 'test:resp3', 'FORMAT', 'RESP3', 'IFNEWER', 0)
+        assert root[:4] == [b'name', b'Alice', b'age', 30]
+        version = r.execute_command('TOON.VERSION', 'test:resp3')
+        assert r.execute_command('TOON.GET', 'test:resp3', 'FORMAT', 'RESP3', 'IFNEWER', version) is None
+
+        with pytest.raises(Exception):
+            r.execute_command('TOON.GET', 'test:resp3', '$', 'FORMAT', 'XML')
+
+    def test_get_maxtokens(self, redis_client):
+        """Test that MAXTOKENS keeps whole rows and elements within the budget."""
+        r = redis_client.redis
+        messages = [{'role': 'user', 'turn': i} for i in range(100)]
+        assert redis_client.from_json('test:budget', {'messages': messages, 'tags': list(range(50))}) is True
+
+        full = redis_client.get_prompt('test:budget', 100000)
+        assert full == r.execute_command('TOON.GET', 'test:budget').decode('utf-8')
+
+        head = redis_client.get_prompt('test:budget', 30, '$.messages')
+        assert head.startswith('[')
+        rows = int(head[1:head.index(',')])
+        assert 0 < rows < 100
+        assert len(head.strip().split('\n')) == rows + 1
+        assert 'user,0' in head
+
+        tail = redis_client.get_prompt('test:budget', 30, '$.messages', keep='tail')
+        assert 'user,99' in tail and 'user,0\n' not in tail
+
+        tags = redis_client.get_prompt('test:budget', 10, '$.tags')
+        assert tags.startswith('[8]: 0,1')
+
+        with pytest.raises(Exception):
+            r.execute_command('TOON.GET', 'test:budget', '$', 'MAXTOKENS', '-1')
+
+    def test_clone_copy_on_write(self, redis_client):
+        """Test that clones share a tree and writes to one leave the other alone."""
+        r = redis_client.redis
+        template = {'system': 'You are helpful.', 'tools': [{'name': 'search', 'args': {'q': 'str'}}],
+                    'session': {'user': None, 'turns': 0}}
+        assert redis_client.from_json('test:template', template) is True
+
+        assert redis_client.clone('test:template', 'test:session') is True
+        r.execute_command('TOON.SET', 'test:session', '$.session.user', 'alice')
+        r.execute_command('TOON.SET', 'test:session', '$.tools[0].args.q', 'text')
+        redis_client.delete('test:session', '$.system')
+
+        assert json.loads(redis_client.to_json('test:template')) == template
+        session = json.loads(redis_client.to_json('test:session'))
+        assert session['session']['user'] == 'alice'
+        assert session['tools'][0]['args']['q'] == 'text'
+        assert 'system' not in session
+
+        r.execute_command('TOON.SET', 'test:template', '$.session.turns', '1')
+        assert json.loads(redis_client.to_json('test:session'))['session']['turns'] == 0
+
+        with pytest.raises(Exception):
+            r.execute_command('TOON.CLONE', 'test:missing', 'test:session')
+
+
+    def test_index_query(self, redis_client):
+        """Test that an index finds rows and follows appends and rewrites."""
+        r = redis_client.redis
+        rows = [{'role': 'user', 'ts': 100}, {'role': 'tool', 'ts': 200}, {'role': 'assistant', 'ts': 300}]
+        assert redis_client.from_json('test:chat:1', {'messages': rows}) is True
+        assert redis_client.from_json('test:chat:2', {'messages': rows[:1]}) is True
+        assert redis_client.index_create('test:msgs', '$.messages', 'role', 'ts') is True
+        assert redis_client.index_create('test:msgs', '$.messages', 'role', 'ts') is True
+        with pytest.raises(Exception):
+            redis_client.index_create('test:msgs', '$.messages', 'role')
+
+        assert [(k, n) for k, n, _ in redis_client.query('test:msgs', '@.role=="tool"')] == [('test:chat:1', 1)]
+        assert [n for _, n, _ in redis_client.query('test:msgs', '@.ts>100')] == [1, 2]
+        assert len(redis_client.query('test:msgs', '@.ts>=100', limit=2)) == 2
+
+        r.execute_command('TOON.ROWAPPEND', 'test:chat:2', '$.messages', 'tool', '400')
+        assert sorted(k for k, _, _ in redis_client.query('test:msgs', '@.role=="tool"')) == ['test:chat:1', 'test:chat:2']
+
+        assert redis_client.from_json('test:chat:1', {'messages': rows[:1]}) is True
+        r.delete('test:chat:2')
+        assert redis_client.query('test:msgs', '@.role=="tool"') == []
+
+        with pytest.raises(Exception):
+            redis_client.query('test:msgs', '@.content=="x"')
+        r.execute_command('TOON.INDEX', 'DROP', 'test:msgs')
 
 class TestJSONConversion:
     """Test JSON to TOON conversion."""
@@ -132,6 +514,38 @@ class TestJSONConversion:
         assert result['product'] == original['product']
         assert result['stock'] == original['stock']
 
+    def test_roundtrip_number_precision(self, redis_client):
+        """Test numbers come back as the same doubles and numeric-looking strings stay strings."""
+        original = {'sum': 0.1 + 0.2, 'tiny': 1.5e-7, 'big': 2 ** 60, 'ts': 1700000000, 'id': '1e5', 'nan': 'nan'}
+        redis_client.from_json('test:numbers', json.dumps(original))
+
+        assert json.loads(redis_client.to_json('test:numbers')) == original
+        toon = redis_client.redis.execute_command('TOON.GET', 'test:numbers')
+        if isinstance(toon, bytes):
+            toon = toon.decode()
+        assert 'ts: 1700000000' in toon
+
+    def test_roundtrip_long_strings(self, redis_client):
+        """Test long strings with escapes at varying offsets survive a roundtrip."""
+        original = {'text': ''.join(f'{"x" * i}"\\\n' for i in range(70)), 'pad': ' ' * 100}
+        redis_client.from_json('test:long_strings', json.dumps(original, indent=4))
+
+        assert json.loads(redis_client.to_json('test:long_strings')) == original
+
+    def test_convert_matches_stored_roundtrip(self, redis_client):
+        """Test TOON.CONVERT gives what storing the text and reading it back would."""
+        json_str = json.dumps({'users': [{'id': 1, 'name': 'a'}, {'id': 2, 'name': 'b'}],
+                               'tags': ['x', 'y'], 'meta': {'ok': True, 'n': None}})
+        redis_client.from_json('test:convert', json_str)
+        r = redis_client.redis
+
+        toon = r.execute_command('TOON.CONVERT', 'JSON', json_str)
+        assert toon == r.execute_command('TOON.GET', 'test:convert')
+        assert r.execute_command('TOON.CONVERT', 'toon', toon) == r.execute_command('TOON.TOJSON', 'test:convert')
+
+        with pytest.raises(Exception):
+            r.execute_command('TOON.CONVERT', 'JSON', '{"a": [1, 2')
+
 
 class TestTypes:
     """Test type checking."""
@@ -179,6 +593,69 @@ class TestTokenCounting:
         count = redis_client.token_count('test:tokens_array')
         assert count > 0
 
+    def test_token_count_after_writes(self, redis_client):
+        """Test that counts kept up to date by writes match a fresh count."""
+        data = {'doc': {'title': 'Notes', 'tags': ['a', 'b']},
+                'messages': [{'id': 1, 'role': 'user'}, {'id': 2, 'role': 'assistant'}]}
+        assert redis_client.from_json('test:tokens_live', data) is True
+        redis_client.token_count('test:tokens_live')
+        redis_client.token_count('test:tokens_live', '$.doc')
+
+        redis_client.arr_append('test:tokens_live', '$.doc.tags', '"a longer tag value"')
+        redis_client.row_append('test:tokens_live', '$.messages', [3, 'tool'])
+        redis_client.redis.execute_command('TOON.SET', 'test:tokens_live', '$.doc.title', '"Meeting notes"')
+        redis_client.redis.execute_command('TOON.SET', 'test:tokens_live', '$.doc.author', 'Alice')
+        redis_client.delete('test:tokens_live', '$.doc.tags[0]')
+
+        assert redis_client.from_json('test:tokens_fresh',
+                                      redis_client.to_json('test:tokens_live')) is True
+        for path in ('$', '$.doc', '$.messages'):
+            assert (redis_client.token_count('test:tokens_live', path) ==
+                    redis_client.token_count('test:tokens_fresh', path))
+
+    def test_token_count_tokenizer_option(self, redis_client):
+        """Test that TOKENIZER must name a tokenizer loaded with the module."""
+        assert redis_client.from_json('test:tokens_bpe', {'name': 'Alice'}) is True
+
+        with pytest.raises(Exception, match='unknown tokenizer'):
+            redis_client.redis.execute_command('TOON.TOKENCOUNT', 'test:tokens_bpe', '$',
+                                               'TOKENIZER', 'no-such-vocabulary')
+        with pytest.raises(Exception, match='syntax error'):
+            redis_client.redis.execute_command('TOON.TOKENCOUNT', 'test:tokens_bpe', '$',
+                                               'VOCAB', 'o200k')
+
+    @pytest.mark.parametrize('data, toon, cl100k, o200k', [
+        # cl100k splits the contraction off, o200k keeps it on the word
+        ("don't", "don't", 2, 1),
+        # Digits go three at a time, so 12345 is not one token
+        (12345, '12345', 2, 2),
+        # A space joins the word after it
+        ({'hello': 'hello hello'}, 'hello: hello hello\n', 5, 5),
+        # Spaces and newlines up to the last newline are one piece
+        ({'do': {'do': {}}}, 'do: do: \n\n', 6, 6),
+    ])
+    def test_token_count_tokenizer_exact(self, bpe_client, data, toon, cl100k, o200k):
+        """Test exact BPE counts against a tiny vocabulary with both split patterns."""
+        bpe_client.redis.execute_command('TOON.FROMJSON', 'test:bpe', json.dumps(data))
+        text = bpe_client.redis.execute_command('TOON.GET', 'test:bpe')
+        if isinstance(text, bytes):
+            text = text.decode()
+        assert text == toon
+
+        count = bpe_client.redis.execute_command('TOON.TOKENCOUNT', 'test:bpe', '$', 'TOKENIZER', 'tiny')
+        assert count == cl100k
+        count = bpe_client.redis.execute_command('TOON.TOKENCOUNT', 'test:bpe', '$', 'TOKENIZER', 'tiny_o200k')
+        assert count == o200k
+
+    def test_token_count_tokenizer_long_piece(self, bpe_client):
+        """Test a long run of letters is merged without stalling the server."""
+        bpe_client.redis.execute_command('TOON.SET', 'test:bpe_long', '$', 'he' * 100000)
+
+        start = time.monotonic()
+        count = bpe_client.redis.execute_command('TOON.TOKENCOUNT', 'test:bpe_long', '$', 'TOKENIZER', 'tiny')
+        assert count == 100000
+        assert time.monotonic() - start < 2
+
     def test_efficiency_comparison(self, redis_client):
         """Test token efficiency comparison."""
         data = {
@@ -236,6 +713,114 @@ class TestEdgeCases:
         result = redis_client.get('test:special')
         assert result is not None
 
+    def test_unquoted_scalar_tokens(self, redis_client):
+        """Test unquoted tokens are numbers only when the whole token is one."""
+        toon = 'date: 2024-01-01\nbig: 1e+21\nzip: 007\nlong: ' + 'x' * 5000
+        redis_client.redis.execute_command('TOON.SET', 'test:scalars', '$', toon)
+
+        result = json.loads(redis_client.to_json('test:scalars'))
+        assert result['date'] == '2024-01-01'
+        assert result['big'] == 1e21
+        assert result['zip'] == '007'
+        assert len(result['long']) == 5000
+
+    def test_nesting_limit(self, redis_client):
+        """Test input nested past the default depth is rejected, not crashed on."""
+        deep = '[' * 100 + '1' + ']' * 100
+        redis_client.redis.execute_command('TOON.FROMJSON', 'test:deep', deep)
+        assert json.loads(redis_client.to_json('test:deep')) == json.loads(deep)
+
+        with pytest.raises(Exception):
+            redis_client.redis.execute_command('TOON.FROMJSON', 'test:too_deep', '[' * 100000 + ']' * 100000)
+        assert redis_client.redis.ping()
+
+
+class TestPersistence:
+    """Test RDB save/load of TOON documents."""
+
+    def test_debug_reload_roundtrip(self, redis_client):
+        """Test a document survives DEBUG RELOAD unchanged."""
+        data = {
+            'name': 'metrics',
+            'rows': [
+                {'ts': 1, 'cpu': 0.5, 'host': 'a'},
+                {'ts': 2, 'cpu': 0.75, 'host': 'b'}
+            ],
+            'tags': ['x', None, True]
+        }
+        redis_client.from_json('test:reload', json.dumps(data))
+        before = redis_client.to_json('test:reload')
+
+        try:
+            redis_client.redis.execute_command('DEBUG', 'RELOAD')
+        except Exception:
+            pytest.skip('DEBUG command is not enabled')
+
+        assert redis_client.to_json('test:reload') == before
+
+    def test_aof_rewrite_keeps_indexes(self, tmp_path):
+        """Test index definitions survive a rewrite of a pure AOF and a restart,
+        with and without TOON documents in the keyspace."""
+        options = AOF_OPTIONS + ['--dir', str(tmp_path)]
+        rows = [{'role': 'user', 'ts': 100}, {'role': 'tool', 'ts': 200}]
+        server, client = start_server(options)
+        try:
+            assert client.index_create('test:msgs', '$.messages', 'role', 'ts') is True
+            rewrite_aof(client)
+        finally:
+            stop_server(server)
+
+        server, client = start_server(options)
+        try:
+            assert client.query('test:msgs', '@.role=="tool"') == []
+            assert client.from_json('test:chat', {'messages': rows}) is True
+            rewrite_aof(client)
+        finally:
+            stop_server(server)
+
+        server, client = start_server(options)
+        try:
+            assert [(k, n) for k, n, _ in client.query('test:msgs', '@.role=="tool"')] == [('test:chat', 1)]
+        finally:
+            stop_server(server)
+
+
+    def test_aof_rewrite_chunked(self, tmp_path):
+        """Test documents over a chunk replay from a rewritten pure AOF, both
+        rebuilt in appends and, with keys a path cannot name, whole."""
+        data = {
+            'name': 'metrics',
+            'rows': [{'ts': i, 'cpu': i / 4, 'host': 'host-%d' % (i % 97)} for i in range(50000)],
+            'tags': ['tag-%d' % i for i in range(50000)],
+            'note': 'x' * (1 << 20),
+        }
+        options = AOF_OPTIONS + ['--dir', str(tmp_path)]
+        server, client = start_server(options)
+        try:
+            r = client.redis
+            assert client.from_json('test:chunked', data) is True
+            text = r.execute_command('TOON.GET', 'test:chunked')
+            if isinstance(text, bytes):
+                text = text.decode()
+            # Duplicated and dotted keys leave the whole-document fallback
+            r.execute_command('TOON.SET', 'test:duplicate', '$', text.rstrip('\n') + '\nname: again')
+            assert client.from_json('test:dotted', dict(data, **{'a.b': 1})) is True
+
+            keys = ['test:chunked', 'test:duplicate', 'test:dotted']
+            before = [r.execute_command('TOON.GET', key) for key in keys]
+            rewrite_aof(client)
+        finally:
+            stop_server(server)
+
+        aof = b''.join(path.read_bytes() for path in tmp_path.rglob('*.aof'))
+        assert b'TOON.ROWAPPEND' in aof and b'TOON.ARRAPPEND' in aof
+
+        server, client = start_server(options)
+        try:
+            assert [client.redis.execute_command('TOON.GET', key) for key in keys] == before
+        finally:
+            stop_server(server)
+
 
 class TestUseCases:
     """Test real-world use cases."""